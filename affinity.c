@@ -0,0 +1,181 @@
+/*
+ * CPU and NUMA node affinity of threads, using the node topology in sysfs
+ * rather than libnuma. Memory follows on its own: pages are placed on the
+ * node of the thread that first touches them, and malloc() gives every
+ * thread an arena of its own, so the buffers of pinned threads end up on
+ * their node.
+ */
+#include "lfs.h"
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <glib.h>
+
+#include "affinity.h"
+
+#define SYSFS_CPU "/sys/devices/system/cpu"
+#define SYSFS_NODE "/sys/devices/system/node"
+
+struct affinity {
+	bool automatic;
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+#endif
+};
+
+#ifdef HAVE_SCHED_SETAFFINITY
+static int parse_list(const char* list, cpu_set_t* cpus, bool nodes);
+
+/**
+ * Add the CPUs of a NUMA node to a set
+ **/
+static int add_node(long node, cpu_set_t* cpus) {
+	char name[64];
+	char buf[4096];
+	FILE* f;
+	bool ok;
+
+	snprintf(name, sizeof(name), SYSFS_NODE "/node%ld/cpulist", node);
+	if(!(f = fopen(name, "r")))
+		return -1;
+	ok = fgets(buf, sizeof(buf), f) != NULL;
+	fclose(f);
+	if(!ok) {
+		errno = EINVAL;
+		return -1;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+	return parse_list(buf, cpus, false);
+}
+
+static int parse_list(const char* list, cpu_set_t* cpus, bool nodes) {
+	const char* p = list;
+	cpu_set_t node;
+	char* end;
+	long first, last;
+
+	CPU_ZERO(cpus);
+	do {
+		if(nodes && !strncmp(p, "node", 4)) {
+			first = strtol(p + 4, &end, 10);
+			if(end == p + 4 || first < 0)
+				goto invalid;
+			if(add_node(first, &node))
+				return -1;
+			CPU_OR(cpus, cpus, &node);
+			p = end;
+			continue;
+		}
+		first = strtol(p, &end, 10);
+		if(end == p || first < 0)
+			goto invalid;
+		last = first;
+		p = end;
+		if(*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if(end == p + 1 || last < first)
+				goto invalid;
+			p = end;
+		}
+		if(last >= CPU_SETSIZE)
+			goto invalid;
+		for(; first <= last; first++)
+			CPU_SET(first, cpus);
+	} while(*p == ',' && *p++);
+	if(*p == '\0')
+		return 0;
+invalid:
+	errno = EINVAL;
+	return -1;
+}
+
+/**
+ * Find the CPUs of the NUMA node that handles a socket's packets
+ **/
+static int incoming_cpus(int net, cpu_set_t* cpus) {
+#ifdef SO_INCOMING_CPU
+	char name[64];
+	struct dirent* de;
+	socklen_t len = sizeof(int);
+	long node = -1;
+	int cpu;
+	DIR* dir;
+
+	if(getsockopt(net, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
+		return -1;
+	if(cpu < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	snprintf(name, sizeof(name), SYSFS_CPU "/cpu%d", cpu);
+	if(!(dir = opendir(name)))
+		return -1;
+	while((de = readdir(dir))) {
+		if(!strncmp(de->d_name, "node", 4)) {
+			node = strtol(de->d_name + 4, NULL, 10);
+			break;
+		}
+	}
+	closedir(dir);
+	if(node < 0) {
+		/* A kernel without NUMA support; all CPUs are equally
+		 * close */
+		errno = ENOENT;
+		return -1;
+	}
+	return add_node(node, cpus);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+#endif
+
+struct affinity* affinity_parse(const char* spec) {
+	struct affinity* a = g_new0(struct affinity, 1);
+
+	if(!strcmp(spec, AFFINITY_AUTO)) {
+		a->automatic = true;
+		return a;
+	}
+#ifdef HAVE_SCHED_SETAFFINITY
+	if(!parse_list(spec, &(a->cpus), true))
+		return a;
+#else
+	errno = ENOSYS;
+#endif
+	g_free(a);
+	return NULL;
+}
+
+void affinity_free(struct affinity* a) {
+	g_free(a);
+}
+
+int affinity_apply(struct affinity* a, int net) {
+#ifdef HAVE_SCHED_SETAFFINITY
+	cpu_set_t cpus;
+
+	if(a->automatic) {
+		if(incoming_cpus(net, &cpus))
+			return -1;
+	} else {
+		cpus = a->cpus;
+	}
+	/* On Linux, a pid of 0 is the calling thread, not the process */
+	return sched_setaffinity(0, sizeof(cpus), &cpus);
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
@@ -0,0 +1,33 @@
+/**
+ * Pinning threads to CPUs and NUMA nodes
+ */
+#ifndef NBD_AFFINITY_H
+#define NBD_AFFINITY_H
+
+#define AFFINITY_AUTO "auto" /**< follow the CPU that receives the connection's packets */
+
+struct affinity;
+
+/**
+ * Parse a set of CPUs. This is either AFFINITY_AUTO, or a comma-separated
+ * list of CPU numbers ("3"), ranges of them ("0-7"), and NUMA nodes
+ * ("node1"), which stand for all their CPUs.
+ *
+ * @return the set, or NULL with errno set if the specification is invalid
+ **/
+struct affinity* affinity_parse(const char* spec);
+
+void affinity_free(struct affinity* a);
+
+/**
+ * Pin the calling thread to a set of CPUs. With AFFINITY_AUTO, these are
+ * the CPUs of the NUMA node of the CPU that handled the last packet that
+ * came in on a socket, so that we run close to the network card and the
+ * data we received.
+ *
+ * @param net the socket of the connection
+ * @return 0 on success, or -1 with errno set
+ **/
+int affinity_apply(struct affinity* a, int net);
+
+#endif
@@ -0,0 +1,446 @@
+/*
+ * Per-block checksums of exports, kept in a file of their own.
+ *
+ * The file starts with a header of CHECKSUM_BLOCKSIZE bytes, followed by
+ * a CRC32C for every block of the export; all of it is mapped in, so
+ * that looking up or changing a checksum is a memory access. A checksum
+ * of 0 means that the block has none yet; a CRC that happens to be 0 is
+ * stored as 1 instead.
+ *
+ * Writers mark the file dirty while they have it open. Checksums are
+ * changed after the data they cover, so if a writer goes away without
+ * closing the file, they can't be trusted; the next one to open it then
+ * forgets all of them, and the scrubber fills them in again.
+ */
+#include "lfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "checksum.h"
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define HAVE_CRC32_INSN 1
+#endif
+
+#define POLY 0x82f63b78	/**< the Castagnoli polynomial, reflected */
+#define NLOCKS 64	/**< number of locks the blocks are spread over */
+#define HEADERSIZE CHECKSUM_BLOCKSIZE
+#define F_DIRTY 1	/**< a writer has the file open */
+#define UNKNOWN 0
+
+/* Lengths the hardware CRC is interleaved over; powers of two */
+#define LONG 1024
+#define SHORT 256
+
+/**
+ * The header of a checksum file. All numbers are little-endian, as are
+ * the checksums that follow it.
+ **/
+struct header {
+	char magic[8];
+	uint32_t blocksize;
+	uint32_t flags;
+	uint64_t size;		/**< size of the export */
+	uint64_t scrubnext;	/**< next block the scrubber looks at */
+};
+
+struct checksums {
+	int fd;
+	char* map;
+	size_t maplen;
+	struct header* header;
+	uint32_t* sums;
+	uint64_t size;
+	uint64_t nblocks;
+	bool readonly;
+	pthread_rwlock_t locks[NLOCKS];
+};
+
+static uint32_t crc32c_table[256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static uint32_t zerosum;
+static uint32_t (*crc32c_impl)(uint32_t crc, const unsigned char* buf, size_t len);
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char* buf, size_t len) {
+	crc = ~crc;
+	while(len--)
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+#ifdef HAVE_CRC32_INSN
+/*
+ * Operators that append a number of zero bytes to a CRC, as matrices over
+ * GF(2); they combine the CRCs of interleaved streams. See Mark Adler's
+ * crc32c.c.
+ */
+static uint32_t gf2_matrix_times(const uint32_t* mat, uint32_t vec) {
+	uint32_t sum = 0;
+
+	while(vec) {
+		if(vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t* square, const uint32_t* mat) {
+	int n;
+
+	for(n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+static void crc32c_zeros_op(uint32_t* even, size_t len) {
+	uint32_t odd[32];
+	uint32_t row = 1;
+	int n;
+
+	odd[0] = POLY;
+	for(n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two zero bits */
+	gf2_matrix_square(odd, even);	/* four zero bits */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if(!len)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while(len);
+	memcpy(even, odd, sizeof(odd));
+}
+
+static void crc32c_zeros(uint32_t zeros[4][256], size_t len) {
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for(n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static inline uint32_t crc32c_shift(uint32_t zeros[4][256], uint32_t crc) {
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static inline uint64_t load64(const unsigned char* p) {
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * CRC32C with the SSE4.2 crc32 instruction. Its latency is three times
+ * its throughput, so three streams are computed at once and combined.
+ **/
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char* buf, size_t len) {
+	uint64_t crc0 = ~crc;
+	uint64_t crc1, crc2;
+	const unsigned char* end;
+
+	while(len && ((uintptr_t)buf & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *buf++);
+		len--;
+	}
+	while(len >= LONG * 3) {
+		crc1 = crc2 = 0;
+		end = buf + LONG;
+		do {
+			crc0 = _mm_crc32_u64(crc0, load64(buf));
+			crc1 = _mm_crc32_u64(crc1, load64(buf + LONG));
+			crc2 = _mm_crc32_u64(crc2, load64(buf + LONG * 2));
+			buf += 8;
+		} while(buf < end);
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_long, crc0) ^ crc2;
+		buf += LONG * 2;
+		len -= LONG * 3;
+	}
+	while(len >= SHORT * 3) {
+		crc1 = crc2 = 0;
+		end = buf + SHORT;
+		do {
+			crc0 = _mm_crc32_u64(crc0, load64(buf));
+			crc1 = _mm_crc32_u64(crc1, load64(buf + SHORT));
+			crc2 = _mm_crc32_u64(crc2, load64(buf + SHORT * 2));
+			buf += 8;
+		} while(buf < end);
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc1;
+		crc0 = crc32c_shift(crc32c_short, crc0) ^ crc2;
+		buf += SHORT * 2;
+		len -= SHORT * 3;
+	}
+	while(len >= 8) {
+		crc0 = _mm_crc32_u64(crc0, load64(buf));
+		buf += 8;
+		len -= 8;
+	}
+	while(len--)
+		crc0 = _mm_crc32_u8(crc0, *buf++);
+	return ~(uint32_t)crc0;
+}
+#endif
+
+static void crc32c_init(void) {
+	static const char zeroes[CHECKSUM_BLOCKSIZE];
+	uint32_t crc;
+	int i, j;
+
+	for(i = 0; i < 256; i++) {
+		crc = i;
+		for(j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+	crc32c_impl = crc32c_sw;
+#ifdef HAVE_CRC32_INSN
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse4.2")) {
+		crc32c_zeros(crc32c_long, LONG);
+		crc32c_zeros(crc32c_short, SHORT);
+		crc32c_impl = crc32c_hw;
+	}
+#endif
+	zerosum = crc32c_impl(0, (const unsigned char*)zeroes, sizeof(zeroes));
+}
+
+uint32_t checksum_crc32c(uint32_t crc, const void* buf, size_t len) {
+	pthread_once(&crc32c_once, crc32c_init);
+	return crc32c_impl(crc, buf, len);
+}
+
+/**
+ * The value stored for a block with these contents
+ **/
+static uint32_t blocksum(const char* buf, size_t len) {
+	uint32_t crc = checksum_crc32c(0, buf, len);
+
+	return htole32(crc == UNKNOWN ? 1 : crc);
+}
+
+static bool header_valid(struct checksums* c, struct stat* st) {
+	struct header* h = c->header;
+
+	return (size_t)st->st_size == c->maplen &&
+		!memcmp(h->magic, CHECKSUM_MAGIC, sizeof(h->magic)) &&
+		le32toh(h->blocksize) == CHECKSUM_BLOCKSIZE &&
+		le64toh(h->size) == c->size &&
+		!(le32toh(h->flags) & F_DIRTY);
+}
+
+/**
+ * Give the file the right size, and fill in a header without any
+ * checksums after it.
+ **/
+static int reset(struct checksums* c) {
+	struct header h;
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CHECKSUM_MAGIC, sizeof(h.magic));
+	h.blocksize = htole32(CHECKSUM_BLOCKSIZE);
+	h.size = htole64(c->size);
+	if(ftruncate(c->fd, 0) || ftruncate(c->fd, c->maplen))
+		return -1;
+	if(pwrite(c->fd, &h, sizeof(h), 0) != sizeof(h))
+		return -1;
+	return fdatasync(c->fd);
+}
+
+/**
+ * Check the file against the export, and start over if it doesn't
+ * belong to it. The file must be locked exclusively.
+ **/
+static int validate(struct checksums* c) {
+	struct stat st;
+
+	if(fstat(c->fd, &st))
+		return -1;
+	if((size_t)st.st_size >= sizeof(struct header) &&
+	   pread(c->fd, c->header, sizeof(struct header), 0) == sizeof(struct header) &&
+	   header_valid(c, &st))
+		return 0;
+	return reset(c);
+}
+
+struct checksums* checksum_open(const char* filename, uint64_t size, bool readonly) {
+	struct checksums* c;
+	struct header h;
+	struct stat st;
+	int i;
+
+	pthread_once(&crc32c_once, crc32c_init);
+	c = g_new0(struct checksums, 1);
+	c->size = size;
+	c->nblocks = (size + CHECKSUM_BLOCKSIZE - 1) / CHECKSUM_BLOCKSIZE;
+	c->maplen = HEADERSIZE + c->nblocks * sizeof(uint32_t);
+	c->readonly = readonly;
+	c->header = &h;
+	if((c->fd = open(filename, O_RDWR | O_CREAT, 0600)) < 0)
+		goto err;
+	if(readonly) {
+		/* Readers only ever add checksums that are right, so they
+		 * can share the file; only one that finds it stale needs it
+		 * to itself */
+		if(flock(c->fd, LOCK_SH | LOCK_NB) || fstat(c->fd, &st))
+			goto err;
+		if((size_t)st.st_size < sizeof(h) ||
+		   pread(c->fd, &h, sizeof(h), 0) != sizeof(h) ||
+		   !header_valid(c, &st)) {
+			if(flock(c->fd, LOCK_EX | LOCK_NB) || validate(c) || flock(c->fd, LOCK_SH | LOCK_NB))
+				goto err;
+		}
+	} else if(flock(c->fd, LOCK_EX | LOCK_NB) || validate(c)) {
+		goto err;
+	}
+	c->map = mmap(NULL, c->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if(c->map == MAP_FAILED)
+		goto err;
+	c->header = (struct header*)c->map;
+	c->sums = (uint32_t*)(c->map + HEADERSIZE);
+	if(!readonly) {
+		c->header->flags = htole32(le32toh(c->header->flags) | F_DIRTY);
+		if(msync(c->map, HEADERSIZE, MS_SYNC)) {
+			munmap(c->map, c->maplen);
+			goto err;
+		}
+	}
+	for(i = 0; i < NLOCKS; i++)
+		pthread_rwlock_init(&c->locks[i], NULL);
+	return c;
+err:
+	i = errno == EWOULDBLOCK ? EBUSY : errno;
+	if(c->fd >= 0)
+		close(c->fd);
+	g_free(c);
+	errno = i;
+	return NULL;
+}
+
+int checksum_flush(struct checksums* c) {
+	return msync(c->map, c->maplen, MS_SYNC);
+}
+
+int checksum_close(struct checksums* c) {
+	int ret;
+	int error;
+	int i;
+
+	ret = checksum_flush(c);
+	if(!ret && !c->readonly) {
+		c->header->flags = htole32(le32toh(c->header->flags) & ~F_DIRTY);
+		ret = msync(c->map, HEADERSIZE, MS_SYNC);
+	}
+	error = errno;
+	munmap(c->map, c->maplen);
+	close(c->fd);
+	for(i = 0; i < NLOCKS; i++)
+		pthread_rwlock_destroy(&c->locks[i]);
+	g_free(c);
+	errno = error;
+	return ret;
+}
+
+/**
+ * Call a function for the locks of the blocks of a range, in the order
+ * of the locks, so that two ranges can't deadlock
+ **/
+static void for_locks(struct checksums* c, uint64_t from, uint64_t len, int (*fn)(pthread_rwlock_t*)) {
+	uint64_t first, count;
+	int i;
+
+	if(!len)
+		return;
+	first = from / CHECKSUM_BLOCKSIZE;
+	count = (from + len - 1) / CHECKSUM_BLOCKSIZE - first + 1;
+	for(i = 0; i < NLOCKS; i++) {
+		if(count >= NLOCKS || (i - first % NLOCKS + NLOCKS) % NLOCKS < count)
+			fn(&c->locks[i]);
+	}
+}
+
+void checksum_lock(struct checksums* c, uint64_t from, uint64_t len, bool write) {
+	for_locks(c, from, len, write ? pthread_rwlock_wrlock : pthread_rwlock_rdlock);
+}
+
+void checksum_unlock(struct checksums* c, uint64_t from, uint64_t len, bool write) {
+	for_locks(c, from, len, pthread_rwlock_unlock);
+}
+
+size_t checksum_blocklen(struct checksums* c, uint64_t block) {
+	uint64_t start = block * CHECKSUM_BLOCKSIZE;
+
+	return MIN(c->size - start, CHECKSUM_BLOCKSIZE);
+}
+
+bool checksum_verify(struct checksums* c, uint64_t block, const char* buf) {
+	uint32_t sum = __atomic_load_n(&c->sums[block], __ATOMIC_RELAXED);
+
+	return sum == UNKNOWN || sum == blocksum(buf, checksum_blocklen(c, block));
+}
+
+void checksum_update(struct checksums* c, uint64_t block, const char* buf) {
+	__atomic_store_n(&c->sums[block], blocksum(buf, checksum_blocklen(c, block)), __ATOMIC_RELAXED);
+}
+
+void checksum_zero(struct checksums* c, uint64_t block) {
+	static const char zeroes[CHECKSUM_BLOCKSIZE];
+	uint32_t sum;
+
+	if(checksum_blocklen(c, block) == CHECKSUM_BLOCKSIZE)
+		sum = htole32(zerosum == UNKNOWN ? 1 : zerosum);
+	else
+		sum = blocksum(zeroes, checksum_blocklen(c, block));
+	__atomic_store_n(&c->sums[block], sum, __ATOMIC_RELAXED);
+}
+
+void checksum_forget(struct checksums* c, uint64_t from, uint64_t len) {
+	uint64_t block;
+
+	if(!len)
+		return;
+	for(block = from / CHECKSUM_BLOCKSIZE; block <= (from + len - 1) / CHECKSUM_BLOCKSIZE && block < c->nblocks; block++)
+		__atomic_store_n(&c->sums[block], UNKNOWN, __ATOMIC_RELAXED);
+}
+
+bool checksum_known(struct checksums* c, uint64_t block) {
+	return __atomic_load_n(&c->sums[block], __ATOMIC_RELAXED) != UNKNOWN;
+}
+
+uint64_t checksum_scrub_next(struct checksums* c) {
+	uint64_t old = __atomic_load_n(&c->header->scrubnext, __ATOMIC_RELAXED);
+	uint64_t next;
+
+	/* The header is shared with the other readers of the file, so
+	 * that they scrub different blocks */
+	do {
+		next = htole64((le64toh(old) + 1) % c->nblocks);
+	} while(!__atomic_compare_exchange_n(&c->header->scrubnext, &old, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return le64toh(old) % c->nblocks;
+}
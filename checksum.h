@@ -0,0 +1,106 @@
+/**
+ * Per-block checksums of exports
+ */
+#ifndef NBD_CHECKSUM_H
+#define NBD_CHECKSUM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CHECKSUM_BLOCKSIZE 4096 /**< size of the blocks that have a checksum of their own */
+#define CHECKSUM_MAGIC "NBDCRC01" /**< first bytes of a checksum file */
+#define CHECKSUM_DEFAULT_SCRUBRATE (16*1024*1024) /**< default bytes per second the scrubber verifies */
+
+struct checksums;
+
+/**
+ * Compute a CRC32C (Castagnoli), with the CPU's CRC instructions if it
+ * has them.
+ *
+ * @param crc the CRC of the data before buf, or 0 to start
+ **/
+uint32_t checksum_crc32c(uint32_t crc, const void* buf, size_t len);
+
+/**
+ * Open the checksum file of an export, and create it if it doesn't
+ * exist. If it belongs to an export of another size, or was not closed
+ * cleanly, all checksums in it are forgotten, since data may have been
+ * written without its checksum.
+ *
+ * A writer needs the file to itself; readers can share it with each
+ * other. Neither waits for the file to be free.
+ *
+ * @param size the size of the export
+ * @param readonly whether the export is only read from
+ * @return the checksums, or NULL with errno set (EBUSY if it's in use)
+ **/
+struct checksums* checksum_open(const char* filename, uint64_t size, bool readonly);
+
+/**
+ * Write all checksums out, mark the file as closed cleanly, and close
+ * it.
+ *
+ * @return 0 on success, nonzero with errno set if the checksums could
+ * not be written out
+ **/
+int checksum_close(struct checksums* c);
+
+/**
+ * Write all checksums out.
+ **/
+int checksum_flush(struct checksums* c);
+
+/**
+ * Lock the blocks of a range, so that the data and checksums of those
+ * blocks can be read or changed together. Readers share the lock.
+ **/
+void checksum_lock(struct checksums* c, uint64_t from, uint64_t len, bool write);
+void checksum_unlock(struct checksums* c, uint64_t from, uint64_t len, bool write);
+
+/**
+ * @return the length of block number block; CHECKSUM_BLOCKSIZE, except
+ * maybe for the last one
+ **/
+size_t checksum_blocklen(struct checksums* c, uint64_t block);
+
+/**
+ * Check a block against its checksum. Blocks that have no checksum yet
+ * pass.
+ *
+ * @param buf the whole block
+ * @return true if the block is intact
+ **/
+bool checksum_verify(struct checksums* c, uint64_t block, const char* buf);
+
+/**
+ * Record the checksum of a block.
+ *
+ * @param buf the whole block
+ **/
+void checksum_update(struct checksums* c, uint64_t block, const char* buf);
+
+/**
+ * Record that a block holds only zeroes.
+ **/
+void checksum_zero(struct checksums* c, uint64_t block);
+
+/**
+ * Forget the checksums of the blocks of a range, for when their
+ * contents are unknown.
+ **/
+void checksum_forget(struct checksums* c, uint64_t from, uint64_t len);
+
+/**
+ * @return whether a block has a checksum
+ **/
+bool checksum_known(struct checksums* c, uint64_t block);
+
+/**
+ * Take the next block to scrub. The scrubber goes around the export over
+ * and over, and carries on where it stopped the last time the file was
+ * open.
+ **/
+uint64_t checksum_scrub_next(struct checksums* c);
+
+#endif
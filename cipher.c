@@ -0,0 +1,155 @@
+/*
+ * At-rest encryption of exports with AES-XTS, through OpenSSL's EVP
+ * interface, which uses the AES-NI or VAES code paths the CPU has.
+ *
+ * EVP contexts can't be shared between threads, and keying one is
+ * expensive, so keyed contexts are kept in a pool per direction; a
+ * request takes one out, and only changes its tweak for every sector.
+ */
+#include "lfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+
+#include "cipher.h"
+
+#define MAXKEYSIZE 64
+
+struct cipher {
+	const EVP_CIPHER* type;
+	unsigned char key[MAXKEYSIZE];
+	pthread_mutex_t lock;
+	GArray* idle[2];	/**< keyed contexts not in use, for decryption and encryption */
+};
+
+struct cipher* cipher_open(const char* keyfile) {
+	struct cipher* c;
+	struct stat st;
+	ssize_t len;
+	int fd;
+
+	fd = open(keyfile, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) || (st.st_size != 32 && st.st_size != 64)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	c = g_new0(struct cipher, 1);
+	len = read(fd, c->key, st.st_size);
+	close(fd);
+	if(len != st.st_size || !CRYPTO_memcmp(c->key, c->key + len / 2, len / 2)) {
+		OPENSSL_cleanse(c->key, sizeof(c->key));
+		g_free(c);
+		errno = EINVAL;
+		return NULL;
+	}
+	c->type = len == 64 ? EVP_aes_256_xts() : EVP_aes_128_xts();
+	pthread_mutex_init(&c->lock, NULL);
+	c->idle[0] = g_array_new(FALSE, FALSE, sizeof(EVP_CIPHER_CTX*));
+	c->idle[1] = g_array_new(FALSE, FALSE, sizeof(EVP_CIPHER_CTX*));
+	return c;
+}
+
+void cipher_close(struct cipher* c) {
+	guint i;
+	int enc;
+
+	for(enc = 0; enc < 2; enc++) {
+		for(i = 0; i < c->idle[enc]->len; i++)
+			EVP_CIPHER_CTX_free(g_array_index(c->idle[enc], EVP_CIPHER_CTX*, i));
+		g_array_free(c->idle[enc], TRUE);
+	}
+	pthread_mutex_destroy(&c->lock);
+	OPENSSL_cleanse(c->key, sizeof(c->key));
+	g_free(c);
+}
+
+/**
+ * Take a keyed context out of the pool, or make a new one.
+ **/
+static EVP_CIPHER_CTX* getctx(struct cipher* c, int enc) {
+	EVP_CIPHER_CTX* ctx = NULL;
+
+	pthread_mutex_lock(&c->lock);
+	if(c->idle[enc]->len > 0) {
+		ctx = g_array_index(c->idle[enc], EVP_CIPHER_CTX*, c->idle[enc]->len - 1);
+		g_array_set_size(c->idle[enc], c->idle[enc]->len - 1);
+	}
+	pthread_mutex_unlock(&c->lock);
+	if(ctx)
+		return ctx;
+	ctx = EVP_CIPHER_CTX_new();
+	if(!ctx)
+		return NULL;
+	if(!EVP_CipherInit_ex(ctx, c->type, NULL, c->key, NULL, enc)) {
+		EVP_CIPHER_CTX_free(ctx);
+		return NULL;
+	}
+	return ctx;
+}
+
+static void putctx(struct cipher* c, EVP_CIPHER_CTX* ctx, int enc) {
+	pthread_mutex_lock(&c->lock);
+	g_array_append_val(c->idle[enc], ctx);
+	pthread_mutex_unlock(&c->lock);
+}
+
+static bool iszero(const char* buf, size_t len) {
+	return buf[0] == 0 && !memcmp(buf, buf + 1, len - 1);
+}
+
+static int transform(struct cipher* c, uint64_t sector, const char* in, char* out, size_t len, int enc) {
+	unsigned char tweak[16] = { 0 };
+	EVP_CIPHER_CTX* ctx;
+	uint64_t le;
+	size_t i;
+	int outl;
+	int ret = 0;
+
+	if(len % CIPHER_SECTORSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	if(!(ctx = getctx(c, enc))) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for(i = 0; i < len; i += CIPHER_SECTORSIZE, sector++) {
+		if(!enc && iszero(in + i, CIPHER_SECTORSIZE)) {
+			if(out != in)
+				memset(out + i, 0, CIPHER_SECTORSIZE);
+			continue;
+		}
+		le = htole64(sector);
+		memcpy(tweak, &le, sizeof(le));
+		if(!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, tweak, -1) ||
+		   !EVP_CipherUpdate(ctx, (unsigned char*)out + i, &outl, (const unsigned char*)in + i, CIPHER_SECTORSIZE) ||
+		   outl != CIPHER_SECTORSIZE) {
+			errno = EIO;
+			ret = -1;
+			break;
+		}
+	}
+	putctx(c, ctx, enc);
+	return ret;
+}
+
+int cipher_encrypt(struct cipher* c, uint64_t sector, const char* in, char* out, size_t len) {
+	return transform(c, sector, in, out, len, 1);
+}
+
+int cipher_decrypt(struct cipher* c, uint64_t sector, const char* in, char* out, size_t len) {
+	return transform(c, sector, in, out, len, 0);
+}
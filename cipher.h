@@ -0,0 +1,50 @@
+/**
+ * At-rest encryption of exports
+ */
+#ifndef NBD_CIPHER_H
+#define NBD_CIPHER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CIPHER_SECTORSIZE 512 /**< size of the units that are encrypted with a tweak of their own */
+
+struct cipher;
+
+/**
+ * Load a key and set up AES-XTS with it. The key file holds the raw key:
+ * 32 bytes for AES-128-XTS, or 64 bytes for AES-256-XTS. As with XTS in
+ * general, the two halves of the key must differ.
+ *
+ * @return the cipher, or NULL with errno set
+ **/
+struct cipher* cipher_open(const char* keyfile);
+
+/**
+ * Forget a key.
+ **/
+void cipher_close(struct cipher* c);
+
+/**
+ * Encrypt sectors. The tweak of every sector is its number, as a 64-bit
+ * little-endian value, as dm-crypt's aes-xts-plain64 does. Safe to call
+ * from several threads at once.
+ *
+ * @param sector the number of the first sector
+ * @param in the plaintext
+ * @param out where to put the ciphertext; may be in
+ * @param len the number of bytes; a multiple of CIPHER_SECTORSIZE
+ * @return 0 on success, nonzero on failure
+ **/
+int cipher_encrypt(struct cipher* c, uint64_t sector, const char* in, char* out, size_t len);
+
+/**
+ * Decrypt sectors. Sectors that are all zeroes are left alone rather
+ * than decrypted, so that holes, trimmed ranges and zeroes written with
+ * fallocate() read back as zeroes.
+ *
+ * @see cipher_encrypt
+ **/
+int cipher_decrypt(struct cipher* c, uint64_t sector, const char* in, char* out, size_t len);
+
+#endif
@@ -95,15 +95,23 @@ void readit(int f, void *buf, size_t len);
 #define NBD_OPT_EXPORT_NAME	(1)	/** Client wants to select a named export (is followed by name of export) */
 #define NBD_OPT_ABORT		(2)	/** Client wishes to abort negotiation */
 #define NBD_OPT_LIST		(3)	/** Client request list of supported exports (not followed by data) */
+#define NBD_OPT_INFO		(6)	/** Client wants information about an export */
+#define NBD_OPT_GO		(7)	/** Client wants information about an export, and to select it */
+#define NBD_OPT_STRUCTURED_REPLY (8)	/** Client wants to receive structured replies */
+#define NBD_OPT_LIST_META_CONTEXT (9)	/** Client wants to know which metadata contexts exist */
+#define NBD_OPT_SET_META_CONTEXT (10)	/** Client selects metadata contexts for the export */
 
 /* Replies the server can send during negotiation */
 #define NBD_REP_ACK		(1)	/** ACK a request. Data: option number to be acked */
 #define NBD_REP_SERVER		(2)	/** Reply to NBD_OPT_LIST (one of these per server; must be followed by NBD_REP_ACK to signal the end of the list */
+#define NBD_REP_INFO		(3)	/** Reply to NBD_OPT_{INFO,GO} (one per piece of information; followed by NBD_REP_ACK) */
+#define NBD_REP_META_CONTEXT	(4)	/** Reply to NBD_OPT_{LIST,SET}_META_CONTEXT (one per context; followed by NBD_REP_ACK) */
 #define NBD_REP_FLAG_ERROR	(1 << 31)	/** If the high bit is set, the reply is an error */
 #define NBD_REP_ERR_UNSUP	(1 | NBD_REP_FLAG_ERROR)	/** Client requested an option not understood by this version of the server */
 #define NBD_REP_ERR_POLICY	(2 | NBD_REP_FLAG_ERROR)	/** Client requested an option not allowed by server configuration. (e.g., the option was disabled) */
 #define NBD_REP_ERR_INVALID	(3 | NBD_REP_FLAG_ERROR)	/** Client issued an invalid request */
 #define NBD_REP_ERR_PLATFORM	(4 | NBD_REP_FLAG_ERROR)	/** Option not supported on this platform */
+#define NBD_REP_ERR_UNKNOWN	(6 | NBD_REP_FLAG_ERROR)	/** The requested export is not available */
 
 /* Global flags */
 #define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)	/* new-style export that actually supports extending */
@@ -111,3 +119,11 @@ void readit(int f, void *buf, size_t len);
 /* Flags from client to server. Only one such option currently. */
 #define NBD_FLAG_C_FIXED_NEWSTYLE NBD_FLAG_FIXED_NEWSTYLE
 #define NBD_FLAG_C_NO_ZEROES	NBD_FLAG_NO_ZEROES
+
+/* The only metadata context nbd-server implements, and the id it uses for it */
+#define NBD_META_BASE_ALLOCATION "base:allocation"
+#define NBD_META_ID_BASE_ALLOCATION 1
+
+/* Information types for NBD_REP_INFO */
+#define NBD_INFO_EXPORT		(0)	/** Export size and transmission flags */
+#define NBD_INFO_BLOCK_SIZE	(3)	/** Minimum, preferred and maximum block size */
@@ -0,0 +1,437 @@
+/*
+ * Seekable compressed export images. An image is a header, an index of
+ * the file offsets of all chunks, and the chunks themselves, each of
+ * which is a zlib stream of its own. The header and index are big-endian:
+ *
+ *   8 bytes   COMPRESSED_MAGIC
+ *   4 bytes   chunk size
+ *   4 bytes   flags, 0
+ *   8 bytes   size of the decompressed image
+ *   8 bytes   number of chunks (n)
+ *   n+1 * 8   offset of every chunk, and of the end of the last one
+ *
+ * A chunk that takes no space is all zeroes. A chunk that takes as much
+ * space as it has data is stored uncompressed.
+ *
+ * Decompressed chunks are kept in a cache that is replaced with the
+ * CLOCK algorithm. The cache lock is only held to look chunks up and
+ * copy them in or out, so threads decompress in parallel.
+ *
+ * Plain gzip images are served too, through the access point index of
+ * gzindex.c, which has a cache and a pool of decompression contexts of
+ * its own.
+ */
+#include "lfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <glib.h>
+
+#include "compressed.h"
+#include "gzindex.h"
+
+#define COMPRESSED_HEADERSIZE 32
+
+struct compressed_slot {
+	int64_t chunk;	/**< chunk held, or -1 */
+	bool ref;	/**< used since the clock hand last passed */
+	char* data;
+};
+
+struct compressed {
+	int fd;
+	uint64_t size;
+	uint32_t chunksize;
+	uint64_t nchunks;
+	uint64_t* offsets;	/**< nchunks + 1 entries */
+	pthread_mutex_t lock;
+	int32_t* slotof;	/**< slot of every chunk, or -1 */
+	struct compressed_slot* slots;
+	uint32_t nslots;
+	uint32_t hand;
+	struct gzindex* gz;	/**< set instead of all of the above for gzip images */
+};
+
+static int write_fully(int fd, const void* buf, size_t len, off_t off) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pwrite(fd, buf, len, off);
+		if(ret <= 0) {
+			if(!ret)
+				errno = EIO;
+			return -1;
+		}
+		buf = (const char*)buf + ret;
+		len -= ret;
+		off += ret;
+	}
+	return 0;
+}
+
+static ssize_t read_fully(int fd, void* buf, size_t len) {
+	size_t done = 0;
+	ssize_t ret;
+
+	while(done < len) {
+		ret = read(fd, (char*)buf + done, len - done);
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		done += ret;
+	}
+	return done;
+}
+
+static bool all_zeroes(const char* data, size_t len) {
+	size_t i;
+
+	for(i = 0; i < len; i++) {
+		if(data[i])
+			return false;
+	}
+	return true;
+}
+
+int compressed_create(int in, int out, uint32_t chunksize, int level) {
+	char header[COMPRESSED_HEADERSIZE];
+	GArray* offsets = g_array_new(FALSE, FALSE, sizeof(uint64_t));
+	char* data = g_malloc(chunksize);
+	uLongf bound = compressBound(chunksize);
+	char* zdata = g_malloc(bound);
+	uint64_t size = 0;
+	uint64_t pos, be;
+	uLongf zlen;
+	ssize_t len;
+	uint64_t i;
+	int retval = -1;
+	uint32_t u32;
+
+	if(chunksize == 0 || chunksize > COMPRESSED_MAX_CHUNKSIZE) {
+		errno = EINVAL;
+		goto out;
+	}
+	/* The index goes between the header and the chunks, so we can only
+	 * write it when we know how many chunks there are; write the chunks
+	 * to a temporary place first. Reading the image twice would not work
+	 * on pipes. */
+	pos = 0;
+	while((len = read_fully(in, data, chunksize)) > 0) {
+		g_array_append_val(offsets, pos);
+		size += len;
+		if(all_zeroes(data, len))
+			continue;
+		zlen = bound;
+		if(compress2((Bytef*)zdata, &zlen, (Bytef*)data, len, level) != Z_OK) {
+			errno = EIO;
+			goto out;
+		}
+		if(zlen >= (uLongf)len) {
+			if(write_fully(out, data, len, COMPRESSED_HEADERSIZE + pos))
+				goto out;
+			pos += len;
+		} else {
+			if(write_fully(out, zdata, zlen, COMPRESSED_HEADERSIZE + pos))
+				goto out;
+			pos += zlen;
+		}
+		if(len < (ssize_t)chunksize)
+			break;
+	}
+	if(len < 0)
+		goto out;
+	g_array_append_val(offsets, pos);
+
+	/* Now move the chunks up to make room for the index, from the end
+	 * so that we don't overwrite what we still have to move */
+	{
+		uint64_t indexsize = offsets->len * sizeof(uint64_t);
+		uint64_t end = pos;
+		uint64_t cur;
+
+		while(end > 0) {
+			cur = MIN(end, (uint64_t)chunksize);
+			end -= cur;
+			if(pread(out, data, cur, COMPRESSED_HEADERSIZE + end) != (ssize_t)cur)
+				goto out;
+			if(write_fully(out, data, cur, COMPRESSED_HEADERSIZE + indexsize + end))
+				goto out;
+		}
+		for(i = 0; i < offsets->len; i++) {
+			be = htobe64(g_array_index(offsets, uint64_t, i) + COMPRESSED_HEADERSIZE + indexsize);
+			if(write_fully(out, &be, sizeof(be), COMPRESSED_HEADERSIZE + i * sizeof(be)))
+				goto out;
+		}
+	}
+	memcpy(header, COMPRESSED_MAGIC, 8);
+	u32 = htobe32(chunksize);
+	memcpy(header + 8, &u32, 4);
+	memset(header + 12, 0, 4);
+	be = htobe64(size);
+	memcpy(header + 16, &be, 8);
+	be = htobe64(offsets->len - 1);
+	memcpy(header + 24, &be, 8);
+	if(write_fully(out, header, sizeof(header), 0))
+		goto out;
+	retval = 0;
+out:
+	g_array_free(offsets, TRUE);
+	g_free(data);
+	g_free(zdata);
+	return retval;
+}
+
+struct compressed* compressed_open(const char* filename, uint64_t cachesize) {
+	char header[COMPRESSED_HEADERSIZE];
+	struct compressed* c = g_new0(struct compressed, 1);
+	uint64_t be;
+	uint32_t u32;
+	uint64_t i;
+	int err;
+
+	c->fd = open(filename, O_RDONLY);
+	if(c->fd < 0)
+		goto fail;
+	if(pread(c->fd, header, 2, 0) == 2 && !memcmp(header, "\x1f\x8b", 2)) {
+		close(c->fd);
+		c->fd = -1;
+		if(!(c->gz = gzindex_open(filename, GZINDEX_DEFAULT_SPAN, cachesize)))
+			goto fail;
+		c->size = gzindex_size(c->gz);
+		c->chunksize = GZINDEX_BLOCK;
+		return c;
+	}
+	if(pread(c->fd, header, sizeof(header), 0) != sizeof(header) ||
+	   memcmp(header, COMPRESSED_MAGIC, 8)) {
+		errno = EINVAL;
+		goto fail;
+	}
+	memcpy(&u32, header + 8, 4);
+	c->chunksize = be32toh(u32);
+	memcpy(&be, header + 16, 8);
+	c->size = be64toh(be);
+	memcpy(&be, header + 24, 8);
+	c->nchunks = be64toh(be);
+	if(c->chunksize == 0 || c->chunksize > COMPRESSED_MAX_CHUNKSIZE ||
+	   c->nchunks != (c->size + c->chunksize - 1) / c->chunksize ||
+	   c->nchunks >= INT32_MAX) {
+		errno = EINVAL;
+		goto fail;
+	}
+	c->offsets = g_new(uint64_t, c->nchunks + 1);
+	if(pread(c->fd, c->offsets, (c->nchunks + 1) * sizeof(uint64_t), COMPRESSED_HEADERSIZE)
+			!= (ssize_t)((c->nchunks + 1) * sizeof(uint64_t))) {
+		errno = EINVAL;
+		goto fail;
+	}
+	for(i = 0; i <= c->nchunks; i++) {
+		c->offsets[i] = be64toh(c->offsets[i]);
+		if(i > 0 && c->offsets[i] < c->offsets[i - 1]) {
+			errno = EINVAL;
+			goto fail;
+		}
+	}
+
+	c->nslots = cachesize / c->chunksize;
+	c->slotof = g_new(int32_t, c->nchunks);
+	for(i = 0; i < c->nchunks; i++)
+		c->slotof[i] = -1;
+	c->slots = g_new0(struct compressed_slot, c->nslots);
+	for(i = 0; i < c->nslots; i++) {
+		c->slots[i].chunk = -1;
+		c->slots[i].data = g_malloc(c->chunksize);
+	}
+	pthread_mutex_init(&c->lock, NULL);
+	return c;
+fail:
+	err = errno;
+	if(c->fd >= 0)
+		close(c->fd);
+	g_free(c->offsets);
+	g_free(c);
+	errno = err;
+	return NULL;
+}
+
+int compressed_prepare(const char* filename) {
+	char magic[2];
+	int fd = open(filename, O_RDONLY);
+	bool gzip;
+
+	if(fd < 0)
+		return -1;
+	gzip = pread(fd, magic, 2, 0) == 2 && !memcmp(magic, "\x1f\x8b", 2);
+	close(fd);
+	if(!gzip)
+		return 0;
+	return gzindex_build(filename, GZINDEX_DEFAULT_SPAN);
+}
+
+void compressed_close(struct compressed* c) {
+	uint32_t i;
+
+	if(c->gz) {
+		gzindex_close(c->gz);
+		g_free(c);
+		return;
+	}
+	for(i = 0; i < c->nslots; i++)
+		g_free(c->slots[i].data);
+	g_free(c->slots);
+	g_free(c->slotof);
+	g_free(c->offsets);
+	pthread_mutex_destroy(&c->lock);
+	close(c->fd);
+	g_free(c);
+}
+
+uint64_t compressed_size(struct compressed* c) {
+	return c->size;
+}
+
+uint32_t compressed_chunksize(struct compressed* c) {
+	return c->chunksize;
+}
+
+/**
+ * Decompress a chunk into a buffer of chunksize bytes.
+ **/
+static int decompress_chunk(struct compressed* c, uint64_t chunk, char* buf, char* zbuf) {
+	uint64_t zlen = c->offsets[chunk + 1] - c->offsets[chunk];
+	uint64_t len = MIN((uint64_t)c->chunksize, c->size - chunk * c->chunksize);
+	uLongf outlen = len;
+
+	if(zlen == 0) {
+		memset(buf, 0, len);
+		return 0;
+	}
+	if(zlen > compressBound(c->chunksize)) {
+		errno = EIO;
+		return -1;
+	}
+	if(pread(c->fd, zbuf, zlen, c->offsets[chunk]) != (ssize_t)zlen)
+		return -1;
+	if(zlen == len) {
+		memcpy(buf, zbuf, len);
+		return 0;
+	}
+	if(uncompress((Bytef*)buf, &outlen, (Bytef*)zbuf, zlen) != Z_OK || outlen != len) {
+		errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Copy part of a chunk out of the cache, if it's there.
+ **/
+static bool cache_get(struct compressed* c, uint64_t chunk, size_t off, char* buf, size_t len) {
+	int32_t slot;
+
+	if(!c->nslots)
+		return false;
+	pthread_mutex_lock(&c->lock);
+	slot = c->slotof[chunk];
+	if(slot >= 0) {
+		memcpy(buf, c->slots[slot].data + off, len);
+		c->slots[slot].ref = true;
+	}
+	pthread_mutex_unlock(&c->lock);
+	return slot >= 0;
+}
+
+static void cache_put(struct compressed* c, uint64_t chunk, const char* data) {
+	struct compressed_slot* s;
+
+	if(!c->nslots)
+		return;
+	pthread_mutex_lock(&c->lock);
+	/* Another thread may have beaten us to it */
+	if(c->slotof[chunk] < 0) {
+		for(;;) {
+			s = &c->slots[c->hand];
+			if(!s->ref)
+				break;
+			s->ref = false;
+			c->hand = (c->hand + 1) % c->nslots;
+		}
+		if(s->chunk >= 0)
+			c->slotof[s->chunk] = -1;
+		s->chunk = chunk;
+		s->ref = true;
+		memcpy(s->data, data, c->chunksize);
+		c->slotof[chunk] = c->hand;
+		c->hand = (c->hand + 1) % c->nslots;
+	}
+	pthread_mutex_unlock(&c->lock);
+}
+
+int compressed_read(struct compressed* c, uint64_t from, char* buf, size_t len) {
+	char* chunkbuf = NULL;
+	char* zbuf = NULL;
+	uint64_t chunk;
+	size_t off, cur;
+	int retval = 0;
+
+	if(c->gz)
+		return gzindex_read(c->gz, from, buf, len);
+	if(from + len > c->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	while(len > 0) {
+		chunk = from / c->chunksize;
+		off = from % c->chunksize;
+		cur = MIN(len, c->chunksize - off);
+		if(c->offsets[chunk + 1] == c->offsets[chunk]) {
+			memset(buf, 0, cur);
+		} else if(!cache_get(c, chunk, off, buf, cur)) {
+			if(!chunkbuf) {
+				chunkbuf = g_malloc(c->chunksize);
+				zbuf = g_malloc(compressBound(c->chunksize));
+			}
+			if(decompress_chunk(c, chunk, chunkbuf, zbuf)) {
+				retval = -1;
+				break;
+			}
+			memcpy(buf, chunkbuf + off, cur);
+			cache_put(c, chunk, chunkbuf);
+		}
+		from += cur;
+		buf += cur;
+		len -= cur;
+	}
+	g_free(chunkbuf);
+	g_free(zbuf);
+	return retval;
+}
+
+uint64_t compressed_extent(struct compressed* c, uint64_t from, uint64_t len, bool* present) {
+	uint64_t chunk = from / c->chunksize;
+	uint64_t end = from + len;
+	uint64_t pos = (chunk + 1) * c->chunksize;
+
+	/* gzip doesn't know where the holes are */
+	if(c->gz) {
+		*present = true;
+		return len;
+	}
+	*present = c->offsets[chunk + 1] != c->offsets[chunk];
+	for(chunk++; pos < end && chunk < c->nchunks; chunk++) {
+		if((c->offsets[chunk + 1] != c->offsets[chunk]) != *present)
+			break;
+		pos += c->chunksize;
+	}
+	return MIN(pos, end) - from;
+}
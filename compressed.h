@@ -0,0 +1,88 @@
+/**
+ * Seekable compressed export images
+ */
+#ifndef NBD_COMPRESSED_H
+#define NBD_COMPRESSED_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPRESSED_MAGIC "NBDCOMP1" /**< first bytes of a compressed image */
+#define COMPRESSED_DEFAULT_CHUNKSIZE (64*1024) /**< size of the chunks images are compressed in */
+#define COMPRESSED_MAX_CHUNKSIZE (16*1024*1024) /**< largest chunk size we accept */
+#define COMPRESSED_DEFAULT_CACHE (16*1024*1024) /**< default size of the cache of decompressed chunks */
+
+struct compressed;
+
+/**
+ * Compress an image. The image is split in chunks which are compressed
+ * independently, so that any of them can be read without the others; an
+ * index of where each chunk starts follows the header. Chunks of zeroes
+ * take no space at all, and chunks that don't compress are stored as
+ * they are.
+ *
+ * @param in the image to compress; read from its current position to
+ * the end
+ * @param out the file to write the compressed image to; must be
+ * seekable
+ * @param chunksize the size of the chunks
+ * @param level the zlib compression level
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int compressed_create(int in, int out, uint32_t chunksize, int level);
+
+/**
+ * Open a compressed image: either one made by compressed_create(), or a
+ * plain gzip image, which is indexed with gzindex_open() (see
+ * gzindex.h).
+ *
+ * @param cachesize the maximum number of bytes of decompressed chunks to
+ * keep around
+ * @return the image, or NULL with errno set
+ **/
+struct compressed* compressed_open(const char* filename, uint64_t cachesize);
+
+/**
+ * Get a compressed image ready to be opened. A plain gzip image has its
+ * index built and saved with gzindex_build() if it isn't already;
+ * images made by compressed_create() need nothing.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int compressed_prepare(const char* filename);
+
+/**
+ * Close a compressed image, and free the cache.
+ **/
+void compressed_close(struct compressed* c);
+
+/**
+ * @return the size of an image when decompressed
+ **/
+uint64_t compressed_size(struct compressed* c);
+
+/**
+ * @return the size of the chunks of an image
+ **/
+uint32_t compressed_chunksize(struct compressed* c);
+
+/**
+ * Read a range of an image. Safe to call from several threads at once;
+ * chunks that aren't cached are decompressed by the calling thread,
+ * without holding any lock.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int compressed_read(struct compressed* c, uint64_t from, char* buf, size_t len);
+
+/**
+ * Find the length of the run of data or zero chunks that starts at a
+ * given offset.
+ *
+ * @param present set to whether the run holds data
+ * @return the length of the run, at most len
+ **/
+uint64_t compressed_extent(struct compressed* c, uint64_t from, uint64_t len, bool* present);
+
+#endif
@@ -0,0 +1,941 @@
+/*
+ * Content-addressed deduplicating export backend. Every block of the
+ * export is stored as a chunk in a chunk store which any number of
+ * exports can share, so identical blocks are stored (and cached by the
+ * kernel) only once. The export itself is just a map from block numbers
+ * to chunk hashes.
+ *
+ * The store packs the chunks into the slots of one file, and keeps an
+ * index from chunk hashes to slots and reference counts: an open
+ * addressing hash table in a file that every process using the store
+ * maps. Slots of chunks that went away are kept on a free list, threaded
+ * through the slots themselves, and are used again first. Once the index
+ * is three quarters full, it is replaced by one twice its size, and the
+ * old one is marked as moved so that other processes map the new one.
+ *
+ * The store is only changed while holding an flock() on its lock file,
+ * so that exports in different processes can share it. Reads don't take
+ * it: the index has a sequence count that is odd while a change that
+ * could affect readers is made, and a reader that sees it change looks
+ * again, or takes the lock after a few tries. References are added
+ * before the map is changed to point at a chunk, and dropped only after
+ * it no longer does, so a crash may leak chunks but never loses data.
+ *
+ * Blocks whose hashes are equal are compared byte for byte before they
+ * are shared, so a hash collision can't corrupt an export; the colliding
+ * block is stored under the next collision index instead.
+ */
+#include "lfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "dedup.h"
+
+#define DEDUP_MAPBATCH 4096 /**< number of map entries we read at once */
+
+#define STORE_MAGIC 0x6e62646464757031ULL /**< "nbdddup1" */
+#define STORE_HEADERSIZE 4096 /**< the index entries start on a page of their own */
+#define STORE_MINENTRIES 1024 /**< number of entries in the index of a new store */
+#define STORE_READTRIES 3 /**< lockless reads we try before taking the lock */
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+/**
+ * Header of the index of a chunk store
+ **/
+struct store_header {
+	uint64_t magic;
+	uint64_t capacity;	/**< number of entries; a power of two */
+	uint64_t count;		/**< number of entries in use */
+	uint64_t nslots;	/**< number of slots in the chunk file */
+	uint64_t freeslot;	/**< first free slot plus one, or 0 if there is none */
+	uint64_t seq;		/**< odd while readers could see a change halfway */
+	uint32_t moved;		/**< set once a larger index replaced this one */
+};
+
+/**
+ * An entry of the index. Entries whose hash is all zeroes are empty.
+ **/
+struct store_entry {
+	struct dedup_entry e;
+	uint64_t slot;		/**< where the chunk is in the chunk file */
+	uint64_t refs;		/**< number of map entries that point at it */
+};
+
+struct dedup {
+	pthread_mutex_t lock;	/**< serializes changes to the map */
+	pthread_mutex_t storelock; /**< serializes changes to the store */
+	pthread_rwlock_t indexlock; /**< held for writing when the index is mapped again */
+	gchar* store;
+	int storefd;
+	int lockfd;		/**< the store's lock file */
+	int chunkfd;		/**< the store's chunk file */
+	struct store_header* index;
+	size_t indexlen;
+	int mapfd;
+	uint64_t size;
+	uint64_t nblocks;
+	bool readonly;
+};
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input) {
+	acc += input * PRIME64_2;
+	acc = rotl64(acc, 31);
+	return acc * PRIME64_1;
+}
+
+static inline uint64_t hash_merge(uint64_t h, uint64_t v) {
+	h ^= hash_round(0, v);
+	return h * PRIME64_1 + PRIME64_4;
+}
+
+static inline uint64_t hash_avalanche(uint64_t h) {
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * The xxHash64 main loop: four independent lanes, which the compiler can
+ * keep in vector registers. A block is hashed at several GB/s, far faster
+ * than we could store it. The second half of the hash is a different mix
+ * of the same lanes.
+ */
+void dedup_hash(const char* data, struct dedup_entry* entry) {
+	uint64_t v[4] = { PRIME64_1 + PRIME64_2, PRIME64_2, 0, -PRIME64_1 };
+	uint64_t in[4];
+	uint64_t h1, h2;
+	size_t i;
+	int j;
+
+	for(i = 0; i < DEDUP_BLOCKSIZE; i += sizeof(in)) {
+		memcpy(in, data + i, sizeof(in));
+		for(j = 0; j < 4; j++)
+			v[j] = hash_round(v[j], in[j]);
+	}
+	h1 = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+	h2 = rotl64(v[0], 18) + rotl64(v[1], 12) + rotl64(v[2], 7) + rotl64(v[3], 1);
+	for(j = 0; j < 4; j++) {
+		h1 = hash_merge(h1, v[j]);
+		h2 = hash_merge(h2, v[3 - j]);
+	}
+	entry->h[0] = hash_avalanche(h1 + DEDUP_BLOCKSIZE) | 1;
+	entry->h[1] = hash_avalanche(h2 ^ (h1 * PRIME64_5)) & ~0xffULL;
+}
+
+static inline bool entry_mapped(const struct dedup_entry* e) {
+	return e->h[0] || e->h[1];
+}
+
+static inline bool entry_equal(const struct dedup_entry* a, const struct dedup_entry* b) {
+	return a->h[0] == b->h[0] && a->h[1] == b->h[1];
+}
+
+static bool all_zeroes(const char* data) {
+	uint64_t w;
+	size_t i;
+
+	for(i = 0; i < DEDUP_BLOCKSIZE; i += sizeof(w)) {
+		memcpy(&w, data + i, sizeof(w));
+		if(w)
+			return false;
+	}
+	return true;
+}
+
+static inline struct store_entry* index_entries(struct store_header* h) {
+	return (struct store_entry*)((char*)h + STORE_HEADERSIZE);
+}
+
+static inline uint64_t index_home(struct store_header* h, const struct dedup_entry* e) {
+	/* The lowest bit of the first word is always set */
+	return (e->h[0] >> 1) & (h->capacity - 1);
+}
+
+/**
+ * Look a chunk up in the index. The entries may change under our feet
+ * if the store isn't locked, but we always stop.
+ *
+ * @return the entry, or NULL if the chunk isn't in the store
+ **/
+static struct store_entry* index_find(struct store_header* h, const struct dedup_entry* e) {
+	struct store_entry* ents = index_entries(h);
+	uint64_t mask = h->capacity - 1;
+	uint64_t i, n;
+	uint64_t h0;
+
+	for(i = index_home(h, e), n = 0; n <= mask; i = (i + 1) & mask, n++) {
+		h0 = __atomic_load_n(&ents[i].e.h[0], __ATOMIC_RELAXED);
+		if(!h0)
+			break;
+		if(h0 == e->h[0] && __atomic_load_n(&ents[i].e.h[1], __ATOMIC_RELAXED) == e->h[1])
+			return &ents[i];
+	}
+	return NULL;
+}
+
+/**
+ * Add a chunk to the index, which must have room for it. Called with
+ * the store locked.
+ **/
+static struct store_entry* index_insert(struct store_header* h, const struct dedup_entry* e) {
+	struct store_entry* ents = index_entries(h);
+	uint64_t mask = h->capacity - 1;
+	uint64_t i;
+
+	for(i = index_home(h, e); ents[i].e.h[0]; i = (i + 1) & mask)
+		;
+	ents[i].e = *e;
+	h->count++;
+	return &ents[i];
+}
+
+/**
+ * Remove an entry from the index, moving the entries after it back so
+ * that no lookup stops short of them. Called with the store locked.
+ **/
+static void index_remove(struct store_header* h, struct store_entry* ent) {
+	struct store_entry* ents = index_entries(h);
+	uint64_t mask = h->capacity - 1;
+	uint64_t i = ent - ents;
+	uint64_t j = i;
+	uint64_t k;
+
+	for(;;) {
+		j = (j + 1) & mask;
+		if(!ents[j].e.h[0])
+			break;
+		/* An entry can fill the hole unless its home lies
+		 * (cyclically) between the hole and the entry */
+		k = index_home(h, &ents[j].e);
+		if(i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		ents[i] = ents[j];
+		i = j;
+	}
+	memset(&ents[i], 0, sizeof(ents[i]));
+	h->count--;
+}
+
+/**
+ * Start a change that lockless readers must not see halfway
+ **/
+static inline void change_begin(struct store_header* h) {
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void change_end(struct store_header* h) {
+	__atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Map the index of the store, creating it if it doesn't exist yet, in
+ * place of the one we have mapped. Called with the store locked, and
+ * indexlock held for writing.
+ **/
+static int index_map(struct dedup* dd) {
+	gchar* name = g_strdup_printf("%s/index", dd->store);
+	struct store_header* h;
+	struct stat st;
+	size_t len;
+	int err;
+	int fd;
+
+	fd = open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st))
+		goto fail;
+	len = st.st_size;
+	if(len == 0) {
+		len = STORE_HEADERSIZE + STORE_MINENTRIES * sizeof(struct store_entry);
+		if(ftruncate(fd, len) || fsync(dd->storefd))
+			goto fail;
+	}
+	h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(h == MAP_FAILED)
+		goto fail;
+	if(st.st_size == 0) {
+		h->magic = STORE_MAGIC;
+		h->capacity = STORE_MINENTRIES;
+	}
+	if(h->magic != STORE_MAGIC || h->capacity & (h->capacity - 1) ||
+	   len != STORE_HEADERSIZE + h->capacity * sizeof(struct store_entry)) {
+		munmap(h, len);
+		errno = EINVAL;
+		goto fail;
+	}
+	close(fd);
+	if(dd->index)
+		munmap(dd->index, dd->indexlen);
+	dd->index = h;
+	dd->indexlen = len;
+	return 0;
+fail:
+	err = errno;
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Replace the index by one twice its size. Called with the store locked.
+ **/
+static int index_grow(struct dedup* dd) {
+	gchar* tmpname = g_strdup_printf("%s/index.tmp", dd->store);
+	gchar* name = g_strdup_printf("%s/index", dd->store);
+	struct store_header* old = dd->index;
+	struct store_entry* ents = index_entries(old);
+	struct store_entry* ent;
+	struct store_header* h;
+	size_t len;
+	uint64_t i;
+	int retval = -1;
+	int fd;
+
+	len = STORE_HEADERSIZE + old->capacity * 2 * sizeof(struct store_entry);
+	fd = open(tmpname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+		goto out;
+	if(ftruncate(fd, len)) {
+		close(fd);
+		goto out;
+	}
+	h = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(h == MAP_FAILED)
+		goto out;
+	h->magic = STORE_MAGIC;
+	h->capacity = old->capacity * 2;
+	h->nslots = old->nslots;
+	h->freeslot = old->freeslot;
+	for(i = 0; i < old->capacity; i++) {
+		if(!ents[i].e.h[0])
+			continue;
+		ent = index_insert(h, &ents[i].e);
+		ent->slot = ents[i].slot;
+		ent->refs = ents[i].refs;
+	}
+	if(msync(h, len, MS_SYNC) || rename(tmpname, name) || fsync(dd->storefd)) {
+		munmap(h, len);
+		goto out;
+	}
+	/* Readers that are using the old index look again, and find it
+	 * moved */
+	change_begin(old);
+	__atomic_store_n(&old->moved, 1, __ATOMIC_RELAXED);
+	change_end(old);
+	pthread_rwlock_wrlock(&dd->indexlock);
+	munmap(old, dd->indexlen);
+	dd->index = h;
+	dd->indexlen = len;
+	pthread_rwlock_unlock(&dd->indexlock);
+	retval = 0;
+out:
+	g_free(tmpname);
+	g_free(name);
+	return retval;
+}
+
+static void store_unlock(struct dedup* dd) {
+	flock(dd->lockfd, LOCK_UN);
+	pthread_mutex_unlock(&dd->storelock);
+}
+
+/**
+ * Lock the store, against other threads and against other processes,
+ * and map its index again if another process replaced it.
+ **/
+static int store_lock(struct dedup* dd) {
+	int ret;
+
+	pthread_mutex_lock(&dd->storelock);
+	flock(dd->lockfd, LOCK_EX);
+	if(__atomic_load_n(&dd->index->moved, __ATOMIC_ACQUIRE)) {
+		pthread_rwlock_wrlock(&dd->indexlock);
+		ret = index_map(dd);
+		pthread_rwlock_unlock(&dd->indexlock);
+		if(ret) {
+			store_unlock(dd);
+			return -1;
+		}
+	}
+	/* A process that died halfway through a change leaves the count
+	 * odd, which would send all readers here */
+	if(dd->index->seq & 1)
+		change_end(dd->index);
+	return 0;
+}
+
+/**
+ * Take a slot for a new chunk. Called with the store locked.
+ **/
+static int slot_alloc(struct dedup* dd, uint64_t* slot) {
+	struct store_header* h = dd->index;
+	uint64_t next;
+
+	if(!h->freeslot) {
+		*slot = h->nslots++;
+		return 0;
+	}
+	*slot = h->freeslot - 1;
+	if(pread(dd->chunkfd, &next, sizeof(next), *slot * DEDUP_BLOCKSIZE) != sizeof(next)) {
+		if(!errno)
+			errno = EIO;
+		return -1;
+	}
+	h->freeslot = next;
+	return 0;
+}
+
+/**
+ * Put a slot on the free list. Called with the store locked, within a
+ * change. Errors are ignored; the slot is leaked then.
+ **/
+static void slot_free(struct dedup* dd, uint64_t slot) {
+	struct store_header* h = dd->index;
+	uint64_t next = h->freeslot;
+
+	if(pwrite(dd->chunkfd, &next, sizeof(next), slot * DEDUP_BLOCKSIZE) == sizeof(next))
+		h->freeslot = slot + 1;
+}
+
+/**
+ * Read the chunk in a slot. A slot beyond the end of the file (after a
+ * crash, say) reads as zeroes.
+ **/
+static int read_slot(struct dedup* dd, uint64_t slot, char* buf) {
+	ssize_t ret;
+
+	ret = pread(dd->chunkfd, buf, DEDUP_BLOCKSIZE, slot * DEDUP_BLOCKSIZE);
+	if(ret < 0)
+		return -1;
+	if(ret < DEDUP_BLOCKSIZE)
+		memset(buf + ret, 0, DEDUP_BLOCKSIZE - ret);
+	return 0;
+}
+
+/**
+ * Add a reference to the chunk holding a block, storing it if it isn't
+ * in the store yet.
+ *
+ * @param e the hash of the block; its collision index is filled in
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+static int chunk_ref(struct dedup* dd, const char* data, struct dedup_entry* e) {
+	char* chunk = g_malloc(DEDUP_BLOCKSIZE);
+	struct store_entry* ent;
+	struct store_header* h;
+	uint64_t slot;
+	int retval = -1;
+	int idx;
+
+	if(store_lock(dd)) {
+		g_free(chunk);
+		return -1;
+	}
+	for(idx = 0; idx < 256; idx++) {
+		e->h[1] = (e->h[1] & ~0xffULL) | idx;
+		ent = index_find(dd->index, e);
+		if(ent) {
+			if(read_slot(dd, ent->slot, chunk))
+				break;
+			/* Same hash, different data */
+			if(memcmp(chunk, data, DEDUP_BLOCKSIZE))
+				continue;
+			ent->refs++;
+			retval = 0;
+			break;
+		}
+		if(dd->index->count >= dd->index->capacity / 4 * 3 && index_grow(dd))
+			break;
+		h = dd->index;
+		if(slot_alloc(dd, &slot))
+			break;
+		if(pwrite(dd->chunkfd, data, DEDUP_BLOCKSIZE, slot * DEDUP_BLOCKSIZE) != DEDUP_BLOCKSIZE) {
+			if(!errno)
+				errno = EIO;
+			change_begin(h);
+			slot_free(dd, slot);
+			change_end(h);
+			break;
+		}
+		change_begin(h);
+		ent = index_insert(h, e);
+		ent->slot = slot;
+		ent->refs = 1;
+		change_end(h);
+		retval = 0;
+		break;
+	}
+	if(idx == 256)
+		errno = EIO;
+	store_unlock(dd);
+	g_free(chunk);
+	return retval;
+}
+
+/**
+ * Drop a reference to a chunk, and free its slot if that was the last
+ * one. Errors are ignored; the worst that can happen is that a chunk
+ * leaks.
+ **/
+static void chunk_unref(struct dedup* dd, const struct dedup_entry* e) {
+	struct store_entry* ent;
+	struct store_header* h;
+	uint64_t slot;
+
+	if(!entry_mapped(e))
+		return;
+	if(store_lock(dd))
+		return;
+	h = dd->index;
+	ent = index_find(h, e);
+	if(ent && ent->refs > 1) {
+		ent->refs--;
+	} else if(ent) {
+		slot = ent->slot;
+		change_begin(h);
+		index_remove(h, ent);
+		slot_free(dd, slot);
+		change_end(h);
+	}
+	store_unlock(dd);
+}
+
+/**
+ * Add a reference for a block, unless it's all zeroes, in which case it
+ * is unmapped.
+ **/
+static int store_block(struct dedup* dd, const char* data, struct dedup_entry* e) {
+	if(all_zeroes(data)) {
+		memset(e, 0, sizeof(*e));
+		return 0;
+	}
+	dedup_hash(data, e);
+	if(chunk_ref(dd, data, e)) {
+		/* so that we don't drop a reference we don't have */
+		memset(e, 0, sizeof(*e));
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Try to read a chunk without locking the store. Called with indexlock
+ * held for reading.
+ *
+ * @return 0 if the chunk was read, 1 if it is missing, -1 on error, or
+ * -2 if the store changed meanwhile
+ **/
+static int read_chunk_lockless(struct dedup* dd, const struct dedup_entry* e, char* buf) {
+	struct store_header* h = dd->index;
+	struct store_entry* ent;
+	uint64_t seq;
+	int ret = 1;
+
+	seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+	if(seq & 1 || __atomic_load_n(&h->moved, __ATOMIC_RELAXED))
+		return -2;
+	ent = index_find(h, e);
+	if(ent)
+		ret = read_slot(dd, __atomic_load_n(&ent->slot, __ATOMIC_RELAXED), buf);
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if(__atomic_load_n(&h->seq, __ATOMIC_RELAXED) != seq)
+		return -2;
+	return ret;
+}
+
+/**
+ * Read the contents of a chunk. A chunk that is missing reads as zeroes.
+ *
+ * @return 0 if the chunk was read, 1 if it is missing, -1 on error
+ **/
+static int read_chunk(struct dedup* dd, const struct dedup_entry* e, char* buf) {
+	struct store_entry* ent;
+	int ret = -2;
+	int i;
+
+	if(!entry_mapped(e)) {
+		memset(buf, 0, DEDUP_BLOCKSIZE);
+		return 0;
+	}
+	for(i = 0; i < STORE_READTRIES && ret == -2; i++) {
+		pthread_rwlock_rdlock(&dd->indexlock);
+		ret = read_chunk_lockless(dd, e, buf);
+		pthread_rwlock_unlock(&dd->indexlock);
+	}
+	if(ret == -2) {
+		if(store_lock(dd))
+			return -1;
+		ent = index_find(dd->index, e);
+		ret = ent ? read_slot(dd, ent->slot, buf) : 1;
+		store_unlock(dd);
+	}
+	if(ret == 1)
+		memset(buf, 0, DEDUP_BLOCKSIZE);
+	return ret;
+}
+
+/**
+ * Read entries from the map. Entries beyond the end of the map file are
+ * unmapped.
+ **/
+static int map_read(struct dedup* dd, uint64_t lba, struct dedup_entry* entries, size_t count) {
+	size_t len = count * sizeof(*entries);
+	ssize_t ret;
+
+	ret = pread(dd->mapfd, entries, len, lba * sizeof(*entries));
+	if(ret < 0)
+		return -1;
+	if((size_t)ret < len)
+		memset((char*)entries + ret, 0, len - ret);
+	return 0;
+}
+
+static int map_write(struct dedup* dd, uint64_t lba, const struct dedup_entry* entries, size_t count) {
+	ssize_t len = count * sizeof(*entries);
+
+	if(pwrite(dd->mapfd, entries, len, lba * sizeof(*entries)) != len) {
+		if(!errno)
+			errno = EIO;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Take the lock on the map, against other threads and against other
+ * processes that have the same export open.
+ **/
+static void map_lock(struct dedup* dd) {
+	pthread_mutex_lock(&dd->lock);
+	flock(dd->mapfd, LOCK_EX);
+}
+
+static void map_unlock(struct dedup* dd) {
+	flock(dd->mapfd, LOCK_UN);
+	pthread_mutex_unlock(&dd->lock);
+}
+
+/**
+ * Whether a range covers all of a block. The last block of the export
+ * may be shorter than DEDUP_BLOCKSIZE.
+ **/
+static bool covers_block(struct dedup* dd, uint64_t from, size_t len, uint64_t lba) {
+	uint64_t start = lba * DEDUP_BLOCKSIZE;
+	uint64_t end = MIN(start + DEDUP_BLOCKSIZE, dd->size);
+
+	return from <= start && from + len >= end;
+}
+
+struct dedup* dedup_open(const char* store, const char* map, uint64_t size, bool readonly) {
+	struct dedup* dd;
+	struct stat st;
+	gchar* name;
+	int err;
+	int ret;
+
+	if(mkdir(store, 0700) && errno != EEXIST)
+		return NULL;
+	dd = g_new0(struct dedup, 1);
+	dd->store = g_strdup(store);
+	dd->size = size;
+	dd->nblocks = (size + DEDUP_BLOCKSIZE - 1) / DEDUP_BLOCKSIZE;
+	dd->readonly = readonly;
+	dd->lockfd = -1;
+	dd->chunkfd = -1;
+	dd->mapfd = -1;
+	pthread_mutex_init(&dd->lock, NULL);
+	pthread_mutex_init(&dd->storelock, NULL);
+	pthread_rwlock_init(&dd->indexlock, NULL);
+	dd->storefd = open(store, O_RDONLY);
+	if(dd->storefd < 0)
+		goto fail;
+	name = g_strdup_printf("%s/lock", store);
+	dd->lockfd = open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if(dd->lockfd < 0)
+		goto fail;
+	name = g_strdup_printf("%s/chunks", store);
+	dd->chunkfd = open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if(dd->chunkfd < 0)
+		goto fail;
+	flock(dd->lockfd, LOCK_EX);
+	ret = index_map(dd);
+	flock(dd->lockfd, LOCK_UN);
+	if(ret)
+		goto fail;
+	dd->mapfd = open(map, readonly ? O_RDONLY : O_RDWR | O_CREAT, 0600);
+	if(dd->mapfd < 0)
+		goto fail;
+	if(!readonly) {
+		if(fstat(dd->mapfd, &st))
+			goto fail;
+		if((uint64_t)st.st_size < dd->nblocks * sizeof(struct dedup_entry) &&
+		   ftruncate(dd->mapfd, dd->nblocks * sizeof(struct dedup_entry)))
+			goto fail;
+	}
+	return dd;
+fail:
+	err = errno;
+	if(dd->index)
+		munmap(dd->index, dd->indexlen);
+	if(dd->mapfd >= 0)
+		close(dd->mapfd);
+	if(dd->chunkfd >= 0)
+		close(dd->chunkfd);
+	if(dd->lockfd >= 0)
+		close(dd->lockfd);
+	if(dd->storefd >= 0)
+		close(dd->storefd);
+	pthread_rwlock_destroy(&dd->indexlock);
+	pthread_mutex_destroy(&dd->storelock);
+	pthread_mutex_destroy(&dd->lock);
+	g_free(dd->store);
+	g_free(dd);
+	errno = err;
+	return NULL;
+}
+
+void dedup_close(struct dedup* dd) {
+	munmap(dd->index, dd->indexlen);
+	close(dd->mapfd);
+	close(dd->chunkfd);
+	close(dd->lockfd);
+	close(dd->storefd);
+	pthread_rwlock_destroy(&dd->indexlock);
+	pthread_mutex_destroy(&dd->storelock);
+	pthread_mutex_destroy(&dd->lock);
+	g_free(dd->store);
+	g_free(dd);
+}
+
+int dedup_read(struct dedup* dd, uint64_t from, char* buf, size_t len) {
+	struct dedup_entry entries[DEDUP_MAPBATCH];
+	struct dedup_entry e;
+	char* block = g_malloc(DEDUP_BLOCKSIZE);
+	uint64_t lba, first, count;
+	size_t off, cur;
+	uint64_t i;
+	int retval = 0;
+	int ret;
+
+	if(from + len > dd->size) {
+		errno = EINVAL;
+		g_free(block);
+		return -1;
+	}
+	while(len > 0 && !retval) {
+		first = from / DEDUP_BLOCKSIZE;
+		count = MIN((uint64_t)DEDUP_MAPBATCH, (from + len - 1) / DEDUP_BLOCKSIZE - first + 1);
+		if(map_read(dd, first, entries, count)) {
+			retval = -1;
+			break;
+		}
+		for(i = 0; i < count && len > 0; i++) {
+			lba = first + i;
+			off = from % DEDUP_BLOCKSIZE;
+			cur = MIN(len, DEDUP_BLOCKSIZE - off);
+			e = entries[i];
+			/* The chunk may have been replaced and deleted since
+			 * we read the map; if so, look again */
+			while((ret = read_chunk(dd, &e, block)) == 1) {
+				struct dedup_entry now;
+				if(map_read(dd, lba, &now, 1) || entry_equal(&now, &e))
+					break;
+				e = now;
+			}
+			if(ret < 0) {
+				retval = -1;
+				break;
+			}
+			memcpy(buf, block + off, cur);
+			from += cur;
+			buf += cur;
+			len -= cur;
+		}
+	}
+	g_free(block);
+	return retval;
+}
+
+int dedup_write(struct dedup* dd, uint64_t from, const char* buf, size_t len) {
+	struct dedup_entry* neu;
+	struct dedup_entry* old;
+	char* block = g_malloc0(DEDUP_BLOCKSIZE);
+	uint64_t first, count, start;
+	size_t off, cur;
+	uint64_t i;
+	int retval = 0;
+
+	if(from + len > dd->size) {
+		errno = ENOSPC;
+		g_free(block);
+		return -1;
+	}
+	if(len == 0) {
+		g_free(block);
+		return 0;
+	}
+	first = from / DEDUP_BLOCKSIZE;
+	count = (from + len - 1) / DEDUP_BLOCKSIZE - first + 1;
+	neu = g_new0(struct dedup_entry, count);
+	old = g_new0(struct dedup_entry, count);
+
+	/* Hashing and storing full blocks doesn't need the lock */
+	for(i = 0; i < count && !retval; i++) {
+		start = (first + i) * DEDUP_BLOCKSIZE;
+		if(!covers_block(dd, from, len, first + i))
+			continue;
+		if(start + DEDUP_BLOCKSIZE <= dd->size) {
+			retval = store_block(dd, buf + (start - from), &neu[i]);
+		} else {
+			/* the last block of the export is padded */
+			memset(block, 0, DEDUP_BLOCKSIZE);
+			memcpy(block, buf + (start - from), dd->size - start);
+			retval = store_block(dd, block, &neu[i]);
+		}
+	}
+	if(retval)
+		goto unref;
+
+	map_lock(dd);
+	retval = map_read(dd, first, old, count);
+	/* Partial blocks are merged with what's there now, which must not
+	 * change while we do that */
+	for(i = 0; i < count && !retval; i++) {
+		start = (first + i) * DEDUP_BLOCKSIZE;
+		if(covers_block(dd, from, len, first + i))
+			continue;
+		if(read_chunk(dd, &old[i], block) < 0) {
+			retval = -1;
+			break;
+		}
+		off = from > start ? from - start : 0;
+		cur = MIN(from + len, start + DEDUP_BLOCKSIZE) - (start + off);
+		memcpy(block + off, buf + (start + off - from), cur);
+		retval = store_block(dd, block, &neu[i]);
+	}
+	if(!retval)
+		retval = map_write(dd, first, neu, count);
+	map_unlock(dd);
+unref:
+	for(i = 0; i < count; i++)
+		chunk_unref(dd, retval ? &neu[i] : &old[i]);
+	g_free(neu);
+	g_free(old);
+	g_free(block);
+	return retval;
+}
+
+int dedup_trim(struct dedup* dd, uint64_t from, size_t len) {
+	struct dedup_entry* old;
+	struct dedup_entry* zero;
+	uint64_t first = (from + DEDUP_BLOCKSIZE - 1) / DEDUP_BLOCKSIZE;
+	uint64_t end = (from + len) / DEDUP_BLOCKSIZE;
+	uint64_t i;
+	int retval;
+
+	/* The last block of the export counts as complete */
+	if(from + len == dd->size)
+		end = dd->nblocks;
+	if(first >= end)
+		return 0;
+	old = g_new0(struct dedup_entry, end - first);
+	zero = g_new0(struct dedup_entry, end - first);
+	map_lock(dd);
+	retval = map_read(dd, first, old, end - first);
+	if(!retval)
+		retval = map_write(dd, first, zero, end - first);
+	map_unlock(dd);
+	if(!retval) {
+		for(i = 0; i < end - first; i++)
+			chunk_unref(dd, &old[i]);
+	}
+	g_free(old);
+	g_free(zero);
+	return retval;
+}
+
+int dedup_flush(struct dedup* dd) {
+	int retval;
+
+	/* Chunks are written by whoever stores them first; they all share
+	 * the chunk file, so this syncs them too */
+	if(fdatasync(dd->chunkfd))
+		return -1;
+	pthread_rwlock_rdlock(&dd->indexlock);
+	retval = msync(dd->index, dd->indexlen, MS_SYNC);
+	pthread_rwlock_unlock(&dd->indexlock);
+	if(retval)
+		return -1;
+	return fdatasync(dd->mapfd);
+}
+
+uint64_t dedup_chunks(struct dedup* dd) {
+	uint64_t count;
+
+	if(store_lock(dd))
+		return 0;
+	count = dd->index->count;
+	store_unlock(dd);
+	return count;
+}
+
+uint64_t dedup_extent(struct dedup* dd, uint64_t from, uint64_t len, bool* present) {
+	struct dedup_entry entries[DEDUP_MAPBATCH];
+	uint64_t lba = from / DEDUP_BLOCKSIZE;
+	uint64_t end = from + len;
+	uint64_t pos = lba * DEDUP_BLOCKSIZE;
+	uint64_t count, i;
+	bool first = true;
+
+	*present = false;
+	while(pos < end) {
+		count = MIN((uint64_t)DEDUP_MAPBATCH, dd->nblocks - lba);
+		if(count == 0 || map_read(dd, lba, entries, count))
+			break;
+		for(i = 0; i < count && pos < end; i++) {
+			if(first) {
+				*present = entry_mapped(&entries[i]);
+				first = false;
+			} else if(entry_mapped(&entries[i]) != *present) {
+				return pos - from;
+			}
+			pos += DEDUP_BLOCKSIZE;
+		}
+		lba += count;
+	}
+	if(pos <= from)
+		return MIN(len, DEDUP_BLOCKSIZE - from % DEDUP_BLOCKSIZE);
+	return MIN(pos, end) - from;
+}
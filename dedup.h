@@ -0,0 +1,92 @@
+/**
+ * Content-addressed deduplicating export backend
+ */
+#ifndef NBD_DEDUP_H
+#define NBD_DEDUP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEDUP_BLOCKSIZE 4096 /**< size of the chunks exports are split in */
+
+/**
+ * What an export's block map holds for every block: the hash of the
+ * chunk the block consists of. The low byte of the second word tells
+ * apart chunks whose hashes collide. All zeroes means the block is
+ * unmapped, and reads as zeroes.
+ **/
+struct dedup_entry {
+	uint64_t h[2];
+};
+
+struct dedup;
+
+/**
+ * Hash a chunk. Never returns an all-zero entry, and always returns a
+ * zero collision index.
+ **/
+void dedup_hash(const char* data, struct dedup_entry* entry);
+
+/**
+ * Open a deduplicated export.
+ *
+ * @param store the directory of the chunk store, which may be shared by
+ * any number of exports
+ * @param map the file holding the export's block map; created if it
+ * doesn't exist yet, unless the export is read only
+ * @param size the size of the export
+ * @return the export, or NULL with errno set
+ **/
+struct dedup* dedup_open(const char* store, const char* map, uint64_t size, bool readonly);
+
+/**
+ * Close a deduplicated export.
+ **/
+void dedup_close(struct dedup* dd);
+
+/**
+ * Read a range of the export.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int dedup_read(struct dedup* dd, uint64_t from, char* buf, size_t len);
+
+/**
+ * Write a range of the export. Blocks that are already in the store
+ * only get a reference added; blocks of zeroes are unmapped.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int dedup_write(struct dedup* dd, uint64_t from, const char* buf, size_t len);
+
+/**
+ * Unmap the blocks that lie completely within a range of the export,
+ * dropping their references to the store.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int dedup_trim(struct dedup* dd, uint64_t from, size_t len);
+
+/**
+ * Make all writes and trims done so far durable.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int dedup_flush(struct dedup* dd);
+
+/**
+ * Count the chunks in the store.
+ **/
+uint64_t dedup_chunks(struct dedup* dd);
+
+/**
+ * Find the length of the run of mapped or unmapped blocks that starts at
+ * a given offset.
+ *
+ * @param present set to whether the run is mapped
+ * @return the length of the run, at most len
+ **/
+uint64_t dedup_extent(struct dedup* dd, uint64_t from, uint64_t len, bool* present);
+
+#endif
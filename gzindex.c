@@ -0,0 +1,774 @@
+/*
+ * Random access to gzip images, after zlib's examples/zran.c.
+ *
+ * Decompression of a deflate stream can only be resumed at a given
+ * point with the 32K of output that came before it (the window), and
+ * with the bit position in the input that the point starts at. The
+ * index holds both for an access point every span bytes of output, so
+ * that a read only needs to decompress from the last access point before
+ * it rather than from the start of the image.
+ *
+ * The index is saved next to the image, big-endian:
+ *
+ *   8 bytes   GZINDEX_MAGIC
+ *   8 bytes   span
+ *   8 bytes   size of the image when compressed
+ *   8 bytes   mtime of the image
+ *   8 bytes   size of the image when decompressed
+ *   8 bytes   number of access points (n)
+ *   n times:
+ *     8 bytes   offset in the decompressed data
+ *     8 bytes   offset of the first whole byte in the compressed data
+ *     4 bytes   number of bits of the byte before that still to use
+ *     4 bytes   0
+ *     32K       window
+ *
+ * The index is mapped rather than read, so that every process that
+ * serves the image shares the one copy in the page cache, and only the
+ * windows that reads actually start from are ever paged in. It is built
+ * with the image locked, so that processes that open it at the same time
+ * wait for the first to build it rather than all building it at once;
+ * gzindex_build() lets the server do that before any client connects.
+ *
+ * Decompressed blocks are kept in an LRU cache. Misses are decompressed
+ * outside the cache lock, each with a decompression context (an inflate
+ * stream and its buffers) from a pool, which grows as needed as more
+ * threads miss at the same time. A miss prefers a context whose stream
+ * stopped just before the block, and keeps it going rather than going
+ * back to the access point, so sequential reads don't restart at the
+ * access point for every block.
+ */
+#include "lfs.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "gzindex.h"
+
+#define WINSIZE 32768
+#define INSIZE 16384
+#define HEADERSIZE 48
+#define POINTSIZE (24 + WINSIZE)
+#define MAXCONTEXTS 64
+
+struct gzindex_block {
+	uint64_t num;
+	int prev;	/**< more recently used */
+	int next;	/**< less recently used */
+	int hnext;	/**< next in the hash chain */
+	bool valid;
+	char* data;
+};
+
+struct gzindex_context {
+	z_stream strm;
+	bool busy;	/**< in use by a thread */
+	bool active;	/**< strm can be carried on */
+	uint64_t strmin;	/**< where strm reads from next */
+	uint64_t strmout;	/**< the offset of the next byte out of strm */
+	unsigned char inbuf[INSIZE];
+	char block[GZINDEX_BLOCK];
+};
+
+struct gzindex {
+	int fd;
+	uint64_t size;
+	uint64_t span;
+	unsigned char* map;	/**< the index file, mapped read-only */
+	size_t maplen;
+	size_t npoints;
+	pthread_mutex_t lock;	/**< protects the pool and the cache */
+	pthread_cond_t idle;	/**< signalled when a context is put back */
+	struct gzindex_context* contexts[MAXCONTEXTS];
+	int ncontexts;
+	struct gzindex_block* blocks;
+	int nblocks;
+	int* hash;
+	int nbuckets;
+	int head;
+	int tail;
+};
+
+static void put64(unsigned char* buf, uint64_t val) {
+	val = htobe64(val);
+	memcpy(buf, &val, sizeof(val));
+}
+
+static uint64_t get64(const unsigned char* buf) {
+	uint64_t val;
+
+	memcpy(&val, buf, sizeof(val));
+	return be64toh(val);
+}
+
+static void header(struct gzindex* g, struct stat* st, unsigned char* buf) {
+	memcpy(buf, GZINDEX_MAGIC, 8);
+	put64(buf + 8, g->span);
+	put64(buf + 16, st->st_size);
+	put64(buf + 24, st->st_mtime);
+	put64(buf + 32, g->size);
+	put64(buf + 40, g->npoints);
+}
+
+/**
+ * @return an access point, as it is in the mapped index
+ **/
+static const unsigned char* point(struct gzindex* g, size_t i) {
+	return g->map + HEADERSIZE + (uint64_t)i * POINTSIZE;
+}
+
+static uint64_t point_out(const unsigned char* p) {
+	return get64(p);
+}
+
+static uint64_t point_in(const unsigned char* p) {
+	return get64(p + 8);
+}
+
+static int point_bits(const unsigned char* p) {
+	return get64(p + 16) >> 32;
+}
+
+static const unsigned char* point_window(const unsigned char* p) {
+	return p + 24;
+}
+
+static int addpoint(struct gzindex* g, FILE* f, int bits, uint64_t in, uint64_t out, unsigned int left, const unsigned char* window) {
+	unsigned char rec[24];
+
+	put64(rec, out);
+	put64(rec + 8, in);
+	put64(rec + 16, (uint64_t)bits << 32);
+	if(fwrite(rec, sizeof(rec), 1, f) != 1)
+		return -1;
+	/* the window is circular; left is where it currently ends */
+	if(left && fwrite(window + WINSIZE - left, left, 1, f) != 1)
+		return -1;
+	if(left < WINSIZE && fwrite(window, WINSIZE - left, 1, f) != 1)
+		return -1;
+	g->npoints++;
+	return 0;
+}
+
+/**
+ * Decompress the whole image, and write an index to a file with an
+ * access point at the first deflate block boundary after every span
+ * bytes of output.
+ **/
+static int build(struct gzindex* g, struct stat* st, FILE* f) {
+	z_stream strm;
+	unsigned char* input = malloc(INSIZE);
+	unsigned char* window = malloc(WINSIZE);
+	unsigned char buf[HEADERSIZE];
+	uint64_t totin = 0, totout = 0, last = 0;
+	ssize_t len;
+	int ret = Z_OK;
+
+	memset(&strm, 0, sizeof(strm));
+	if(!input || !window || inflateInit2(&strm, 47) != Z_OK) {
+		free(input);
+		free(window);
+		errno = ENOMEM;
+		return -1;
+	}
+	g->npoints = 0;
+	/* the header is only known at the end */
+	memset(buf, 0, HEADERSIZE);
+	if(fwrite(buf, HEADERSIZE, 1, f) != 1)
+		ret = Z_ERRNO;
+	strm.avail_out = 0;
+	while(ret == Z_OK) {
+		len = pread(g->fd, input, INSIZE, totin);
+		if(len <= 0) {
+			ret = len < 0 ? Z_ERRNO : Z_DATA_ERROR;
+			break;
+		}
+		strm.next_in = input;
+		strm.avail_in = len;
+		do {
+			if(strm.avail_out == 0) {
+				strm.next_out = window;
+				strm.avail_out = WINSIZE;
+			}
+			totin += strm.avail_in;
+			totout += strm.avail_out;
+			ret = inflate(&strm, Z_BLOCK);
+			totin -= strm.avail_in;
+			totout -= strm.avail_out;
+			if(ret == Z_NEED_DICT)
+				ret = Z_DATA_ERROR;
+			if(ret == Z_MEM_ERROR || ret == Z_DATA_ERROR)
+				break;
+			if(ret == Z_STREAM_END)
+				break;
+			/* at the end of a deflate block, but not the last one */
+			if((strm.data_type & 128) && !(strm.data_type & 64) && (totout == 0 || totout - last > g->span)) {
+				if(addpoint(g, f, strm.data_type & 7, totin, totout, strm.avail_out, window)) {
+					ret = Z_ERRNO;
+					break;
+				}
+				last = totout;
+			}
+		} while(strm.avail_in != 0);
+	}
+	inflateEnd(&strm);
+	free(input);
+	free(window);
+	if(ret == Z_STREAM_END && (totin != (uint64_t)st->st_size || (totout > 0 && g->npoints == 0))) {
+		/* more gzip members follow, which zran can't deal with */
+		ret = Z_DATA_ERROR;
+	}
+	switch(ret) {
+	case Z_STREAM_END:
+		g->size = totout;
+		header(g, st, buf);
+		if(fseek(f, 0, SEEK_SET) || fwrite(buf, HEADERSIZE, 1, f) != 1 || fflush(f))
+			return -1;
+		return 0;
+	case Z_ERRNO:
+		return -1;
+	case Z_MEM_ERROR:
+		errno = ENOMEM;
+		return -1;
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+}
+
+/**
+ * See whether an index file was made for this image with the same span,
+ * going by its header only.
+ *
+ * @return the number of access points in it, or -1 if it wasn't
+ **/
+static ssize_t current(struct gzindex* g, int fd, struct stat* st) {
+	unsigned char expect[HEADERSIZE];
+	unsigned char buf[HEADERSIZE];
+	struct stat ist;
+	uint64_t n;
+
+	if(pread(fd, buf, HEADERSIZE, 0) != HEADERSIZE)
+		return -1;
+	g->npoints = 0;
+	header(g, st, expect);
+	if(memcmp(buf, expect, 32))
+		return -1;
+	n = get64(buf + 40);
+	if(n > (SIZE_MAX - HEADERSIZE) / POINTSIZE)
+		return -1;
+	if(fstat(fd, &ist) || (uint64_t)ist.st_size != HEADERSIZE + n * POINTSIZE)
+		return -1;
+	g->size = get64(buf + 32);
+	if(n == 0 && g->size > 0)
+		return -1;
+	return n;
+}
+
+/**
+ * Map an index file, if it belongs to this image.
+ *
+ * @return 0 if it does
+ **/
+static int map(struct gzindex* g, int fd, struct stat* st) {
+	const unsigned char* p;
+	ssize_t n = current(g, fd, st);
+	uint64_t prev = 0;
+	size_t i;
+
+	if(n < 0)
+		return -1;
+	g->maplen = HEADERSIZE + (size_t)n * POINTSIZE;
+	g->map = mmap(NULL, g->maplen, PROT_READ, MAP_SHARED, fd, 0);
+	if(g->map == MAP_FAILED) {
+		g->map = NULL;
+		return -1;
+	}
+	g->npoints = n;
+	for(i = 0; i < g->npoints; i++) {
+		p = point(g, i);
+		if(point_bits(p) > 7 || point_out(p) > g->size || (i == 0 && point_out(p) != 0) || (i > 0 && point_out(p) <= prev))
+			goto err;
+		prev = point_out(p);
+	}
+	return 0;
+err:
+	munmap(g->map, g->maplen);
+	g->map = NULL;
+	g->npoints = 0;
+	return -1;
+}
+
+/**
+ * Map the index from next to the image.
+ *
+ * @return 0 if it was there and belongs to this image
+ **/
+static int load(struct gzindex* g, const char* name, struct stat* st) {
+	int fd = open(name, O_RDONLY);
+	int ret;
+
+	if(fd < 0)
+		return -1;
+	ret = map(g, fd, st);
+	close(fd);
+	return ret;
+}
+
+/**
+ * Build the index, and save it next to the image through a temporary
+ * file, so that a half-written index is never found. If the directory
+ * can't be written to, and keep is set, the index goes to an anonymous
+ * temporary file instead, which goes away when it is unmapped.
+ **/
+static int make(struct gzindex* g, const char* name, struct stat* st, bool keep) {
+	char* tmp = malloc(strlen(name) + 8);
+	FILE* f = NULL;
+	int err;
+	int fd;
+
+	if(!tmp) {
+		errno = ENOMEM;
+		return -1;
+	}
+	sprintf(tmp, "%s.XXXXXX", name);
+	if((fd = mkstemp(tmp)) >= 0) {
+		fchmod(fd, 0644);
+		if(!(f = fdopen(fd, "w+")))
+			close(fd);
+	}
+	if(!f) {
+		unlink(tmp);
+		free(tmp);
+		tmp = NULL;
+		if(!keep || !(f = tmpfile()))
+			return -1;
+	}
+	if(build(g, st, f))
+		goto err;
+	if(tmp) {
+		if(fsync(fileno(f)) || rename(tmp, name))
+			goto err;
+		free(tmp);
+		tmp = NULL;
+	}
+	if(map(g, fileno(f), st)) {
+		errno = EIO;
+		goto err;
+	}
+	fclose(f);
+	return 0;
+err:
+	err = errno;
+	fclose(f);
+	if(tmp) {
+		unlink(tmp);
+		free(tmp);
+	}
+	errno = err;
+	return -1;
+}
+
+/**
+ * Map the index of the image, building it first if need be. The image
+ * is locked while the index is built, and the index is looked for again
+ * once we have the lock, in case whoever had it before just built it.
+ **/
+static int prepare(struct gzindex* g, const char* name, struct stat* st, bool keep) {
+	int ret;
+
+	if(!load(g, name, st))
+		return 0;
+	if(flock(g->fd, LOCK_EX))
+		return -1;
+	ret = load(g, name, st);
+	if(ret)
+		ret = make(g, name, st, keep);
+	flock(g->fd, LOCK_UN);
+	return ret;
+}
+
+/**
+ * Decompress the next len bytes of the current stream.
+ **/
+static int inflate_out(struct gzindex* g, struct gzindex_context* ctx, unsigned char* out, size_t len) {
+	ssize_t r;
+	int ret;
+
+	ctx->strm.next_out = out;
+	ctx->strm.avail_out = len;
+	while(ctx->strm.avail_out > 0) {
+		if(ctx->strm.avail_in == 0) {
+			r = pread(g->fd, ctx->inbuf, INSIZE, ctx->strmin);
+			if(r <= 0)
+				goto err;
+			ctx->strmin += r;
+			ctx->strm.next_in = ctx->inbuf;
+			ctx->strm.avail_in = r;
+		}
+		ret = inflate(&ctx->strm, Z_NO_FLUSH);
+		if(ret == Z_STREAM_END && ctx->strm.avail_out > 0)
+			goto err;
+		if(ret != Z_OK && ret != Z_STREAM_END)
+			goto err;
+	}
+	ctx->strmout += len;
+	return 0;
+err:
+	ctx->active = false;
+	errno = EIO;
+	return -1;
+}
+
+/**
+ * @return the last access point at or before an offset
+ **/
+static const unsigned char* findpoint(struct gzindex* g, uint64_t from) {
+	size_t lo = 0, hi = g->npoints, mid;
+
+	while(hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if(point_out(point(g, mid)) <= from)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return point(g, lo);
+}
+
+/**
+ * Decompress a range of the image, which must lie within it.
+ **/
+static int extract(struct gzindex* g, struct gzindex_context* ctx, uint64_t from, unsigned char* buf, size_t len) {
+	unsigned char discard[WINSIZE];
+	const unsigned char* p = findpoint(g, from);
+	int bits = point_bits(p);
+	unsigned char c;
+
+	if(!ctx->active || ctx->strmout > from || ctx->strmout < point_out(p)) {
+		inflateReset(&ctx->strm);
+		ctx->strm.avail_in = 0;
+		ctx->strmin = point_in(p);
+		ctx->strmout = point_out(p);
+		if(bits) {
+			if(pread(g->fd, &c, 1, ctx->strmin - 1) != 1) {
+				errno = EIO;
+				return -1;
+			}
+			inflatePrime(&ctx->strm, bits, c >> (8 - bits));
+		}
+		inflateSetDictionary(&ctx->strm, point_window(p), WINSIZE);
+		ctx->active = true;
+	}
+	while(ctx->strmout < from) {
+		if(inflate_out(g, ctx, discard, MIN(from - ctx->strmout, WINSIZE)))
+			return -1;
+	}
+	return inflate_out(g, ctx, buf, len);
+}
+
+/**
+ * Take a decompression context from the pool, preferring one that can
+ * carry on to an offset without going back to an access point. Called
+ * with the lock held.
+ *
+ * @return the context, or NULL with errno set
+ **/
+static struct gzindex_context* getcontext(struct gzindex* g, uint64_t from) {
+	uint64_t out = point_out(findpoint(g, from));
+	struct gzindex_context* ctx;
+	int i;
+
+	for(;;) {
+		ctx = NULL;
+		for(i = 0; i < g->ncontexts; i++) {
+			if(g->contexts[i]->busy)
+				continue;
+			if(g->contexts[i]->active && g->contexts[i]->strmout <= from && g->contexts[i]->strmout >= out) {
+				ctx = g->contexts[i];
+				break;
+			}
+			if(!ctx)
+				ctx = g->contexts[i];
+		}
+		if(ctx)
+			break;
+		if(g->ncontexts < MAXCONTEXTS) {
+			ctx = calloc(1, sizeof(struct gzindex_context));
+			if(!ctx || inflateInit2(&ctx->strm, -15) != Z_OK) {
+				free(ctx);
+				errno = ENOMEM;
+				return NULL;
+			}
+			g->contexts[g->ncontexts++] = ctx;
+			break;
+		}
+		pthread_cond_wait(&g->idle, &g->lock);
+	}
+	ctx->busy = true;
+	return ctx;
+}
+
+static void lru_unlink(struct gzindex* g, int i) {
+	struct gzindex_block* b = &g->blocks[i];
+
+	if(b->prev >= 0)
+		g->blocks[b->prev].next = b->next;
+	else
+		g->head = b->next;
+	if(b->next >= 0)
+		g->blocks[b->next].prev = b->prev;
+	else
+		g->tail = b->prev;
+}
+
+static void lru_push(struct gzindex* g, int i) {
+	struct gzindex_block* b = &g->blocks[i];
+
+	b->prev = -1;
+	b->next = g->head;
+	if(g->head >= 0)
+		g->blocks[g->head].prev = i;
+	g->head = i;
+	if(g->tail < 0)
+		g->tail = i;
+}
+
+static int hashof(struct gzindex* g, uint64_t num) {
+	return (num * 0x9E3779B97F4A7C15ULL >> 32) & (g->nbuckets - 1);
+}
+
+/**
+ * Find a block in the cache. Called with the lock held.
+ *
+ * @return the block, or NULL if it isn't there
+ **/
+static struct gzindex_block* cache_get(struct gzindex* g, uint64_t num) {
+	int i;
+
+	for(i = g->hash[hashof(g, num)]; i >= 0; i = g->blocks[i].hnext) {
+		if(g->blocks[i].num == num) {
+			lru_unlink(g, i);
+			lru_push(g, i);
+			return &g->blocks[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Put a block in the least recently used slot of the cache, unless
+ * another thread beat us to it. Called with the lock held.
+ **/
+static void cache_put(struct gzindex* g, uint64_t num, const char* data, size_t len) {
+	struct gzindex_block* b;
+	int* link;
+	int i;
+
+	if(cache_get(g, num))
+		return;
+	i = g->tail;
+	b = &g->blocks[i];
+	if(b->valid) {
+		for(link = &g->hash[hashof(g, b->num)]; *link != i; link = &g->blocks[*link].hnext);
+		*link = b->hnext;
+	}
+	memcpy(b->data, data, len);
+	b->num = num;
+	b->valid = true;
+	b->hnext = g->hash[hashof(g, num)];
+	g->hash[hashof(g, num)] = i;
+	lru_unlink(g, i);
+	lru_push(g, i);
+}
+
+/**
+ * Copy part of a block out of the cache, decompressing it first if it
+ * isn't there.
+ **/
+static int getblock(struct gzindex* g, uint64_t num, size_t off, char* buf, size_t len) {
+	struct gzindex_context* ctx;
+	struct gzindex_block* b;
+	uint64_t start = num * GZINDEX_BLOCK;
+	size_t blen = MIN((uint64_t)GZINDEX_BLOCK, g->size - start);
+	int ret;
+
+	pthread_mutex_lock(&g->lock);
+	if((b = cache_get(g, num))) {
+		memcpy(buf, b->data + off, len);
+		pthread_mutex_unlock(&g->lock);
+		return 0;
+	}
+	ctx = getcontext(g, start);
+	pthread_mutex_unlock(&g->lock);
+	if(!ctx)
+		return -1;
+	ret = extract(g, ctx, start, (unsigned char*)ctx->block, blen);
+	if(!ret)
+		memcpy(buf, ctx->block + off, len);
+	pthread_mutex_lock(&g->lock);
+	if(!ret)
+		cache_put(g, num, ctx->block, blen);
+	ctx->busy = false;
+	pthread_cond_signal(&g->idle);
+	pthread_mutex_unlock(&g->lock);
+	return ret;
+}
+
+struct gzindex* gzindex_open(const char* filename, uint64_t span, size_t cachesize) {
+	struct gzindex* g = calloc(1, sizeof(struct gzindex));
+	char* name = NULL;
+	struct stat st;
+	int err;
+	int i;
+
+	if(!g) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	pthread_mutex_init(&g->lock, NULL);
+	pthread_cond_init(&g->idle, NULL);
+	g->fd = open(filename, O_RDONLY);
+	if(g->fd < 0 || fstat(g->fd, &st))
+		goto err;
+	g->span = span ? span : GZINDEX_DEFAULT_SPAN;
+	if(!(name = malloc(strlen(filename) + strlen(GZINDEX_SUFFIX) + 1))) {
+		errno = ENOMEM;
+		goto err;
+	}
+	sprintf(name, "%s%s", filename, GZINDEX_SUFFIX);
+	/* Without a saved index, the next open builds it again; that's
+	 * slow, but not wrong */
+	if(prepare(g, name, &st, true))
+		goto err;
+	free(name);
+	name = NULL;
+
+	g->nblocks = MAX(cachesize / GZINDEX_BLOCK, 1);
+	for(g->nbuckets = 1; g->nbuckets < g->nblocks; g->nbuckets <<= 1);
+	g->blocks = calloc(g->nblocks, sizeof(struct gzindex_block));
+	g->hash = malloc(g->nbuckets * sizeof(int));
+	if(!g->blocks || !g->hash) {
+		errno = ENOMEM;
+		goto err;
+	}
+	memset(g->hash, 0xff, g->nbuckets * sizeof(int));
+	g->head = g->tail = -1;
+	for(i = 0; i < g->nblocks; i++) {
+		if(!(g->blocks[i].data = malloc(GZINDEX_BLOCK))) {
+			errno = ENOMEM;
+			goto err;
+		}
+		g->blocks[i].hnext = -1;
+		lru_push(g, i);
+	}
+	return g;
+err:
+	err = errno;
+	free(name);
+	gzindex_close(g);
+	errno = err;
+	return NULL;
+}
+
+void gzindex_close(struct gzindex* g) {
+	int i;
+
+	if(g->blocks) {
+		for(i = 0; i < g->nblocks; i++)
+			free(g->blocks[i].data);
+	}
+	free(g->blocks);
+	free(g->hash);
+	if(g->map)
+		munmap(g->map, g->maplen);
+	for(i = 0; i < g->ncontexts; i++) {
+		inflateEnd(&g->contexts[i]->strm);
+		free(g->contexts[i]);
+	}
+	if(g->fd >= 0)
+		close(g->fd);
+	pthread_mutex_destroy(&g->lock);
+	pthread_cond_destroy(&g->idle);
+	free(g);
+}
+
+uint64_t gzindex_size(struct gzindex* g) {
+	return g->size;
+}
+
+size_t gzindex_points(struct gzindex* g) {
+	return g->npoints;
+}
+
+int gzindex_read(struct gzindex* g, uint64_t from, char* buf, size_t len) {
+	uint64_t num;
+	size_t off, cur;
+
+	if(from > g->size || len > g->size - from) {
+		errno = EINVAL;
+		return -1;
+	}
+	while(len > 0) {
+		num = from / GZINDEX_BLOCK;
+		off = from % GZINDEX_BLOCK;
+		cur = MIN(len, GZINDEX_BLOCK - off);
+		if(getblock(g, num, off, buf, cur))
+			return -1;
+		from += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+int gzindex_build(const char* filename, uint64_t span) {
+	struct gzindex g;
+	struct stat st;
+	char* name;
+	int ret = -1;
+	int err;
+	int fd;
+
+	memset(&g, 0, sizeof(g));
+	g.span = span ? span : GZINDEX_DEFAULT_SPAN;
+	if((g.fd = open(filename, O_RDONLY)) < 0)
+		return -1;
+	if(!(name = malloc(strlen(filename) + strlen(GZINDEX_SUFFIX) + 1))) {
+		errno = ENOMEM;
+		goto out;
+	}
+	sprintf(name, "%s%s", filename, GZINDEX_SUFFIX);
+	if(!fstat(g.fd, &st)) {
+		/* This is called often, so look at the header of the
+		 * index first rather than checking all of it */
+		if((fd = open(name, O_RDONLY)) >= 0) {
+			if(current(&g, fd, &st) >= 0)
+				ret = 0;
+			close(fd);
+		}
+		if(ret)
+			ret = prepare(&g, name, &st, false);
+	}
+	free(name);
+out:
+	err = errno;
+	if(g.map)
+		munmap(g.map, g.maplen);
+	close(g.fd);
+	errno = err;
+	return ret;
+}
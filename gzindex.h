@@ -0,0 +1,71 @@
+/**
+ * Random access to gzip images
+ */
+#ifndef GZINDEX_H
+#define GZINDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define GZINDEX_MAGIC "GZNBDIX1" /**< first bytes of an index file */
+#define GZINDEX_SUFFIX ".idx" /**< appended to the name of an image to find its index */
+#define GZINDEX_DEFAULT_SPAN (1024*1024) /**< default distance between access points */
+#define GZINDEX_BLOCK (32*1024) /**< size of the blocks in the cache */
+#define GZINDEX_DEFAULT_CACHE (8*1024*1024) /**< default size of the cache */
+
+struct gzindex;
+
+/**
+ * Open a gzip image for random access. The index of access points is
+ * mapped from next to the image if it is there and was made for this
+ * image with the same span; otherwise the whole image is decompressed
+ * once to build it, and it is saved next to the image if possible. Only
+ * one process builds the index at a time; others that open the image
+ * meanwhile wait for it, and use the index it saved.
+ *
+ * @param filename the gzip image
+ * @param span the distance, in decompressed bytes, between access points
+ * @param cachesize the number of bytes of decompressed blocks to keep
+ * around; at least one block is always kept
+ * @return the image, or NULL with errno set. EINVAL means the file is
+ * not a single gzip (or zlib) stream, which the index can't handle.
+ **/
+struct gzindex* gzindex_open(const char* filename, uint64_t span, size_t cachesize);
+
+/**
+ * Make sure the index of a gzip image is saved next to it, building it
+ * if it's missing or was made for another version of the image, so that
+ * gzindex_open() finds it ready.
+ *
+ * @return 0 on success, nonzero with errno set on failure, which
+ * includes not being able to save the index
+ **/
+int gzindex_build(const char* filename, uint64_t span);
+
+/**
+ * Close an image, and unmap its index and free its cache.
+ **/
+void gzindex_close(struct gzindex* g);
+
+/**
+ * @return the size of an image when decompressed
+ **/
+uint64_t gzindex_size(struct gzindex* g);
+
+/**
+ * @return the number of access points in the index of an image
+ **/
+size_t gzindex_points(struct gzindex* g);
+
+/**
+ * Read a range of an image. Safe to call from several threads at once;
+ * blocks that aren't cached are decompressed by the calling thread,
+ * without holding any lock. Decompression starts at the nearest access
+ * point before the range, or carries on where an earlier read that
+ * missed the cache stopped if that is closer.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int gzindex_read(struct gzindex* g, uint64_t from, char* buf, size_t len);
+
+#endif
@@ -3,8 +3,17 @@
 
    Most of the stuff cribbed from the nbd package written by Pavel Machek
 
-   Unfortunately quite slow since zlib has to decompress all the stuff between
-   seeks, so only suited to smaller files
+   zlib has to decompress all the stuff between seeks, so gznbd builds an
+   index of access points every few megabytes (see gzindex.c) the first
+   time an image is served, and saves it as image.gz.idx. Reads then only
+   decompress from the nearest access point, and recently read blocks are
+   cached.
+
+   gznbd only talks to a local /dev/nbdX, with the old protocol and one
+   request at a time. To serve a gzip image over the network, with the
+   newstyle protocol and several requests decompressed at once, export
+   it from nbd-server with "compressed = true" instead; that uses the
+   same index.
    
    Could be a neat way to do userland encryption/steganography if you have 
    a crypto library which has a stdiolike interface to replace zlib
@@ -20,6 +29,10 @@
      gzip -9 /tmp/image
      gznbd /dev/nbd0 /tmp/image.gz
 
+   -i sets the distance between access points in megabytes (default 1,
+   0 to go without an index), -m the size of the block cache in megabytes
+   (default 8).
+
    gznbd does not background, from another terminal type
 
      mount -o ro,nocheck /dev/nbd0 /mnt/
@@ -57,6 +70,8 @@
 #include "../config.h"
 #include "../cliserv.h"
 
+#include "../gzindex.h"
+
 #define BLOCK 1024
 
 /* don't ask me why this value, I only copied it */
@@ -68,8 +83,12 @@ int main(int argc, char **argv)
   int pr[2];
   int sk;
   int nbd;
-  gzFile gz;
+  gzFile gz=NULL;
+  struct gzindex *idx=NULL;
   int gzerr;
+  int c;
+  u64 span=GZINDEX_DEFAULT_SPAN;
+  u64 cachesize=GZINDEX_DEFAULT_CACHE;
 
   char chunk[CHUNK];
   struct nbd_request request;
@@ -79,15 +98,47 @@ int main(int argc, char **argv)
   u64 from;
   u32 len;
 
+  while((c=getopt(argc,argv,"i:m:"))>=0){
+    switch(c){
+      case 'i' :
+        span=strtoull(optarg,NULL,0)*1024*1024;
+        break;
+      case 'm' :
+        cachesize=strtoull(optarg,NULL,0)*1024*1024;
+        break;
+      default :
+        argc=0;
+        break;
+    }
+  }
+  /* drop the options, but keep our name in argv[0] */
+  argv[optind-1]=argv[0];
+  argc-=optind-1;
+  argv+=optind-1;
+
   if(argc<3){
-    printf("Usage: %s nbdevice gzfile [size]\n",argv[0]);
+    printf("Usage: %s [-i span] [-m cache] nbdevice gzfile [size]\n",argv[0]);
     exit(1);
   }
 
-  gz=gzopen(argv[2], "rb");
-  if(gz==NULL){
-    fprintf(stderr,"%s: unable open compressed file %s\n",argv[0],argv[2]);
-    exit(1);
+  if(span){
+    printf("%s: file=%s, indexing, ",argv[0],argv[2]);
+    fflush(stdout);
+    idx=gzindex_open(argv[2],span,cachesize);
+    if(idx){
+      printf("%zu access points\n",gzindex_points(idx));
+    } else {
+      printf("failed\n");
+      fprintf(stderr,"%s: unable to index %s, falling back to seeking: %s\n",argv[0],argv[2],strerror(errno));
+    }
+  }
+
+  if(idx==NULL){
+    gz=gzopen(argv[2], "rb");
+    if(gz==NULL){
+      fprintf(stderr,"%s: unable open compressed file %s\n",argv[0],argv[2]);
+      exit(1);
+    }
   }
 
   if(argc>3){
@@ -97,6 +148,13 @@ int main(int argc, char **argv)
       exit(1);
     }
     printf("%s: file=%s, size=%"PRId64"\n",argv[0],argv[2],size);
+  } else if(idx){
+    size=gzindex_size(idx);
+    if((size==0)||(size%BLOCK)){
+      fprintf(stderr,"%s: decompressed size %"PRId64" has to be a nonzero multiple of %d\n",argv[0],size,BLOCK);
+      exit(1);
+    }
+    printf("%s: file=%s, size=%"PRId64"\n",argv[0],argv[2],size);
   } else {
     char buffer[BLOCK];
     int result;
@@ -140,7 +198,11 @@ int main(int argc, char **argv)
       exit(1);
       break;
     case 0 : /* child */
-      gzclose(gz);
+      if(idx){
+        gzindex_close(idx);
+      } else {
+        gzclose(gz);
+      }
 
       close(pr[0]);
 
@@ -219,7 +281,13 @@ fprintf(stderr,"%s: len=%d, from=%"PRId64"\n",argv[0],len,from);
       reply.error=htonl(EIO);
     }
 
-    if(reply.error==htonl(0)){
+    if(reply.error==htonl(0)&&idx){
+      if(gzindex_read(idx,from,chunk+sizeof(struct nbd_reply),len)){
+        fprintf(stderr,"%s: unable to read: %s\n",argv[0],strerror(errno));
+        reply.error=htonl(EIO);
+        len=0;
+      }
+    } else if(reply.error==htonl(0)){
       gzseek(gz,from,0);
       if(gzread(gz,chunk+sizeof(struct nbd_reply),len)!=len){
         fprintf(stderr,"%s: unable to read\n",argv[0]);
@@ -236,7 +304,11 @@ fprintf(stderr,"%s: len=%d, from=%"PRId64"\n",argv[0],len,from);
     }
   }
 
-  gzclose(gz);
+  if(idx){
+    gzindex_close(idx);
+  } else {
+    gzclose(gz);
+  }
 
   return 0;
 }
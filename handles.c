@@ -0,0 +1,165 @@
+/*
+ * Files of an export, opened and sized once in the master. A child that
+ * serves the export gets its own descriptors with dup(), which is much
+ * cheaper than opening every file of a multifile export and finding its
+ * size with ioctl(), fstat() and lseek() for every connection.
+ *
+ * A file that is replaced, resized, or added to a multifile export makes
+ * the handles stale; the children notice that with a stat() of every file,
+ * and open the files themselves until the master opens them again.
+ */
+#include "lfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <glib.h>
+
+#include <nbdsrv.h>
+#include "handles.h"
+
+struct handle {
+	int fd;
+	off_t startoff;
+	dev_t dev;	/**< device and inode of the file, to see whether */
+	ino_t ino;	/**< it was replaced */
+	off_t statsize;	/**< size of the file as stat() reports it */
+};
+
+struct handles {
+	gchar* name;
+	bool multifile;
+	bool readonly;
+	uint64_t size;
+	GArray* files;	/**< of struct handle */
+};
+
+static gchar* file_name(struct handles* h, int i) {
+	if(h->multifile)
+		return g_strdup_printf("%s.%d", h->name, i);
+	return g_strdup(h->name);
+}
+
+struct handles* handles_open(const char* name, bool multifile, bool writable) {
+	struct handles* h = g_new0(struct handles, 1);
+	struct handle f;
+	struct stat st;
+	gchar* fname;
+	int i;
+	int e;
+
+	h->name = g_strdup(name);
+	h->multifile = multifile;
+	h->files = g_array_new(FALSE, FALSE, sizeof(struct handle));
+	for(i = 0; ; i++) {
+		fname = file_name(h, i);
+		f.fd = -1;
+		if(writable)
+			f.fd = open(fname, O_RDWR);
+		if(f.fd < 0) {
+			/* Try again because maybe media was read-only */
+			f.fd = open(fname, O_RDONLY);
+			if(f.fd >= 0 && writable)
+				h->readonly = true;
+		}
+		g_free(fname);
+		if(f.fd < 0) {
+			if(multifile && i > 0)
+				break;
+			goto err;
+		}
+		if(fstat(f.fd, &st) < 0) {
+			close(f.fd);
+			goto err;
+		}
+		f.startoff = h->size;
+		f.dev = st.st_dev;
+		f.ino = st.st_ino;
+		f.statsize = st.st_size;
+		g_array_append_val(h->files, f);
+		h->size += size_autodetect(f.fd);
+		if(!multifile)
+			break;
+	}
+	return h;
+err:
+	e = errno;
+	handles_close(h);
+	errno = e;
+	return NULL;
+}
+
+void handles_close(struct handles* h) {
+	int i;
+
+	for(i = 0; i < h->files->len; i++)
+		close(g_array_index(h->files, struct handle, i).fd);
+	g_array_free(h->files, TRUE);
+	g_free(h->name);
+	g_free(h);
+}
+
+bool handles_current(struct handles* h) {
+	struct handle* f;
+	struct stat st;
+	gchar* fname;
+	bool ok = true;
+	int i;
+
+	for(i = 0; ok && i < h->files->len; i++) {
+		f = &g_array_index(h->files, struct handle, i);
+		fname = file_name(h, i);
+		ok = !stat(fname, &st) && st.st_dev == f->dev &&
+			st.st_ino == f->ino && st.st_size == f->statsize;
+		g_free(fname);
+	}
+	if(ok && h->multifile) {
+		fname = file_name(h, i);
+		ok = stat(fname, &st) < 0 && errno == ENOENT;
+		g_free(fname);
+	}
+	return ok;
+}
+
+bool handles_readonly(struct handles* h) {
+	return h->readonly;
+}
+
+uint64_t handles_size(struct handles* h) {
+	return h->size;
+}
+
+GArray* handles_dup(struct handles* h) {
+	GArray* export;
+	struct handle* f;
+	FILE_INFO fi;
+	int i;
+	int e;
+
+	if(!handles_current(h)) {
+		errno = ESTALE;
+		return NULL;
+	}
+	export = g_array_new(TRUE, TRUE, sizeof(FILE_INFO));
+	for(i = 0; i < h->files->len; i++) {
+		f = &g_array_index(h->files, struct handle, i);
+		fi.fhandle = dup(f->fd);
+		if(fi.fhandle < 0)
+			goto err;
+		fi.startoff = f->startoff;
+		g_array_append_val(export, fi);
+	}
+	return export;
+err:
+	e = errno;
+	for(i = 0; i < export->len; i++)
+		close(g_array_index(export, FILE_INFO, i).fhandle);
+	g_array_free(export, TRUE);
+	errno = e;
+	return NULL;
+}
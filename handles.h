@@ -0,0 +1,55 @@
+/**
+ * Files of an export, opened and sized once in the master, so that the
+ * children that serve it only have to duplicate the file descriptors
+ */
+#ifndef NBD_HANDLES_H
+#define NBD_HANDLES_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+struct handles;
+
+/**
+ * Open the files of an export, and find their sizes.
+ *
+ * @param name the name of the file, or with multifile, the name that
+ * ".0", ".1" and so on are appended to
+ * @param multifile whether the export consists of several files
+ * @param writable whether to open the files for writing. Files that
+ * can't be opened for writing are opened read-only.
+ * @return the files, or NULL with errno set if they could not be opened
+ **/
+struct handles* handles_open(const char* name, bool multifile, bool writable);
+
+void handles_close(struct handles* h);
+
+/**
+ * Check whether the files are still the ones at their names, with the
+ * sizes we found, and whether no file was added to a multifile export.
+ * That only takes a stat() of every file.
+ **/
+bool handles_current(struct handles* h);
+
+/**
+ * @return whether any of the files had to be opened read-only
+ **/
+bool handles_readonly(struct handles* h);
+
+/**
+ * @return the total size of the files
+ **/
+uint64_t handles_size(struct handles* h);
+
+/**
+ * Give a connection file descriptors of its own for the files, which it
+ * can close when it is done.
+ *
+ * @return an array of FILE_INFO, or NULL with errno set if the files have
+ * changed since they were opened
+ **/
+GArray* handles_dup(struct handles* h);
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ * The in-flight budget of a connection. The thread that reads requests
+ * takes every request from the budget before it allocates its buffer, and
+ * the worker that answers it gives it back. When the budget is spent, the
+ * reading thread waits, so that the requests the client sends pile up in
+ * the socket buffers, and TCP makes the client wait in turn, rather than
+ * the server buffering as much as the client cares to send.
+ */
+#include "lfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "inflight.h"
+
+struct inflight {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint32_t maxrequests;
+	uint64_t maxbytes;
+	struct inflight_stats stats;
+};
+
+static uint64_t now_usec(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+struct inflight* inflight_new(uint32_t maxrequests, uint64_t maxbytes) {
+	struct inflight* f = g_new0(struct inflight, 1);
+
+	pthread_mutex_init(&f->lock, NULL);
+	pthread_cond_init(&f->cond, NULL);
+	f->maxrequests = maxrequests;
+	f->maxbytes = maxbytes;
+	return f;
+}
+
+void inflight_free(struct inflight* f) {
+	pthread_cond_destroy(&f->cond);
+	pthread_mutex_destroy(&f->lock);
+	g_free(f);
+}
+
+static bool fits(struct inflight* f, uint64_t bytes) {
+	if(!f->stats.requests)
+		return true;
+	if(f->maxrequests && f->stats.requests >= f->maxrequests)
+		return false;
+	if(f->maxbytes && f->stats.bytes + bytes > f->maxbytes)
+		return false;
+	return true;
+}
+
+void inflight_acquire(struct inflight* f, uint64_t bytes) {
+	uint64_t start;
+
+	pthread_mutex_lock(&f->lock);
+	if(!fits(f, bytes)) {
+		start = now_usec();
+		f->stats.waits++;
+		do {
+			pthread_cond_wait(&f->cond, &f->lock);
+		} while(!fits(f, bytes));
+		f->stats.waitusec += now_usec() - start;
+	}
+	f->stats.requests++;
+	f->stats.bytes += bytes;
+	if(f->stats.requests > f->stats.maxrequests)
+		f->stats.maxrequests = f->stats.requests;
+	if(f->stats.bytes > f->stats.maxbytes)
+		f->stats.maxbytes = f->stats.bytes;
+	pthread_mutex_unlock(&f->lock);
+}
+
+void inflight_release(struct inflight* f, uint64_t bytes) {
+	pthread_mutex_lock(&f->lock);
+	f->stats.requests--;
+	f->stats.bytes -= bytes;
+	/* Only the thread that reads requests ever waits */
+	pthread_cond_signal(&f->cond);
+	pthread_mutex_unlock(&f->lock);
+}
+
+void inflight_get_stats(struct inflight* f, struct inflight_stats* stats) {
+	pthread_mutex_lock(&f->lock);
+	*stats = f->stats;
+	pthread_mutex_unlock(&f->lock);
+}
@@ -0,0 +1,50 @@
+/**
+ * Limits on the requests of a connection that have been read but not yet
+ * answered, and on the bytes of data they hold
+ */
+#ifndef NBD_INFLIGHT_H
+#define NBD_INFLIGHT_H
+
+#include <stdint.h>
+
+/** In-flight budget of a connection used when nothing else is configured */
+#define INFLIGHT_DEFAULT_BYTES (64 * 1024 * 1024)
+
+struct inflight;
+
+struct inflight_stats {
+	uint32_t requests;	/**< requests in flight now */
+	uint64_t bytes;		/**< bytes in flight now */
+	uint32_t maxrequests;	/**< the most requests that were in flight */
+	uint64_t maxbytes;	/**< the most bytes that were in flight */
+	uint64_t waits;		/**< number of times we had to wait */
+	uint64_t waitusec;	/**< time spent waiting, in microseconds */
+};
+
+/**
+ * Create a budget.
+ *
+ * @param maxrequests the most requests to have in flight, or 0 for no limit
+ * @param maxbytes the most bytes to have in flight, or 0 for no limit
+ **/
+struct inflight* inflight_new(uint32_t maxrequests, uint64_t maxbytes);
+
+void inflight_free(struct inflight* f);
+
+/**
+ * Take a request of a given size from the budget, and wait until enough of
+ * it is left if it isn't. A request larger than the whole budget is let in
+ * once nothing else is in flight, so that it can't wait forever; callers
+ * that don't want to allocate that much have to refuse such requests
+ * before they get here.
+ **/
+void inflight_acquire(struct inflight* f, uint64_t bytes);
+
+/**
+ * Give a request back to the budget when it has been answered
+ **/
+void inflight_release(struct inflight* f, uint64_t bytes);
+
+void inflight_get_stats(struct inflight* f, struct inflight_stats* stats);
+
+#endif
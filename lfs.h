@@ -15,5 +15,8 @@
 # define USE_SYNC_FILE_RANGE
 # define _GNU_SOURCE
 #endif /* HAVE_SYNC_FILE_RANGE */
+#ifdef HAVE_PREADV2
+# define _GNU_SOURCE
+#endif /* HAVE_PREADV2 */
 
 #endif /* LFS_H */
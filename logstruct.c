@@ -0,0 +1,848 @@
+/*
+ * Log-structured export backend. Writes are appended to segment files,
+ * whatever their offset in the export, so that random writes turn into
+ * sequential ones. An in-memory index maps every block of the export to
+ * its location in a segment.
+ *
+ * Every change to the index is appended to a log as well. Now and then,
+ * the whole index is written out as a checkpoint. A checkpoint starts a
+ * new log, and copies the index a piece at a time while requests carry
+ * on, so a piece may be newer than the start of the new log; replaying
+ * the new log over it still ends up at the right location for every
+ * block. Once the checkpoint is in place, the old log is dropped. Opening
+ * an export loads the checkpoint and replays the logs.
+ *
+ * Blocks that are overwritten or trimmed leave dead space behind in their
+ * segment. A thread compacts segments that are mostly dead by copying
+ * their live blocks to the current segment, and deletes segments once no
+ * block lives in them anymore.
+ *
+ * Locking: "lock" protects the index, the segment table and the append
+ * position. "seglock" is held for reading while a segment file is in use
+ * without holding "lock", and for writing when segments are deleted.
+ * When both are needed, seglock is taken first.
+ */
+#include "lfs.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "logstruct.h"
+
+#define LOGSTRUCT_MAGIC 0x6e62646c6f677331ULL /**< "nbdlogs1" */
+
+/** Locations are the segment number in the upper 32 bits, and the block
+ * within the segment in the lower ones. Segment numbers start at 1, so
+ * that 0 can mean "unmapped". */
+#define LOC(seg, slot) (((uint64_t)(seg) << 32) | (slot))
+#define LOC_SEG(loc) ((uint32_t)((loc) >> 32))
+#define LOC_SLOT(loc) ((uint32_t)((loc) & 0xffffffff))
+
+struct logstruct_segment {
+	int fd;
+	uint32_t used;	/**< number of blocks written to the segment */
+	uint32_t live;	/**< number of blocks the index points to */
+};
+
+/**
+ * Header of the checkpoint file; the index follows it
+ **/
+struct logstruct_header {
+	uint64_t magic;
+	uint64_t size;
+	uint32_t blocksize;
+	uint32_t segblocks;
+};
+
+/**
+ * A record in the log: block lba now lives at loc
+ **/
+struct logstruct_record {
+	uint64_t lba;
+	uint64_t loc;
+};
+
+struct logstruct {
+	pthread_mutex_t lock;
+	pthread_rwlock_t seglock;
+	pthread_cond_t wake;	/**< wakes the compaction thread */
+	gchar* dir;
+	int lockfd;		/**< holds the lock on the export */
+	uint64_t size;
+	uint64_t nblocks;
+	uint64_t* index;	/**< location of every block, or 0 */
+	struct logstruct_segment** segs; /**< indexed by segment number */
+	uint32_t nsegs;		/**< size of segs */
+	uint32_t curseg;	/**< segment we append to */
+	int logfd;		/**< the log we append to */
+	int oldlogfd;		/**< the log before it, until a checkpoint covers it; or -1 */
+	off_t logpos;
+	bool stop;
+	pthread_t thread;
+};
+
+static gchar* seg_name(struct logstruct* ls, uint32_t seg) {
+	return g_strdup_printf("%s/segment.%u", ls->dir, seg);
+}
+
+/**
+ * Open (or create) a segment file, and add it to the segment table.
+ * Called with the lock held, or before the thread runs.
+ **/
+static struct logstruct_segment* seg_open(struct logstruct* ls, uint32_t seg, bool create) {
+	struct logstruct_segment* s;
+	struct stat st;
+	gchar* name = seg_name(ls, seg);
+	int fd;
+
+	fd = open(name, O_RDWR | (create ? O_CREAT | O_TRUNC : 0), 0600);
+	g_free(name);
+	if(fd < 0)
+		return NULL;
+	if(seg >= ls->nsegs) {
+		uint32_t n = ls->nsegs ? ls->nsegs : 16;
+		while(n <= seg)
+			n *= 2;
+		ls->segs = g_realloc(ls->segs, n * sizeof(*ls->segs));
+		memset(ls->segs + ls->nsegs, 0, (n - ls->nsegs) * sizeof(*ls->segs));
+		ls->nsegs = n;
+	}
+	s = g_new0(struct logstruct_segment, 1);
+	s->fd = fd;
+	if(!create && !fstat(fd, &st))
+		s->used = st.st_size / LOGSTRUCT_BLOCKSIZE;
+	ls->segs[seg] = s;
+	return s;
+}
+
+static inline struct logstruct_segment* seg_get(struct logstruct* ls, uint32_t seg) {
+	return seg < ls->nsegs ? ls->segs[seg] : NULL;
+}
+
+/**
+ * Point a block at a new location, keeping the live counts of the
+ * segments right. Called with the lock held.
+ **/
+static void set_loc(struct logstruct* ls, uint64_t lba, uint64_t loc) {
+	struct logstruct_segment* s;
+
+	if(ls->index[lba] && (s = seg_get(ls, LOC_SEG(ls->index[lba]))))
+		s->live--;
+	ls->index[lba] = loc;
+	if(loc && (s = seg_get(ls, LOC_SEG(loc))))
+		s->live++;
+}
+
+static int append_log(struct logstruct* ls, struct logstruct_record* recs, size_t n) {
+	ssize_t len = n * sizeof(*recs);
+
+	if(pwrite(ls->logfd, recs, len, ls->logpos) != len) {
+		if(!errno)
+			errno = EIO;
+		return -1;
+	}
+	ls->logpos += len;
+	if(ls->logpos > LOGSTRUCT_CHECKPOINT)
+		pthread_cond_signal(&ls->wake);
+	return 0;
+}
+
+static gchar* log_name(struct logstruct* ls, bool next) {
+	return g_strdup_printf("%s/%s", ls->dir, next ? "log.new" : "log");
+}
+
+static int sync_dir(struct logstruct* ls) {
+	int fd = open(ls->dir, O_RDONLY);
+	int retval;
+
+	if(fd < 0)
+		return -1;
+	retval = fsync(fd);
+	close(fd);
+	return retval;
+}
+
+/**
+ * Write out the whole index, and drop the log it makes redundant. Called
+ * without the lock, from the compaction thread or while nothing else uses
+ * the export; the lock is only taken for short whiles.
+ **/
+static int checkpoint(struct logstruct* ls) {
+	struct logstruct_header hdr;
+	gchar* tmpname = g_strdup_printf("%s/index.tmp", ls->dir);
+	gchar* name = g_strdup_printf("%s/index", ls->dir);
+	gchar* logname = log_name(ls, false);
+	gchar* newlogname = log_name(ls, true);
+	uint64_t* chunk = g_new(uint64_t, 65536);
+	uint64_t start, n;
+	size_t len, done;
+	ssize_t ret;
+	int retval = -1;
+	int fd = -1;
+	int segfd;
+	int newlogfd;
+	bool rotate;
+
+	/* Start a new log, unless an earlier checkpoint failed, in which
+	 * case the current log still is the new one */
+	pthread_mutex_lock(&ls->lock);
+	rotate = ls->oldlogfd < 0;
+	pthread_mutex_unlock(&ls->lock);
+	if(rotate) {
+		newlogfd = open(newlogname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+		if(newlogfd < 0)
+			goto out;
+		if(sync_dir(ls)) {
+			close(newlogfd);
+			goto out;
+		}
+		pthread_mutex_lock(&ls->lock);
+		ls->oldlogfd = ls->logfd;
+		ls->logfd = newlogfd;
+		ls->logpos = 0;
+		pthread_mutex_unlock(&ls->lock);
+	}
+
+	fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if(fd < 0)
+		goto out;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = LOGSTRUCT_MAGIC;
+	hdr.size = ls->size;
+	hdr.blocksize = LOGSTRUCT_BLOCKSIZE;
+	hdr.segblocks = LOGSTRUCT_SEGBLOCKS;
+	if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+		goto out;
+	for(start = 0; start < ls->nblocks; start += n) {
+		n = MIN(ls->nblocks - start, (uint64_t)65536);
+		len = n * sizeof(uint64_t);
+		pthread_mutex_lock(&ls->lock);
+		memcpy(chunk, ls->index + start, len);
+		pthread_mutex_unlock(&ls->lock);
+		for(done = 0; done < len; done += ret) {
+			ret = write(fd, (char*)chunk + done, len - done);
+			if(ret <= 0)
+				goto out;
+		}
+	}
+	/* The index may point at data that isn't on disk yet. Segments
+	 * before the current one were synced when they were finished, and
+	 * only this thread deletes segments, so the file stays open */
+	pthread_mutex_lock(&ls->lock);
+	segfd = ls->segs[ls->curseg] ? ls->segs[ls->curseg]->fd : -1;
+	pthread_mutex_unlock(&ls->lock);
+	if(segfd >= 0 && fdatasync(segfd))
+		goto out;
+	if(fdatasync(fd))
+		goto out;
+	if(rename(tmpname, name) || sync_dir(ls))
+		goto out;
+	/* The checkpoint covers the old log now */
+	if(rename(newlogname, logname) || sync_dir(ls))
+		goto out;
+	pthread_mutex_lock(&ls->lock);
+	close(ls->oldlogfd);
+	ls->oldlogfd = -1;
+	pthread_mutex_unlock(&ls->lock);
+	retval = 0;
+out:
+	if(fd >= 0)
+		close(fd);
+	g_free(chunk);
+	g_free(tmpname);
+	g_free(name);
+	g_free(logname);
+	g_free(newlogname);
+	return retval;
+}
+
+/**
+ * Delete the segments in which nothing lives anymore. Called with the
+ * lock held, and seglock held for writing, right after a checkpoint.
+ * The checkpoint, or the log before a later record, may still point into
+ * such a segment; the log is synced first, so that the record that moved
+ * the block elsewhere is on disk once the segment is gone.
+ **/
+static void delete_dead_segments(struct logstruct* ls) {
+	struct logstruct_segment* s;
+	gchar* name;
+	uint32_t i;
+
+	for(i = 1; i < ls->nsegs; i++) {
+		s = ls->segs[i];
+		if(s && i != ls->curseg && s->live == 0)
+			break;
+	}
+	if(i == ls->nsegs)
+		return;
+	if(fdatasync(ls->segs[ls->curseg]->fd) || fdatasync(ls->logfd))
+		return;
+	for(i = 1; i < ls->nsegs; i++) {
+		s = ls->segs[i];
+		if(!s || i == ls->curseg || s->live > 0)
+			continue;
+		name = seg_name(ls, i);
+		unlink(name);
+		g_free(name);
+		close(s->fd);
+		g_free(s);
+		ls->segs[i] = NULL;
+	}
+}
+
+/**
+ * Start a new segment to append to. Called with the lock held.
+ **/
+static int new_segment(struct logstruct* ls) {
+	uint32_t seg = ls->curseg + 1;
+
+	/* Writes that were appended to the old segment must be on disk
+	 * before the next flush, which only syncs the current segment */
+	if(ls->curseg && ls->segs[ls->curseg] && fdatasync(ls->segs[ls->curseg]->fd))
+		return -1;
+	if(!seg_open(ls, seg, true))
+		return -1;
+	ls->curseg = seg;
+	return 0;
+}
+
+/**
+ * Append full blocks to the log. Called with the lock held.
+ *
+ * @param lba the first block
+ * @param count the number of blocks
+ **/
+static int append_blocks(struct logstruct* ls, uint64_t lba, const char* data, uint64_t count) {
+	struct logstruct_segment* s;
+	struct logstruct_record* recs;
+	uint64_t n, i;
+	ssize_t ret;
+	size_t done;
+
+	while(count > 0) {
+		s = ls->segs[ls->curseg];
+		if(s->used == LOGSTRUCT_SEGBLOCKS) {
+			if(new_segment(ls))
+				return -1;
+			s = ls->segs[ls->curseg];
+		}
+		n = MIN(count, (uint64_t)(LOGSTRUCT_SEGBLOCKS - s->used));
+		for(done = 0; done < n * LOGSTRUCT_BLOCKSIZE; done += ret) {
+			ret = pwrite(s->fd, data + done, n * LOGSTRUCT_BLOCKSIZE - done,
+					(off_t)s->used * LOGSTRUCT_BLOCKSIZE + done);
+			if(ret <= 0)
+				return -1;
+		}
+		recs = g_new(struct logstruct_record, n);
+		for(i = 0; i < n; i++) {
+			recs[i].lba = lba + i;
+			recs[i].loc = LOC(ls->curseg, s->used + i);
+		}
+		if(append_log(ls, recs, n)) {
+			g_free(recs);
+			return -1;
+		}
+		for(i = 0; i < n; i++)
+			set_loc(ls, recs[i].lba, recs[i].loc);
+		g_free(recs);
+		s->used += n;
+		lba += n;
+		data += n * LOGSTRUCT_BLOCKSIZE;
+		count -= n;
+	}
+	return 0;
+}
+
+/**
+ * Read a run of blocks. Called with seglock held; the lock is only taken
+ * to look the blocks up.
+ *
+ * @param from the offset of the first byte to read
+ * @param len the number of bytes to read
+ **/
+static int read_range(struct logstruct* ls, uint64_t from, char* buf, size_t len, bool locked) {
+	struct logstruct_segment* s;
+	uint64_t lba, loc, next;
+	size_t cur, off;
+	ssize_t ret;
+	int fd;
+
+	while(len > 0) {
+		lba = from / LOGSTRUCT_BLOCKSIZE;
+		off = from % LOGSTRUCT_BLOCKSIZE;
+		cur = MIN(len, LOGSTRUCT_BLOCKSIZE - off);
+		if(!locked)
+			pthread_mutex_lock(&ls->lock);
+		loc = ls->index[lba];
+		s = loc ? seg_get(ls, LOC_SEG(loc)) : NULL;
+		fd = s ? s->fd : -1;
+		/* Blocks that follow each other in the export and in the
+		 * segment can be read in one go */
+		next = loc;
+		while(fd >= 0 && cur < len && lba + 1 < ls->nblocks &&
+		      ls->index[lba + 1] == next + 1 &&
+		      LOC_SEG(next + 1) == LOC_SEG(loc)) {
+			lba++;
+			next++;
+			cur = MIN(len, cur + LOGSTRUCT_BLOCKSIZE);
+		}
+		if(!locked)
+			pthread_mutex_unlock(&ls->lock);
+		if(fd < 0) {
+			memset(buf, 0, cur);
+		} else {
+			ret = pread(fd, buf, cur, (off_t)LOC_SLOT(loc) * LOGSTRUCT_BLOCKSIZE + off);
+			if(ret < 0)
+				return -1;
+			/* A segment that is shorter than it should be (after
+			 * a crash, say) reads as zeroes */
+			if((size_t)ret < cur)
+				memset(buf + ret, 0, cur - ret);
+		}
+		from += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/**
+ * Find a segment that is worth compacting: the one with the smallest
+ * share of live blocks, if that is below LOGSTRUCT_COMPACT_PERCENT.
+ * Called with the lock held.
+ *
+ * @return the segment number, or 0 if there is none
+ **/
+static uint32_t pick_victim(struct logstruct* ls) {
+	struct logstruct_segment* s;
+	uint32_t victim = 0;
+	uint64_t best = 100;
+	uint64_t pct;
+	uint32_t i;
+
+	for(i = 1; i < ls->nsegs; i++) {
+		s = ls->segs[i];
+		if(!s || i == ls->curseg || s->used == 0)
+			continue;
+		pct = (uint64_t)s->live * 100 / s->used;
+		if(pct < LOGSTRUCT_COMPACT_PERCENT && pct < best) {
+			best = pct;
+			victim = i;
+		}
+	}
+	return victim;
+}
+
+/**
+ * Copy the live blocks of a segment to the current one.
+ **/
+static void compact(struct logstruct* ls, uint32_t victim) {
+	char* block = g_malloc(LOGSTRUCT_BLOCKSIZE);
+	struct logstruct_segment* s;
+	uint64_t lba, start, end;
+	uint64_t loc;
+
+	/* Don't hold the lock for the whole scan of the index, so that
+	 * requests don't stall */
+	for(start = 0; start < ls->nblocks && !ls->stop; start = end) {
+		end = MIN(ls->nblocks, start + 65536);
+		pthread_rwlock_rdlock(&ls->seglock);
+		pthread_mutex_lock(&ls->lock);
+		s = seg_get(ls, victim);
+		for(lba = start; s && s->live > 0 && lba < end; lba++) {
+			loc = ls->index[lba];
+			if(LOC_SEG(loc) != victim)
+				continue;
+			if(pread(s->fd, block, LOGSTRUCT_BLOCKSIZE, (off_t)LOC_SLOT(loc) * LOGSTRUCT_BLOCKSIZE) != LOGSTRUCT_BLOCKSIZE)
+				memset(block, 0, LOGSTRUCT_BLOCKSIZE);
+			if(append_blocks(ls, lba, block, 1))
+				break;
+		}
+		pthread_mutex_unlock(&ls->lock);
+		pthread_rwlock_unlock(&ls->seglock);
+		if(!s || s->live == 0)
+			break;
+	}
+	g_free(block);
+}
+
+/**
+ * Checkpoint and get rid of the segments that are dead. Requests are only
+ * held up while the segments are deleted, not while the index is written.
+ **/
+static void checkpoint_and_clean(struct logstruct* ls) {
+	if(checkpoint(ls))
+		return;
+	pthread_rwlock_wrlock(&ls->seglock);
+	pthread_mutex_lock(&ls->lock);
+	delete_dead_segments(ls);
+	pthread_mutex_unlock(&ls->lock);
+	pthread_rwlock_unlock(&ls->seglock);
+}
+
+static void* compact_thread(void* data) {
+	struct logstruct* ls = (struct logstruct*)data;
+	struct timeval now;
+	struct timespec timeout;
+	uint32_t victim;
+
+	pthread_mutex_lock(&ls->lock);
+	while(!ls->stop) {
+		gettimeofday(&now, NULL);
+		timeout.tv_sec = now.tv_sec + LOGSTRUCT_COMPACT_INTERVAL;
+		timeout.tv_nsec = now.tv_usec * 1000;
+		pthread_cond_timedwait(&ls->wake, &ls->lock, &timeout);
+		if(ls->stop)
+			break;
+		victim = pick_victim(ls);
+		if(!victim && ls->logpos <= LOGSTRUCT_CHECKPOINT)
+			continue;
+		pthread_mutex_unlock(&ls->lock);
+		if(victim)
+			compact(ls, victim);
+		checkpoint_and_clean(ls);
+		pthread_mutex_lock(&ls->lock);
+	}
+	pthread_mutex_unlock(&ls->lock);
+	return NULL;
+}
+
+/**
+ * Replay a log over the index.
+ *
+ * @return the end of the last complete record
+ **/
+static off_t replay(struct logstruct* ls, int fd) {
+	struct logstruct_record rec;
+	off_t pos;
+
+	/* A record that was only partly written is ignored */
+	for(pos = 0; pread(fd, &rec, sizeof(rec), pos) == sizeof(rec); pos += sizeof(rec)) {
+		if(rec.lba >= ls->nblocks)
+			continue;
+		if(rec.loc && !seg_get(ls, LOC_SEG(rec.loc)))
+			rec.loc = 0;
+		set_loc(ls, rec.lba, rec.loc);
+	}
+	return pos;
+}
+
+/**
+ * Load the checkpoint and replay the logs.
+ **/
+static int load(struct logstruct* ls) {
+	struct logstruct_header hdr;
+	struct logstruct_segment* s;
+	gchar* name = g_strdup_printf("%s/index", ls->dir);
+	uint64_t len = ls->nblocks * sizeof(uint64_t);
+	uint64_t done;
+	uint64_t lba;
+	ssize_t ret;
+	int fd;
+
+	fd = open(name, O_RDONLY);
+	g_free(name);
+	if(fd >= 0) {
+		if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+		   hdr.magic != LOGSTRUCT_MAGIC || hdr.size != ls->size ||
+		   hdr.blocksize != LOGSTRUCT_BLOCKSIZE ||
+		   hdr.segblocks != LOGSTRUCT_SEGBLOCKS) {
+			close(fd);
+			errno = EINVAL;
+			return -1;
+		}
+		for(done = 0; done < len; done += ret) {
+			ret = read(fd, (char*)ls->index + done, len - done);
+			if(ret <= 0) {
+				close(fd);
+				errno = EINVAL;
+				return -1;
+			}
+		}
+		close(fd);
+	}
+	/* Blocks in segments that don't exist anymore are unmapped */
+	for(lba = 0; lba < ls->nblocks; lba++) {
+		if(!ls->index[lba])
+			continue;
+		if((s = seg_get(ls, LOC_SEG(ls->index[lba]))))
+			s->live++;
+		else
+			ls->index[lba] = 0;
+	}
+	ls->logpos = replay(ls, ls->logfd);
+	/* A checkpoint that didn't finish leaves a new log behind, which
+	 * stays the one to append to until a checkpoint covers both */
+	name = log_name(ls, true);
+	fd = open(name, O_RDWR);
+	g_free(name);
+	if(fd >= 0) {
+		ls->oldlogfd = ls->logfd;
+		ls->logfd = fd;
+		ls->logpos = replay(ls, fd);
+	}
+	return 0;
+}
+
+struct logstruct* logstruct_open(const char* dir, uint64_t size, bool wait) {
+	struct logstruct* ls;
+	struct dirent* de;
+	gchar* name;
+	uint32_t seg;
+	uint32_t maxseg = 0;
+	char* end;
+	DIR* d;
+	int err;
+
+	if(mkdir(dir, 0700) && errno != EEXIST)
+		return NULL;
+	ls = g_new0(struct logstruct, 1);
+	ls->dir = g_strdup(dir);
+	ls->size = size;
+	ls->nblocks = (size + LOGSTRUCT_BLOCKSIZE - 1) / LOGSTRUCT_BLOCKSIZE;
+	ls->lockfd = -1;
+	ls->logfd = -1;
+	ls->oldlogfd = -1;
+	pthread_mutex_init(&ls->lock, NULL);
+	pthread_rwlock_init(&ls->seglock, NULL);
+	pthread_cond_init(&ls->wake, NULL);
+
+	name = g_strdup_printf("%s/lock", dir);
+	ls->lockfd = open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if(ls->lockfd < 0)
+		goto fail;
+	if(flock(ls->lockfd, LOCK_EX | (wait ? 0 : LOCK_NB))) {
+		if(errno == EWOULDBLOCK)
+			errno = EBUSY;
+		goto fail;
+	}
+
+	d = opendir(dir);
+	if(!d)
+		goto fail;
+	while((de = readdir(d))) {
+		if(strncmp(de->d_name, "segment.", 8))
+			continue;
+		seg = strtoul(de->d_name + 8, &end, 10);
+		if(*end || seg == 0)
+			continue;
+		if(!seg_open(ls, seg, false)) {
+			closedir(d);
+			goto fail;
+		}
+		if(seg > maxseg)
+			maxseg = seg;
+	}
+	closedir(d);
+
+	name = log_name(ls, false);
+	ls->logfd = open(name, O_RDWR | O_CREAT, 0600);
+	g_free(name);
+	if(ls->logfd < 0)
+		goto fail;
+	ls->index = g_new0(uint64_t, ls->nblocks);
+	if(load(ls))
+		goto fail;
+
+	/* Don't append to the segments of an earlier run; they may have
+	 * been cut short. */
+	ls->curseg = maxseg;
+	if(new_segment(ls))
+		goto fail;
+	if(checkpoint(ls))
+		goto fail;
+	delete_dead_segments(ls);
+
+	pthread_create(&ls->thread, NULL, compact_thread, ls);
+	return ls;
+fail:
+	err = errno;
+	for(seg = 0; seg < ls->nsegs; seg++) {
+		if(ls->segs[seg]) {
+			close(ls->segs[seg]->fd);
+			g_free(ls->segs[seg]);
+		}
+	}
+	if(ls->logfd >= 0)
+		close(ls->logfd);
+	if(ls->oldlogfd >= 0)
+		close(ls->oldlogfd);
+	if(ls->lockfd >= 0)
+		close(ls->lockfd);
+	pthread_cond_destroy(&ls->wake);
+	pthread_rwlock_destroy(&ls->seglock);
+	pthread_mutex_destroy(&ls->lock);
+	g_free(ls->segs);
+	g_free(ls->index);
+	g_free(ls->dir);
+	g_free(ls);
+	errno = err;
+	return NULL;
+}
+
+int logstruct_close(struct logstruct* ls) {
+	uint32_t i;
+	int retval;
+
+	pthread_mutex_lock(&ls->lock);
+	ls->stop = true;
+	pthread_cond_signal(&ls->wake);
+	pthread_mutex_unlock(&ls->lock);
+	pthread_join(ls->thread, NULL);
+
+	retval = checkpoint(ls);
+	if(!retval)
+		delete_dead_segments(ls);
+	for(i = 0; i < ls->nsegs; i++) {
+		if(ls->segs[i]) {
+			close(ls->segs[i]->fd);
+			g_free(ls->segs[i]);
+		}
+	}
+	close(ls->logfd);
+	if(ls->oldlogfd >= 0)
+		close(ls->oldlogfd);
+	close(ls->lockfd);
+	pthread_cond_destroy(&ls->wake);
+	pthread_rwlock_destroy(&ls->seglock);
+	pthread_mutex_destroy(&ls->lock);
+	g_free(ls->segs);
+	g_free(ls->index);
+	g_free(ls->dir);
+	g_free(ls);
+	return retval;
+}
+
+int logstruct_read(struct logstruct* ls, uint64_t from, char* buf, size_t len) {
+	int retval;
+
+	if(from + len > ls->size) {
+		errno = EINVAL;
+		return -1;
+	}
+	pthread_rwlock_rdlock(&ls->seglock);
+	retval = read_range(ls, from, buf, len, false);
+	pthread_rwlock_unlock(&ls->seglock);
+	return retval;
+}
+
+int logstruct_write(struct logstruct* ls, uint64_t from, const char* buf, size_t len) {
+	uint64_t first, last, count;
+	uint64_t start;
+	char* data;
+	int retval;
+
+	if(from + len > ls->size) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if(len == 0)
+		return 0;
+	first = from / LOGSTRUCT_BLOCKSIZE;
+	last = (from + len - 1) / LOGSTRUCT_BLOCKSIZE;
+	count = last - first + 1;
+	start = first * LOGSTRUCT_BLOCKSIZE;
+
+	pthread_rwlock_rdlock(&ls->seglock);
+	pthread_mutex_lock(&ls->lock);
+	if(from % LOGSTRUCT_BLOCKSIZE == 0 && len % LOGSTRUCT_BLOCKSIZE == 0) {
+		retval = append_blocks(ls, first, buf, count);
+	} else {
+		/* Fill in the rest of partial blocks with what's there now;
+		 * the last block of the export may be partial too */
+		data = g_malloc0(count * LOGSTRUCT_BLOCKSIZE);
+		retval = read_range(ls, start, data, LOGSTRUCT_BLOCKSIZE, true);
+		if(!retval && count > 1) {
+			uint64_t laststart = last * LOGSTRUCT_BLOCKSIZE;
+			retval = read_range(ls, laststart, data + (count - 1) * LOGSTRUCT_BLOCKSIZE,
+					MIN((uint64_t)LOGSTRUCT_BLOCKSIZE, ls->size - laststart), true);
+		}
+		if(!retval) {
+			memcpy(data + (from - start), buf, len);
+			retval = append_blocks(ls, first, data, count);
+		}
+		g_free(data);
+	}
+	pthread_mutex_unlock(&ls->lock);
+	pthread_rwlock_unlock(&ls->seglock);
+	return retval;
+}
+
+int logstruct_trim(struct logstruct* ls, uint64_t from, size_t len) {
+	struct logstruct_record* recs;
+	uint64_t first = (from + LOGSTRUCT_BLOCKSIZE - 1) / LOGSTRUCT_BLOCKSIZE;
+	uint64_t end = (from + len) / LOGSTRUCT_BLOCKSIZE;
+	uint64_t lba;
+	size_t n = 0;
+	int retval;
+
+	/* The last block of the export counts as complete */
+	if(from + len == ls->size)
+		end = ls->nblocks;
+	if(first >= end)
+		return 0;
+	recs = g_new(struct logstruct_record, end - first);
+	pthread_mutex_lock(&ls->lock);
+	for(lba = first; lba < end; lba++) {
+		if(!ls->index[lba])
+			continue;
+		recs[n].lba = lba;
+		recs[n].loc = 0;
+		n++;
+	}
+	retval = n ? append_log(ls, recs, n) : 0;
+	if(!retval) {
+		while(n-- > 0)
+			set_loc(ls, recs[n].lba, 0);
+	}
+	pthread_mutex_unlock(&ls->lock);
+	g_free(recs);
+	return retval;
+}
+
+int logstruct_flush(struct logstruct* ls) {
+	int retval;
+
+	pthread_mutex_lock(&ls->lock);
+	retval = fdatasync(ls->segs[ls->curseg]->fd);
+	if(!retval)
+		retval = fdatasync(ls->logfd);
+	/* Until the checkpoint that is being written is in place, the
+	 * records in the old log are still needed */
+	if(!retval && ls->oldlogfd >= 0)
+		retval = fdatasync(ls->oldlogfd);
+	pthread_mutex_unlock(&ls->lock);
+	return retval;
+}
+
+uint64_t logstruct_extent(struct logstruct* ls, uint64_t from, uint64_t len, bool* present) {
+	uint64_t lba = from / LOGSTRUCT_BLOCKSIZE;
+	uint64_t end = from + len;
+	uint64_t pos;
+
+	pthread_mutex_lock(&ls->lock);
+	*present = ls->index[lba] != 0;
+	pos = (lba + 1) * LOGSTRUCT_BLOCKSIZE;
+	for(lba++; pos < end && lba < ls->nblocks; lba++) {
+		if((ls->index[lba] != 0) != *present)
+			break;
+		pos += LOGSTRUCT_BLOCKSIZE;
+	}
+	pthread_mutex_unlock(&ls->lock);
+	return MIN(pos, end) - from;
+}
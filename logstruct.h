@@ -0,0 +1,78 @@
+/**
+ * Log-structured export backend
+ */
+#ifndef NBD_LOGSTRUCT_H
+#define NBD_LOGSTRUCT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LOGSTRUCT_BLOCKSIZE 4096 /**< size of the blocks the export is mapped in */
+#define LOGSTRUCT_SEGBLOCKS 16384 /**< number of blocks in a segment file (64M) */
+#define LOGSTRUCT_CHECKPOINT (16*1024*1024) /**< size of the log above which the index is checkpointed */
+#define LOGSTRUCT_COMPACT_PERCENT 50 /**< segments with fewer live blocks than this are compacted */
+#define LOGSTRUCT_COMPACT_INTERVAL 5 /**< seconds between looks for segments to compact */
+
+struct logstruct;
+
+/**
+ * Open a log-structured export, creating it if it doesn't exist yet, and
+ * start the thread that compacts it. Only one process can have an export
+ * open at a time.
+ *
+ * @param dir the directory that holds the export's files
+ * @param size the size of the export
+ * @param wait whether to wait until a process that has the export open
+ * closes it, rather than failing
+ * @return the export, or NULL with errno set (EBUSY if it's in use)
+ **/
+struct logstruct* logstruct_open(const char* dir, uint64_t size, bool wait);
+
+/**
+ * Checkpoint the index, stop the compaction thread, and close the export.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int logstruct_close(struct logstruct* ls);
+
+/**
+ * Read a range of the export. Parts that were never written or that were
+ * trimmed read as zeroes.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int logstruct_read(struct logstruct* ls, uint64_t from, char* buf, size_t len);
+
+/**
+ * Write a range of the export, by appending it to the current segment.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int logstruct_write(struct logstruct* ls, uint64_t from, const char* buf, size_t len);
+
+/**
+ * Unmap the blocks that lie completely within a range of the export, so
+ * that they read as zeroes and their space can be reclaimed.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int logstruct_trim(struct logstruct* ls, uint64_t from, size_t len);
+
+/**
+ * Make all writes and trims done so far durable.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int logstruct_flush(struct logstruct* ls);
+
+/**
+ * Find the length of the run of mapped or unmapped blocks that starts at
+ * a given offset.
+ *
+ * @param present set to whether the run is mapped
+ * @return the length of the run, at most len
+ **/
+uint64_t logstruct_extent(struct logstruct* ls, uint64_t from, uint64_t len, bool* present);
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * nbd-compress.c
+ *
+ * Creates a seekable compressed image, which nbd-server can export with
+ * the "compressed" option.
+ */
+
+#include "lfs.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compressed.h"
+
+static void usage(const char* name) {
+	printf("This is nbd-compress, part of nbd %s.\n", PACKAGE_VERSION);
+	printf("Use: %s [-c chunksize] [-l level] image compressed-image\n", name);
+	printf("\t-c: size of the chunks the image is compressed in (default %d)\n", COMPRESSED_DEFAULT_CHUNKSIZE);
+	printf("\t-l: zlib compression level, 1 to 9 (default %d)\n", Z_BEST_COMPRESSION);
+	printf("Use - as the image to read it from standard input.\n");
+}
+
+int main(int argc, char** argv) {
+	unsigned long chunksize = COMPRESSED_DEFAULT_CHUNKSIZE;
+	int level = Z_BEST_COMPRESSION;
+	char* end;
+	int in, out;
+	int c;
+
+	while((c = getopt(argc, argv, "c:l:h")) >= 0) {
+		switch(c) {
+		case 'c':
+			chunksize = strtoul(optarg, &end, 0);
+			if(*end || chunksize == 0 || chunksize > COMPRESSED_MAX_CHUNKSIZE) {
+				fprintf(stderr, "E: invalid chunk size %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'l':
+			level = strtol(optarg, &end, 0);
+			if(*end || level < 1 || level > 9) {
+				fprintf(stderr, "E: invalid compression level %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	if(strcmp(argv[optind], "-")) {
+		in = open(argv[optind], O_RDONLY);
+		if(in < 0) {
+			fprintf(stderr, "E: could not open %s: %s\n", argv[optind], strerror(errno));
+			return 1;
+		}
+	} else {
+		in = 0;
+	}
+	out = open(argv[optind + 1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(out < 0) {
+		fprintf(stderr, "E: could not open %s: %s\n", argv[optind + 1], strerror(errno));
+		return 1;
+	}
+	if(compressed_create(in, out, chunksize, level) || fsync(out)) {
+		fprintf(stderr, "E: could not compress the image: %s\n", strerror(errno));
+		unlink(argv[optind + 1]);
+		return 1;
+	}
+	close(out);
+	return 0;
+}
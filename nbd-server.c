@@ -69,8 +69,14 @@
 #include <sys/select.h>
 #include <sys/wait.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef HAVE_SYS_PRCTL_H
+#include <sys/prctl.h>
+#endif
 #ifdef HAVE_SYS_IOCTL_H
 #include <sys/ioctl.h>
+#include <sys/file.h>
 #endif
 #include <sys/param.h>
 #include <signal.h>
@@ -86,9 +92,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #if HAVE_FALLOC_PH
 #include <linux/falloc.h>
 #endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
 #include <arpa/inet.h>
 #include <strings.h>
 #include <dirent.h>
@@ -119,6 +129,18 @@
 #include "netdb-compat.h"
 #include "backend.h"
 #include "treefiles.h"
+#include "logstruct.h"
+#include "dedup.h"
+#include "compressed.h"
+#include "cipher.h"
+#include "checksum.h"
+#include "readcache.h"
+#include "readahead.h"
+#include "writecache.h"
+#include "reqsched.h"
+#include "affinity.h"
+#include "handles.h"
+#include "inflight.h"
 
 #ifdef WITH_SDP
 #include <sdp_inet.h>
@@ -154,12 +176,23 @@ int dontfork = 0;
  **/
 #define OFFT_MAX ~((off_t)1<<(sizeof(off_t)*8-1))
 #define BUFSIZE ((1024*1024)+sizeof(struct nbd_reply)) /**< Size of buffer that can hold requests */
-#define DIFFPAGESIZE 4096 /**< diff file uses those chunks */
+#define MAX_EXTENTS 65536 /**< Maximum number of extents in a block status reply */
+#define MAX_OPTLEN 65536 /**< Maximum length of option data we accept */
+#define ZEROBUFSIZE (64*1024) /**< Size of the buffer used to write zeroes when we can't avoid it */
+#define ZERODETECT_BLOCK 4096 /**< Size of the aligned blocks of zeroes that detectzeroes looks for */
+#define CACHE_CHUNK (1024*1024) /**< Size of the chunks in which we prefetch */
+#define MAX_CACHE_PENDING (64*1024*1024) /**< Maximum number of bytes queued for prefetching */
+#define CACHE_BACKOFF 1000 /**< Microseconds to wait before prefetching while reads are pending */
+#define SCRUB_BATCH 16 /**< Number of blocks the scrubber verifies between pauses */
+#define SCRUB_NAP 100000 /**< Longest the scrubber sleeps before checking whether it should stop, in microseconds */
+#define MAX_BLOCKSIZE (32*1024*1024) /**< Largest request we advertise we're willing to handle */
+#define READCACHE_MAXRUN 256 /**< Maximum number of blocks read into the read cache at once */
 
 /** Global flags: */
 #define F_OLDSTYLE 1	  /**< Allow oldstyle (port-based) exports */
 #define F_LIST 2	  /**< Allow clients to list the exports on a server */
 #define F_NO_ZEROES 4	  /**< Do not send zeros to client */
+#define F_IOPRIO 8	  /**< Set the I/O priority of worker threads by class of request */
 GHashTable *children;
 char pidfname[256]; /**< name of our PID file */
 char default_authname[] = SYSCONFDIR "/nbd-server/allow"; /**< default name of allow file */
@@ -179,7 +212,34 @@ char default_authname[] = SYSCONFDIR "/nbd-server/allow"; /**< default name of a
 #include <nbdsrv.h>
 
 /* Our thread pool */
-GThreadPool *tpool;
+struct reqsched *tpool;
+
+/* The CPUs that the threads which read requests, and the worker
+ * threads, should run on, or NULL */
+struct affinity *receiveraffinity;
+struct affinity *workeraffinity;
+
+/* The most requests, and bytes, that a server process may have in flight,
+ * or 0 for no limit. Every process serves a single connection, so these
+ * apply to each connection, on top of the limits of its export. */
+int maxinflight;
+uint64_t maxinflightbytes;
+
+/* The in-flight budget of the connection that this process serves, so
+ * that its statistics can be logged however the connection ends */
+static struct inflight *connection_inflight;
+
+/* A read that was split into parts, which are handled in parallel */
+struct split_read {
+	char* buf; /**< the data of all parts, unless we send them as they come */
+	uint64_t from;
+	uint32_t len;
+	int remaining; /**< parts not yet done; protected by the client lock */
+	int error; /**< error of any part; protected by the client lock */
+	uint64_t rafrom; /**< start of the range to read ahead after the read */
+	uint64_t ralen; /**< length of that range, or 0 */
+	int64_t inflight; /**< bytes taken from the in-flight budget, or -1 */
+};
 
 /* A work package for the thread pool functions */
 struct work_package {
@@ -187,8 +247,22 @@ struct work_package {
 	struct nbd_request* req;
 	int pipefd[2];
 	void* data; /**< for read requests */
+	uint64_t rafrom; /**< start of the range to read ahead after a read */
+	uint64_t ralen; /**< length of that range, or 0 */
+	struct work_package* merged; /**< next request merged into this one */
+	uint64_t mergefrom; /**< start of the range of the merged requests */
+	uint64_t mergelen; /**< length of that range */
+	struct split_read* split; /**< the read this is a part of, or NULL */
+	int64_t inflight; /**< bytes taken from the in-flight budget, or -1 */
 };
 
+/* Used during negotiation, but defined further down */
+int setupexport(CLIENT* client);
+static int sparseexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua);
+int set_peername(int net, CLIENT *client);
+int do_run(gchar* command, gchar* file);
+static bool connection_limit_reached(SERVER *serve);
+
 static volatile sig_atomic_t is_sigchld_caught; /**< Flag set by
 						     SIGCHLD handler
 						     to mark a child
@@ -214,6 +288,18 @@ GArray* modernsocks;	  /**< Sockets for the modern handler. Not used
 			       and IPv6 from the same socket (like,
 			       e.g., FreeBSD) */
 
+static int prefork;	  /**< Number of acceptor processes, which each
+			       accept connections on a set of sockets of
+			       their own, or 0 if we accept them in the
+			       main process */
+static GArray** acceptorsocks; /**< The sets of sockets of the acceptors */
+static pid_t* acceptors;  /**< PIDs of the acceptors, in the main process */
+static int acceptor = -1; /**< Which acceptor we are, or -1 */
+static int* connections;  /**< Number of connections served by the
+			       children of each acceptor, in memory
+			       shared between all of them, and then by
+			       the children of acceptors that are gone */
+
 bool logged_oversized=false;  /**< whether we logged oversized requests already */
 
 /**
@@ -252,6 +338,11 @@ struct generic_conf {
         gchar *modernaddr;      /**< address of the modern socket */
         gchar *modernport;      /**< port of the modern socket    */
         gchar *unixsock;	/**< file name of the unix domain socket */
+	gchar *receiveraffinity;/**< CPUs for the threads reading requests */
+	gchar *workeraffinity;	/**< CPUs for the worker threads */
+	gint prefork;		/**< number of acceptor processes, or 0 to accept in this one */
+	gint maxinflight;	/**< most requests a server process may have in flight */
+	gint64 maxinflightbytes;/**< most bytes a server process may have in flight */
         gint flags;             /**< global flags                 */
 	gint threads;		/**< maximum number of parallel threads we want to run */
 };
@@ -274,6 +365,12 @@ static inline const char * getcommandname(uint64_t command) {
 		return "NBD_CMD_FLUSH";
 	case NBD_CMD_TRIM:
 		return "NBD_CMD_TRIM";
+	case NBD_CMD_CACHE:
+		return "NBD_CMD_CACHE";
+	case NBD_CMD_WRITE_ZEROES:
+		return "NBD_CMD_WRITE_ZEROES";
+	case NBD_CMD_BLOCK_STATUS:
+		return "NBD_CMD_BLOCK_STATUS";
 	default:
 		return "UNKNOWN";
 	}
@@ -374,6 +471,25 @@ void dump_section(SERVER* serve, gchar* section_header) {
 	if(serve->flags & F_TREEFILES) {
 		printf("\ttreefiles = true\n");
 	}
+	if(serve->flags & F_LOGSTRUCT) {
+		printf("\tlogstructured = true\n");
+	}
+	if(serve->dedupstore) {
+		printf("\tdedupstore = %s\n", serve->dedupstore);
+	}
+	if(serve->flags & F_COMPRESSED) {
+		printf("\tcompressed = true\n");
+	}
+	if(serve->flags & F_DETECTZEROES) {
+		printf("\tdetectzeroes = true\n");
+	}
+	if(serve->encryptionkey) {
+		printf("\tencryptionkey = %s\n", serve->encryptionkey);
+	}
+	if(serve->checksumfile) {
+		printf("\tchecksumfile = %s\n", serve->checksumfile);
+		printf("\tscrubrate = %llu\n", (unsigned long long)serve->scrubrate);
+	}
 	if(serve->flags & F_COPYONWRITE) {
 		printf("\tcopyonwrite = true\n");
 	}
@@ -648,9 +764,35 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		{ "postrun",	FALSE,	PARAM_STRING,	&(s.postrun),		0 },
 		{ "transactionlog", FALSE, PARAM_STRING, &(s.transactionlog),	0 },
 		{ "cowdir",	FALSE,	PARAM_STRING,	&(s.cowdir),		0 },
+		{ "readcache",	FALSE,	PARAM_OFFT,	&(s.readcachesize),	0 },
+		{ "readahead",	FALSE,	PARAM_INT,	&(s.readahead),		0 },
+		{ "writecache",	FALSE,	PARAM_OFFT,	&(s.writecachesize),	0 },
+		{ "writecachebackground", FALSE, PARAM_OFFT, &(s.writecachebackground), 0 },
+		{ "writecachejournal", FALSE, PARAM_STRING, &(s.writecachejournal), 0 },
 		{ "readonly",	FALSE,	PARAM_BOOL,	&(s.flags),		F_READONLY },
 		{ "multifile",	FALSE,	PARAM_BOOL,	&(s.flags),		F_MULTIFILE },
 		{ "treefiles",	FALSE,	PARAM_BOOL,	&(s.flags),		F_TREEFILES },
+		{ "logstructured", FALSE, PARAM_BOOL,	&(s.flags),		F_LOGSTRUCT },
+		{ "dedupstore",	FALSE,	PARAM_STRING,	&(s.dedupstore),	0 },
+		{ "detectzeroes", FALSE, PARAM_BOOL,	&(s.flags),		F_DETECTZEROES },
+		{ "compressed",	FALSE,	PARAM_BOOL,	&(s.flags),		F_COMPRESSED },
+		{ "compressedcache", FALSE, PARAM_OFFT,	&(s.compressedcache),	0 },
+		{ "encryptionkey", FALSE, PARAM_STRING,	&(s.encryptionkey),	0 },
+		{ "checksumfile", FALSE, PARAM_STRING,	&(s.checksumfile),	0 },
+		{ "scrubrate",	FALSE,	PARAM_OFFT,	&(s.scrubrate),		0 },
+		{ "readiops",	FALSE,	PARAM_INT64,	&(s.qoslimits[QOS_EXPORT][QOS_READ_IOPS]), 0 },
+		{ "readbps",	FALSE,	PARAM_INT64,	&(s.qoslimits[QOS_EXPORT][QOS_READ_BPS]), 0 },
+		{ "writeiops",	FALSE,	PARAM_INT64,	&(s.qoslimits[QOS_EXPORT][QOS_WRITE_IOPS]), 0 },
+		{ "writebps",	FALSE,	PARAM_INT64,	&(s.qoslimits[QOS_EXPORT][QOS_WRITE_BPS]), 0 },
+		{ "clientreadiops", FALSE, PARAM_INT64,	&(s.qoslimits[QOS_CLIENT][QOS_READ_IOPS]), 0 },
+		{ "clientreadbps", FALSE, PARAM_INT64,	&(s.qoslimits[QOS_CLIENT][QOS_READ_BPS]), 0 },
+		{ "clientwriteiops", FALSE, PARAM_INT64, &(s.qoslimits[QOS_CLIENT][QOS_WRITE_IOPS]), 0 },
+		{ "clientwritebps", FALSE, PARAM_INT64,	&(s.qoslimits[QOS_CLIENT][QOS_WRITE_BPS]), 0 },
+		{ "qosburst",	FALSE,	PARAM_INT,	&(s.qosburst),		0 },
+		{ "maxmerge",	FALSE,	PARAM_INT,	&(s.maxmerge),		0 },
+		{ "splitread",	FALSE,	PARAM_INT,	&(s.splitread),		0 },
+		{ "maxinflight", FALSE,	PARAM_INT,	&(s.maxinflight),	0 },
+		{ "maxinflightbytes", FALSE, PARAM_OFFT, &(s.maxinflightbytes),	0 },
 		{ "copyonwrite", FALSE,	PARAM_BOOL,	&(s.flags),		F_COPYONWRITE },
 		{ "sparse_cow",	FALSE,	PARAM_BOOL,	&(s.flags),		F_SPARSE },
 		{ "sdp",	FALSE,	PARAM_BOOL,	&(s.flags),		F_SDP },
@@ -677,6 +819,12 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 		{ "allowlist",  FALSE, PARAM_BOOL,	&(genconftmp.flags),      F_LIST },
 		{ "unixsock",	FALSE, PARAM_STRING,    &(genconftmp.unixsock),   0 },
 		{ "max_threads", FALSE, PARAM_INT,	&(genconftmp.threads),	  0 },
+		{ "ioprio",	FALSE, PARAM_BOOL,	&(genconftmp.flags),      F_IOPRIO },
+		{ "receiveraffinity", FALSE, PARAM_STRING, &(genconftmp.receiveraffinity), 0 },
+		{ "workeraffinity", FALSE, PARAM_STRING, &(genconftmp.workeraffinity), 0 },
+		{ "prefork",	FALSE, PARAM_INT,	&(genconftmp.prefork),	  0 },
+		{ "maxinflight", FALSE, PARAM_INT,	&(genconftmp.maxinflight), 0 },
+		{ "maxinflightbytes", FALSE, PARAM_INT64, &(genconftmp.maxinflightbytes), 0 },
 	};
 	PARAM* p=gp;
 	int p_size=sizeof(gp)/sizeof(PARAM);
@@ -720,6 +868,9 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 	groups = g_key_file_get_groups(cfile, NULL);
 	for(i=0;groups[i];i++) {
 		memset(&s, '\0', sizeof(SERVER));
+		s.compressedcache = COMPRESSED_DEFAULT_CACHE;
+		s.scrubrate = CHECKSUM_DEFAULT_SCRUBRATE;
+		s.qosburst = QOS_DEFAULT_BURST;
 
 		/* After the [generic] group or when we're parsing an include
 		 * directory, start parsing exports */
@@ -828,6 +979,58 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 			return NULL;
 		}
 #endif
+#ifndef HAVE_ZLIB
+		if (s.flags & F_COMPRESSED) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED, "This nbd-server was built without zlib, yet group %s uses compressed", groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+#endif
+#ifndef HAVE_OPENSSL
+		if (s.encryptionkey) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_UNSUPPORTED, "This nbd-server was built without OpenSSL, yet group %s uses encryptionkey", groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+#endif
+		if (s.qosburst < 0) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Invalid value %d for parameter qosburst in group %s",
+				    s.qosburst, groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		/* Spliced writes never pass through a buffer we could
+		 * look at */
+		if ((s.flags & F_DETECTZEROES) && (s.flags & F_SPLICE)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix detectzeroes with splice for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		/* Spliced requests never pass through a buffer we
+		 * could merge them in */
+		if ((s.maxmerge > 0) && (s.flags & F_SPLICE)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix maxmerge with splice for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		if ((s.splitread > 0) && (s.flags & F_SPLICE)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix splitread with splice for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
 		/* We can't mix copyonwrite and splice. */
 		if ((s.flags & F_COPYONWRITE) && (s.flags & F_SPLICE)) {
 			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_INVALID_SPLICE,
@@ -837,6 +1040,66 @@ GArray* parse_cfile(gchar* f, struct generic_conf *const genconf, bool expect_ge
 			g_key_file_free(cfile);
 			return NULL;
 		}
+		/* A log-structured store is a backend of its own */
+		if ((s.flags & F_LOGSTRUCT) && (s.flags & (F_MULTIFILE | F_TREEFILES | F_COPYONWRITE | F_SPLICE | F_TEMPORARY))) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix logstructured with multifile, treefiles, copyonwrite, splice or temporary for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		if (s.dedupstore && (s.flags & (F_MULTIFILE | F_TREEFILES | F_LOGSTRUCT | F_SPLICE | F_TEMPORARY))) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix dedupstore with multifile, treefiles, logstructured, splice or temporary for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		if ((s.flags & F_COMPRESSED) && (s.dedupstore || (s.flags & (F_MULTIFILE | F_TREEFILES | F_LOGSTRUCT | F_SPLICE | F_TEMPORARY)))) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix compressed with multifile, treefiles, logstructured, dedupstore, splice or temporary for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		/* Splice bypasses the encryption, a compressed image is
+		 * plaintext already, and the write-back cache journal would
+		 * hold plaintext */
+		if (s.encryptionkey && ((s.flags & (F_COMPRESSED | F_SPLICE)) || s.writecachesize)) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix encryptionkey with compressed, splice or writecache for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		/* Checksums cover the blocks of the export files; the
+		 * other backends don't write to those, splice bypasses the
+		 * checks, and a temporary export is new every time */
+		if (s.checksumfile && (s.dedupstore || (s.flags & (F_COPYONWRITE | F_LOGSTRUCT | F_COMPRESSED | F_SPLICE | F_TEMPORARY)))) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_VALUE_INVALID,
+				    "Cannot mix checksumfile with copyonwrite, logstructured, dedupstore, compressed, splice or temporary for export %s",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
+		/* Compressed images can't be written to; writes go to a
+		 * copy-on-write overlay instead */
+		if ((s.flags & F_COMPRESSED) && !(s.flags & F_READONLY)) {
+			s.flags |= F_COPYONWRITE;
+		}
+		if ((s.dedupstore || (s.flags & F_LOGSTRUCT)) && !s.expected_size) {
+			g_set_error(e, NBDS_ERR, NBDS_ERR_CFILE_KEY_MISSING,
+				    "The logstructured or deduplicated export %s needs a filesize",
+				    groups[i]);
+			g_array_free(retval, TRUE);
+			g_key_file_free(cfile);
+			return NULL;
+		}
 		/* Don't need to free this, it's not our string */
 		virtstyle=NULL;
 		/* Don't append values for the [generic] group */
@@ -1010,6 +1273,21 @@ ssize_t rawexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
 	size_t maxbytes;
 	ssize_t retval;
 
+	if(client->server->flags & F_LOGSTRUCT) {
+		if(logstruct_write(client->logstruct, a, buf, len))
+			return -1;
+		if(((client->server->flags & F_SYNC) || fua) && logstruct_flush(client->logstruct))
+			return -1;
+		return len;
+	}
+	if(client->dedup) {
+		if(dedup_write(client->dedup, a, buf, len))
+			return -1;
+		if(((client->server->flags & F_SYNC) || fua) && dedup_flush(client->dedup))
+			return -1;
+		return len;
+	}
+
 	if(get_filepos(client, a, &fhandle, &foffset, &maxbytes))
 		return -1;
 	if(maxbytes && len > maxbytes)
@@ -1089,8 +1367,8 @@ int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
 }
 
 /**
- * Read an amount of bytes at a given offset from the right file. This
- * abstracts the read-side of the multiple files option.
+ * Read an amount of bytes at a given offset from the right file, without
+ * going through the read cache.
  *
  * @param a The offset where the read should start
  * @param buf A buffer to read into
@@ -1099,12 +1377,30 @@ int rawexpwrite_fully(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
  * @return The number of bytes actually read, or -1 in case of an
  * error.
  **/
-ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
+static ssize_t fileexpread(off_t a, char *buf, size_t len, CLIENT *client) {
 	int fhandle;
 	off_t foffset;
 	size_t maxbytes;
 	ssize_t retval;
 
+	if(client->server->flags & F_LOGSTRUCT) {
+		if(logstruct_read(client->logstruct, a, buf, len))
+			return -1;
+		return len;
+	}
+	if(client->dedup) {
+		if(dedup_read(client->dedup, a, buf, len))
+			return -1;
+		return len;
+	}
+#ifdef HAVE_ZLIB
+	if(client->compressed) {
+		if(compressed_read(client->compressed, a, buf, len))
+			return -1;
+		return len;
+	}
+#endif
+
 	if(get_filepos(client, a, &fhandle, &foffset, &maxbytes))
 		return -1;
 	if(maxbytes && len > maxbytes)
@@ -1119,6 +1415,86 @@ ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
 	return retval;
 }
 
+/**
+ * Read through the export's shared read cache. If the first block of the
+ * request isn't cached, the run of uncached blocks it starts is read from
+ * the file in one go and added to the cache, so that the next requests of
+ * a sequential reader are hits.
+ *
+ * @return The number of bytes actually read, which may be less than len,
+ * or -1 in case of an error.
+ **/
+static ssize_t cachedexpread(off_t a, char *buf, size_t len, CLIENT *client) {
+	struct readcache* cache = client->server->readcache;
+	uint64_t block = a / READCACHE_BLOCKSIZE;
+	off_t blockstart = block * READCACHE_BLOCKSIZE;
+	size_t skip = a - blockstart;
+	char blockbuf[READCACHE_BLOCKSIZE];
+	uint64_t nblocks;
+	uint64_t maxblocks;
+	uint64_t i;
+	char *runbuf;
+	size_t runlen;
+	ssize_t ret;
+
+	if(readcache_get(cache, client->readcachetag, block, blockbuf)) {
+		if(len > READCACHE_BLOCKSIZE - skip)
+			len = READCACHE_BLOCKSIZE - skip;
+		memcpy(buf, blockbuf + skip, len);
+		return len;
+	}
+
+	/* Only blocks that lie completely within the export are cached */
+	nblocks = (skip + len + READCACHE_BLOCKSIZE - 1) / READCACHE_BLOCKSIZE;
+	if(nblocks > READCACHE_MAXRUN)
+		nblocks = READCACHE_MAXRUN;
+	maxblocks = (client->exportsize - blockstart) / READCACHE_BLOCKSIZE;
+	if(nblocks > maxblocks)
+		nblocks = maxblocks;
+	for(i = 1; i < nblocks; i++) {
+		if(readcache_get(cache, client->readcachetag, block + i, NULL)) {
+			nblocks = i;
+			break;
+		}
+	}
+	if(nblocks == 0)
+		return fileexpread(a, buf, len, client);
+
+	runlen = nblocks * READCACHE_BLOCKSIZE;
+	runbuf = g_malloc(runlen);
+	for(i = 0; i < runlen; i += ret) {
+		ret = fileexpread(blockstart + i, runbuf + i, runlen - i, client);
+		if(ret <= 0) {
+			g_free(runbuf);
+			return -1;
+		}
+	}
+	for(i = 0; i < nblocks; i++)
+		readcache_put(cache, client->readcachetag, block + i, runbuf + i * READCACHE_BLOCKSIZE);
+	if(len > runlen - skip)
+		len = runlen - skip;
+	memcpy(buf, runbuf + skip, len);
+	g_free(runbuf);
+	return len;
+}
+
+/**
+ * Read an amount of bytes at a given offset from the right file. This
+ * abstracts the read-side of the multiple files option.
+ *
+ * @param a The offset where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're serving for
+ * @return The number of bytes actually read, or -1 in case of an
+ * error.
+ **/
+ssize_t rawexpread(off_t a, char *buf, size_t len, CLIENT *client) {
+	if(client->server->readcache)
+		return cachedexpread(a, buf, len, client);
+	return fileexpread(a, buf, len, client);
+}
+
 /**
  * Call rawexpread repeatedly until all data has been read.
  * @return 0 on success, nonzero on failure
@@ -1196,6 +1572,102 @@ int expsplice(int pipe, off_t a, size_t len, CLIENT *client, int dir, int fua)
 }
 #endif /* HAVE_SPLICE */
 
+/**
+ * Read from an export with checksums, and check every block the range
+ * touches against its checksum. Blocks that are only partly in the range
+ * are read in full to check them.
+ *
+ * @return 0 on success, nonzero on failure; errno is EIO if a block
+ * doesn't match its checksum
+ * @see rawexpread_fully
+ **/
+static int checkedexpread(off_t a, char *buf, size_t len, CLIENT *client) {
+	struct checksums* c = client->checksums;
+	char block[CHECKSUM_BLOCKSIZE];
+	uint64_t b, last;
+	off_t start;
+	size_t blen;
+	const char* data;
+	int ret;
+
+	if (!len)
+		return 0;
+	checksum_lock(c, a, len, false);
+	ret = rawexpread_fully(a, buf, len, client);
+	last = (a + len - 1) / CHECKSUM_BLOCKSIZE;
+	for (b = a / CHECKSUM_BLOCKSIZE; !ret && b <= last; b++) {
+		start = b * CHECKSUM_BLOCKSIZE;
+		blen = checksum_blocklen(c, b);
+		if (start >= a && start + blen <= a + len) {
+			data = buf + (start - a);
+		} else if (!checksum_known(c, b)) {
+			continue;
+		} else if (rawexpread_fully(start, block, blen, client)) {
+			ret = -1;
+			break;
+		} else {
+			data = block;
+		}
+		if (!checksum_verify(c, b, data)) {
+			msg(LOG_ERR, "Block %llu of %s does not match its checksum",
+			    (unsigned long long)b, client->exportname);
+			errno = EIO;
+			ret = -1;
+		}
+	}
+	checksum_unlock(c, a, len, false);
+	return ret;
+}
+
+/**
+ * Write to an export with checksums, and update the checksums of the
+ * blocks the range touches. Blocks that are only partly in the range
+ * are read back to compute theirs.
+ *
+ * @see rawexpwrite_fully
+ **/
+static int checkedexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	struct checksums* c = client->checksums;
+	char block[CHECKSUM_BLOCKSIZE];
+	uint64_t b, last;
+	off_t start;
+	size_t blen;
+	int ret;
+
+	if (!len)
+		return 0;
+	checksum_lock(c, a, len, true);
+	ret = rawexpwrite_fully(a, buf, len, client, fua);
+	last = (a + len - 1) / CHECKSUM_BLOCKSIZE;
+	for (b = a / CHECKSUM_BLOCKSIZE; b <= last; b++) {
+		start = b * CHECKSUM_BLOCKSIZE;
+		blen = checksum_blocklen(c, b);
+		if (ret) {
+			/* We don't know what made it to disk */
+			checksum_forget(c, start, blen);
+		} else if (start >= a && start + blen <= a + len) {
+			checksum_update(c, b, buf + (start - a));
+		} else if (rawexpread_fully(start, block, blen, client)) {
+			checksum_forget(c, start, blen);
+		} else {
+			checksum_update(c, b, block);
+		}
+	}
+	checksum_unlock(c, a, len, true);
+	return ret;
+}
+
+/**
+ * Find where a page of a copy-on-write export is in the diff file. Pages
+ * are given their place by requests on other threads, which set it only
+ * once they have written the page there.
+ *
+ * @return the page of the diff file, or (u32)-1 if it isn't there
+ **/
+static u32 diffpage(CLIENT *client, off_t mapcnt) {
+	return __atomic_load_n(&client->difmap[mapcnt], __ATOMIC_ACQUIRE);
+}
+
 /**
  * Read an amount of bytes at a given offset from the right file. This
  * abstracts the read-side of the copyonwrite stuff, and calls
@@ -1206,12 +1678,16 @@ int expsplice(int pipe, off_t a, size_t len, CLIENT *client, int dir, int fua)
  * @param client The client we're going to read for
  * @return 0 on success, nonzero on failure
  **/
-int expread(off_t a, char *buf, size_t len, CLIENT *client) {
+static int cowexpread(off_t a, char *buf, size_t len, CLIENT *client) {
 	off_t rdlen, offset;
 	off_t mapcnt, mapl, maph, pagestart;
+	u32 page;
 
-	if (!(client->server->flags & F_COPYONWRITE))
+	if (!(client->server->flags & F_COPYONWRITE)) {
+		if (client->checksums)
+			return checkedexpread(a, buf, len, client);
 		return(rawexpread_fully(a, buf, len, client));
+	}
 	DEBUG("Asked to read %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
 
 	mapl=a/DIFFPAGESIZE; maph=(a+len-1)/DIFFPAGESIZE;
@@ -1221,11 +1697,15 @@ int expread(off_t a, char *buf, size_t len, CLIENT *client) {
 		offset=a-pagestart;
 		rdlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
 			len : (size_t)DIFFPAGESIZE-offset;
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
+		page = diffpage(client, mapcnt);
+		if (page!=(u32)(-1)) { /* the block is already there */
 			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
-			myseek(client->difffile, client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (read(client->difffile, buf, rdlen) != rdlen) return -1;
+			       (unsigned long)page);
+			/* The parts of a split read, and other requests,
+			 * read the diff file at the same time, so they
+			 * can't share its offset */
+			if (pread(client->difffile, buf, rdlen,
+					(off_t)page*DIFFPAGESIZE+offset) != rdlen) return -1;
 		} else { /* the block is not there */
 			DEBUG("Page %llu is not here, we read the original one\n",
 			       (unsigned long long)mapcnt);
@@ -1248,15 +1728,21 @@ int expread(off_t a, char *buf, size_t len, CLIENT *client) {
  * @param fua Flag to indicate 'Force Unit Access'
  * @return 0 on success, nonzero on failure
  **/
-int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+static int cowexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
 	char pagebuf[DIFFPAGESIZE];
 	off_t mapcnt,mapl,maph;
 	off_t wrlen,rdlen; 
 	off_t pagestart;
 	off_t offset;
+	u32 page;
+	bool locked;
+	int ret;
 
-	if (!(client->server->flags & F_COPYONWRITE))
+	if (!(client->server->flags & F_COPYONWRITE)) {
+		if (client->checksums)
+			return checkedexpwrite(a, buf, len, client, fua);
 		return(rawexpwrite_fully(a, buf, len, client, fua)); 
+	}
 	DEBUG("Asked to write %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
 
 	mapl=a/DIFFPAGESIZE ; maph=(a+len-1)/DIFFPAGESIZE ;
@@ -1267,26 +1753,41 @@ int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
 		wrlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
 			len : (size_t)DIFFPAGESIZE-offset;
 
-		if (client->difmap[mapcnt]!=(u32)(-1)) { /* the block is already there */
+		page = diffpage(client, mapcnt);
+		locked = false;
+		if (page == (u32)(-1)) {
+			/* Another request may be claiming the page too;
+			 * whichever gets the lock first copies it, and the
+			 * other then finds it there */
+			pthread_mutex_lock(&client->difflock);
+			locked = true;
+			page = diffpage(client, mapcnt);
+		}
+		if (page!=(u32)(-1)) { /* the block is already there */
 			DEBUG("Page %llu is at %lu\n", (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt])) ;
-			myseek(client->difffile,
-					client->difmap[mapcnt]*DIFFPAGESIZE+offset);
-			if (write(client->difffile, buf, wrlen) != wrlen) return -1 ;
+			       (unsigned long)page) ;
+			ret = pwrite(client->difffile, buf, wrlen,
+					(off_t)page*DIFFPAGESIZE+offset) != wrlen;
 		} else { /* the block is not there */
-			myseek(client->difffile,client->difffilelen*DIFFPAGESIZE) ;
-			client->difmap[mapcnt]=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
+			page=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
 			DEBUG("Page %llu is not here, we put it at %lu\n",
 			       (unsigned long long)mapcnt,
-			       (unsigned long)(client->difmap[mapcnt]));
+			       (unsigned long)page);
 			rdlen=DIFFPAGESIZE ;
-			if (rawexpread_fully(pagestart, pagebuf, rdlen, client))
-				return -1;
-			memcpy(pagebuf+offset,buf,wrlen) ;
-			if (write(client->difffile, pagebuf, DIFFPAGESIZE) !=
-					DIFFPAGESIZE)
-				return -1;
-		}						    
+			ret = rawexpread_fully(pagestart, pagebuf, rdlen, client);
+			if (!ret) {
+				memcpy(pagebuf+offset,buf,wrlen) ;
+				ret = pwrite(client->difffile, pagebuf, DIFFPAGESIZE,
+						(off_t)page*DIFFPAGESIZE) != DIFFPAGESIZE;
+			}
+			/* Only now may other threads find the page there */
+			if (!ret)
+				__atomic_store_n(&client->difmap[mapcnt], page, __ATOMIC_RELEASE);
+		}
+		if (locked)
+			pthread_mutex_unlock(&client->difflock);
+		if (ret)
+			return -1;
 		len-=wrlen ; a+=wrlen ; buf+=wrlen ;
 	}
 	if (client->server->flags & F_SYNC) {
@@ -1300,6 +1801,75 @@ int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
 	return 0;
 }
 
+/**
+ * Read an amount of bytes at a given offset, and decrypt them if the
+ * export is encrypted. Whole sectors are read and decrypted in place;
+ * a read that doesn't start or end on a sector boundary goes through a
+ * bounce buffer.
+ *
+ * @param a The offset where the read should start
+ * @param buf A buffer to read into
+ * @param len The size of buf
+ * @param client The client we're going to read for
+ * @return 0 on success, nonzero on failure
+ **/
+int expread(off_t a, char *buf, size_t len, CLIENT *client) {
+	off_t start, end;
+	char *sectors;
+	int retval;
+
+	if(!client->cipher)
+		return cowexpread(a, buf, len, client);
+	start = a - a % CIPHER_SECTORSIZE;
+	end = (a + len + CIPHER_SECTORSIZE - 1) / CIPHER_SECTORSIZE * CIPHER_SECTORSIZE;
+	if(start == a && (size_t)(end - start) == len) {
+		if(cowexpread(a, buf, len, client))
+			return -1;
+		return cipher_decrypt(client->cipher, a / CIPHER_SECTORSIZE, buf, buf, len);
+	}
+	sectors = g_malloc(end - start);
+	retval = cowexpread(start, sectors, end - start, client) ||
+		cipher_decrypt(client->cipher, start / CIPHER_SECTORSIZE, sectors, sectors, end - start);
+	if(!retval)
+		memcpy(buf, sectors + (a - start), len);
+	g_free(sectors);
+	return retval;
+}
+
+/**
+ * Write an amount of bytes at a given offset, encrypting them first if
+ * the export is encrypted. The caller's buffer may be shared
+ * (expwritezeroes() writes from a static one), so the ciphertext goes to
+ * a buffer of its own. On an encrypted export, a write that doesn't
+ * start and end on a sector boundary fails with EINVAL: it would have to
+ * read the sectors at its edges and write them back, which races with
+ * any other write to them, and we tell clients that the minimum block
+ * size is a sector.
+ *
+ * @param a The offset where the write should start
+ * @param buf The buffer to write from
+ * @param len The length of buf
+ * @param client The client we're going to write for.
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @return 0 on success, nonzero on failure
+ **/
+int expwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	char *sectors;
+	int retval;
+
+	if(!client->cipher)
+		return cowexpwrite(a, buf, len, client, fua);
+	if(a % CIPHER_SECTORSIZE || len % CIPHER_SECTORSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+	sectors = g_malloc(len);
+	retval = cipher_encrypt(client->cipher, a / CIPHER_SECTORSIZE, buf, sectors, len) ||
+		cowexpwrite(a, sectors, len, client, fua);
+	g_free(sectors);
+	return retval;
+}
+
 /**
  * Flush data to a client
  *
@@ -1313,6 +1883,19 @@ int expflush(CLIENT *client) {
 		return fsync(client->difffile);
 	}
 
+	if (client->server->flags & F_LOGSTRUCT) {
+		return logstruct_flush(client->logstruct);
+	}
+
+	if (client->dedup) {
+		return dedup_flush(client->dedup);
+	}
+
+	/* A read-only compressed image has nothing to flush */
+	if (client->compressed) {
+		return 0;
+	}
+
         if (client->server->flags & F_TREEFILES ) {
 		// all we can do is force sync the entire filesystem containing the tree
 		if (client->server->flags & F_READONLY)
@@ -1330,107 +1913,1139 @@ int expflush(CLIENT *client) {
 	return 0;
 }
 
-void punch_hole(int fd, off_t off, off_t len) {
-	DEBUG("punching hole in fd=%d, starting from %llu, length %llu\n", fd, (unsigned long long)off, (unsigned long long)len);
-#if HAVE_FALLOC_PH
-	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
-#elif HAVE_FSCTL_SET_ZERO_DATA
-	FILE_ZERO_DATA_INFORMATION zerodata;
-	zerodata.FileOffset.QuadPart = off;
-	zerodata.BeyondFinalZero.QuadPart = off + len;
-	HANDLE w32handle = (HANDLE)_get_osfhandle(fd);
-	DWORD bytesret;
-	DeviceIoControl(w32handle, FSCTL_SET_ZERO_DATA, &zerodata, sizeof(zerodata), NULL, 0, &bytesret, NULL);
-#else
-	DEBUG("punching holes not supported on this platform\n");
-#endif
+/**
+ * Callbacks through which the write-back cache accesses the export
+ **/
+static int writecache_expwrite(uint64_t from, char* buf, size_t len, void* opaque) {
+	return sparseexpwrite(from, buf, len, (CLIENT*)opaque, 0);
 }
 
-static void send_reply(uint32_t opt, int net, uint32_t reply_type, size_t datasize, void* data) {
-	uint64_t magic = htonll(0x3e889045565a9LL);
-	reply_type = htonl(reply_type);
-	uint32_t datsize = htonl(datasize);
-	opt = htonl(opt);
-	struct iovec v_data[] = {
-		{ &magic, sizeof(magic) },
-		{ &opt, sizeof(opt) },
-		{ &reply_type, sizeof(reply_type) },
-		{ &datsize, sizeof(datsize) },
-		{ data, datasize },
-	};
-	size_t total = sizeof(magic) + sizeof(opt) + sizeof(reply_type) + sizeof(datsize) + datasize;
-	ssize_t sent = writev(net, v_data, 5);
-	if(sent != total) {
-		perror("E: couldn't write enough data:");
-	}
+static int writecache_expread(uint64_t from, char* buf, size_t len, void* opaque) {
+	return expread(from, buf, len, (CLIENT*)opaque);
 }
 
-static CLIENT* handle_export_name(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
-	uint32_t namelen;
-	char* name;
-	int i;
+static int writecache_expflush(void* opaque) {
+	return expflush((CLIENT*)opaque);
+}
 
-	if (read(net, &namelen, sizeof(namelen)) < 0) {
-		err("Negotiation failed/7: %m");
-		return NULL;
+/**
+ * Set up the write-back cache for a client, if the export asks for one.
+ * If there is a journal, the writes in it that didn't make it to the
+ * export before (because we crashed, say) are written back first.
+ **/
+static void setup_writecache(CLIENT* client) {
+	SERVER* serve = client->server;
+	uint64_t background;
+	gchar* journal = serve->writecachejournal;
+
+	client->writecache = NULL;
+	client->journalfd = -1;
+	if(!serve->writecachesize || (serve->flags & (F_READONLY | F_AUTOREADONLY)))
+		return;
+	if(serve->flags & F_SPLICE) {
+		msg(LOG_WARNING, "Ignoring writecache: it can't be used with splice");
+		return;
 	}
-	namelen = ntohl(namelen);
-	if(namelen > 0) {
-		name = malloc(namelen+1);
-		name[namelen]=0;
-		if (read(net, name, namelen) < 0) {
-			err("Negotiation failed/8: %m");
-			free(name);
-			return NULL;
+	/* Writes that were acknowledged must survive the connection going
+	 * away without a disconnect request, or the server being killed,
+	 * and only the journal makes sure of that. The data of copy-on-write
+	 * and temporary exports goes away with the connection anyway. */
+	if(serve->flags & (F_COPYONWRITE | F_TEMPORARY)) {
+		journal = NULL;
+	} else if(!journal) {
+		msg(LOG_WARNING, "Ignoring writecache: it needs a writecachejournal");
+		return;
+	} else if(strchr(serve->exportname, '%')) {
+		msg(LOG_WARNING, "Ignoring writecache: export is not the same file for every client, so it can't have a journal");
+		return;
+	}
+	if(journal) {
+		client->journalfd = open(journal, O_RDWR | O_CREAT, 0600);
+		if(client->journalfd < 0) {
+			err("Could not open write cache journal: %m");
+		}
+		/* The journal can only be used by one connection at a time;
+		 * the others write through */
+		if(flock(client->journalfd, LOCK_EX | LOCK_NB) < 0) {
+			msg(LOG_INFO, "Write cache journal %s is in use, not caching writes", journal);
+			close(client->journalfd);
+			client->journalfd = -1;
+			return;
+		}
+		if(writecache_replay(client->journalfd, writecache_expwrite,
+					writecache_expflush, client)) {
+			err("Could not replay write cache journal: %m");
 		}
-	} else {
-		name = strdup("");
 	}
-	for(i=0; i<servers->len; i++) {
-		SERVER* serve = &(g_array_index(servers, SERVER, i));
-		if(!strcmp(serve->servename, name)) {
-			CLIENT* client = g_new0(CLIENT, 1);
-			client->server = serve;
-			client->exportsize = OFFT_MAX;
-			client->net = net;
-			client->modern = TRUE;
-			client->transactionlogfd = -1;
-			client->clientfeats = cflags;
-			pthread_mutex_init(&(client->lock), NULL);
+	background = serve->writecachebackground;
+	if(!background || background > serve->writecachesize)
+		background = serve->writecachesize / 4;
+	client->writecache = writecache_new(serve->writecachesize, background,
+			client->journalfd, writecache_expwrite,
+			writecache_expflush, client);
+}
+
+/**
+ * Tell the kernel we're going to read a range of a file soon, so that it
+ * can start reading it into the page cache.
+ **/
+static void prefetch(int fd, off_t off, off_t len) {
+	DEBUG("prefetching fd=%d, starting from %llu, length %llu\n", fd, (unsigned long long)off, (unsigned long long)len);
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(fd, off, len, POSIX_FADV_WILLNEED);
+#endif
+}
+
+/**
+ * Prefetch a range of the underlying files, without the copy-on-write
+ * layer.
+ **/
+static void rawexpcache(off_t a, size_t len, CLIENT *client) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	size_t cur;
+
+	/* The segments and chunks don't map linearly to the export */
+	if((client->server->flags & F_LOGSTRUCT) || client->dedup || client->compressed)
+		return;
+
+	while(len > 0) {
+		if(client->server->flags & F_TREEFILES) {
+			/* Don't go through get_filepos(), it would create
+			 * the files we're looking at */
+			cur = TREEPAGESIZE - a % TREEPAGESIZE;
+			if(cur > len)
+				cur = len;
+			cache_treefile(client->exportname, client->exportsize, a);
+		} else {
+			if(get_filepos(client, a, &fhandle, &foffset, &maxbytes))
+				return;
+			cur = (maxbytes && len > maxbytes) ? maxbytes : len;
+			prefetch(fhandle, foffset, cur);
+		}
+		a += cur;
+		len -= cur;
+	}
+}
+
+/**
+ * Prefetch a range of the export. This abstracts the copyonwrite layer,
+ * like expread() does: pages in the diff file are prefetched from there,
+ * runs of other pages from the original export.
+ *
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @param client The client we're prefetching for
+ **/
+static void expcache(off_t a, size_t len, CLIENT *client) {
+	off_t mapcnt, mapl, maph, runend;
+
+	if (!(client->server->flags & F_COPYONWRITE)) {
+		rawexpcache(a, len, client);
+		return;
+	}
+	mapl=a/DIFFPAGESIZE; maph=(a+len-1)/DIFFPAGESIZE;
+
+	for (mapcnt=mapl;mapcnt<=maph;mapcnt=runend) {
+		runend=mapcnt+1;
+		if (diffpage(client, mapcnt)!=(u32)(-1)) {
+			prefetch(client->difffile, (off_t)diffpage(client, mapcnt)*DIFFPAGESIZE, DIFFPAGESIZE);
+		} else {
+			while (runend<=maph && diffpage(client, runend)==(u32)(-1))
+				runend++;
+			rawexpcache(mapcnt*DIFFPAGESIZE, (runend-mapcnt)*DIFFPAGESIZE, client);
+		}
+	}
+}
+
+/**
+ * Prefetch the ranges queued by NBD_CMD_CACHE requests. This runs in a
+ * thread of its own so that prefetching never keeps a worker thread away
+ * from real requests, and it backs off for as long as reads are waiting
+ * to be handled.
+ *
+ * @param data the client we're prefetching for
+ **/
+static void* cache_thread(void* data) {
+	CLIENT* client = (CLIENT*)data;
+	struct nbd_request* req;
+	off_t from;
+	size_t len;
+	size_t cur;
+
+	while((req = g_async_queue_pop(client->cachequeue))->len > 0) {
+		from = req->from;
+		len = req->len;
+		while(len > 0) {
+			while(g_atomic_int_get(&client->readsinflight) > 0) {
+				g_usleep(CACHE_BACKOFF);
+			}
+			cur = len > CACHE_CHUNK ? CACHE_CHUNK : len;
+			expcache(from, cur, client);
+			from += cur;
+			len -= cur;
+		}
+		g_atomic_int_add(&client->cachepending, -(gint)req->len);
+		free(req);
+	}
+	free(req);
+	return NULL;
+}
+
+/**
+ * Go through the blocks of an export with checksums in the background,
+ * at no more than scrubrate bytes per second, check them against their
+ * checksums, and fill in the checksums of blocks that have none yet.
+ * Like cache_thread(), this backs off while reads are waiting.
+ *
+ * @param data the client we're scrubbing for
+ **/
+static void* scrub_thread(void* data) {
+	CLIENT* client = (CLIENT*)data;
+	struct checksums* c = client->checksums;
+	char block[CHECKSUM_BLOCKSIZE];
+	gulong pause = (uint64_t)SCRUB_BATCH * CHECKSUM_BLOCKSIZE * 1000000 / client->server->scrubrate;
+	gulong slept;
+	uint64_t b;
+	size_t blen;
+	int i;
+
+	while(!g_atomic_int_get(&client->scrubstop)) {
+		for(i = 0; i < SCRUB_BATCH; i++) {
+			while(g_atomic_int_get(&client->readsinflight) > 0 &&
+			      !g_atomic_int_get(&client->scrubstop)) {
+				g_usleep(CACHE_BACKOFF);
+			}
+			b = checksum_scrub_next(c);
+			blen = checksum_blocklen(c, b);
+			checksum_lock(c, b * CHECKSUM_BLOCKSIZE, blen, false);
+			if(rawexpread_fully(b * CHECKSUM_BLOCKSIZE, block, blen, client)) {
+				msg(LOG_ERR, "Could not read block %llu of %s to scrub it: %m",
+				    (unsigned long long)b, client->exportname);
+			} else if(!checksum_known(c, b)) {
+				checksum_update(c, b, block);
+			} else if(!checksum_verify(c, b, block)) {
+				msg(LOG_ERR, "Scrubbing found that block %llu of %s does not match its checksum",
+				    (unsigned long long)b, client->exportname);
+			}
+			checksum_unlock(c, b * CHECKSUM_BLOCKSIZE, blen, false);
+		}
+		for(slept = 0; slept < pause && !g_atomic_int_get(&client->scrubstop); slept += SCRUB_NAP)
+			g_usleep(MIN(pause - slept, SCRUB_NAP));
+	}
+	return NULL;
+}
+
+void punch_hole(int fd, off_t off, off_t len) {
+	DEBUG("punching hole in fd=%d, starting from %llu, length %llu\n", fd, (unsigned long long)off, (unsigned long long)len);
+#if HAVE_FALLOC_PH
+	fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len);
+#elif HAVE_FSCTL_SET_ZERO_DATA
+	FILE_ZERO_DATA_INFORMATION zerodata;
+	zerodata.FileOffset.QuadPart = off;
+	zerodata.BeyondFinalZero.QuadPart = off + len;
+	HANDLE w32handle = (HANDLE)_get_osfhandle(fd);
+	DWORD bytesret;
+	DeviceIoControl(w32handle, FSCTL_SET_ZERO_DATA, &zerodata, sizeof(zerodata), NULL, 0, &bytesret, NULL);
+#else
+	DEBUG("punching holes not supported on this platform\n");
+#endif
+}
+
+static char zeroes[ZEROBUFSIZE];
+
+/**
+ * Zero a range of a file or block device without sending the zeroes
+ * through the page cache, if the platform allows for that.
+ *
+ * @param fd The file descriptor to zero
+ * @param off The offset at which to start
+ * @param len The number of bytes to zero
+ * @param may_trim Whether the range may be deallocated
+ * @return 0 on success, -1 if the caller should write zeroes instead
+ **/
+static int zero_range(int fd, off_t off, off_t len, bool may_trim) {
+#ifdef BLKZEROOUT
+	struct stat st;
+
+	if(!fstat(fd, &st) && S_ISBLK(st.st_mode)) {
+		uint64_t range[2] = { off, len };
+
+		if(off % 512 || len % 512)
+			return -1;
+		return ioctl(fd, BLKZEROOUT, range) ? -1 : 0;
+	}
+#endif
+#if HAVE_FALLOC_PH
+	if(may_trim && !fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, off, len))
+		return 0;
+#ifdef FALLOC_FL_ZERO_RANGE
+	if(!fallocate(fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, off, len))
+		return 0;
+#endif
+#endif
+	return -1;
+}
+
+/**
+ * Zero a range of a file the slow way, by writing zeroes to it.
+ *
+ * @return 0 on success, -1 on failure
+ **/
+static int write_zeroes(int fd, off_t off, off_t len) {
+	ssize_t ret;
+
+	while(len > 0) {
+		ret = pwrite(fd, zeroes, len > ZEROBUFSIZE ? ZEROBUFSIZE : len, off);
+		if(ret <= 0)
+			return -1;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/**
+ * Write zeroes to a range of a log-structured export.
+ **/
+static int logstruct_zero(struct logstruct *ls, off_t a, size_t len) {
+	size_t cur;
+
+	while(len > 0) {
+		cur = len > ZEROBUFSIZE ? ZEROBUFSIZE : len;
+		if(logstruct_write(ls, a, zeroes, cur))
+			return -1;
+		a += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+/**
+ * Zero a range of a log-structured export. Full blocks are unmapped when
+ * we may deallocate them; only the partial blocks at either end are
+ * written.
+ **/
+static int logstruct_writezeroes(off_t a, size_t len, CLIENT *client, int fua, bool may_trim) {
+	off_t first = ((a + LOGSTRUCT_BLOCKSIZE - 1) / LOGSTRUCT_BLOCKSIZE) * LOGSTRUCT_BLOCKSIZE;
+	off_t last = ((a + len) / LOGSTRUCT_BLOCKSIZE) * LOGSTRUCT_BLOCKSIZE;
+	int ret;
+
+	/* The last block of the export counts as complete */
+	if(a + len == client->exportsize)
+		last = a + len;
+	if(may_trim && first < last) {
+		ret = logstruct_trim(client->logstruct, a, len);
+		if(!ret)
+			ret = logstruct_zero(client->logstruct, a, first - a);
+		if(!ret)
+			ret = logstruct_zero(client->logstruct, last, a + len - last);
+	} else {
+		ret = logstruct_zero(client->logstruct, a, len);
+	}
+	if(!ret && ((client->server->flags & F_SYNC) || fua))
+		ret = logstruct_flush(client->logstruct);
+	return ret;
+}
+
+/**
+ * Zero a range of a deduplicated export. Blocks of zeroes are unmapped
+ * rather than stored, so this never takes space, whether or not we may
+ * deallocate.
+ **/
+static int dedup_writezeroes(off_t a, size_t len, CLIENT *client, int fua) {
+	size_t cur;
+
+	while(len > 0) {
+		cur = len > ZEROBUFSIZE ? ZEROBUFSIZE : len;
+		if(dedup_write(client->dedup, a, zeroes, cur))
+			return -1;
+		a += cur;
+		len -= cur;
+	}
+	if((client->server->flags & F_SYNC) || fua)
+		return dedup_flush(client->dedup);
+	return 0;
+}
+
+/**
+ * Zero a range of the underlying files, without the copy-on-write layer.
+ * Full tree file pages are deleted when we may deallocate them; they read
+ * back as zeroes after that.
+ **/
+static int rawexpwritezeroes(off_t a, size_t len, CLIENT *client, int fua, bool may_trim) {
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	size_t cur;
+	struct stat st;
+	int ret = 0;
+
+	if(client->server->flags & F_LOGSTRUCT)
+		return logstruct_writezeroes(a, len, client, fua, may_trim);
+	if(client->dedup)
+		return dedup_writezeroes(a, len, client, fua);
+
+	while(len > 0 && !ret) {
+		if((client->server->flags & F_TREEFILES) && may_trim &&
+		   a % TREEPAGESIZE == 0 && len >= TREEPAGESIZE) {
+			delete_treefile(client->exportname, client->exportsize, a);
+			a += TREEPAGESIZE;
+			len -= TREEPAGESIZE;
+			continue;
+		}
+		if(get_filepos(client, a, &fhandle, &foffset, &maxbytes))
+			return -1;
+		cur = (maxbytes && len > maxbytes) ? maxbytes : len;
+		DEBUG("(ZERO fd %d offset %llu len %u), ", fhandle, (long long unsigned)foffset, (unsigned int)cur);
+		if(client->server->flags & F_TREEFILES) {
+			/* a tree file that was just created is still empty */
+			if(!fstat(fhandle, &st) && st.st_size < TREEPAGESIZE)
+				ret = ftruncate(fhandle, TREEPAGESIZE);
+		}
+		if(!ret && zero_range(fhandle, foffset, cur, may_trim))
+			ret = write_zeroes(fhandle, foffset, cur);
+		if(client->server->flags & F_SYNC)
+			fsync(fhandle);
+		else if(fua)
+			fdatasync(fhandle);
+		if(client->server->flags & F_TREEFILES)
+			close(fhandle);
+		a += cur;
+		len -= cur;
+	}
+	return ret;
+}
+
+/**
+ * Zero a range of an export with checksums. Whole blocks get the
+ * checksum of a block of zeroes; blocks that are only partly in the
+ * range are read back.
+ *
+ * @see checkedexpwrite
+ **/
+static int checkedexpwritezeroes(off_t a, size_t len, CLIENT *client, int fua, bool may_trim) {
+	struct checksums* c = client->checksums;
+	char block[CHECKSUM_BLOCKSIZE];
+	uint64_t b, last;
+	off_t start;
+	size_t blen;
+	int ret;
+
+	if (!len)
+		return 0;
+	checksum_lock(c, a, len, true);
+	ret = rawexpwritezeroes(a, len, client, fua, may_trim);
+	last = (a + len - 1) / CHECKSUM_BLOCKSIZE;
+	for (b = a / CHECKSUM_BLOCKSIZE; b <= last; b++) {
+		start = b * CHECKSUM_BLOCKSIZE;
+		blen = checksum_blocklen(c, b);
+		if (ret) {
+			checksum_forget(c, start, blen);
+		} else if (start >= a && start + blen <= a + len) {
+			checksum_zero(c, b);
+		} else if (rawexpread_fully(start, block, blen, client)) {
+			checksum_forget(c, start, blen);
+		} else {
+			checksum_update(c, b, block);
+		}
+	}
+	checksum_unlock(c, a, len, true);
+	return ret;
+}
+
+/**
+ * Write zeroes to a range of the export, avoiding to actually write them
+ * where we can. This is the WRITE_ZEROES counterpart of cowexpwrite().
+ *
+ * @param a The offset where the range starts
+ * @param len The length of the range
+ * @param client The client we're going to write for.
+ * @param fua Flag to indicate 'Force Unit Access'
+ * @param may_trim Whether the range may be deallocated
+ * @return 0 on success, nonzero on failure
+ **/
+static int cowexpwritezeroes(off_t a, size_t len, CLIENT *client, int fua, bool may_trim) {
+	off_t mapcnt,mapl,maph;
+	off_t pagestart;
+	off_t offset;
+	off_t zlen;
+	off_t difflen;
+	off_t known = 0;
+	off_t pos;
+	struct stat st;
+	u32 page;
+	int ret;
+
+	if (!(client->server->flags & F_COPYONWRITE)) {
+		if (client->checksums)
+			return checkedexpwritezeroes(a, len, client, fua, may_trim);
+		return rawexpwritezeroes(a, len, client, fua, may_trim);
+	}
+	if (!len)
+		return 0;
+	DEBUG("Asked to zero %u bytes at %llu.\n", (unsigned int)len, (unsigned long long)a);
+
+	mapl=a/DIFFPAGESIZE ; maph=(a+len-1)/DIFFPAGESIZE ;
+
+	for (mapcnt=mapl;mapcnt<=maph;mapcnt++) {
+		pagestart=mapcnt*DIFFPAGESIZE ;
+		offset=a-pagestart ;
+		zlen=(0<DIFFPAGESIZE-offset && len<(size_t)(DIFFPAGESIZE-offset)) ?
+			len : (size_t)DIFFPAGESIZE-offset;
+
+		if (zlen < DIFFPAGESIZE) { /* partial page, take the normal road */
+			if (expwrite(a, zeroes, zlen, client, 0))
+				return -1;
+			len-=zlen ; a+=zlen ;
+			continue;
+		}
+		page = diffpage(client, mapcnt);
+		if (page == (u32)(-1)) {
+			pthread_mutex_lock(&client->difflock);
+			page = diffpage(client, mapcnt);
+			if (page == (u32)(-1)) { /* the block is not there */
+				/* Pages that were never written to read back
+				 * as zeroes, as long as the file reaches
+				 * them, so claiming one is all we need to
+				 * do. The file is grown with the lock held,
+				 * so as not to cut off a page that another
+				 * thread just wrote past the end, and far
+				 * enough for the pages of the rest of the
+				 * range too, so that it is grown only once. */
+				page=(client->server->flags&F_SPARSE)?mapcnt:client->difffilelen++;
+				DEBUG("Page %llu is not here, we put it at %lu\n",
+				       (unsigned long long)mapcnt,
+				       (unsigned long)page);
+				difflen = (off_t)(page+1+(maph-mapcnt))*DIFFPAGESIZE;
+				ret = 0;
+				if (difflen > known) {
+					if (!(ret = fstat(client->difffile, &st)))
+						known = st.st_size;
+				}
+				if (!ret && difflen > known) {
+					ret = ftruncate(client->difffile, difflen);
+					known = difflen;
+				}
+				if (!ret)
+					__atomic_store_n(&client->difmap[mapcnt], page, __ATOMIC_RELEASE);
+				pthread_mutex_unlock(&client->difflock);
+				if (ret)
+					return -1;
+				len-=zlen ; a+=zlen ;
+				continue;
+			}
+			pthread_mutex_unlock(&client->difflock);
+		}
+		/* the block is already there */
+		pos = (off_t)page*DIFFPAGESIZE;
+		if (zero_range(client->difffile, pos, DIFFPAGESIZE, true) &&
+		    write_zeroes(client->difffile, pos, DIFFPAGESIZE))
+			return -1;
+		len-=zlen ; a+=zlen ;
+	}
+	if (client->server->flags & F_SYNC) {
+		fsync(client->difffile);
+	} else if (fua) {
+		fdatasync(client->difffile);
+	}
+	return 0;
+}
+
+/**
+ * Write zeroes to a range of the export. On an encrypted export, only
+ * whole sectors of zeroes on disk read back as zeroes, so, as with
+ * expwrite(), a range that doesn't start and end on a sector boundary
+ * fails with EINVAL.
+ *
+ * @see cowexpwritezeroes
+ **/
+int expwritezeroes(off_t a, size_t len, CLIENT *client, int fua, bool may_trim) {
+	if (client->cipher && (a % CIPHER_SECTORSIZE || len % CIPHER_SECTORSIZE)) {
+		errno = EINVAL;
+		return -1;
+	}
+	return cowexpwritezeroes(a, len, client, fua, may_trim);
+}
+
+/**
+ * Write an amount of bytes to the export. With detectzeroes, aligned
+ * blocks of zeroes in the buffer are written as write zeroes requests
+ * that may deallocate them, so that zeroes written by clients keep a thin
+ * export thin. The blocks are compared with memcmp(), which is
+ * vectorized and stops at the first byte that isn't zero.
+ *
+ * @see expwrite
+ **/
+static int sparseexpwrite(off_t a, char *buf, size_t len, CLIENT *client, int fua) {
+	size_t cur, step;
+
+	if (!(client->server->flags & F_DETECTZEROES))
+		return expwrite(a, buf, len, client, fua);
+	while (len > 0) {
+		/* the data up to the first aligned block of zeroes... */
+		for (cur = 0; cur < len; cur += step) {
+			step = MIN(ZERODETECT_BLOCK - (a + cur) % ZERODETECT_BLOCK, len - cur);
+			if (step == ZERODETECT_BLOCK && !memcmp(buf + cur, zeroes, step))
+				break;
+		}
+		if (cur && expwrite(a, buf, cur, client, fua))
+			return -1;
+		a += cur;
+		buf += cur;
+		len -= cur;
+		/* ...and the blocks of zeroes that follow it */
+		for (cur = 0; cur + ZERODETECT_BLOCK <= len && !memcmp(buf + cur, zeroes, ZERODETECT_BLOCK); cur += ZERODETECT_BLOCK)
+			;
+		if (cur && expwritezeroes(a, cur, client, fua, true))
+			return -1;
+		a += cur;
+		buf += cur;
+		len -= cur;
+	}
+	return 0;
+}
+
+static void send_reply(uint32_t opt, int net, uint32_t reply_type, size_t datasize, void* data) {
+	uint64_t magic = htonll(0x3e889045565a9LL);
+	reply_type = htonl(reply_type);
+	uint32_t datsize = htonl(datasize);
+	opt = htonl(opt);
+	struct iovec v_data[] = {
+		{ &magic, sizeof(magic) },
+		{ &opt, sizeof(opt) },
+		{ &reply_type, sizeof(reply_type) },
+		{ &datsize, sizeof(datsize) },
+		{ data, datasize },
+	};
+	size_t total = sizeof(magic) + sizeof(opt) + sizeof(reply_type) + sizeof(datsize) + datasize;
+	ssize_t sent = writev(net, v_data, 5);
+	if(sent != total) {
+		perror("E: couldn't write enough data:");
+	}
+}
+
+static CLIENT* new_client(SERVER* serve, int net, uint32_t cflags) {
+	CLIENT* client = g_new0(CLIENT, 1);
+
+	client->server = serve;
+	client->exportsize = OFFT_MAX;
+	client->net = net;
+	client->modern = TRUE;
+	client->transactionlogfd = -1;
+	client->clientfeats = cflags;
+	pthread_mutex_init(&(client->lock), NULL);
+	return client;
+}
+
+static CLIENT* handle_export_name(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
+	uint32_t namelen;
+	char* name;
+	int i;
+
+	if (read(net, &namelen, sizeof(namelen)) < 0) {
+		err("Negotiation failed/7: %m");
+		return NULL;
+	}
+	namelen = ntohl(namelen);
+	if(namelen > 0) {
+		name = malloc(namelen+1);
+		name[namelen]=0;
+		if (read(net, name, namelen) < 0) {
+			err("Negotiation failed/8: %m");
 			free(name);
-			return client;
+			return NULL;
+		}
+	} else {
+		name = strdup("");
+	}
+	for(i=0; i<servers->len; i++) {
+		SERVER* serve = &(g_array_index(servers, SERVER, i));
+		if(!strcmp(serve->servename, name)) {
+			free(name);
+			return new_client(serve, net, cflags);
+		}
+	}
+	err("Negotiation failed/8a: Requested export not found");
+	free(name);
+	return NULL;
+}
+
+static void handle_list(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
+	uint32_t len;
+	int i;
+	char buf[1024];
+	char *ptr = buf + sizeof(len);
+
+	if (read(net, &len, sizeof(len)) < 0)
+		err("Negotiation failed/8: %m");
+	len = ntohl(len);
+	if(len) {
+		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
+	}
+	if(!(glob_flags & F_LIST)) {
+		send_reply(opt, net, NBD_REP_ERR_POLICY, 0, NULL);
+		err_nonfatal("Client tried disallowed list option");
+		return;
+	}
+	for(i=0; i<servers->len; i++) {
+		SERVER* serve = &(g_array_index(servers, SERVER, i));
+		len = htonl(strlen(serve->servename));
+		memcpy(buf, &len, sizeof(len));
+		strncpy(ptr, serve->servename, sizeof(buf) - sizeof(len));
+		send_reply(opt, net, NBD_REP_SERVER, strlen(serve->servename)+sizeof(len), buf);
+	}
+	send_reply(opt, net, NBD_REP_ACK, 0, NULL);
+}
+
+static void handle_unknown_option(uint32_t opt, int net) {
+	uint32_t len;
+	char buf[1024];
+
+	if (read(net, &len, sizeof(len)) < 0)
+		err("Negotiation failed/8: %m");
+	len = ntohl(len);
+	consume(net, buf, len, sizeof(buf));
+	send_reply(opt, net, NBD_REP_ERR_UNSUP, 0, NULL);
+}
+
+static void handle_structured_reply(uint32_t opt, int net, bool* structured) {
+	uint32_t len;
+	char buf[1024];
+
+	if (read(net, &len, sizeof(len)) < 0)
+		err("Negotiation failed/8: %m");
+	len = ntohl(len);
+	if(len) {
+		consume(net, buf, len, sizeof(buf));
+		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
+		return;
+	}
+	*structured = true;
+	send_reply(opt, net, NBD_REP_ACK, 0, NULL);
+}
+
+/**
+ * Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT. The only
+ * context we know about is base:allocation, so all we need to find out is
+ * whether the client asked for that one.
+ *
+ * @param metaexport the name of the export for which base:allocation was
+ * selected, or NULL. Updated for NBD_OPT_SET_META_CONTEXT.
+ **/
+static void handle_meta_context(uint32_t opt, int net, GArray* servers, bool structured, gchar** metaexport) {
+	uint32_t len;
+	uint32_t namelen;
+	uint32_t nqueries;
+	uint32_t qlen;
+	char buf[1024];
+	char* data;
+	char* p;
+	char* end;
+	gchar* name = NULL;
+	bool found = false;
+	bool want = false;
+	uint32_t reply = NBD_REP_ERR_INVALID;
+	int i;
+
+	if (read(net, &len, sizeof(len)) < 0)
+		err("Negotiation failed/8: %m");
+	len = ntohl(len);
+	if(len > MAX_OPTLEN) {
+		consume(net, buf, len, sizeof(buf));
+		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
+		return;
+	}
+	data = g_malloc(len + 1);
+	readit(net, data, len);
+	p = data;
+	end = data + len;
+
+	if(opt == NBD_OPT_SET_META_CONTEXT && !structured) {
+		goto out;
+	}
+	if(end - p < sizeof(namelen))
+		goto out;
+	memcpy(&namelen, p, sizeof(namelen));
+	namelen = ntohl(namelen);
+	p += sizeof(namelen);
+	if(end - p < namelen)
+		goto out;
+	name = g_strndup(p, namelen);
+	p += namelen;
+	if(end - p < sizeof(nqueries))
+		goto out;
+	memcpy(&nqueries, p, sizeof(nqueries));
+	nqueries = ntohl(nqueries);
+	p += sizeof(nqueries);
+
+	/* An empty LIST query means "tell me everything" */
+	if(!nqueries && opt == NBD_OPT_LIST_META_CONTEXT)
+		want = true;
+	for(; nqueries > 0; nqueries--) {
+		if(end - p < sizeof(qlen))
+			goto out;
+		memcpy(&qlen, p, sizeof(qlen));
+		qlen = ntohl(qlen);
+		p += sizeof(qlen);
+		if(end - p < qlen)
+			goto out;
+		if(qlen == strlen(NBD_META_BASE_ALLOCATION) && !memcmp(p, NBD_META_BASE_ALLOCATION, qlen))
+			want = true;
+		/* Listing the "base:" namespace includes base:allocation */
+		if(opt == NBD_OPT_LIST_META_CONTEXT && qlen == strlen("base:") && !memcmp(p, "base:", qlen))
+			want = true;
+		p += qlen;
+	}
+	if(p != end)
+		goto out;
+
+	for(i=0; i<servers->len; i++) {
+		SERVER* serve = &(g_array_index(servers, SERVER, i));
+		if(!strcmp(serve->servename, name)) {
+			found = true;
+		}
+	}
+	if(!found) {
+		reply = NBD_REP_ERR_UNKNOWN;
+		goto out;
+	}
+	if(want) {
+		uint32_t id = htonl(NBD_META_ID_BASE_ALLOCATION);
+		memcpy(buf, &id, sizeof(id));
+		memcpy(buf + sizeof(id), NBD_META_BASE_ALLOCATION, strlen(NBD_META_BASE_ALLOCATION));
+		send_reply(opt, net, NBD_REP_META_CONTEXT, sizeof(id) + strlen(NBD_META_BASE_ALLOCATION), buf);
+	}
+	if(opt == NBD_OPT_SET_META_CONTEXT) {
+		g_free(*metaexport);
+		*metaexport = want ? g_strdup(name) : NULL;
+	}
+	reply = NBD_REP_ACK;
+out:
+	send_reply(opt, net, reply, 0, NULL);
+	g_free(name);
+	g_free(data);
+}
+
+/**
+ * Find the transmission flags for an export
+ **/
+static uint16_t export_flags(CLIENT* client) {
+	uint16_t flags = NBD_FLAG_HAS_FLAGS;
+
+	/* Every connection has a write-back cache of its own, so a flush
+	 * on one of them doesn't cover writes made on the others; and a
+	 * writer to an export with checksums has it to itself, as does any
+	 * connection to a log-structured store */
+	if (((!client->server->writecachesize && !client->server->checksumfile) ||
+	     (client->server->flags & F_READONLY)) &&
+	    !(client->server->flags & F_LOGSTRUCT))
+		flags |= NBD_FLAG_CAN_MULTI_CONN;
+	if (client->server->flags & F_READONLY)
+		flags |= NBD_FLAG_READ_ONLY;
+	if (client->server->flags & F_FLUSH)
+		flags |= NBD_FLAG_SEND_FLUSH;
+	if (client->server->flags & F_FUA)
+		flags |= NBD_FLAG_SEND_FUA;
+	if (client->server->flags & F_ROTATIONAL)
+		flags |= NBD_FLAG_ROTATIONAL;
+	if (client->server->flags & F_TRIM)
+		flags |= NBD_FLAG_SEND_TRIM;
+	if (!(client->server->flags & F_READONLY))
+		flags |= NBD_FLAG_SEND_WRITE_ZEROES;
+	flags |= NBD_FLAG_SEND_CACHE;
+	return flags;
+}
+
+/**
+ * Close the files of an export that was opened by setupexport(), and free
+ * the client. Used when a client only asked for information about it.
+ *
+ * @param postrun whether to run the postrun command after closing
+ **/
+static void free_client(CLIENT* client, bool postrun) {
+	int i;
+
+	if(client->export) {
+		for(i = 0; i < client->export->len; i++) {
+			close(g_array_index(client->export, FILE_INFO, i).fhandle);
+		}
+		g_array_free(client->export, TRUE);
+	}
+	if(client->logstruct)
+		logstruct_close(client->logstruct);
+	if(client->dedup)
+		dedup_close(client->dedup);
+#ifdef HAVE_ZLIB
+	if(client->compressed)
+		compressed_close(client->compressed);
+#endif
+#ifdef HAVE_OPENSSL
+	if(client->cipher)
+		cipher_close(client->cipher);
+#endif
+	if(client->checksums)
+		checksum_close(client->checksums);
+	if(postrun)
+		do_run(client->server->postrun, client->exportname);
+	g_free(client->exportname);
+	g_free(client->clientname);
+	g_free(client);
+}
+
+/**
+ * Find the block size clients should preferably use for an export: the
+ * block size of the backing storage, or the page size of copy-on-write,
+ * tree file, log-structured and deduplicated exports, whichever is larger.
+ **/
+static uint32_t preferred_blocksize(CLIENT* client) {
+	uint32_t size = 4096;
+	struct stat st;
+	int fd;
+
+	if(client->server->flags & F_TREEFILES) {
+		size = TREEPAGESIZE;
+	} else if(client->server->flags & F_LOGSTRUCT) {
+		size = LOGSTRUCT_BLOCKSIZE;
+	} else if(client->server->dedupstore) {
+		size = DEDUP_BLOCKSIZE;
+	} else if(client->server->flags & F_COMPRESSED) {
+		/* Compressed chunks are usually larger than what clients
+		 * can use; the cache of decompressed chunks makes up for it */
+		size = 4096;
+	} else if(client->export && client->export->len) {
+		fd = g_array_index(client->export, FILE_INFO, 0).fhandle;
+		if(!fstat(fd, &st)) {
+			if(st.st_blksize > size)
+				size = st.st_blksize;
+#ifdef BLKPBSZGET
+			if(S_ISBLK(st.st_mode)) {
+				unsigned int pbsz;
+				if(!ioctl(fd, BLKPBSZGET, &pbsz) && pbsz > size)
+					size = pbsz;
+			}
+#endif
+		}
+	}
+	if((client->server->flags & F_COPYONWRITE) && size < DIFFPAGESIZE)
+		size = DIFFPAGESIZE;
+	/* The protocol wants a power of two */
+	if(size & (size - 1) || size > MAX_BLOCKSIZE)
+		size = 4096;
+	return size;
+}
+
+/**
+ * The smaller of two limits, either of which may be 0 for no limit
+ **/
+static uint64_t min_limit(uint64_t a, uint64_t b) {
+	if(!a || (b && b < a))
+		return b;
+	return a;
+}
+
+/**
+ * Find the largest request a connection to an export takes: the most we
+ * tell clients, or less if its in-flight byte budget is smaller, since a
+ * larger request would have to wait for everything else to be answered,
+ * and then still make us allocate more than the budget. Larger requests
+ * are refused before anything is allocated for them.
+ **/
+static uint32_t max_request(SERVER* serve) {
+	uint64_t max = min_limit(MAX_BLOCKSIZE, min_limit(serve->maxinflightbytes, maxinflightbytes));
+	uint32_t min = serve->encryptionkey ? CIPHER_SECTORSIZE : 1;
+
+	/* The protocol wants a multiple of the minimum block size */
+	max -= max % min;
+	return MAX(max, min);
+}
+
+/**
+ * Find the size of an export, and whether it is read-only, to answer
+ * NBD_OPT_INFO. Unlike setupexport(), this runs no prerun command, takes
+ * no locks and creates nothing, so that a client can ask about an export
+ * without disturbing the connections that use it.
+ *
+ * @return 0 on success, or -1 if the export can't be opened
+ **/
+static int probe_export(CLIENT* client) {
+	SERVER* server = client->server;
+	bool multifile = server->flags & F_MULTIFILE;
+	uint64_t size = server->expected_size;
+	struct handles* h;
+
+	if((server->flags & (F_TREEFILES | F_LOGSTRUCT)) || server->dedupstore ||
+	   ((server->flags & F_TEMPORARY) && !multifile)) {
+		/* The size comes from the configuration */
+#ifdef HAVE_ZLIB
+	} else if(server->flags & F_COMPRESSED) {
+		client->compressed = compressed_open(client->exportname, server->compressedcache);
+		if(!client->compressed)
+			return -1;
+		size = compressed_size(client->compressed);
+#endif
+	} else if(server->handles && (client->export = handles_dup(server->handles))) {
+		size = handles_size(server->handles);
+	} else if((h = handles_open(client->exportname, multifile, !(server->flags & F_READONLY)))) {
+		if(handles_readonly(h) && !(server->flags & F_COPYONWRITE))
+			server->flags |= F_AUTOREADONLY | F_READONLY;
+		size = handles_size(h);
+		client->export = handles_dup(h);
+		handles_close(h);
+	} else if(errno != ENOENT || !server->expected_size || multifile) {
+		return -1;
+	}
+	/* setupexport() creates a missing file of the expected size */
+	if(server->expected_size) {
+		if(server->expected_size > size && (client->export || client->compressed))
+			return -1;
+		size = server->expected_size;
+	}
+	if(server->encryptionkey)
+		size -= size % CIPHER_SECTORSIZE;
+	client->exportsize = size;
+	return 0;
+}
+
+/**
+ * Handle NBD_OPT_INFO and NBD_OPT_GO. Both tell the client about the
+ * export; the latter also selects it. For NBD_OPT_GO, we need to open the
+ * export anyway, so we do everything here that would otherwise only be
+ * done after NBD_OPT_EXPORT_NAME; for NBD_OPT_INFO, we only look at it.
+ *
+ * @return the client for the selected export, if opt is NBD_OPT_GO and
+ * the client may use it; NULL otherwise.
+ **/
+static CLIENT* handle_info(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
+	uint32_t len;
+	uint32_t namelen;
+	uint16_t nreqs;
+	uint16_t req;
+	char buf[1024];
+	char* data;
+	char* p;
+	char* end;
+	gchar* name = NULL;
+	CLIENT* client = NULL;
+	bool want_blocksize = false;
+	bool exportopen = false;
+	uint32_t reply = NBD_REP_ERR_INVALID;
+	int i;
+	struct {
+		uint16_t type;
+		uint64_t size;
+		uint16_t flags;
+	} __attribute__ ((packed)) info_export;
+	struct {
+		uint16_t type;
+		uint32_t min;
+		uint32_t pref;
+		uint32_t max;
+	} __attribute__ ((packed)) info_bs;
+	uint32_t prefbs, maxbs;
+
+	if (read(net, &len, sizeof(len)) < 0)
+		err("Negotiation failed/8: %m");
+	len = ntohl(len);
+	if(len > MAX_OPTLEN) {
+		consume(net, buf, len, sizeof(buf));
+		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
+		return NULL;
+	}
+	data = g_malloc(len + 1);
+	readit(net, data, len);
+	p = data;
+	end = data + len;
+
+	if(end - p < sizeof(namelen))
+		goto out;
+	memcpy(&namelen, p, sizeof(namelen));
+	namelen = ntohl(namelen);
+	p += sizeof(namelen);
+	if(end - p < namelen)
+		goto out;
+	name = g_strndup(p, namelen);
+	p += namelen;
+	if(end - p < sizeof(nreqs))
+		goto out;
+	memcpy(&nreqs, p, sizeof(nreqs));
+	nreqs = ntohs(nreqs);
+	p += sizeof(nreqs);
+	if(end - p != nreqs * sizeof(req))
+		goto out;
+	for(i = 0; i < nreqs; i++) {
+		memcpy(&req, p + i * sizeof(req), sizeof(req));
+		if(ntohs(req) == NBD_INFO_BLOCK_SIZE)
+			want_blocksize = true;
+	}
+
+	reply = NBD_REP_ERR_UNKNOWN;
+	for(i=0; i<servers->len; i++) {
+		SERVER* serve = &(g_array_index(servers, SERVER, i));
+		if(!strcmp(serve->servename, name)) {
+			client = new_client(serve, net, cflags);
+			break;
+		}
+	}
+	if(!client)
+		goto out;
+	if(set_peername(net, client)) {
+		err("Negotiation failed/8b: could not find peer name");
+	}
+	if(!authorized_client(client)) {
+		msg(LOG_INFO, "Client '%s' is not authorized to access",
+		    client->clientname);
+		reply = NBD_REP_ERR_POLICY;
+		goto out;
+	}
+	if(opt == NBD_OPT_INFO) {
+		if(probe_export(client)) {
+			msg(LOG_INFO, "Could not open export %s: %m", client->exportname);
+			goto out;
+		}
+	} else {
+		if(connection_limit_reached(client->server)) {
+			reply = NBD_REP_ERR_POLICY;
+			goto out;
+		}
+		if(do_run(client->server->prerun, client->exportname)) {
+			goto out;
+		}
+		exportopen = true;
+		if(setupexport(client)) {
+			msg(LOG_INFO, "Could not open export %s: %m", client->exportname);
+			goto out;
 		}
 	}
-	err("Negotiation failed/8a: Requested export not found");
-	free(name);
-	return NULL;
-}
-
-static void handle_list(uint32_t opt, int net, GArray* servers, uint32_t cflags) {
-	uint32_t len;
-	int i;
-	char buf[1024];
-	char *ptr = buf + sizeof(len);
 
-	if (read(net, &len, sizeof(len)) < 0)
-		err("Negotiation failed/8: %m");
-	len = ntohl(len);
-	if(len) {
-		send_reply(opt, net, NBD_REP_ERR_INVALID, 0, NULL);
-	}
-	if(!(glob_flags & F_LIST)) {
-		send_reply(opt, net, NBD_REP_ERR_POLICY, 0, NULL);
-		err_nonfatal("Client tried disallowed list option");
-		return;
+	info_export.type = htons(NBD_INFO_EXPORT);
+	info_export.size = htonll(client->exportsize);
+	info_export.flags = htons(export_flags(client));
+	send_reply(opt, net, NBD_REP_INFO, sizeof(info_export), &info_export);
+
+	if(want_blocksize) {
+		info_bs.type = htons(NBD_INFO_BLOCK_SIZE);
+		info_bs.min = htonl(client->server->encryptionkey ? CIPHER_SECTORSIZE : 1);
+		/* The preferred size mustn't be larger than the largest */
+		maxbs = max_request(client->server);
+		for(prefbs = preferred_blocksize(client); prefbs > maxbs; prefbs /= 2);
+		info_bs.pref = htonl(prefbs);
+		info_bs.max = htonl(maxbs);
+		send_reply(opt, net, NBD_REP_INFO, sizeof(info_bs), &info_bs);
 	}
-	for(i=0; i<servers->len; i++) {
-		SERVER* serve = &(g_array_index(servers, SERVER, i));
-		len = htonl(strlen(serve->servename));
-		memcpy(buf, &len, sizeof(len));
-		strncpy(ptr, serve->servename, sizeof(buf) - sizeof(len));
-		send_reply(opt, net, NBD_REP_SERVER, strlen(serve->servename)+sizeof(len), buf);
+	reply = NBD_REP_ACK;
+out:
+	send_reply(opt, net, reply, 0, NULL);
+	g_free(name);
+	g_free(data);
+	if(client && (opt != NBD_OPT_GO || reply != NBD_REP_ACK)) {
+		free_client(client, exportopen);
+		client = NULL;
 	}
-	send_reply(opt, net, NBD_REP_ACK, 0, NULL);
+	if(client)
+		client->go = TRUE;
+	return client;
 }
 
 /**
@@ -1443,6 +3058,9 @@ CLIENT* negotiate(int net, GArray* servers) {
 	uint64_t magic;
 	uint32_t cflags = 0;
 	uint32_t opt;
+	CLIENT* client;
+	bool structured = false;
+	gchar* metaexport = NULL;
 
 	assert(servers != NULL);
 	if (write(net, INIT_PASSWD, 8) < 0)
@@ -1476,19 +3094,43 @@ CLIENT* negotiate(int net, GArray* servers) {
 			// NBD_OPT_EXPORT_NAME must be the last
 			// selected option, so return from here
 			// if that is chosen.
-			return handle_export_name(opt, net, servers, cflags);
+			client = handle_export_name(opt, net, servers, cflags);
+			if(client) {
+				client->structured = structured;
+				client->alloc_ctx = metaexport && !strcmp(metaexport, client->server->servename);
+			}
+			g_free(metaexport);
+			return client;
 			break;
 		case NBD_OPT_LIST:
 			handle_list(opt, net, servers, cflags);
 			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			client = handle_info(opt, net, servers, cflags);
+			if(client) {
+				client->structured = structured;
+				client->alloc_ctx = metaexport && !strcmp(metaexport, client->server->servename);
+				g_free(metaexport);
+				return client;
+			}
+			break;
+		case NBD_OPT_STRUCTURED_REPLY:
+			handle_structured_reply(opt, net, &structured);
+			break;
+		case NBD_OPT_LIST_META_CONTEXT:
+		case NBD_OPT_SET_META_CONTEXT:
+			handle_meta_context(opt, net, servers, structured, &metaexport);
+			break;
 		case NBD_OPT_ABORT:
 			// handled below
 			break;
 		default:
-			send_reply(opt, net, NBD_REP_ERR_UNSUP, 0, NULL);
+			handle_unknown_option(opt, net);
 			break;
 		}
 	} while((opt != NBD_OPT_EXPORT_NAME) && (opt != NBD_OPT_ABORT));
+	g_free(metaexport);
 	if(opt == NBD_OPT_ABORT) {
 		err_nonfatal("Session terminated by client");
 		return NULL;
@@ -1499,21 +3141,10 @@ CLIENT* negotiate(int net, GArray* servers) {
 
 void send_export_info(CLIENT* client) {
 	uint64_t size_host = htonll((u64)(client->exportsize));
-	uint16_t flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_CAN_MULTI_CONN;
+	uint16_t flags = htons(export_flags(client));
 
 	if (write(client->net, &size_host, 8) < 0)
 		err("Negotiation failed/9: %m");
-	if (client->server->flags & F_READONLY)
-		flags |= NBD_FLAG_READ_ONLY;
-	if (client->server->flags & F_FLUSH)
-		flags |= NBD_FLAG_SEND_FLUSH;
-	if (client->server->flags & F_FUA)
-		flags |= NBD_FLAG_SEND_FUA;
-	if (client->server->flags & F_ROTATIONAL)
-		flags |= NBD_FLAG_ROTATIONAL;
-	if (client->server->flags & F_TRIM)
-		flags |= NBD_FLAG_SEND_TRIM;
-	flags = htons(flags);
 	if (write(client->net, &flags, sizeof(flags)) < 0)
 		err("Negotiation failed/11: %m");
 	if (!(glob_flags & F_NO_ZEROES)) {
@@ -1546,6 +3177,8 @@ static int nbd_errno(int errcode) {
 }
 
 static void package_dispose(struct work_package* package) {
+	if (package->inflight >= 0)
+		inflight_release(package->client->inflight, package->inflight);
 	if (package->pipefd[0] > 0)
 		close(package->pipefd[0]);
 	if (package->pipefd[1] > 0)
@@ -1583,6 +3216,7 @@ struct work_package* package_create(CLIENT* client, struct nbd_request* req) {
 	rv->data = NULL;
 	rv->pipefd[0] = -1;
 	rv->pipefd[1] = -1;
+	rv->inflight = -1;
 
 	if((req->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
 		if (client->server->flags & F_SPLICE) {
@@ -1602,10 +3236,75 @@ static void setup_reply(struct nbd_reply* rep, struct nbd_request* req) {
 	memcpy(&(rep->handle), &(req->handle), sizeof(req->handle));
 }
 
+/**
+ * Send the header of a structured reply chunk, followed by the first
+ * (small) part of its payload. The caller must hold the client lock, and
+ * write the rest of the payload afterwards.
+ *
+ * @param length the total length of the payload, including prefix
+ * @param prefix the start of the payload, at most 16 bytes
+ **/
+static void send_structured_header(CLIENT* client, struct nbd_request* req, uint16_t flags, uint16_t type, uint32_t length, void* prefix, size_t prefixlen) {
+	char buf[sizeof(struct nbd_structured_reply) + 16];
+	struct nbd_structured_reply hdr;
+
+	assert(prefixlen <= 16);
+	hdr.magic = htonl(NBD_STRUCTURED_REPLY_MAGIC);
+	hdr.flags = htons(flags);
+	hdr.type = htons(type);
+	memcpy(&(hdr.handle), &(req->handle), sizeof(req->handle));
+	hdr.length = htonl(length);
+	memcpy(buf, &hdr, sizeof(hdr));
+	if(prefixlen)
+		memcpy(buf + sizeof(hdr), prefix, prefixlen);
+	writeit(client->net, buf, sizeof(hdr) + prefixlen);
+}
+
+/**
+ * Send an error reply for a request; a structured one if the client
+ * negotiated structured replies, since a read must never get a simple
+ * reply in that case.
+ **/
+static void send_error_reply(CLIENT* client, struct nbd_request* req, int errcode) {
+	struct nbd_reply rep;
+	struct {
+		uint32_t error;
+		uint16_t msglen;
+	} __attribute__ ((packed)) payload;
+
+	pthread_mutex_lock(&(client->lock));
+	if(client->structured) {
+		payload.error = nbd_errno(errcode);
+		payload.msglen = 0;
+		send_structured_header(client, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, sizeof(payload), &payload, sizeof(payload));
+	} else {
+		setup_reply(&rep, req);
+		rep.error = nbd_errno(errcode);
+		writeit(client->net, &rep, sizeof rep);
+	}
+	pthread_mutex_unlock(&(client->lock));
+}
+
+/**
+ * Send the header of a successful read reply; the data should follow. The
+ * caller must hold the client lock.
+ **/
+static void send_read_header(CLIENT* client, struct nbd_request* req) {
+	struct nbd_reply rep;
+	uint64_t offset;
+
+	if(client->structured) {
+		offset = htonll(req->from);
+		send_structured_header(client, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_OFFSET_DATA, sizeof(offset) + req->len, &offset, sizeof(offset));
+	} else {
+		setup_reply(&rep, req);
+		writeit(client->net, &rep, sizeof(rep));
+	}
+}
+
 #ifdef HAVE_SPLICE
 static int handle_splice_read(CLIENT *client, struct nbd_request *req)
 {
-	struct nbd_reply rep;
 	int pipefd[2];
 	int max_pipe_size = 1 * 1024 * 1024;
 	int pipe_size;
@@ -1620,9 +3319,8 @@ static int handle_splice_read(CLIENT *client, struct nbd_request *req)
 	}
 
 	DEBUG("handling read request (splice)\n");
-	setup_reply(&rep, req);
 	pthread_mutex_lock(&(client->lock));
-	writeit(client->net, &rep, sizeof(rep));
+	send_read_header(client, req);
 	spliceit(pipefd[0], NULL, client->net, NULL, req->len);
 	pthread_mutex_unlock(&(client->lock));
 	close(pipefd[0]);
@@ -1633,28 +3331,33 @@ static int handle_splice_read(CLIENT *client, struct nbd_request *req)
 
 static void handle_normal_read(CLIENT *client, struct nbd_request *req)
 {
-	struct nbd_reply rep;
 	void* buf = malloc(req->len);
 	if(!buf) {
 		err("Could not allocate memory for request");
 	}
 	DEBUG("handling read request\n");
-	setup_reply(&rep, req);
-	if(expread(req->from, buf, req->len, client)) {
+	if(client->writecache ?
+	   writecache_read(client->writecache, req->from, buf, req->len, writecache_expread) :
+	   expread(req->from, buf, req->len, client)) {
 		DEBUG("Read failed: %m");
-		rep.error = nbd_errno(errno);
+		send_error_reply(client, req, errno);
+		free(buf);
+		return;
 	}
 	pthread_mutex_lock(&(client->lock));
-	writeit(client->net, &rep, sizeof rep);
-	if(!rep.error) {
-		writeit(client->net, buf, req->len);
-	}
+	send_read_header(client, req);
+	writeit(client->net, buf, req->len);
 	pthread_mutex_unlock(&(client->lock));
 	free(buf);
 }
 
 static void handle_read(CLIENT* client, struct nbd_request* req)
 {
+	/* The length of a structured read reply must fit in 32 bits */
+	if(client->structured && req->len > UINT32_MAX - sizeof(uint64_t)) {
+		send_error_reply(client, req, EINVAL);
+		return;
+	}
 #ifdef HAVE_SPLICE
 	/*
 	 * If we have splice set we want to try that first, and if that fails
@@ -1689,8 +3392,13 @@ static void handle_write(struct work_package *pkg)
 			rep.error = nbd_errno(errno);
 		}
 #endif
+	} else if (client->writecache) {
+		if(writecache_write(client->writecache, req->from, pkg->data, req->len, fua)) {
+			DEBUG("Write failed: %m");
+			rep.error = nbd_errno(errno);
+		}
 	} else {
-		if(expwrite(req->from, pkg->data, req->len, client, fua)) {
+		if(sparseexpwrite(req->from, pkg->data, req->len, client, fua)) {
 			DEBUG("Write failed: %m");
 			rep.error = nbd_errno(errno);
 		}
@@ -1704,7 +3412,7 @@ static void handle_flush(CLIENT* client, struct nbd_request* req) {
 	struct nbd_reply rep;
 	DEBUG("handling flush request\n");
 	setup_reply(&rep, req);
-	if(expflush(client)) {
+	if(client->writecache ? writecache_flush(client->writecache) : expflush(client)) {
 		DEBUG("Flush failed: %m");
 		rep.error = nbd_errno(errno);
 	}
@@ -1717,7 +3425,10 @@ static void handle_trim(CLIENT* client, struct nbd_request* req) {
 	struct nbd_reply rep;
 	DEBUG("handling trim request\n");
 	setup_reply(&rep, req);
-	if(exptrim(req, client)) {
+	if(client->writecache && writecache_sync(client->writecache)) {
+		DEBUG("Write back failed: %m");
+		rep.error = nbd_errno(errno);
+	} else if(exptrim(req, client)) {
 		DEBUG("Trim failed: %m");
 		rep.error = nbd_errno(errno);
 	}
@@ -1726,13 +3437,300 @@ static void handle_trim(CLIENT* client, struct nbd_request* req) {
 	pthread_mutex_unlock(&(client->lock));
 }
 
-static void handle_request(gpointer data, gpointer user_data) {
+static void handle_cache(CLIENT* client, struct nbd_request* req) {
+	struct nbd_reply rep;
+	struct nbd_request* range;
+	uint64_t pending;
+
+	DEBUG("handling cache request\n");
+	setup_reply(&rep, req);
+	if (req->from + req->len > client->exportsize) {
+		rep.error = nbd_errno(EINVAL);
+	} else {
+		/* Caching is only a hint, so if too much is queued
+		 * already, we only do part of it, or nothing at all */
+		pending = g_atomic_int_get(&client->cachepending);
+		if (pending < MAX_CACHE_PENDING && req->len > 0) {
+			range = malloc(sizeof(struct nbd_request));
+			memcpy(range, req, sizeof(struct nbd_request));
+			if (range->len > MAX_CACHE_PENDING - pending)
+				range->len = MAX_CACHE_PENDING - pending;
+			g_atomic_int_add(&client->cachepending, range->len);
+			g_async_queue_push(client->cachequeue, range);
+		} else {
+			DEBUG("Too much prefetching queued, ignoring cache request");
+		}
+	}
+	pthread_mutex_lock(&(client->lock));
+	writeit(client->net, &rep, sizeof rep);
+	pthread_mutex_unlock(&(client->lock));
+}
+
+static void handle_write_zeroes(CLIENT* client, struct nbd_request* req) {
+	struct nbd_reply rep;
+	int fua = req->type & NBD_CMD_FLAG_FUA;
+	/* Only deallocate if the admin allows trimming, and the client
+	 * didn't ask us not to */
+	bool may_trim = (client->server->flags & F_TRIM) &&
+		!(req->type & NBD_CMD_FLAG_NO_HOLE);
+
+	DEBUG("handling write zeroes request\n");
+	setup_reply(&rep, req);
+	if ((client->server->flags & F_READONLY) ||
+	    (client->server->flags & F_AUTOREADONLY)) {
+		DEBUG("[WRITE_ZEROES to READONLY!]");
+		rep.error = nbd_errno(EPERM);
+	} else if (req->from + req->len > client->exportsize) {
+		rep.error = nbd_errno(ENOSPC);
+	} else if (client->writecache && writecache_sync(client->writecache)) {
+		DEBUG("Write back failed: %m");
+		rep.error = nbd_errno(errno);
+	} else if (expwritezeroes(req->from, req->len, client, fua, may_trim)) {
+		DEBUG("Write zeroes failed: %m");
+		rep.error = nbd_errno(errno);
+	}
+	pthread_mutex_lock(&(client->lock));
+	writeit(client->net, &rep, sizeof rep);
+	pthread_mutex_unlock(&(client->lock));
+}
+
+static void handle_block_status(CLIENT* client, struct nbd_request* req) {
+	GArray* extents;
+	uint32_t id = htonl(NBD_META_ID_BASE_ALLOCATION);
+	int i;
+
+	DEBUG("handling block status request\n");
+	if(!client->alloc_ctx) {
+		send_error_reply(client, req, EINVAL);
+		return;
+	}
+	/* Dirty data may fill what is still a hole in the file */
+	if(client->writecache && writecache_sync(client->writecache)) {
+		send_error_reply(client, req, errno);
+		return;
+	}
+	extents = expblockstatus(client, req->from, req->len,
+			(req->type & NBD_CMD_FLAG_REQ_ONE) ? 1 : MAX_EXTENTS);
+	if(!extents) {
+		DEBUG("Block status failed: %m");
+		send_error_reply(client, req, errno);
+		return;
+	}
+	for(i = 0; i < extents->len; i++) {
+		struct nbd_block_descriptor* ext = &g_array_index(extents, struct nbd_block_descriptor, i);
+		ext->length = htonl(ext->length);
+		ext->status_flags = htonl(ext->status_flags);
+	}
+	pthread_mutex_lock(&(client->lock));
+	send_structured_header(client, req, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+			sizeof(id) + extents->len * sizeof(struct nbd_block_descriptor), &id, sizeof(id));
+	writeit(client->net, extents->data, extents->len * sizeof(struct nbd_block_descriptor));
+	pthread_mutex_unlock(&(client->lock));
+	g_array_free(extents, TRUE);
+}
+
+/**
+ * Merge a queued request into the one a worker is about to handle, if it
+ * is a read or write of the same kind that starts or ends where the
+ * requests merged so far end or start. This is called by the scheduler
+ * with its lock held, so it must not do more than look at the requests.
+ **/
+static bool merge_package(void* data, void* other) {
+	struct work_package* pkg = data;
+	struct work_package* o = other;
+	CLIENT* client = pkg->client;
+	SERVER* server = client->server;
+	uint32_t type = pkg->req->type & NBD_CMD_MASK_COMMAND;
+
+	if(server->maxmerge <= 0 || o->client != client || pkg->split || o->split ||
+	   (o->req->type & NBD_CMD_MASK_COMMAND) != type ||
+	   !pkg->req->len || !o->req->len ||
+	   o->req->from + o->req->len > client->exportsize)
+		return false;
+	switch(type) {
+		case NBD_CMD_READ:
+			if(pkg->req->type != type || o->req->type != type)
+				return false;
+			break;
+		case NBD_CMD_WRITE:
+			if((pkg->req->type | o->req->type) & ~(NBD_CMD_MASK_COMMAND | NBD_CMD_FLAG_FUA) ||
+			   !pkg->data || !o->data ||
+			   (server->flags & (F_READONLY | F_AUTOREADONLY)))
+				return false;
+			break;
+		default:
+			return false;
+	}
+	if(!pkg->merged) {
+		if(pkg->req->from + pkg->req->len > client->exportsize)
+			return false;
+		pkg->mergefrom = pkg->req->from;
+		pkg->mergelen = pkg->req->len;
+	}
+	if(pkg->mergelen + o->req->len > server->maxmerge)
+		return false;
+	if(o->req->from + o->req->len == pkg->mergefrom)
+		pkg->mergefrom = o->req->from;
+	else if(o->req->from != pkg->mergefrom + pkg->mergelen)
+		return false;
+	pkg->mergelen += o->req->len;
+	o->merged = pkg->merged;
+	pkg->merged = o;
+	return true;
+}
+
+/**
+ * Handle requests that were merged, with a single read or write of the
+ * range they cover together, and send a reply to every one of them.
+ **/
+static void handle_merged(struct work_package* pkg) {
+	CLIENT* client = pkg->client;
+	struct work_package* p;
+	struct nbd_reply rep;
+	char* buf = malloc(pkg->mergelen);
+	int fua = 0;
+	int error = 0;
+
+	if(!buf) {
+		err("Could not allocate memory for request");
+	}
+	DEBUG("handling merged requests\n");
+	if((pkg->req->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) {
+		if(client->writecache ?
+		   writecache_read(client->writecache, pkg->mergefrom, buf, pkg->mergelen, writecache_expread) :
+		   expread(pkg->mergefrom, buf, pkg->mergelen, client)) {
+			error = errno;
+			DEBUG("Read failed: %m");
+		}
+		for(p = pkg; p; p = p->merged) {
+			if(error) {
+				send_error_reply(client, p->req, error);
+				continue;
+			}
+			pthread_mutex_lock(&(client->lock));
+			send_read_header(client, p->req);
+			writeit(client->net, buf + (p->req->from - pkg->mergefrom), p->req->len);
+			pthread_mutex_unlock(&(client->lock));
+		}
+	} else {
+		for(p = pkg; p; p = p->merged) {
+			memcpy(buf + (p->req->from - pkg->mergefrom), p->data, p->req->len);
+			fua |= p->req->type & NBD_CMD_FLAG_FUA;
+		}
+		if(client->writecache ?
+		   writecache_write(client->writecache, pkg->mergefrom, buf, pkg->mergelen, fua) :
+		   sparseexpwrite(pkg->mergefrom, buf, pkg->mergelen, client, fua)) {
+			error = errno;
+			DEBUG("Write failed: %m");
+		}
+		for(p = pkg; p; p = p->merged) {
+			setup_reply(&rep, p->req);
+			if(error)
+				rep.error = nbd_errno(error);
+			pthread_mutex_lock(&(client->lock));
+			writeit(client->net, &rep, sizeof rep);
+			pthread_mutex_unlock(&(client->lock));
+		}
+	}
+	free(buf);
+}
+
+/**
+ * Handle a part of a split read. With structured replies, every part is
+ * sent as a chunk of its own as soon as it has been read; otherwise, the
+ * part that finishes last sends the whole reply.
+ **/
+static void handle_split_read(struct work_package* pkg) {
+	CLIENT* client = pkg->client;
+	struct nbd_request* req = pkg->req;
+	struct split_read* split = pkg->split;
+	struct {
+		uint32_t error;
+		uint16_t msglen;
+	} __attribute__ ((packed)) payload;
+	uint64_t offset;
+	char* buf;
+	int error = 0;
+	bool last;
+
+	buf = client->structured ? malloc(req->len) : split->buf + (req->from - split->from);
+	if(!buf) {
+		err("Could not allocate memory for request");
+	}
+	DEBUG("handling part of a split read\n");
+	if(client->writecache ?
+	   writecache_read(client->writecache, req->from, buf, req->len, writecache_expread) :
+	   expread(req->from, buf, req->len, client)) {
+		error = errno;
+		DEBUG("Read failed: %m");
+	}
+	pthread_mutex_lock(&(client->lock));
+	last = --split->remaining == 0;
+	if(client->structured) {
+		/* Chunks go out under the client lock, so the one with
+		 * the done flag is always the last one */
+		if(error) {
+			payload.error = nbd_errno(error);
+			payload.msglen = 0;
+			send_structured_header(client, req, last ? NBD_REPLY_FLAG_DONE : 0, NBD_REPLY_TYPE_ERROR, sizeof(payload), &payload, sizeof(payload));
+		} else {
+			offset = htonll(req->from);
+			send_structured_header(client, req, last ? NBD_REPLY_FLAG_DONE : 0, NBD_REPLY_TYPE_OFFSET_DATA, sizeof(offset) + req->len, &offset, sizeof(offset));
+			writeit(client->net, buf, req->len);
+		}
+		free(buf);
+	} else if(error) {
+		split->error = error;
+	}
+	pthread_mutex_unlock(&(client->lock));
+	if(!last)
+		return;
+	if(!client->structured) {
+		if(split->error) {
+			send_error_reply(client, req, split->error);
+		} else {
+			pthread_mutex_lock(&(client->lock));
+			send_read_header(client, req);
+			writeit(client->net, split->buf, split->len);
+			pthread_mutex_unlock(&(client->lock));
+		}
+	}
+	if(split->ralen)
+		expcache(split->rafrom, split->ralen, client);
+	g_atomic_int_add(&(client->readsinflight), -1);
+	if(split->inflight >= 0)
+		inflight_release(client->inflight, split->inflight);
+	free(split->buf);
+	g_free(split);
+}
+
+static void handle_request(void* data) {
 	struct work_package* package = (struct work_package*) data;
 	uint32_t type = package->req->type & NBD_CMD_MASK_COMMAND;
 	uint32_t flags = package->req->type & ~NBD_CMD_MASK_COMMAND;
-	struct nbd_reply rep;
+	struct work_package* next;
+
+	if(package->split) {
+		handle_split_read(package);
+		package_dispose(package);
+		return;
+	}
+	if(package->merged) {
+		handle_merged(package);
+		for(; package; package = next) {
+			next = package->merged;
+			if(package->ralen)
+				expcache(package->rafrom, package->ralen, package->client);
+			if(type == NBD_CMD_READ)
+				g_atomic_int_add(&(package->client->readsinflight), -1);
+			package_dispose(package);
+		}
+		return;
+	}
 
-	if(flags & ~NBD_CMD_FLAG_FUA) {
+	if(flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE | NBD_CMD_FLAG_REQ_ONE) ||
+	   ((flags & NBD_CMD_FLAG_NO_HOLE) && type != NBD_CMD_WRITE_ZEROES) ||
+	   ((flags & NBD_CMD_FLAG_REQ_ONE) && type != NBD_CMD_BLOCK_STATUS)) {
 		msg(LOG_ERR, "E: received invalid flag %d on command %d, ignoring", flags, type);
 		goto error;
 	}
@@ -1740,6 +3738,10 @@ static void handle_request(gpointer data, gpointer user_data) {
 	switch(type) {
 		case NBD_CMD_READ:
 			handle_read(package->client, package->req);
+			/* Read ahead only after replying, so that the read
+			 * ahead I/O doesn't delay the read itself */
+			if(package->ralen)
+				expcache(package->rafrom, package->ralen, package->client);
 			break;
 		case NBD_CMD_WRITE:
 			handle_write(package);
@@ -1750,31 +3752,273 @@ static void handle_request(gpointer data, gpointer user_data) {
 		case NBD_CMD_TRIM:
 			handle_trim(package->client, package->req);
 			break;
+		case NBD_CMD_CACHE:
+			handle_cache(package->client, package->req);
+			break;
+		case NBD_CMD_WRITE_ZEROES:
+			handle_write_zeroes(package->client, package->req);
+			break;
+		case NBD_CMD_BLOCK_STATUS:
+			handle_block_status(package->client, package->req);
+			break;
 		default:
 			msg(LOG_ERR, "E: received unknown command %d of type, ignoring", package->req->type);
 			goto error;
 	}
 	goto end;
 error:
-	setup_reply(&rep, package->req);
-	rep.error = nbd_errno(EINVAL);
-	pthread_mutex_lock(&(package->client->lock));
-	writeit(package->client->net, &rep, sizeof rep);
-	pthread_mutex_unlock(&(package->client->lock));
+	send_error_reply(package->client, package->req, EINVAL);
 end:
+	if(type == NBD_CMD_READ)
+		g_atomic_int_add(&(package->client->readsinflight), -1);
 	package_dispose(package);
 }
 
+/**
+ * Hold a request back for as long as the rate limits of its export
+ * require. This happens before the request is handed to the thread pool,
+ * so a connection that goes over its limits stops reading requests, and
+ * the others get their turn. The request first waits for its client's
+ * share of the export, so that a client with many connections doesn't
+ * queue up in front of the others.
+ **/
+static void throttle(CLIENT* client, struct nbd_request* req) {
+	uint64_t delay;
+	bool write;
+	uint64_t len;
+
+	switch(req->type & NBD_CMD_MASK_COMMAND) {
+		case NBD_CMD_READ:
+			write = false;
+			len = req->len;
+			break;
+		case NBD_CMD_CACHE:
+			write = false;
+			len = 0;
+			break;
+		case NBD_CMD_WRITE:
+			write = true;
+			len = req->len;
+			break;
+		case NBD_CMD_TRIM:
+		case NBD_CMD_WRITE_ZEROES:
+			write = true;
+			len = 0;
+			break;
+		default:
+			return;
+	}
+	delay = qos_share(client->server->qos, &client->clientaddr, write, len);
+	if(delay)
+		g_usleep(delay);
+	delay = qos_charge(client->server->qos, &client->clientaddr, write, len);
+	if(delay)
+		g_usleep(delay);
+}
+
+/**
+ * The class of a request, for the scheduler
+ **/
+static int request_class(struct nbd_request* req) {
+	switch(req->type & NBD_CMD_MASK_COMMAND) {
+		case NBD_CMD_READ:
+			return req->len <= REQSCHED_SMALLREAD_MAX ? REQSCHED_SMALLREAD : REQSCHED_LARGEREAD;
+		case NBD_CMD_BLOCK_STATUS:
+			return REQSCHED_SMALLREAD;
+		case NBD_CMD_CACHE:
+			return REQSCHED_LARGEREAD;
+		case NBD_CMD_WRITE:
+		case NBD_CMD_WRITE_ZEROES:
+			return REQSCHED_WRITE;
+		default:
+			return REQSCHED_SYNC;
+	}
+}
+
+/**
+ * Whether to split a read into parts that are handled in parallel
+ **/
+static bool should_split(CLIENT* client, struct nbd_request* req) {
+	SERVER* server = client->server;
+
+	return server->splitread > 0 && req->type == NBD_CMD_READ &&
+		req->len > server->splitread &&
+		req->from + req->len <= client->exportsize &&
+		!(client->structured && req->len > UINT32_MAX - sizeof(uint64_t));
+}
+
+/**
+ * Split a read into parts of at most splitread bytes, and queue them
+ **/
+static void push_split_read(struct work_package* pkg) {
+	CLIENT* client = pkg->client;
+	struct nbd_request* req = pkg->req;
+	struct split_read* split = g_new0(struct split_read, 1);
+	struct work_package* part;
+	struct nbd_request* partreq;
+	struct nbd_request orig = *req;
+	uint32_t partlen = client->server->splitread;
+	int cls = request_class(req);
+	uint64_t done;
+
+	split->from = req->from;
+	split->len = req->len;
+	split->remaining = ((uint64_t)req->len + partlen - 1) / partlen;
+	split->rafrom = pkg->rafrom;
+	split->ralen = pkg->ralen;
+	/* The budget is given back when the last part is done */
+	split->inflight = pkg->inflight;
+	pkg->inflight = -1;
+	if(!client->structured) {
+		split->buf = malloc(req->len);
+		if(!split->buf) {
+			err("Could not allocate memory for request");
+		}
+	}
+	req->len = partlen;
+	pkg->ralen = 0;
+	pkg->split = split;
+	/* The first part may be done and gone by the time we queue the
+	 * others, so they are made from a copy of the request */
+	reqsched_push(tpool, cls, req->from, pkg);
+	for(done = partlen; done < orig.len; done += partlen) {
+		partreq = calloc(sizeof(struct nbd_request), 1);
+		memcpy(partreq, &orig, sizeof(struct nbd_request));
+		partreq->from = orig.from + done;
+		partreq->len = MIN(partlen, orig.len - done);
+		part = package_create(client, partreq);
+		part->split = split;
+		reqsched_push(tpool, cls, partreq->from, part);
+	}
+}
+
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+/**
+ * Whether reads from an export are plain reads of its files, which we can
+ * try in the thread that reads requests
+ **/
+static bool can_read_inline(CLIENT* client) {
+	SERVER* server = client->server;
+
+	return client->export &&
+		!(server->flags & (F_TREEFILES | F_COPYONWRITE | F_LOGSTRUCT | F_COMPRESSED)) &&
+		!server->readcache && !client->writecache && !client->dedup &&
+		!client->cipher && !client->checksums;
+}
+
+/**
+ * Try to answer a small read right away, in the thread that reads
+ * requests, which saves waking up a worker for it. With RWF_NOWAIT,
+ * preadv2() only returns what is in the page cache and never waits for
+ * the disk; if any of the data isn't there, the read goes to a worker as
+ * usual.
+ *
+ * @return whether the read was answered
+ **/
+static bool read_inline(CLIENT* client, struct nbd_request* req) {
+	char buf[REQSCHED_SMALLREAD_MAX];
+	struct iovec iov;
+	int fhandle;
+	off_t foffset;
+	size_t maxbytes;
+	size_t done;
+	ssize_t ret;
+
+	if(req->type != NBD_CMD_READ || !req->len || req->len > sizeof(buf) ||
+	   req->from + req->len > client->exportsize)
+		return false;
+	for(done = 0; done < req->len; done += ret) {
+		if(get_filepos(client, req->from + done, &fhandle, &foffset, &maxbytes))
+			return false;
+		iov.iov_base = buf + done;
+		iov.iov_len = req->len - done;
+		if(maxbytes && iov.iov_len > maxbytes)
+			iov.iov_len = maxbytes;
+		ret = preadv2(fhandle, &iov, 1, foffset, RWF_NOWAIT);
+		if(ret <= 0) {
+			/* Not every file system can do this */
+			if(ret < 0 && errno == EOPNOTSUPP)
+				client->readinline = FALSE;
+			return false;
+		}
+	}
+	pthread_mutex_lock(&(client->lock));
+	send_read_header(client, req);
+	writeit(client->net, buf, req->len);
+	pthread_mutex_unlock(&(client->lock));
+	return true;
+}
+#endif
+
+/**
+ * The bytes a request holds on to while it is in flight: the data of a
+ * write from the moment we read it, and the buffer of a read
+ **/
+static uint64_t inflight_bytes(struct nbd_request* req) {
+	switch(req->type & NBD_CMD_MASK_COMMAND) {
+		case NBD_CMD_READ:
+		case NBD_CMD_WRITE:
+			return req->len;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Log how much of its in-flight budget a connection used
+ **/
+static void log_inflight(struct inflight* f) {
+	struct inflight_stats st;
+
+	inflight_get_stats(f, &st);
+	msg(LOG_INFO, "In flight at most: %" PRIu32 " requests, %" PRIu64 " bytes; waited for the budget %" PRIu64 " times, %" PRIu64 " ms",
+	    st.maxrequests, st.maxbytes, st.waits, st.waitusec / 1000);
+}
+
+/**
+ * Log the in-flight statistics of a connection that ends because we
+ * exit, which is what happens when reading from or writing to the
+ * socket fails
+ **/
+static void log_inflight_at_exit(void) {
+	if(connection_inflight)
+		log_inflight(connection_inflight);
+}
+
 static int mainloop_threaded(CLIENT* client) {
 	struct nbd_request* req;
 	struct work_package* pkg;
 	SERVER *server = client->server;
 	struct timespec start;
 	bool fail = false;
+	pthread_t cachethread;
+	pthread_t scrubthread;
+	bool scrubbing = false;
+	static bool exithook = false;
+	uint32_t maxlen = max_request(server);
+	char discard[65536];
 
 	clock_gettime(CLOCK_MONOTONIC, &start);
+	client->cachequeue = g_async_queue_new();
+	pthread_create(&cachethread, NULL, cache_thread, client);
+	if(client->checksums && server->scrubrate && client->exportsize) {
+		client->scrubstop = 0;
+		scrubbing = !pthread_create(&scrubthread, NULL, scrub_thread, client);
+	}
+	client->readahead = NULL;
+	if(server->readahead > 0)
+		client->readahead = readahead_new(server->readahead);
+	client->inflight = inflight_new(min_limit(server->maxinflight, maxinflight),
+			min_limit(server->maxinflightbytes, maxinflightbytes));
+	connection_inflight = client->inflight;
+	if(!exithook)
+		exithook = !atexit(log_inflight_at_exit);
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+	client->readinline = can_read_inline(client);
+#endif
 
-	send_export_info(client);
+	if(!client->go)
+		send_export_info(client);
 	DEBUG("Entering request loop\n");
 	while(1) {
 		req = calloc(sizeof (struct nbd_request), 1);
@@ -1808,7 +4052,26 @@ static int mainloop_threaded(CLIENT* client) {
 		if(req->magic != htonl(NBD_REQUEST_MAGIC))
 			err("Protocol error: not enough magic.");
 
+		/* Refuse a request that is too large before we allocate
+		 * anything for it; the data of a write is read and thrown
+		 * away, so that we stay in step with the client */
+		if(inflight_bytes(req) > maxlen) {
+			DEBUG("[Request too large!]");
+			if((req->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE)
+				consume(client->net, discard, req->len, sizeof(discard));
+			send_error_reply(client, req, EINVAL);
+			free(req);
+			continue;
+		}
+
+		/* Wait for earlier requests to be answered if they use up
+		 * the budget, before we allocate anything for this one, and
+		 * before we read its data */
+		if(req->type != NBD_CMD_DISC)
+			inflight_acquire(client->inflight, inflight_bytes(req));
 		pkg = package_create(client, req);
+		if(req->type != NBD_CMD_DISC)
+			pkg->inflight = inflight_bytes(req);
 
 		if((req->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_WRITE) {
 #ifdef HAVE_SPLICE
@@ -1821,10 +4084,64 @@ static int mainloop_threaded(CLIENT* client) {
 				readit(client->net, pkg->data, req->len);
 		}
 		if(req->type == NBD_CMD_DISC) {
-			g_thread_pool_free(tpool, FALSE, TRUE);
+			reqsched_free(tpool);
+			/* a zero-length range stops the cache thread */
+			g_async_queue_push(client->cachequeue, calloc(sizeof(struct nbd_request), 1));
+			pthread_join(cachethread, NULL);
+			if(scrubbing) {
+				g_atomic_int_set(&client->scrubstop, 1);
+				pthread_join(scrubthread, NULL);
+			}
+			if(client->readahead)
+				readahead_free(client->readahead);
+			if(client->writecache && writecache_free(client->writecache))
+				msg(LOG_ERR, "Could not write back all cached data: %m");
+			if(client->checksums && checksum_close(client->checksums))
+				msg(LOG_ERR, "Could not write out the checksums: %m");
+			if(client->journalfd >= 0)
+				close(client->journalfd);
+			if(client->logstruct && logstruct_close(client->logstruct))
+				msg(LOG_ERR, "Could not checkpoint the log-structured export: %m");
+			if(client->dedup)
+				dedup_close(client->dedup);
+#ifdef HAVE_ZLIB
+			if(client->compressed)
+				compressed_close(client->compressed);
+#endif
+#ifdef HAVE_OPENSSL
+			if(client->cipher)
+				cipher_close(client->cipher);
+#endif
+			log_inflight(client->inflight);
+			connection_inflight = NULL;
+			package_dispose(pkg);
+			inflight_free(client->inflight);
+			client->inflight = NULL;
 			return 0;
 		}
-		g_thread_pool_push(tpool, pkg, NULL);
+		if(server->qos)
+			throttle(client, req);
+		if((req->type & NBD_CMD_MASK_COMMAND) == NBD_CMD_READ) {
+			/* Stream detection has to see the reads in the order
+			 * in which they arrive, so it happens here rather
+			 * than in the worker threads */
+			if(client->readahead && req->from + req->len <= client->exportsize)
+				readahead_access(client->readahead, req->from, req->len,
+						client->exportsize, &pkg->rafrom, &pkg->ralen);
+#if defined(HAVE_PREADV2) && defined(RWF_NOWAIT)
+			/* A read that has to start reading ahead goes to a
+			 * worker, which does that after replying */
+			if(client->readinline && !pkg->ralen && read_inline(client, req)) {
+				package_dispose(pkg);
+				continue;
+			}
+#endif
+			g_atomic_int_inc(&client->readsinflight);
+		}
+		if(should_split(client, req))
+			push_split_read(pkg);
+		else
+			reqsched_push(tpool, request_class(req), req->from, pkg);
 	}
 }
 
@@ -2012,18 +4329,103 @@ int mainloop(CLIENT *client) {
  * Set up client export array, which is an array of FILE_INFO.
  * Also, split a single exportfile into multiple ones, if that was asked.
  * @param client information on the client which we want to setup export for
+ * @return 0 on success, or -1 with errno set to EBUSY if another
+ * connection has the export to itself; anything else is fatal
+ **/
+/**
+ * Work out the tag under which a connection finds its blocks in the
+ * shared read cache. It is made of the device, inode and size of every
+ * file of the export, so that once a file is replaced or resized, new
+ * connections no longer see what was cached from the old one, while
+ * those that still have the old file open keep to their own blocks.
+ *
+ * @param client the connection, whose export has been opened
  **/
-void setupexport(CLIENT* client) {
+static uint64_t readcache_tag(CLIENT* client) {
+	uint64_t tag = 14695981039346656037ULL;
+	uint64_t id[3];
+	struct stat st;
+	const unsigned char* p;
+	size_t j;
+	int i;
+
+	/* FNV-1a */
+	for(i = 0; client->export && i < client->export->len; i++) {
+		if(fstat(g_array_index(client->export, FILE_INFO, i).fhandle, &st) < 0)
+			memset(&st, 0, sizeof(st));
+		id[0] = st.st_dev;
+		id[1] = st.st_ino;
+		id[2] = st.st_size;
+		p = (const unsigned char*)id;
+		for(j = 0; j < sizeof(id); j++)
+			tag = (tag ^ p[j]) * 1099511628211ULL;
+	}
+	return tag;
+}
+
+int setupexport(CLIENT* client) {
 	int i;
 	off_t laststartoff = 0, lastsize = 0;
 	int multifile = (client->server->flags & F_MULTIFILE);
 	int treefile = (client->server->flags & F_TREEFILES);
+	int logstruct = (client->server->flags & F_LOGSTRUCT);
 	int temporary = (client->server->flags & F_TEMPORARY) && !multifile;
 	int cancreate = (client->server->expected_size) && !multifile;
 
+	client->logstruct = NULL;
+	client->dedup = NULL;
+	client->compressed = NULL;
+	client->cipher = NULL;
+	client->checksums = NULL;
 	if (treefile) {
 		client->export = NULL; // this could be thousands of files so we open handles on demand although its slower
 		client->exportsize = client->server->expected_size; // available space is not checked, as it could change during runtime anyway
+	} else if (logstruct) {
+		client->export = NULL;
+		client->exportsize = client->server->expected_size;
+		/* Only one connection can use the store at a time; the
+		 * next one is refused rather than left waiting */
+		client->logstruct = logstruct_open(client->exportname, client->exportsize, false);
+		if(!client->logstruct) {
+			if(errno == EBUSY)
+				return -1;
+			err("Could not open log-structured export: %m");
+		}
+	} else if (client->server->dedupstore) {
+		/* The export file is just the block map */
+		client->export = NULL;
+		client->exportsize = client->server->expected_size;
+		client->dedup = dedup_open(client->server->dedupstore, client->exportname,
+				client->exportsize, client->server->flags & F_READONLY);
+		if(!client->dedup) {
+			err("Could not open deduplicated export: %m");
+		}
+#ifdef HAVE_ZLIB
+	} else if (client->server->flags & F_COMPRESSED) {
+		client->export = NULL;
+		client->compressed = compressed_open(client->exportname, client->server->compressedcache);
+		if(!client->compressed) {
+			err("Could not open compressed image: %m");
+		}
+		client->exportsize = compressed_size(client->compressed);
+		if(client->server->expected_size) {
+			if(client->server->expected_size > client->exportsize) {
+				err("Size of exported file is too big\n");
+			}
+			client->exportsize = client->server->expected_size;
+		}
+#endif
+	} else if (client->server->handles && (client->export = handles_dup(client->server->handles))) {
+		/* The master opened the files and found their sizes for us
+		 * already */
+		i = client->export->len;
+		client->exportsize = handles_size(client->server->handles);
+		if(client->server->expected_size) {
+			if(client->server->expected_size > client->exportsize) {
+				err("Size of exported file is too big\n");
+			}
+			client->exportsize = client->server->expected_size;
+		}
 	} else {
 		client->export = g_array_new(TRUE, TRUE, sizeof(FILE_INFO));
 
@@ -2116,6 +4518,31 @@ void setupexport(CLIENT* client) {
 		}
 	}
 
+#ifdef HAVE_OPENSSL
+	if(client->server->encryptionkey) {
+		client->cipher = cipher_open(client->server->encryptionkey);
+		if(!client->cipher) {
+			err("Could not load the encryption key: %m");
+		}
+		/* Only whole sectors can be encrypted */
+		client->exportsize -= client->exportsize % CIPHER_SECTORSIZE;
+	}
+#endif
+	if(client->server->checksumfile) {
+		/* A writer is refused while other connections use the
+		 * checksums */
+		client->checksums = checksum_open(client->server->checksumfile, client->exportsize,
+				client->server->flags & F_READONLY);
+		if(!client->checksums) {
+			if(errno == EBUSY)
+				return -1;
+			err("Could not open the checksum file: %m");
+		}
+	}
+
+	if(client->server->readcache)
+		client->readcachetag = readcache_tag(client);
+
 	msg(LOG_INFO, "Size of exported file/device is %llu", (unsigned long long)client->exportsize);
 	if(multifile) {
 		msg(LOG_INFO, "Total number of files: %d", i);
@@ -2123,6 +4550,7 @@ void setupexport(CLIENT* client) {
 	if(treefile) {
 		msg(LOG_INFO, "Total number of (potential) files: %" PRId64, (client->exportsize+TREEPAGESIZE-1)/TREEPAGESIZE);
 	}
+	return 0;
 }
 
 int copyonwrite_prepare(CLIENT* client) {
@@ -2145,6 +4573,7 @@ int copyonwrite_prepare(CLIENT* client) {
 	if ((client->difmap=calloc(client->exportsize/DIFFPAGESIZE,sizeof(u32)))==NULL)
 		err("Could not allocate memory") ;
 	for (i=0;i<client->exportsize/DIFFPAGESIZE;i++) client->difmap[i]=(u32)-1 ;
+	pthread_mutex_init(&client->difflock, NULL);
 
 	return 0;
 }
@@ -2168,6 +4597,18 @@ int do_run(gchar* command, gchar* file) {
 	return retval;
 }
 
+/**
+ * Pin a worker thread to the CPUs configured for the workers
+ *
+ * @param arg the client the worker serves
+ **/
+static void pin_worker(void* arg) {
+	CLIENT* client = arg;
+
+	if(affinity_apply(workeraffinity, client->net))
+		msg(LOG_WARNING, "Could not set the CPU affinity of a worker thread: %m");
+}
+
 /**
  * Serve a connection. 
  *
@@ -2186,17 +4627,31 @@ void serveconnection(CLIENT *client) {
 				  client->server->transactionlog);
 	}
 
-	if(do_run(client->server->prerun, client->exportname)) {
-		exit(EXIT_FAILURE);
+	/* With NBD_OPT_GO, negotiate() did this already */
+	if(!client->go) {
+		if(do_run(client->server->prerun, client->exportname)) {
+			exit(EXIT_FAILURE);
+		}
+		if(setupexport(client)) {
+			do_run(client->server->postrun, client->exportname);
+			err("Could not open export: %m");
+		}
 	}
-	setupexport(client);
 
 	if (client->server->flags & F_COPYONWRITE) {
 		copyonwrite_prepare(client);
 	}
+	setup_writecache(client);
 
 	setmysockopt(client->net);
 
+	/* The cache and scrubber threads follow the receiver; the workers
+	 * are only started once requests come in */
+	if(receiveraffinity && affinity_apply(receiveraffinity, client->net))
+		msg(LOG_WARNING, "Could not set the CPU affinity of the receiver: %m");
+	if(workeraffinity && tpool)
+		reqsched_set_start(tpool, pin_worker, client);
+
 	mainloop_threaded(client);
 	do_run(client->server->postrun, client->exportname);
 
@@ -2381,6 +4836,42 @@ socket_accept(const int sock)
         return net;
 }
 
+/**
+ * Count the connections we serve, besides that of the calling child
+ **/
+static int
+count_connections(void)
+{
+        int count = 0;
+        int i;
+
+        /* Each child of ours is in our table, except the calling
+         * one, which was forked before it was added */
+        if (!connections)
+                return g_hash_table_size(children);
+
+        /* With acceptors, the calling child was counted before it
+         * was forked */
+        for (i = 0; i <= prefork; i++)
+                count += __atomic_load_n(&connections[i], __ATOMIC_RELAXED);
+        return count - 1;
+}
+
+/**
+ * Whether serving another connection would go over the limit of an export
+ **/
+static bool
+connection_limit_reached(SERVER *serve)
+{
+        if (serve->max_connections > 0 &&
+            count_connections() >= serve->max_connections) {
+                msg(LOG_ERR, "Max connections (%d) reached",
+                    serve->max_connections);
+                return true;
+        }
+        return false;
+}
+
 static void
 handle_modern_connection(GArray *const servers, const int sock)
 {
@@ -2395,12 +4886,17 @@ handle_modern_connection(GArray *const servers, const int sock)
                 return;
 
         if (!dontfork) {
+                if (connections)
+                        __atomic_add_fetch(&connections[acceptor], 1, __ATOMIC_RELAXED);
                 pid = spawn_child();
                 if (pid) {
                         if (pid > 0)
                                 msg(LOG_INFO, "Spawned a child process");
-                        if (pid < 0)
+                        if (pid < 0) {
                                 msg(LOG_ERR, "Failed to spawn a child process");
+                                if (connections)
+                                        __atomic_sub_fetch(&connections[acceptor], 1, __ATOMIC_RELAXED);
+                        }
                         close(net);
                         return;
                 }
@@ -2413,12 +4909,10 @@ handle_modern_connection(GArray *const servers, const int sock)
                 goto handler_err;
         }
 
-        if (client->server->max_connections > 0 &&
-           g_hash_table_size(children) >= client->server->max_connections) {
-                msg(LOG_ERR, "Max connections (%d) reached",
-                    client->server->max_connections);
+        /* With NBD_OPT_GO, negotiate() checked this before it set up
+         * the export */
+        if (!client->go && connection_limit_reached(client->server))
                 goto handler_err;
-        }
 
         sock_flags_old = fcntl(net, F_GETFL, 0);
         if (sock_flags_old == -1) {
@@ -2433,12 +4927,12 @@ handle_modern_connection(GArray *const servers, const int sock)
                 goto handler_err;
         }
 
-        if (set_peername(net, client)) {
+        if (!client->go && set_peername(net, client)) {
                 msg(LOG_ERR, "Failed to set peername");
                 goto handler_err;
         }
 
-        if (!authorized_client(client)) {
+        if (!client->go && !authorized_client(client)) {
                 msg(LOG_INFO, "Client '%s' is not authorized to access",
                     client->clientname);
                 goto handler_err;
@@ -2474,7 +4968,8 @@ handle_modern_connection(GArray *const servers, const int sock)
         exit(EXIT_SUCCESS);
 
 handler_err:
-        g_free(client);
+        if (client)
+                free_client(client, client->go);
         close(net);
 
         if (!dontfork) {
@@ -2505,6 +5000,124 @@ static int get_index_by_servename(const gchar *const servename,
         return -1;
 }
 
+/**
+ * Set up the shared read cache of an export, if it asked for one. This
+ * must happen in the master, so that all children of the export share it.
+ * Only exports whose data can't change underneath us can be cached: those
+ * that are read-only or copy-on-write, and which are the same file for
+ * every client.
+ *
+ * @param serve the export
+ **/
+static void setup_readcache(SERVER *serve) {
+	if(!serve->readcachesize || serve->readcache)
+		return;
+	if(!(serve->flags & (F_READONLY | F_COPYONWRITE))) {
+		g_warning("Ignoring readcache for %s: export is neither read-only nor copy-on-write", serve->exportname);
+		return;
+	}
+	if(strchr(serve->exportname, '%') || (serve->flags & F_TEMPORARY)) {
+		g_warning("Ignoring readcache for %s: export is not the same file for every client", serve->exportname);
+		return;
+	}
+	serve->readcache = readcache_new(serve->readcachesize);
+	if(!serve->readcache)
+		g_warning("Could not allocate readcache for %s: %s", serve->exportname, strerror(errno));
+}
+
+/**
+ * Set up the rate limits of an export. Like the read cache, they live in
+ * memory that is shared with the children, so that they hold across all
+ * connections to the export.
+ **/
+static void setup_qos(SERVER *serve) {
+	bool limited = false;
+	int i, j;
+
+	for(i = 0; i < 2; i++) {
+		for(j = 0; j < QOS_NLIMITS; j++)
+			limited = limited || serve->qoslimits[i][j];
+	}
+	if(!limited || serve->qos)
+		return;
+	serve->qos = qos_new((const uint64_t (*)[QOS_NLIMITS])serve->qoslimits, serve->qosburst);
+	if(!serve->qos)
+		g_warning("Could not set up the rate limits for %s: %s", serve->exportname, strerror(errno));
+}
+
+/**
+ * Open the files of an export in advance, or again if they changed, so
+ * that the children don't have to open them and find their sizes for
+ * every connection. Only exports that are plain files qualify, and only
+ * if they are the same files for every client, and no prerun command
+ * could change them before they are opened.
+ *
+ * @param serve the export
+ **/
+static void setup_handles(SERVER *serve) {
+	int writable;
+
+	if(serve->handles) {
+		if(handles_current(serve->handles))
+			return;
+		handles_close(serve->handles);
+		serve->handles = NULL;
+	}
+	if((serve->flags & (F_TREEFILES | F_LOGSTRUCT | F_COMPRESSED | F_TEMPORARY)) ||
+	   serve->dedupstore || serve->prerun || strchr(serve->exportname, '%'))
+		return;
+	/* If the files were read-only before, they may not be anymore */
+	writable = !(serve->flags & F_READONLY) || (serve->flags & F_AUTOREADONLY);
+	serve->handles = handles_open(serve->exportname, serve->flags & F_MULTIFILE, writable);
+	if(!serve->handles) {
+		DEBUG("Not opening %s in advance: %s", serve->exportname, strerror(errno));
+		return;
+	}
+	/* A file that is still to be created or expanded is left to the
+	 * child */
+	if(handles_size(serve->handles) < serve->expected_size) {
+		handles_close(serve->handles);
+		serve->handles = NULL;
+		return;
+	}
+	if(writable && !(serve->flags & F_COPYONWRITE)) {
+		if(handles_readonly(serve->handles))
+			serve->flags |= F_AUTOREADONLY | F_READONLY;
+		else
+			serve->flags &= ~(F_AUTOREADONLY | F_READONLY);
+	}
+}
+
+/**
+ * Open the files of all exports in advance, or again if they changed.
+ **/
+static void refresh_handles(GArray *const servers) {
+	int i;
+
+	for(i = 0; i < servers->len; i++)
+		setup_handles(&g_array_index(servers, SERVER, i));
+}
+
+/**
+ * Index the gzip images of compressed exports, so that connections find
+ * the index ready rather than build it while they negotiate. Images
+ * that are not the same file for every client are left to the children.
+ **/
+static void prepare_compressed(GArray *const servers) {
+#ifdef HAVE_ZLIB
+	SERVER *serve;
+	int i;
+
+	for(i = 0; i < servers->len; i++) {
+		serve = &g_array_index(servers, SERVER, i);
+		if(!(serve->flags & F_COMPRESSED) || strchr(serve->exportname, '%'))
+			continue;
+		if(compressed_prepare(serve->exportname))
+			g_warning("Could not index %s in advance: %s", serve->exportname, strerror(errno));
+	}
+#endif
+}
+
 /**
  * Parse configuration files and add servers to the array if they don't
  * already exist there. The existence is tested by comparing
@@ -2522,10 +5135,15 @@ static int append_new_servers(GArray *const servers, GError **const gerror) {
         int retval = -1;
         struct generic_conf genconf;
 
+	memset(&genconf, 0, sizeof(genconf));
+	genconf.threads = 4;
+	genconf.maxinflightbytes = INFLIGHT_DEFAULT_BYTES;
         new_servers = parse_cfile(config_file_pos, &genconf, true, gerror);
-	g_thread_pool_set_max_threads(tpool, genconf.threads, NULL);
+	reqsched_set_threads(tpool, genconf.threads);
         if (!new_servers)
                 goto out;
+	maxinflight = genconf.maxinflight;
+	maxinflightbytes = genconf.maxinflightbytes;
 
         for (i = 0; i < new_servers->len; ++i) {
                 SERVER new_server = g_array_index(new_servers, SERVER, i);
@@ -2533,6 +5151,8 @@ static int append_new_servers(GArray *const servers, GError **const gerror) {
                 if (new_server.servename
                     && -1 == get_index_by_servename(new_server.servename,
                                                     servers)) {
+			setup_readcache(&new_server);
+			setup_qos(&new_server);
 			g_array_append_val(servers, new_server);
                 }
         }
@@ -2544,6 +5164,32 @@ out:
         return retval;
 }
 
+/**
+ * Handle a reconfiguration request
+ **/
+static void reconfigure(GArray *const servers) {
+        int i;
+        int n;
+        GError *gerror = NULL;
+
+        msg(LOG_INFO, "reconfiguration request received");
+
+        n = append_new_servers(servers, &gerror);
+        if (n == -1)
+                msg(LOG_ERR, "failed to append new servers: %s",
+                    gerror->message);
+
+        for (i = servers->len - n; i < servers->len; ++i) {
+                const SERVER server = g_array_index(servers,
+                                                    SERVER, i);
+
+                msg(LOG_INFO, "reconfigured new server: %s",
+                    server.servename);
+        }
+        refresh_handles(servers);
+	prepare_compressed(servers);
+}
+
 /**
  * Loop through the available servers, and serve them. Never returns.
  **/
@@ -2554,6 +5200,7 @@ void serveloop(GArray* servers) {
 	fd_set rset;
 	sigset_t blocking_mask;
 	sigset_t original_mask;
+	time_t refreshed = time(NULL);
 
 	/* 
 	 * Set up the master fd_set. The set of descriptors we need
@@ -2615,6 +5262,8 @@ void serveloop(GArray* servers) {
 				} else {
 					DEBUG("Removing %d from the list of children", pid);
 					g_hash_table_remove(children, &pid);
+					if (connections)
+						__atomic_sub_fetch(&connections[acceptor], 1, __ATOMIC_RELAXED);
 				}
 			}
 		}
@@ -2626,25 +5275,17 @@ void serveloop(GArray* servers) {
                  * export. This does not alter old runtime configuration
                  * but just appends new exports. */
                 if (is_sighup_caught) {
-                        int n;
-                        GError *gerror = NULL;
-
-                        msg(LOG_INFO, "reconfiguration request received");
                         is_sighup_caught = 0; /* Reset to allow catching
                                                * it again. */
-
-                        n = append_new_servers(servers, &gerror);
-                        if (n == -1)
-                                msg(LOG_ERR, "failed to append new servers: %s",
-                                    gerror->message);
-
-                        for (i = servers->len - n; i < servers->len; ++i) {
-                                const SERVER server = g_array_index(servers,
-                                                                    SERVER, i);
-
-                                msg(LOG_INFO, "reconfigured new server: %s",
-                                    server.servename);
-                        }
+			/* An acceptor leaves it to the main process, which
+			 * sets up the read caches and rate limits of new
+			 * exports in memory that the acceptor it starts in
+			 * our place shares; our children carry on */
+			if (acceptor >= 0) {
+				msg(LOG_INFO, "Acceptor %d restarting to reconfigure", acceptor);
+				exit(EXIT_SUCCESS);
+			}
+                        reconfigure(servers);
                 }
 
 		memcpy(&rset, &mset, sizeof(fd_set));
@@ -2659,6 +5300,14 @@ void serveloop(GArray* servers) {
 				handle_modern_connection(servers, sock);
 			}
 		}
+
+		/* Notice exports whose files changed, but only after
+		 * the connections at hand are dealt with, and at most
+		 * once a second */
+		if (time(NULL) != refreshed) {
+			refresh_handles(servers);
+			refreshed = time(NULL);
+		}
 	}
 }
 void serveloop(GArray* servers) G_GNUC_NORETURN;
@@ -2703,6 +5352,22 @@ int dosockopts(const int socket, GError **const gerror) {
                             strerror(errno));
                 return -1;
 	}
+	/* Let every acceptor listen on a socket of its own, and have
+	 * the kernel spread the connections over them */
+	if (prefork > 0) {
+#ifdef SO_REUSEPORT
+		if (setsockopt(socket,SOL_SOCKET,SO_REUSEPORT,&yes,sizeof(int)) == -1) {
+			g_set_error(gerror, NBDS_ERR, NBDS_ERR_SO_REUSEPORT,
+				    "failed to set socket option SO_REUSEPORT: %s",
+				    strerror(errno));
+			return -1;
+		}
+#else
+		g_set_error(gerror, NBDS_ERR, NBDS_ERR_SO_REUSEPORT,
+			    "socket option SO_REUSEPORT is not supported");
+		return -1;
+#endif
+	}
 
         return 0;
 }
@@ -2852,30 +5517,11 @@ out:
 }
 
 /**
- * Connect our servers.
+ * Install the handlers of the signals that serveloop() reacts to.
  **/
-void setup_servers(GArray *const servers, const gchar *const modernaddr,
-                   const gchar *const modernport, const gchar* unixsock) {
+static void setup_signals(void) {
 	struct sigaction sa;
 
-        GError *gerror = NULL;
-        if (open_modern(modernaddr, modernport, &gerror) == -1) {
-                msg(LOG_ERR, "failed to setup servers: %s",
-                    gerror->message);
-                g_clear_error(&gerror);
-                exit(EXIT_FAILURE);
-	}
-	if(unixsock != NULL) {
-		GError* gerror = NULL;
-		if(open_unix(unixsock, &gerror) == -1) {
-			msg(LOG_ERR, "failed to setup servers: %s",
-					gerror->message);
-			g_clear_error(&gerror);
-			exit(EXIT_FAILURE);
-		}
-	}
-	children=g_hash_table_new_full(g_int_hash, g_int_equal, NULL, destroy_pid_t);
-
 	sa.sa_handler = sigchld_handler;
 	sigemptyset(&sa.sa_mask);
 	sigaddset(&sa.sa_mask, SIGTERM);
@@ -2897,6 +5543,209 @@ void setup_servers(GArray *const servers, const gchar *const modernaddr,
 		err("sigaction: %m");
 }
 
+/**
+ * Connect our servers.
+ **/
+void setup_servers(GArray *const servers, const gchar *const modernaddr,
+                   const gchar *const modernport, const gchar* unixsock) {
+	int i;
+	int sock;
+
+	/* With acceptors, each gets a set of sockets of its own */
+	if(prefork > 0)
+		acceptorsocks = g_new0(GArray*, prefork);
+	for(i = 0; i == 0 || i < prefork; i++) {
+		GError *gerror = NULL;
+
+		if(i > 0)
+			modernsocks = g_array_new(FALSE, FALSE, sizeof(int));
+		if (open_modern(modernaddr, modernport, &gerror) == -1) {
+			msg(LOG_ERR, "failed to setup servers: %s",
+			    gerror->message);
+			g_clear_error(&gerror);
+			exit(EXIT_FAILURE);
+		}
+		if(prefork > 0)
+			acceptorsocks[i] = modernsocks;
+	}
+	if(unixsock != NULL) {
+		GError* gerror = NULL;
+		if(open_unix(unixsock, &gerror) == -1) {
+			msg(LOG_ERR, "failed to setup servers: %s",
+					gerror->message);
+			g_clear_error(&gerror);
+			exit(EXIT_FAILURE);
+		}
+		/* There can only be one unix socket at a path, so the
+		 * acceptors share it */
+		sock = g_array_index(modernsocks, int, modernsocks->len - 1);
+		for(i = 0; i < prefork - 1; i++)
+			g_array_append_val(acceptorsocks[i], sock);
+	}
+	children=g_hash_table_new_full(g_int_hash, g_int_equal, NULL, destroy_pid_t);
+
+	setup_signals();
+}
+
+/**
+ * Start an acceptor, which accepts connections on its own set of
+ * sockets, and forks a child to serve each of them.
+ *
+ * @param n which acceptor to start
+ * @return the PID of the acceptor, or -1 if it could not be started
+ **/
+static pid_t spawn_acceptor(GArray *const servers, const int n) {
+	pid_t pid;
+	int i, j, k;
+	int sock;
+
+	pid = spawn_child();
+	if(pid)
+		return pid;
+
+#ifdef HAVE_SYS_PRCTL_H
+	/* Don't keep on accepting connections if the main process is gone */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	acceptor = n;
+	/* The PID file belongs to the main process */
+	pidfname[0] = '\0';
+	g_hash_table_destroy(children);
+	children = g_hash_table_new_full(g_int_hash, g_int_equal, NULL, destroy_pid_t);
+	for(i = 0; i < prefork; i++) {
+		if(i == n)
+			continue;
+		for(j = 0; j < acceptorsocks[i]->len; j++) {
+			sock = g_array_index(acceptorsocks[i], int, j);
+			for(k = 0; k < acceptorsocks[n]->len; k++) {
+				if(g_array_index(acceptorsocks[n], int, k) == sock)
+					break;
+			}
+			if(k == acceptorsocks[n]->len)
+				close(sock);
+		}
+	}
+	modernsocks = acceptorsocks[n];
+	setup_signals();
+	msg(LOG_INFO, "Acceptor %d started", n);
+	serveloop(servers);
+}
+
+/**
+ * Start the acceptors, and restart them when they die. Never returns.
+ **/
+static void supervise(GArray *const servers) {
+	sigset_t blocking_mask;
+	sigset_t original_mask;
+	struct timespec delay;
+	time_t* started;
+	time_t now;
+	bool waiting;
+	int status;
+	bool found;
+	pid_t pid;
+	int i;
+
+	/* One counter per acceptor, and one for the children of acceptors
+	 * that died, which carry on serving */
+	connections = mmap(NULL, (prefork + 1) * sizeof(int), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(connections == MAP_FAILED)
+		err("Could not set up the connection counters: %m");
+	acceptors = g_new0(pid_t, prefork);
+	started = g_new0(time_t, prefork);
+
+	sigemptyset(&blocking_mask);
+	sigaddset(&blocking_mask, SIGCHLD);
+	sigaddset(&blocking_mask, SIGHUP);
+	sigaddset(&blocking_mask, SIGTERM);
+	if (sigprocmask(SIG_BLOCK, &blocking_mask, &original_mask) == -1)
+		err("failed to block signals: %m");
+#if defined(HAVE_SYS_PRCTL_H) && defined(PR_SET_CHILD_SUBREAPER)
+	/* Have the children of acceptors that die handed to us rather
+	 * than to init, so that we notice when they are done. Without
+	 * that, they count against max_connections for good. */
+	if(prctl(PR_SET_CHILD_SUBREAPER, 1))
+		msg(LOG_WARNING, "Could not reap the children of acceptors: %m");
+#endif
+
+	for(;;) {
+		if (is_sigterm_caught) {
+			is_sigterm_caught = 0;
+
+			g_hash_table_foreach(children, killchild, NULL);
+			unlink(pidfname);
+
+			exit(EXIT_SUCCESS);
+		}
+
+		if (is_sigchld_caught) {
+			is_sigchld_caught = 0;
+
+			while ((pid=waitpid(-1, &status, WNOHANG)) > 0) {
+				g_hash_table_remove(children, &pid);
+				found = false;
+				for(i = 0; i < prefork; i++) {
+					if(acceptors[i] != pid)
+						continue;
+					found = true;
+					if(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+						msg(LOG_INFO, "Acceptor %d exited, restarting it", i);
+					else
+						msg(LOG_ERR, "Acceptor %d died, restarting it", i);
+					acceptors[i] = 0;
+					/* Its children are ours to count now */
+					__atomic_add_fetch(&connections[prefork],
+						__atomic_exchange_n(&connections[i], 0, __ATOMIC_RELAXED),
+						__ATOMIC_RELAXED);
+				}
+				/* Anything else is the child of an acceptor that
+				 * died before it */
+				if(!found)
+					__atomic_sub_fetch(&connections[prefork], 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (is_sighup_caught) {
+			is_sighup_caught = 0;
+
+			/* The acceptors can't share the read caches and rate
+			 * limits of new exports if each sets them up on its
+			 * own, so we do, and have the acceptors exit and
+			 * start them again with our configuration */
+			reconfigure(servers);
+			for(i = 0; i < prefork; i++) {
+				if(acceptors[i] > 0) {
+					kill(acceptors[i], SIGHUP);
+					started[i] = 0;
+				}
+			}
+		}
+
+		/* Restart an acceptor at most once a second, so that one
+		 * that keeps dying doesn't keep us busy */
+		now = time(NULL);
+		waiting = false;
+		for(i = 0; i < prefork; i++) {
+			if(acceptors[i] > 0)
+				continue;
+			if(started[i] && now - started[i] < 1) {
+				waiting = true;
+				continue;
+			}
+			started[i] = now;
+			acceptors[i] = spawn_acceptor(servers, i);
+			if(acceptors[i] < 0) {
+				acceptors[i] = 0;
+				waiting = true;
+			}
+		}
+
+		delay.tv_sec = 1;
+		delay.tv_nsec = 0;
+		pselect(0, NULL, NULL, NULL, waiting ? &delay : NULL, &original_mask);
+	}
+}
+
 /**
  * Go daemon (unless we specified at compile time that we didn't want this)
  * @param serve the first server of our configuration. If its port is zero,
@@ -3001,6 +5850,8 @@ int main(int argc, char *argv[]) {
 	GArray *servers;
 	GError *gerr=NULL;
 	struct generic_conf genconf;
+	gchar* str;
+	int i;
 
 	memset(&genconf, 0, sizeof(struct generic_conf));
 
@@ -3016,11 +5867,14 @@ int main(int argc, char *argv[]) {
 	serve=cmdline(argc, argv, &genconf);
 
 	genconf.threads = 4;
+	genconf.maxinflightbytes = INFLIGHT_DEFAULT_BYTES;
         servers = parse_cfile(config_file_pos, &genconf, true, &gerr);
 	
         /* Update global variables with parsed values. This will be
          * removed once we get rid of global configuration variables. */
         glob_flags   |= genconf.flags;
+	maxinflight = genconf.maxinflight;
+	maxinflightbytes = genconf.maxinflightbytes;
 
 	if(serve) {
 		g_array_append_val(servers, *serve);
@@ -3057,16 +5911,37 @@ int main(int argc, char *argv[]) {
 			g_message("No configured exports; quitting.");
 		exit(EXIT_FAILURE);
 	}
-	if (!dontfork)
+	if(genconf.receiveraffinity && !(receiveraffinity = affinity_parse(genconf.receiveraffinity))) {
+		str = g_strdup_printf("Invalid value %s for parameter receiveraffinity: %%m", genconf.receiveraffinity);
+		err(str);
+	}
+	if(genconf.workeraffinity && !(workeraffinity = affinity_parse(genconf.workeraffinity))) {
+		str = g_strdup_printf("Invalid value %s for parameter workeraffinity: %%m", genconf.workeraffinity);
+		err(str);
+	}
+	for(i=0; servers && i<servers->len; i++) {
+		setup_readcache(&g_array_index(servers, SERVER, i));
+		setup_qos(&g_array_index(servers, SERVER, i));
+	}
+	if (!dontfork) {
+		/* Acceptors fork off children, so they don't go with -d */
+		prefork = genconf.prefork;
 		daemonize();
+	}
 #if HAVE_OLD_GLIB
 	g_thread_init(NULL);
 #endif
-	tpool = g_thread_pool_new(handle_request, NULL, genconf.threads, FALSE, NULL);
+	tpool = reqsched_new(handle_request, merge_package, genconf.threads, glob_flags & F_IOPRIO);
 
 	setup_servers(servers, genconf.modernaddr, genconf.modernport,
 			genconf.unixsock);
 	dousers(genconf.user, genconf.group);
+	/* Only now, so that we can't open files that the user we run as
+	 * could not */
+	refresh_handles(servers);
+	prepare_compressed(servers);
 
+	if(prefork > 0)
+		supervise(servers);
 	serveloop(servers);
 }
@@ -81,6 +81,12 @@ int main(int argc, char**argv) {
 			case NBD_CMD_FLUSH:
 				ctext="NBD_CMD_FLUSH";
 				break;
+			case NBD_CMD_TRIM:
+				ctext="NBD_CMD_TRIM";
+				break;
+			case NBD_CMD_BLOCK_STATUS:
+				ctext="NBD_CMD_BLOCK_STATUS";
+				break;
 			default:
 				ctext="UNKNOWN";
 				break;
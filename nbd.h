@@ -34,12 +34,17 @@ enum {
 	NBD_CMD_WRITE = 1,
 	NBD_CMD_DISC = 2,
 	NBD_CMD_FLUSH = 3,
-	NBD_CMD_TRIM = 4
+	NBD_CMD_TRIM = 4,
+	NBD_CMD_CACHE = 5,
+	NBD_CMD_WRITE_ZEROES = 6,
+	NBD_CMD_BLOCK_STATUS = 7
 };
 
 #define NBD_CMD_MASK_COMMAND 0x0000ffff
 #define NBD_CMD_SHIFT (16)
 #define NBD_CMD_FLAG_FUA ((1 << 0) << NBD_CMD_SHIFT)
+#define NBD_CMD_FLAG_NO_HOLE ((1 << 1) << NBD_CMD_SHIFT)
+#define NBD_CMD_FLAG_REQ_ONE ((1 << 3) << NBD_CMD_SHIFT)
 
 /* values for flags field, these are server interaction specific. */
 #define NBD_FLAG_HAS_FLAGS	(1 << 0)	/* Flags are there */
@@ -48,7 +53,9 @@ enum {
 #define NBD_FLAG_SEND_FUA	(1 << 3)	/* Send FUA (Force Unit Access) */
 #define NBD_FLAG_ROTATIONAL	(1 << 4)	/* Use elevator algorithm - rotational media */
 #define NBD_FLAG_SEND_TRIM	(1 << 5)	/* Send TRIM (discard) */
+#define NBD_FLAG_SEND_WRITE_ZEROES (1 << 6)	/* Send WRITE_ZEROES */
 #define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)	/* Server supports multiple connections per export. */
+#define NBD_FLAG_SEND_CACHE	(1 << 10)	/* Send CACHE (prefetch) */
 
 /* These are client behavior specific flags. */
 #define NBD_CFLAG_DESTROY_ON_DISCONNECT	(1 << 0) /* delete the nbd device on
@@ -62,6 +69,7 @@ enum {
 
 #define NBD_REQUEST_MAGIC 0x25609513
 #define NBD_REPLY_MAGIC 0x67446698
+#define NBD_STRUCTURED_REPLY_MAGIC 0x668e33ef
 /* Do *not* use magics: 0x12560953 0x96744668. */
 
 /*
@@ -85,4 +93,34 @@ struct nbd_reply {
 	uint32_t error;		/* 0 = ok, else error	*/
 	char handle[8];		/* handle you got from request	*/
 };
+
+/* Structured reply chunk types and flags */
+#define NBD_REPLY_FLAG_DONE		(1 << 0)
+
+#define NBD_REPLY_TYPE_NONE		0
+#define NBD_REPLY_TYPE_OFFSET_DATA	1
+#define NBD_REPLY_TYPE_BLOCK_STATUS	5
+#define NBD_REPLY_TYPE_ERROR		((1 << 15) + 1)
+
+/* Status flags for the base:allocation metadata context */
+#define NBD_STATE_HOLE	(1 << 0)	/* Extent is not allocated */
+#define NBD_STATE_ZERO	(1 << 1)	/* Extent reads as zeroes */
+
+/*
+ * This is the header of a structured reply chunk, which is sent instead of
+ * a struct nbd_reply when the client negotiated structured replies.
+ */
+struct nbd_structured_reply {
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	char handle[8];
+	uint32_t length;	/* length of the payload that follows */
+} __attribute__ ((packed));
+
+/* One extent of an NBD_REPLY_TYPE_BLOCK_STATUS chunk */
+struct nbd_block_descriptor {
+	uint32_t length;
+	uint32_t status_flags;
+};
 #endif
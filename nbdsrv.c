@@ -16,6 +16,10 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <treefiles.h>
+#include <logstruct.h>
+#include <dedup.h>
+#include <compressed.h>
+#include <checksum.h>
 #include "backend.h"
 #ifdef HAVE_SYS_MOUNT_H
 #include <sys/mount.h>
@@ -188,6 +192,33 @@ SERVER* dup_serve(const SERVER *const s) {
 		serve->cowdir = g_strdup(s->cowdir);
 
 	serve->max_connections = s->max_connections;
+	serve->readcachesize = s->readcachesize;
+	serve->readcache = s->readcache;
+	serve->readahead = s->readahead;
+	serve->writecachesize = s->writecachesize;
+	serve->writecachebackground = s->writecachebackground;
+	serve->compressedcache = s->compressedcache;
+	serve->scrubrate = s->scrubrate;
+	memcpy(serve->qoslimits, s->qoslimits, sizeof(serve->qoslimits));
+	serve->qosburst = s->qosburst;
+	serve->qos = s->qos;
+	serve->handles = s->handles;
+	serve->maxmerge = s->maxmerge;
+	serve->splitread = s->splitread;
+	serve->maxinflight = s->maxinflight;
+	serve->maxinflightbytes = s->maxinflightbytes;
+
+	if(s->writecachejournal)
+		serve->writecachejournal = g_strdup(s->writecachejournal);
+
+	if(s->dedupstore)
+		serve->dedupstore = g_strdup(s->dedupstore);
+
+	if(s->encryptionkey)
+		serve->encryptionkey = g_strdup(s->encryptionkey);
+
+	if(s->checksumfile)
+		serve->checksumfile = g_strdup(s->checksumfile);
 
 	return serve;
 }
@@ -233,7 +264,12 @@ uint64_t size_autodetect(int fhandle) {
 	return UINT64_MAX;
 }
 
-int exptrim(struct nbd_request* req, CLIENT* client) {
+/**
+ * Punch a hole in the backend file, without taking care of checksums.
+ *
+ * @see exptrim
+ **/
+static int rawexptrim(struct nbd_request* req, CLIENT* client) {
 	/* Don't trim when we're read only */
 	if(client->server->flags & F_READONLY) {
 		errno = EINVAL;
@@ -262,6 +298,12 @@ int exptrim(struct nbd_request* req, CLIENT* client) {
 		DEBUG("Performed TRIM request on TREE structure from %llu to %llu", (unsigned long long) req->from, (unsigned long long) req->len);
 		return 0;
 	}
+	if (client->server->flags & F_LOGSTRUCT) {
+		return logstruct_trim(client->logstruct, req->from, req->len);
+	}
+	if (client->dedup) {
+		return dedup_trim(client->dedup, req->from, req->len);
+	}
 	FILE_INFO cur = g_array_index(client->export, FILE_INFO, 0);
 	FILE_INFO next;
 	int i = 1;
@@ -285,6 +327,174 @@ int exptrim(struct nbd_request* req, CLIENT* client) {
 	return 0;
 }
 
+int exptrim(struct nbd_request* req, CLIENT* client) {
+	int ret;
+
+	if(!client->checksums)
+		return rawexptrim(req, client);
+	/* What a trimmed block reads back as is up to the file system */
+	checksum_lock(client->checksums, req->from, req->len, true);
+	ret = rawexptrim(req, client);
+	if(req->from + req->len <= client->exportsize)
+		checksum_forget(client->checksums, req->from, req->len);
+	checksum_unlock(client->checksums, req->from, req->len, true);
+	return ret;
+}
+
+/**
+ * Add an extent to an array of extents, merging it with the previous one
+ * if they have the same status.
+ **/
+static void add_extent(GArray* extents, uint32_t len, uint32_t flags) {
+	struct nbd_block_descriptor ext;
+
+	if(extents->len > 0) {
+		struct nbd_block_descriptor* last = &g_array_index(extents, struct nbd_block_descriptor, extents->len - 1);
+		if(last->status_flags == flags) {
+			last->length += len;
+			return;
+		}
+	}
+	ext.length = len;
+	ext.status_flags = flags;
+	g_array_append_val(extents, ext);
+}
+
+/**
+ * Find the status of the region of a file starting at a given offset.
+ *
+ * @param fd the file to look at
+ * @param off the offset to start at
+ * @param len the maximum length of the region
+ * @param flags [out] the status flags of the region
+ * @return the length of the region with status flags, at most len
+ **/
+static off_t file_extent(int fd, off_t off, off_t len, uint32_t* flags) {
+#ifdef SEEK_DATA
+	off_t next = lseek(fd, off, SEEK_DATA);
+
+	if(next < 0) {
+		/* ENXIO: nothing but a hole up to the end of the file;
+		 * anything else: we can't tell, so it's all data */
+		*flags = (errno == ENXIO) ? NBD_STATE_HOLE | NBD_STATE_ZERO : 0;
+		return len;
+	}
+	if(next > off) {
+		*flags = NBD_STATE_HOLE | NBD_STATE_ZERO;
+		return next - off < len ? next - off : len;
+	}
+	*flags = 0;
+	next = lseek(fd, off, SEEK_HOLE);
+	if(next < 0) {
+		return len;
+	}
+	return next - off < len ? next - off : len;
+#else
+	*flags = 0;
+	return len;
+#endif
+}
+
+/**
+ * Add the extents of the backend files (or tree) for a range of the
+ * export, without taking copy-on-write into account.
+ *
+ * @return the number of bytes covered, which is less than len only if
+ * maxext extents have been added
+ **/
+static uint64_t raw_block_status(CLIENT* client, uint64_t from, uint64_t len, GArray* extents, int maxext) {
+	uint64_t done = 0;
+	off_t cur;
+	uint32_t flags;
+	bool present;
+	int i = 0;
+
+	while(done < len && extents->len <= maxext) {
+		if(client->server->flags & F_TREEFILES) {
+			cur = treefile_extent(client->exportname, client->exportsize, from + done, len - done, &present);
+			flags = present ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+		} else if(client->server->flags & F_LOGSTRUCT) {
+			cur = logstruct_extent(client->logstruct, from + done, len - done, &present);
+			flags = present ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+		} else if(client->dedup) {
+			cur = dedup_extent(client->dedup, from + done, len - done, &present);
+			flags = present ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+#ifdef HAVE_ZLIB
+		} else if(client->compressed) {
+			cur = compressed_extent(client->compressed, from + done, len - done, &present);
+			flags = present ? 0 : NBD_STATE_HOLE | NBD_STATE_ZERO;
+#endif
+		} else {
+			FILE_INFO fi;
+			off_t end;
+
+			/* Find the file that holds from + done */
+			while(i + 1 < client->export->len && g_array_index(client->export, FILE_INFO, i + 1).startoff <= from + done) {
+				i++;
+			}
+			fi = g_array_index(client->export, FILE_INFO, i);
+			end = (i + 1 < client->export->len) ? g_array_index(client->export, FILE_INFO, i + 1).startoff : client->exportsize;
+			if(end > from + len) {
+				end = from + len;
+			}
+			cur = file_extent(fi.fhandle, from + done - fi.startoff, end - (from + done), &flags);
+			if(cur <= 0) {
+				/* The file changed under us; don't loop forever */
+				cur = end - (from + done);
+				flags = 0;
+			}
+		}
+		if(extents->len == maxext && g_array_index(extents, struct nbd_block_descriptor, maxext - 1).status_flags != flags) {
+			break;
+		}
+		add_extent(extents, cur, flags);
+		done += cur;
+	}
+	return done;
+}
+
+GArray* expblockstatus(CLIENT* client, uint64_t from, uint32_t len, int maxext) {
+	GArray* extents;
+	uint64_t end = from + len;
+	uint64_t pos = from;
+
+	if(len == 0 || maxext <= 0 || end > client->exportsize) {
+		errno = EINVAL;
+		return NULL;
+	}
+	extents = g_array_new(FALSE, FALSE, sizeof(struct nbd_block_descriptor));
+	if(!(client->server->flags & F_COPYONWRITE)) {
+		raw_block_status(client, from, len, extents, maxext);
+		return extents;
+	}
+	/* Pages that are in the diff file are allocated; for all others,
+	 * ask the backend */
+	while(pos < end && extents->len <= maxext) {
+		uint64_t page = pos / DIFFPAGESIZE;
+		uint64_t npages = client->exportsize / DIFFPAGESIZE;
+		uint64_t runend = pos;
+		bool mapped = page < npages && client->difmap[page] != (uint32_t)-1;
+
+		do {
+			runend = (page + 1) * DIFFPAGESIZE;
+			page++;
+		} while(runend < end && (page < npages && client->difmap[page] != (uint32_t)-1) == mapped);
+		if(runend > end) {
+			runend = end;
+		}
+		if(mapped) {
+			if(extents->len == maxext && g_array_index(extents, struct nbd_block_descriptor, maxext - 1).status_flags != 0) {
+				break;
+			}
+			add_extent(extents, runend - pos, 0);
+		} else if(raw_block_status(client, pos, runend - pos, extents, maxext) < runend - pos) {
+			break;
+		}
+		pos = runend;
+	}
+	return extents;
+}
+
 void myseek(int handle,off_t a) {
 	if (lseek(handle, a, SEEK_SET) < 0) {
 		err("Can not seek locally!\n");
@@ -10,6 +10,7 @@
 #include <sys/socket.h>
 #include <sys/types.h>
 #include "nbd.h"
+#include "qos.h"
 
 /* Structures */
 
@@ -46,6 +47,41 @@ typedef struct {
 	int failtime;        /** Timer before falling the fuck over. */
 	gchar* transactionlog;/**< filename for transaction log */
 	gchar* cowdir;	     /**< directory for copy-on-write diff files. */
+	uint64_t readcachesize;/**< size of the shared read cache, or 0 */
+	struct readcache* readcache;/**< shared read cache, set up by the
+				  master before any child is forked */
+	int readahead;	     /**< maximum size of the read-ahead window, 0
+				  to disable read-ahead */
+	uint64_t writecachesize;/**< maximum amount of dirty data in the
+				  write-back cache, or 0 for no cache */
+	uint64_t writecachebackground;/**< amount of dirty data above which
+				  we start writing back at once */
+	gchar* writecachejournal;/**< journal file for the write-back cache */
+	gchar* dedupstore;   /**< chunk store directory of a deduplicated
+				  export, or NULL */
+	uint64_t compressedcache;/**< size of the cache of decompressed
+				  chunks of a compressed export */
+	gchar* encryptionkey;/**< key file of an encrypted export, or NULL */
+	gchar* checksumfile; /**< file with the checksums of the blocks of
+				  the export, or NULL */
+	uint64_t scrubrate;  /**< bytes per second the scrubber verifies,
+				  or 0 for no scrubbing */
+	uint64_t qoslimits[2][QOS_NLIMITS];/**< rate limits per export and
+				  per client address, or 0 */
+	int qosburst;	     /**< milliseconds the rate limits may be
+				  exceeded for after a quiet period */
+	struct qos* qos;     /**< shared rate limits, set up by the master
+				  before any child is forked */
+	int maxmerge;	     /**< largest request we merge queued adjacent
+				  requests into, or 0 to not merge them */
+	int splitread;	     /**< size of the parts that larger reads are
+				  split into, or 0 to not split reads */
+	struct handles* handles;/**< files of the export, opened by the
+				  master in advance, or NULL */
+	int maxinflight;     /**< most requests a connection may have in
+				  flight, or 0 for no limit of its own */
+	uint64_t maxinflightbytes;/**< most bytes a connection may have in
+				  flight, or 0 for no limit of its own */
 } SERVER;
 
 /**
@@ -67,10 +103,34 @@ typedef struct {
 			       make -m and -c mutually exclusive */
 	uint32_t difffilelen;     /**< number of pages in difffile */
 	uint32_t *difmap;	     /**< see comment on the global difmap for this one */
+	pthread_mutex_t difflock; /**< taken to give a page of difffile to a
+				    page of the export, so that requests
+				    on several threads don't both do */
 	gboolean modern;     /**< client was negotiated using modern negotiation protocol */
 	int transactionlogfd;/**< fd for transaction log */
 	int clientfeats;     /**< Features supported by this client */
 	pthread_mutex_t lock;
+	gboolean structured; /**< client negotiated structured replies */
+	gboolean alloc_ctx;  /**< client selected the base:allocation
+			          metadata context */
+	gboolean go; /**< export was selected with NBD_OPT_GO, and is set up already */
+	GAsyncQueue* cachequeue; /**< ranges to prefetch for NBD_CMD_CACHE */
+	gint cachepending; /**< number of bytes queued in cachequeue */
+	gint readsinflight; /**< number of reads not yet handled */
+	struct readahead* readahead; /**< sequential stream detector */
+	uint64_t readcachetag; /**< identifies the files of the export in
+				    the shared read cache */
+	struct writecache* writecache; /**< write-back cache, if any */
+	int journalfd; /**< fd of the write-back cache journal, or -1 */
+	struct logstruct* logstruct; /**< log-structured store, if F_LOGSTRUCT */
+	struct dedup* dedup; /**< block map of a deduplicated export, if any */
+	struct compressed* compressed; /**< compressed image, if F_COMPRESSED */
+	struct cipher* cipher; /**< encryption of the export, if any */
+	struct checksums* checksums; /**< checksums of the blocks, if any */
+	gint scrubstop; /**< set to stop the scrubber */
+	struct inflight* inflight; /**< budget of the requests in flight, or NULL */
+	gboolean readinline; /**< try to answer small reads from the page
+				  cache before handing them to a worker */
 } CLIENT;
 
 /**
@@ -83,6 +143,8 @@ typedef struct {
 
 /* Constants and macros */
 
+#define DIFFPAGESIZE 4096 /**< diff file uses those chunks */
+
 /**
  * Error domain common for all NBD server errors.
  **/
@@ -108,6 +170,7 @@ typedef enum {
         NBDS_ERR_SO_LINGER,               /**< Failed to set SO_LINGER to a socket */
         NBDS_ERR_SO_REUSEADDR,            /**< Failed to set SO_REUSEADDR to a socket */
         NBDS_ERR_SO_KEEPALIVE,            /**< Failed to set SO_KEEPALIVE to a socket */
+        NBDS_ERR_SO_REUSEPORT,            /**< Failed to set SO_REUSEPORT to a socket */
         NBDS_ERR_GAI,                     /**< Failed to get address info */
         NBDS_ERR_SOCKET,                  /**< Failed to create a socket */
         NBDS_ERR_BIND,                    /**< Failed to bind an address to socket */
@@ -145,6 +208,9 @@ typedef enum {
 #define F_FIXED 4096	  /**< Client supports fixed new-style protocol (and can thus send us extra options */
 #define F_TREEFILES 8192	  /**< flag to tell us a file is exported using -t */
 #define F_SPLICE 16384	  /**< flag to tell us to use splice for read/write operations */
+#define F_LOGSTRUCT 32768 /**< flag to tell us the export is a log-structured store */
+#define F_COMPRESSED 65536 /**< flag to tell us the export is a compressed image */
+#define F_DETECTZEROES 131072 /**< flag to tell us to turn written blocks of zeroes into holes */
 
 /* Functions */
 
@@ -203,6 +269,21 @@ uint64_t size_autodetect(int fhandle);
  **/
 int exptrim(struct nbd_request* req, CLIENT* client);
 
+/**
+ * Find out which parts of a range of the export are allocated, for the
+ * base:allocation metadata context. Adjacent extents with the same
+ * status are merged.
+ *
+ * @param client the client for which we're processing this request
+ * @param from the offset of the first byte to report on
+ * @param len the number of bytes to report on
+ * @param maxext the maximum number of extents to return
+ * @return a GArray of struct nbd_block_descriptor, in host byte order,
+ * covering at least the first byte of the range; or NULL with errno
+ * set on failure
+ **/
+GArray* expblockstatus(CLIENT* client, uint64_t from, uint32_t len, int maxext);
+
 /**
  * seek to a position in a file, with error handling.
  * @param handle a filedescriptor
@@ -0,0 +1,220 @@
+/*
+ * Rate limits on exports, in shared memory so that they hold across all
+ * children that serve an export.
+ *
+ * Every limit is a token bucket, kept as the generic cell rate algorithm
+ * does: as the time at which the bucket would be full again. Charging a
+ * request moves that time forward by the time the limit allows for the
+ * request, and the request may go ahead once it is less than the burst
+ * allowance ahead of the clock. That state is a single number, so it is
+ * updated with a compare-and-swap, and no locks are needed.
+ *
+ * The buckets of client addresses are kept in a set-associative table; a
+ * new address takes over an idle slot of its set.
+ *
+ * So that one client can't take all of an export's limits, every client
+ * also has a bucket for its share of them, which a request has to get
+ * through before it is charged to the export. The share is the export's
+ * limit divided by the number of clients that used the export lately,
+ * which is counted again at most once a millisecond. A client with a
+ * backlog of requests then waits in its own bucket, and the export's
+ * buckets are left to the requests of the others.
+ */
+#include "lfs.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include "qos.h"
+
+#define QOS_SETS 64	/**< number of sets of client slots */
+#define QOS_WAYS 8	/**< number of slots in a set */
+#define QOS_RECOUNT 1000000	/**< how often the active clients are counted, in ns */
+#define QOS_ACTIVE 100000000	/**< how long a client counts as active after its share was used, in ns */
+
+struct qos_slot {
+	uint64_t key;	/**< hash of the client address, or 0 if the slot is empty */
+	uint64_t full[QOS_NLIMITS];	/**< when the buckets are full again, in ns */
+	uint64_t share[QOS_NLIMITS];	/**< when the buckets of the client's share of the export are full again */
+};
+
+struct qos {
+	uint64_t limits[2][QOS_NLIMITS];
+	uint64_t burst;	/**< in ns */
+	uint64_t full[QOS_NLIMITS];	/**< when the export's buckets are full again */
+	uint64_t counted;	/**< when the active clients were last counted, in ns */
+	uint64_t nactive;	/**< the number of active clients then */
+	struct qos_slot slots[QOS_SETS][QOS_WAYS];
+};
+
+struct qos* qos_new(const uint64_t limits[2][QOS_NLIMITS], unsigned int burst) {
+	struct qos* q;
+
+	/* Anonymous memory is zeroed, so all buckets start out full */
+	q = mmap(NULL, sizeof(struct qos), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(q == MAP_FAILED)
+		return NULL;
+	memcpy(q->limits, limits, sizeof(q->limits));
+	q->burst = (uint64_t)burst * 1000000;
+	return q;
+}
+
+void qos_free(struct qos* q) {
+	munmap(q, sizeof(struct qos));
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t addr_key(const struct sockaddr_storage* addr) {
+	const unsigned char* p = NULL;
+	size_t len = 0;
+	uint64_t hash = 14695981039346656037ULL;
+
+	if(addr->ss_family == AF_INET) {
+		p = (const unsigned char*)&((const struct sockaddr_in*)addr)->sin_addr;
+		len = sizeof(struct in_addr);
+	} else if(addr->ss_family == AF_INET6) {
+		p = (const unsigned char*)&((const struct sockaddr_in6*)addr)->sin6_addr;
+		len = sizeof(struct in6_addr);
+	}
+	hash = (hash ^ addr->ss_family) * 1099511628211ULL;
+	while(len--)
+		hash = (hash ^ *p++) * 1099511628211ULL;
+	return hash ? hash : 1;
+}
+
+/**
+ * Find the slot of a client address, or take one over for it.
+ **/
+static struct qos_slot* find_slot(struct qos* q, uint64_t key, uint64_t now) {
+	struct qos_slot* set = q->slots[key % QOS_SETS];
+	struct qos_slot* victim = &set[0];
+	uint64_t victimfull = UINT64_MAX;
+	uint64_t old, full;
+	int i, j;
+
+	for(i = 0; i < QOS_WAYS; i++) {
+		if(__atomic_load_n(&set[i].key, __ATOMIC_RELAXED) == key)
+			return &set[i];
+	}
+	for(i = 0; i < QOS_WAYS; i++) {
+		old = __atomic_load_n(&set[i].key, __ATOMIC_RELAXED);
+		for(j = 0, full = 0; j < QOS_NLIMITS; j++) {
+			full = MAX(full, __atomic_load_n(&set[i].full[j], __ATOMIC_RELAXED));
+			full = MAX(full, __atomic_load_n(&set[i].share[j], __ATOMIC_RELAXED));
+		}
+		/* A slot whose buckets are full is as good as a new one */
+		if((old == 0 || full <= now) &&
+		   __atomic_compare_exchange_n(&set[i].key, &old, key, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			return &set[i];
+		if(full < victimfull) {
+			victim = &set[i];
+			victimfull = full;
+		}
+	}
+	/* Every slot is busy; share the one that will be idle first,
+	 * which is the best we can do without a lock */
+	return victim;
+}
+
+/**
+ * Charge a bucket
+ *
+ * @param full when the bucket is full again
+ * @param limit units per second
+ * @return when the request may go ahead
+ **/
+static uint64_t charge(struct qos* q, uint64_t* full, uint64_t limit, uint64_t units, uint64_t now) {
+	uint64_t old, next;
+	uint64_t cost;
+
+	if(!limit)
+		return now;
+	cost = (uint64_t)((double)units * 1000000000 / limit);
+	old = __atomic_load_n(full, __ATOMIC_RELAXED);
+	do {
+		next = MAX(old, now) + cost;
+	} while(!__atomic_compare_exchange_n(full, &old, next, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return next > q->burst ? next - q->burst : 0;
+}
+
+/**
+ * Count the clients that used their share of the export lately, or return
+ * the last count if that is recent enough. One caller does the counting,
+ * while the others go on with the old count.
+ **/
+static uint64_t active_clients(struct qos* q, uint64_t now) {
+	uint64_t counted = __atomic_load_n(&q->counted, __ATOMIC_RELAXED);
+	uint64_t n = 0;
+	uint64_t share;
+	int i, j, k;
+
+	if(now - counted >= QOS_RECOUNT &&
+	   __atomic_compare_exchange_n(&q->counted, &counted, now, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		for(i = 0; i < QOS_SETS; i++) {
+			for(j = 0; j < QOS_WAYS; j++) {
+				for(k = 0; k < QOS_NLIMITS; k++) {
+					share = __atomic_load_n(&q->slots[i][j].share[k], __ATOMIC_RELAXED);
+					if(share && share + QOS_ACTIVE > now) {
+						n++;
+						break;
+					}
+				}
+			}
+		}
+		__atomic_store_n(&q->nactive, n, __ATOMIC_RELAXED);
+	} else {
+		n = __atomic_load_n(&q->nactive, __ATOMIC_RELAXED);
+	}
+	return n ? n : 1;
+}
+
+uint64_t qos_share(struct qos* q, const struct sockaddr_storage* addr, bool write, uint64_t len) {
+	int iops = write ? QOS_WRITE_IOPS : QOS_READ_IOPS;
+	int bps = write ? QOS_WRITE_BPS : QOS_READ_BPS;
+	uint64_t now = now_ns();
+	uint64_t start[2];
+	struct qos_slot* slot;
+	uint64_t n;
+
+	if(!q->limits[QOS_EXPORT][iops] && !q->limits[QOS_EXPORT][bps])
+		return 0;
+	slot = find_slot(q, addr_key(addr), now);
+	n = active_clients(q, now);
+	/* A share of 1/n of the limit costs n times as much */
+	start[0] = charge(q, &slot->share[iops], q->limits[QOS_EXPORT][iops], n, now);
+	start[1] = charge(q, &slot->share[bps], q->limits[QOS_EXPORT][bps], len * n, now);
+	start[0] = MAX(start[0], start[1]);
+	return start[0] > now ? (start[0] - now) / 1000 : 0;
+}
+
+uint64_t qos_charge(struct qos* q, const struct sockaddr_storage* addr, bool write, uint64_t len) {
+	int iops = write ? QOS_WRITE_IOPS : QOS_READ_IOPS;
+	int bps = write ? QOS_WRITE_BPS : QOS_READ_BPS;
+	uint64_t now = now_ns();
+	uint64_t start[4];
+	struct qos_slot* slot;
+
+	start[0] = charge(q, &q->full[iops], q->limits[QOS_EXPORT][iops], 1, now);
+	start[1] = charge(q, &q->full[bps], q->limits[QOS_EXPORT][bps], len, now);
+	start[2] = start[3] = now;
+	if(q->limits[QOS_CLIENT][iops] || q->limits[QOS_CLIENT][bps]) {
+		slot = find_slot(q, addr_key(addr), now);
+		start[2] = charge(q, &slot->full[iops], q->limits[QOS_CLIENT][iops], 1, now);
+		start[3] = charge(q, &slot->full[bps], q->limits[QOS_CLIENT][bps], len, now);
+	}
+	start[0] = MAX(MAX(start[0], start[1]), MAX(start[2], start[3]));
+	return start[0] > now ? (start[0] - now) / 1000 : 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * Limits on the rate of requests and bytes, shared by all children that
+ * serve the same export
+ */
+#ifndef NBD_QOS_H
+#define NBD_QOS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+
+#define QOS_READ_IOPS 0 /**< read requests per second */
+#define QOS_READ_BPS 1 /**< bytes read per second */
+#define QOS_WRITE_IOPS 2 /**< write requests per second */
+#define QOS_WRITE_BPS 3 /**< bytes written per second */
+#define QOS_NLIMITS 4
+
+#define QOS_EXPORT 0 /**< limits on all connections to an export together */
+#define QOS_CLIENT 1 /**< limits on the connections from one address */
+
+#define QOS_DEFAULT_BURST 1000 /**< default burst allowance, in milliseconds */
+
+struct qos;
+
+/**
+ * Set up the rate limits of an export, in memory that children forked
+ * later share.
+ *
+ * @param limits the limits per export and per client address, indexed by
+ * QOS_EXPORT or QOS_CLIENT and then by QOS_READ_IOPS and friends; 0 is
+ * no limit
+ * @param burst for how many milliseconds an idle export or client may go
+ * beyond its limits
+ * @return the limits, or NULL with errno set
+ **/
+struct qos* qos_new(const uint64_t limits[2][QOS_NLIMITS], unsigned int burst);
+
+void qos_free(struct qos* q);
+
+/**
+ * Hold a request back until it is within the share of the export's limits
+ * of its client, before it is charged with qos_charge(). The limits of an
+ * export are split evenly between the client addresses that used it
+ * lately, so a client that sends many requests, or uses many connections,
+ * waits for its own share rather than taking the turns of the others.
+ *
+ * @param addr the address of the client
+ * @param write whether the request writes
+ * @param len the number of bytes it transfers
+ * @return the number of microseconds to wait before charging it
+ **/
+uint64_t qos_share(struct qos* q, const struct sockaddr_storage* addr, bool write, uint64_t len);
+
+/**
+ * Account for a request, and find out how long it has to be held back to
+ * stay within the limits. Requests are charged in the order in which
+ * they come in, so they are also let through in that order.
+ *
+ * @param addr the address of the client
+ * @param write whether the request writes
+ * @param len the number of bytes it transfers
+ * @return the number of microseconds to wait before handling it
+ **/
+uint64_t qos_charge(struct qos* q, const struct sockaddr_storage* addr, bool write, uint64_t len);
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ * Sequential stream detection for server-side read-ahead.
+ */
+#include "lfs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <glib.h>
+
+#include "readahead.h"
+
+struct readahead* readahead_new(uint32_t maxwindow) {
+	struct readahead* ra = g_new0(struct readahead, 1);
+
+	ra->maxwindow = maxwindow;
+	return ra;
+}
+
+void readahead_free(struct readahead* ra) {
+	g_free(ra);
+}
+
+bool readahead_access(struct readahead* ra, uint64_t from, uint32_t len,
+		uint64_t size, uint64_t* rafrom, uint64_t* ralen) {
+	struct readahead_stream* s = NULL;
+	struct readahead_stream* victim = &(ra->streams[0]);
+	uint64_t end = from + len;
+	uint64_t newend;
+	int i;
+
+	ra->counter++;
+	for(i = 0; i < READAHEAD_STREAMS; i++) {
+		struct readahead_stream* cur = &(ra->streams[i]);
+		/* Prefer an unused stream as victim, or else the one
+		 * that was used least recently */
+		if(cur->seqcount == 0) {
+			if(victim->seqcount != 0)
+				victim = cur;
+			continue;
+		}
+		if(victim->seqcount != 0 && cur->lastuse < victim->lastuse)
+			victim = cur;
+		if(from == cur->next) {
+			s = cur;
+			break;
+		}
+		if(from > cur->next && from - cur->next <= cur->window) {
+			/* The reader skipped part of what we read ahead */
+			s = cur;
+			s->window /= 2;
+			if(s->window < READAHEAD_MINWINDOW)
+				s->window = READAHEAD_MINWINDOW;
+			break;
+		}
+	}
+	if(!s) {
+		victim->next = end;
+		victim->raend = end;
+		victim->lastuse = ra->counter;
+		victim->window = READAHEAD_MINWINDOW;
+		if(victim->window > ra->maxwindow)
+			victim->window = ra->maxwindow;
+		victim->seqcount = 1;
+		return false;
+	}
+
+	s->next = end;
+	s->lastuse = ra->counter;
+	s->seqcount++;
+	if(s->raend < end)
+		s->raend = end;
+	if(s->seqcount < READAHEAD_TRIGGER)
+		return false;
+	/* Wait until half of what we read ahead has been used */
+	if(s->raend - end > s->window / 2)
+		return false;
+	if(s->seqcount > READAHEAD_TRIGGER) {
+		s->window *= 2;
+		if(s->window > ra->maxwindow)
+			s->window = ra->maxwindow;
+	}
+	newend = end + s->window;
+	if(newend > size)
+		newend = size;
+	if(newend <= s->raend)
+		return false;
+	*rafrom = s->raend;
+	*ralen = newend - s->raend;
+	s->raend = newend;
+	return true;
+}
@@ -0,0 +1,63 @@
+/**
+ * Detection of sequential streams, to decide what to read ahead
+ */
+#ifndef NBD_READAHEAD_H
+#define NBD_READAHEAD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define READAHEAD_STREAMS 8 /**< number of streams we track per client */
+#define READAHEAD_TRIGGER 3 /**< number of sequential reads before we start reading ahead */
+#define READAHEAD_MINWINDOW (128*1024) /**< initial size of the read-ahead window */
+
+/**
+ * A stream of sequential reads
+ **/
+struct readahead_stream {
+	uint64_t next;		/**< where we expect the next read of the stream */
+	uint64_t raend;		/**< end of what we've read ahead so far */
+	uint64_t lastuse;	/**< access counter at the last read of the stream */
+	uint32_t window;	/**< current size of the read-ahead window */
+	uint32_t seqcount;	/**< number of sequential reads seen, 0 if unused */
+};
+
+struct readahead {
+	struct readahead_stream streams[READAHEAD_STREAMS];
+	uint64_t counter;	/**< number of reads seen */
+	uint32_t maxwindow;	/**< maximum size of the read-ahead window */
+};
+
+/**
+ * Create the stream detector for a client. This isn't thread-safe; it
+ * must only be used from the thread that reads requests.
+ *
+ * @param maxwindow the maximum number of bytes to read ahead of a stream
+ **/
+struct readahead* readahead_new(uint32_t maxwindow);
+
+/**
+ * Release a stream detector.
+ **/
+void readahead_free(struct readahead* ra);
+
+/**
+ * Record a read, and find out whether we should read ahead because of it.
+ * A read that continues a stream, or skips only a little of it, is part of
+ * that stream; any other read starts a new one, replacing the stream that
+ * was used least recently. Once a stream has seen READAHEAD_TRIGGER reads,
+ * we keep a window of data read ahead of it. The window doubles every time
+ * the reader has used up half of it, and is halved again when the reader
+ * skips over data that we read ahead.
+ *
+ * @param from the offset of the read
+ * @param len the length of the read
+ * @param size the size of the export; we never read ahead past it
+ * @param rafrom set to the offset of the range to read ahead
+ * @param ralen set to the length of the range to read ahead
+ * @return true if there is something to read ahead
+ **/
+bool readahead_access(struct readahead* ra, uint64_t from, uint32_t len,
+		uint64_t size, uint64_t* rafrom, uint64_t* ralen);
+
+#endif
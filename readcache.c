@@ -0,0 +1,131 @@
+/*
+ * Shared-memory block cache, shared by all children that serve the same
+ * read-only (or copy-on-write base) export.
+ *
+ * The cache is set-associative: a block can only live in one of the
+ * READCACHE_WAYS slots of the set it hashes to, and CLOCK picks the slot
+ * to evict within that set. There are no locks; every slot has a sequence
+ * number that is odd while the slot is being written, so readers can
+ * detect that they raced with a writer, and writers claim a slot with a
+ * compare-and-swap on it.
+ */
+#include "lfs.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+
+#include "readcache.h"
+
+#define READCACHE_WAYS 8 /**< number of slots in a set */
+
+struct readcache_slot {
+	uint64_t key;	/**< block number plus one, or 0 if the slot is empty */
+	uint64_t tag;	/**< files that the block was read from */
+	gint seq;	/**< odd while the slot is being written */
+	gint ref;	/**< CLOCK reference bit */
+};
+
+struct readcache_set {
+	struct readcache_slot slot[READCACHE_WAYS];
+	gint hand;	/**< CLOCK hand */
+};
+
+struct readcache {
+	size_t maplen;	/**< size of the whole mapping */
+	uint64_t nsets;	/**< number of sets */
+	char* data;	/**< the blocks, READCACHE_WAYS per set */
+	struct readcache_set sets[];
+};
+
+struct readcache* readcache_new(uint64_t size) {
+	struct readcache* cache;
+	uint64_t nsets = size / (READCACHE_BLOCKSIZE * READCACHE_WAYS);
+	size_t hdrlen;
+	size_t maplen;
+
+	if(nsets < 1)
+		nsets = 1;
+	hdrlen = sizeof(struct readcache) + nsets * sizeof(struct readcache_set);
+	hdrlen = (hdrlen + READCACHE_BLOCKSIZE - 1) / READCACHE_BLOCKSIZE * READCACHE_BLOCKSIZE;
+	maplen = hdrlen + nsets * READCACHE_WAYS * READCACHE_BLOCKSIZE;
+	/* Anonymous memory is zeroed, so all slots start out empty */
+	cache = mmap(NULL, maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(cache == MAP_FAILED)
+		return NULL;
+	cache->maplen = maplen;
+	cache->nsets = nsets;
+	cache->data = (char*)cache + hdrlen;
+	return cache;
+}
+
+void readcache_free(struct readcache* cache) {
+	munmap(cache, cache->maplen);
+}
+
+static inline char* slot_data(struct readcache* cache, uint64_t set, int way) {
+	return cache->data + (set * READCACHE_WAYS + way) * READCACHE_BLOCKSIZE;
+}
+
+bool readcache_get(struct readcache* cache, uint64_t tag, uint64_t block, char* buf) {
+	uint64_t set = block % cache->nsets;
+	struct readcache_slot* slot;
+	gint seq;
+	int i;
+
+	for(i = 0; i < READCACHE_WAYS; i++) {
+		slot = &(cache->sets[set].slot[i]);
+		seq = g_atomic_int_get(&slot->seq);
+		if((seq & 1) || slot->key != block + 1 || slot->tag != tag)
+			continue;
+		if(buf)
+			memcpy(buf, slot_data(cache, set, i), READCACHE_BLOCKSIZE);
+		/* If a writer got in, what we copied may be garbage. The
+		 * copy is made of plain loads, which must not be moved past
+		 * the check */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if(g_atomic_int_get(&slot->seq) != seq)
+			continue;
+		g_atomic_int_set(&slot->ref, 1);
+		return true;
+	}
+	return false;
+}
+
+void readcache_put(struct readcache* cache, uint64_t tag, uint64_t block, const char* buf) {
+	uint64_t set = block % cache->nsets;
+	struct readcache_set* s = &(cache->sets[set]);
+	struct readcache_slot* slot;
+	gint hand;
+	gint seq;
+	int i;
+
+	if(readcache_get(cache, tag, block, NULL))
+		return;
+	/* Two rounds of the clock are enough to find a slot that wasn't
+	 * referenced since the hand last passed it */
+	for(i = 0; i < 2 * READCACHE_WAYS; i++) {
+		/* Races on the hand only make eviction slightly less fair */
+		hand = g_atomic_int_get(&s->hand) % READCACHE_WAYS;
+		g_atomic_int_set(&s->hand, (hand + 1) % READCACHE_WAYS);
+		slot = &(s->slot[hand]);
+		if(g_atomic_int_get(&slot->ref)) {
+			g_atomic_int_set(&slot->ref, 0);
+			continue;
+		}
+		seq = g_atomic_int_get(&slot->seq);
+		if(seq & 1)
+			continue;
+		if(!g_atomic_int_compare_and_exchange(&slot->seq, seq, seq + 1))
+			continue;
+		slot->key = block + 1;
+		slot->tag = tag;
+		memcpy(slot_data(cache, set, hand), buf, READCACHE_BLOCKSIZE);
+		g_atomic_int_set(&slot->seq, seq + 2);
+		return;
+	}
+}
@@ -0,0 +1,48 @@
+/**
+ * Shared-memory block cache for exports whose data doesn't change
+ */
+#ifndef NBD_READCACHE_H
+#define NBD_READCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define READCACHE_BLOCKSIZE 4096 /**< size of the blocks in the read cache */
+
+struct readcache;
+
+/**
+ * Create a read cache in shared memory. This must be done before forking,
+ * so that the children all use the same cache.
+ *
+ * @param size the (approximate) number of bytes of data to cache
+ * @return the cache, or NULL with errno set on failure
+ **/
+struct readcache* readcache_new(uint64_t size);
+
+/**
+ * Release a read cache.
+ **/
+void readcache_free(struct readcache* cache);
+
+/**
+ * Look up a block in the cache.
+ *
+ * @param tag identifies the files that the block was read from; a block
+ * that was added with another tag is not found, so that a connection to
+ * an export whose file was replaced or resized doesn't see the old data
+ * @param block the number of the block, in units of READCACHE_BLOCKSIZE
+ * @param buf where to copy the block to, if it's there; may be NULL to
+ * only check whether it is
+ * @return true if the block was found
+ **/
+bool readcache_get(struct readcache* cache, uint64_t tag, uint64_t block, char* buf);
+
+/**
+ * Add a block to the cache, evicting another one if need be. This is only
+ * a best effort; if another process is busy with the same part of the
+ * cache, the block is not added.
+ **/
+void readcache_put(struct readcache* cache, uint64_t tag, uint64_t block, const char* buf);
+
+#endif
@@ -0,0 +1,412 @@
+/*
+ * A pool of worker threads with a queue per class of request.
+ *
+ * Classes take turns by stride scheduling: every class has a pass, which
+ * goes up by the inverse of its weight whenever one of its requests is
+ * handed out, and a free worker takes the request of the class with the
+ * lowest pass. A class that was idle for a while starts out at the pass
+ * of the last request handed out, so that it cannot save up turns.
+ *
+ * So that the workers don't all contend for one lock, the queues come in
+ * shards, one for every worker, each with a lock of its own. Work is
+ * queued in the shard of its position, and a worker takes work from its
+ * own shard first, and steals it from the others when that is empty. The
+ * number of workers on every class is kept in a single word, which is
+ * updated with a compare-and-swap, so that the workers kept for small
+ * reads are kept exactly without a global lock. That lock is only taken
+ * to start, stop, and wake up workers.
+ */
+#include "lfs.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include <glib.h>
+
+#include "reqsched.h"
+
+#define REQSCHED_STRIDE (1 << 20)
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+
+/** How many turns every class gets, relative to the others */
+static const int weight[REQSCHED_NCLASSES] = { 8, 2, 4, 2 };
+/** The best-effort I/O priority level of every class; lower is better */
+static const int iolevel[REQSCHED_NCLASSES] = { 0, 4, 4, 6 };
+
+struct reqsched_item {
+	void* data;
+	uint64_t queued;	/**< when the work was queued, in ns */
+	struct reqsched_item* next;
+};
+
+struct reqsched_queue {
+	struct reqsched_item* head;
+	struct reqsched_item* tail;
+	uint64_t pass;
+};
+
+struct reqsched_shard {
+	pthread_mutex_t lock;
+	struct reqsched_queue queues[REQSCHED_NCLASSES];
+	uint64_t pass;	/**< pass of the last work handed out */
+	int queued;	/**< number of queued pieces of work; read without
+			     the lock to skip empty shards */
+};
+
+struct reqsched {
+	void (*func)(void* data);
+	bool (*merge)(void* data, void* other);
+	struct reqsched_shard* shards;
+	int nshards;
+	uint64_t busy;	/**< number of workers on every class, REQSCHED_BUSYBITS
+			     bits per class */
+	unsigned int events;	/**< goes up when work is queued or done, so
+				     that a worker that is about to wait can
+				     see that it missed some */
+	int threads;	/**< maximum number of workers */
+	int waiting;	/**< number of workers waiting for work */
+	pthread_mutex_t lock;	/**< protects the fields below */
+	pthread_cond_t work;	/**< signalled when there may be work to take */
+	pthread_cond_t done;	/**< signalled when a worker stops */
+	void (*start)(void* arg);
+	void* startarg;
+	int nthreads;	/**< number of running workers */
+	int nextshard;	/**< own shard of the next worker that starts */
+	bool ioprio;
+	bool stop;
+};
+
+#define REQSCHED_BUSYBITS 16
+#define BUSY(busy, cls) ((int)(((busy) >> ((cls) * REQSCHED_BUSYBITS)) & ((1 << REQSCHED_BUSYBITS) - 1)))
+#define BUSYONE(cls) ((uint64_t)1 << ((cls) * REQSCHED_BUSYBITS))
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * The number of workers kept for a class; a quarter of them, for small
+ * reads
+ **/
+static int reserved(int threads, int cls) {
+	if(cls != REQSCHED_SMALLREAD || threads < 2)
+		return 0;
+	return (threads + 3) / 4;
+}
+
+/**
+ * Whether a worker may take work of a class, which it may unless that
+ * would take a worker that is kept for another class
+ *
+ * @param busy the number of workers on every class
+ **/
+static bool may_take(struct reqsched* s, uint64_t busy, int cls) {
+	int threads = __atomic_load_n(&(s->threads), __ATOMIC_RELAXED);
+	int idle = threads;
+	int kept = 0;
+	int i;
+
+	for(i = 0; i < REQSCHED_NCLASSES; i++) {
+		idle -= BUSY(busy, i);
+		if(i != cls && reserved(threads, i) > BUSY(busy, i))
+			kept += reserved(threads, i) - BUSY(busy, i);
+	}
+	return idle > kept;
+}
+
+/**
+ * Count a worker as busy on a class, if it may take work of that class
+ **/
+static bool claim(struct reqsched* s, int cls) {
+	uint64_t busy = __atomic_load_n(&(s->busy), __ATOMIC_RELAXED);
+
+	do {
+		if(!may_take(s, busy, cls))
+			return false;
+	} while(!__atomic_compare_exchange_n(&(s->busy), &busy, busy + BUSYONE(cls),
+				false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	return true;
+}
+
+/**
+ * Choose the class to take work from in a shard
+ *
+ * @return the class, or -1 if there is no work we may take
+ **/
+static int pick(struct reqsched* s, struct reqsched_shard* sh) {
+	uint64_t busy = __atomic_load_n(&(s->busy), __ATOMIC_RELAXED);
+	uint64_t now = 0;
+	int best = -1;
+	int oldest = -1;
+	int i;
+
+	for(i = 0; i < REQSCHED_NCLASSES; i++) {
+		struct reqsched_queue* q = &(sh->queues[i]);
+		if(!q->head || !may_take(s, busy, i))
+			continue;
+		if(!now)
+			now = now_ns();
+		if(q->head->queued + (uint64_t)REQSCHED_MAXWAIT * 1000 <= now &&
+		   (oldest < 0 || q->head->queued < sh->queues[oldest].head->queued))
+			oldest = i;
+		if(best < 0 || q->pass < sh->queues[best].pass)
+			best = i;
+	}
+	return oldest >= 0 ? oldest : best;
+}
+
+/**
+ * Let a piece of work take over the queued work that it can be merged
+ * with. Since every merge may make more work mergeable, keep going until
+ * nothing changes.
+ **/
+static void merge_queued(struct reqsched* s, struct reqsched_shard* sh, struct reqsched_queue* q, struct reqsched_item* item) {
+	struct reqsched_item* prev;
+	struct reqsched_item* cur;
+	struct reqsched_item* next;
+	bool merged = true;
+	int n;
+
+	while(merged) {
+		merged = false;
+		prev = NULL;
+		for(cur = q->head, n = 0; cur && n < REQSCHED_MERGESCAN; cur = next, n++) {
+			next = cur->next;
+			if(!s->merge(item->data, cur->data)) {
+				prev = cur;
+				continue;
+			}
+			if(prev)
+				prev->next = next;
+			else
+				q->head = next;
+			if(q->tail == cur)
+				q->tail = prev;
+			__atomic_sub_fetch(&(sh->queued), 1, __ATOMIC_RELAXED);
+			g_free(cur);
+			merged = true;
+		}
+	}
+}
+
+/**
+ * Take a piece of work from a shard
+ *
+ * @param cls set to the class of the work, which the caller is counted
+ * as busy on
+ * @return the work, or NULL if there is no work in the shard that we may
+ * take
+ **/
+static struct reqsched_item* take(struct reqsched* s, struct reqsched_shard* sh, int* cls) {
+	struct reqsched_queue* q;
+	struct reqsched_item* item;
+
+	if(!__atomic_load_n(&(sh->queued), __ATOMIC_RELAXED))
+		return NULL;
+	pthread_mutex_lock(&(sh->lock));
+	/* Another worker may have taken the last idle worker for a class
+	 * since we picked it */
+	while((*cls = pick(s, sh)) >= 0 && !claim(s, *cls));
+	if(*cls < 0) {
+		pthread_mutex_unlock(&(sh->lock));
+		return NULL;
+	}
+	q = &(sh->queues[*cls]);
+	item = q->head;
+	q->head = item->next;
+	if(!q->head)
+		q->tail = NULL;
+	sh->pass = q->pass;
+	q->pass += REQSCHED_STRIDE / weight[*cls];
+	__atomic_sub_fetch(&(sh->queued), 1, __ATOMIC_RELAXED);
+	if(s->merge && q->head)
+		merge_queued(s, sh, q, item);
+	pthread_mutex_unlock(&(sh->lock));
+	return item;
+}
+
+static int total_queued(struct reqsched* s) {
+	int queued = 0;
+	int i;
+
+	for(i = 0; i < s->nshards; i++)
+		queued += __atomic_load_n(&(s->shards[i].queued), __ATOMIC_RELAXED);
+	return queued;
+}
+
+/**
+ * Tell waiting workers that there may be work for them
+ **/
+static void wake(struct reqsched* s, bool all) {
+	__atomic_add_fetch(&(s->events), 1, __ATOMIC_SEQ_CST);
+	if(!__atomic_load_n(&(s->waiting), __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&(s->lock));
+	if(all)
+		pthread_cond_broadcast(&(s->work));
+	else
+		pthread_cond_signal(&(s->work));
+	pthread_mutex_unlock(&(s->lock));
+}
+
+static void set_ioprio(int cls) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+	/* With a pid of 0, this applies to the calling thread only */
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		(IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) | iolevel[cls]);
+#endif
+}
+
+static void* worker(void* arg) {
+	struct reqsched* s = arg;
+	struct reqsched_item* item;
+	void (*start)(void* arg);
+	void* startarg;
+	unsigned int events;
+	int prio = -1;
+	int self;
+	int cls;
+	int i;
+
+	pthread_mutex_lock(&(s->lock));
+	self = s->nextshard++ % s->nshards;
+	start = s->start;
+	startarg = s->startarg;
+	pthread_mutex_unlock(&(s->lock));
+	if(start)
+		start(startarg);
+	while(1) {
+		events = __atomic_load_n(&(s->events), __ATOMIC_SEQ_CST);
+		item = NULL;
+		for(i = 0; !item && i < s->nshards; i++)
+			item = take(s, &(s->shards[(self + i) % s->nshards]), &cls);
+		if(!item) {
+			pthread_mutex_lock(&(s->lock));
+			if(s->stop && !total_queued(s)) {
+				pthread_mutex_unlock(&(s->lock));
+				break;
+			}
+			__atomic_add_fetch(&(s->waiting), 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&(s->events), __ATOMIC_SEQ_CST) == events)
+				pthread_cond_wait(&(s->work), &(s->lock));
+			__atomic_sub_fetch(&(s->waiting), 1, __ATOMIC_SEQ_CST);
+			pthread_mutex_unlock(&(s->lock));
+			continue;
+		}
+
+		if(s->ioprio && cls != prio) {
+			set_ioprio(cls);
+			prio = cls;
+		}
+		s->func(item->data);
+		g_free(item);
+
+		__atomic_sub_fetch(&(s->busy), BUSYONE(cls), __ATOMIC_ACQ_REL);
+		/* Work that we were not allowed to take may be free now */
+		if(__atomic_load_n(&(s->waiting), __ATOMIC_SEQ_CST) && total_queued(s))
+			wake(s, true);
+	}
+	pthread_mutex_lock(&(s->lock));
+	__atomic_sub_fetch(&(s->nthreads), 1, __ATOMIC_RELAXED);
+	pthread_cond_signal(&(s->done));
+	pthread_mutex_unlock(&(s->lock));
+	return NULL;
+}
+
+struct reqsched* reqsched_new(void (*func)(void* data), bool (*merge)(void* data, void* other),
+		int threads, bool ioprio) {
+	struct reqsched* s = g_new0(struct reqsched, 1);
+	int i;
+
+	s->func = func;
+	s->merge = merge;
+	s->threads = threads > 0 ? threads : 1;
+	s->ioprio = ioprio;
+	/* Workers that are added later share the shards */
+	s->nshards = s->threads;
+	s->shards = g_new0(struct reqsched_shard, s->nshards);
+	for(i = 0; i < s->nshards; i++)
+		pthread_mutex_init(&(s->shards[i].lock), NULL);
+	pthread_mutex_init(&(s->lock), NULL);
+	pthread_cond_init(&(s->work), NULL);
+	pthread_cond_init(&(s->done), NULL);
+	return s;
+}
+
+void reqsched_set_threads(struct reqsched* s, int threads) {
+	if(threads <= 0)
+		return;
+	pthread_mutex_lock(&(s->lock));
+	__atomic_store_n(&(s->threads), threads, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(s->lock));
+}
+
+void reqsched_set_start(struct reqsched* s, void (*start)(void* arg), void* arg) {
+	pthread_mutex_lock(&(s->lock));
+	s->start = start;
+	s->startarg = arg;
+	pthread_mutex_unlock(&(s->lock));
+}
+
+void reqsched_push(struct reqsched* s, int cls, uint64_t pos, void* data) {
+	struct reqsched_item* item = g_new0(struct reqsched_item, 1);
+	struct reqsched_shard* sh = &(s->shards[(pos / REQSCHED_LOCALITY) % s->nshards]);
+	struct reqsched_queue* q = &(sh->queues[cls]);
+	pthread_t thread;
+
+	item->data = data;
+	item->queued = now_ns();
+	pthread_mutex_lock(&(sh->lock));
+	if(q->tail) {
+		q->tail->next = item;
+	} else {
+		q->head = item;
+		q->pass = MAX(q->pass, sh->pass);
+	}
+	q->tail = item;
+	__atomic_add_fetch(&(sh->queued), 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&(sh->lock));
+	wake(s, false);
+
+	/* Start another worker if there is more work than workers waiting
+	 * for it; once they are all running, this takes no lock */
+	if(__atomic_load_n(&(s->nthreads), __ATOMIC_RELAXED) >= __atomic_load_n(&(s->threads), __ATOMIC_RELAXED))
+		return;
+	pthread_mutex_lock(&(s->lock));
+	if(total_queued(s) > s->waiting && s->nthreads < s->threads &&
+	   !pthread_create(&thread, NULL, worker, s)) {
+		pthread_detach(thread);
+		__atomic_add_fetch(&(s->nthreads), 1, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&(s->lock));
+}
+
+void reqsched_free(struct reqsched* s) {
+	int i;
+
+	pthread_mutex_lock(&(s->lock));
+	s->stop = true;
+	pthread_cond_broadcast(&(s->work));
+	while(s->nthreads)
+		pthread_cond_wait(&(s->done), &(s->lock));
+	pthread_mutex_unlock(&(s->lock));
+	for(i = 0; i < s->nshards; i++)
+		pthread_mutex_destroy(&(s->shards[i].lock));
+	g_free(s->shards);
+	pthread_cond_destroy(&(s->work));
+	pthread_cond_destroy(&(s->done));
+	pthread_mutex_destroy(&(s->lock));
+	g_free(s);
+}
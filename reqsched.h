@@ -0,0 +1,77 @@
+/**
+ * A pool of worker threads that hands out work by class of request,
+ * rather than in the order in which it came in
+ */
+#ifndef NBD_REQSCHED_H
+#define NBD_REQSCHED_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define REQSCHED_SMALLREAD 0 /**< reads that a client is likely waiting for */
+#define REQSCHED_LARGEREAD 1 /**< large reads, and reads for the cache */
+#define REQSCHED_WRITE 2 /**< writes */
+#define REQSCHED_SYNC 3 /**< flushes, trims, and everything else */
+#define REQSCHED_NCLASSES 4
+
+#define REQSCHED_SMALLREAD_MAX (64*1024) /**< largest read that is still a small one */
+#define REQSCHED_MAXWAIT 100000 /**< after how many microseconds a request is handled before any other */
+#define REQSCHED_MERGESCAN 32 /**< how many queued requests we look at for merging */
+#define REQSCHED_LOCALITY (1024*1024) /**< size of the ranges whose work goes to the same queue */
+
+struct reqsched;
+
+/**
+ * Create a pool of worker threads. The threads are only started when
+ * there is work for them, so a pool may be created before forking.
+ *
+ * @param func the function that handles a piece of work
+ * @param merge if not NULL, called when a worker takes a piece of work,
+ * with every piece of work of the same class that is queued near the
+ * front; if it returns true, the first piece of work has taken over the
+ * second one, which is removed from the queue
+ * @param threads the maximum number of worker threads
+ * @param ioprio whether the workers should set their I/O priority to
+ * match the class of the work they are doing
+ **/
+struct reqsched* reqsched_new(void (*func)(void* data), bool (*merge)(void* data, void* other),
+		int threads, bool ioprio);
+
+/**
+ * Change the maximum number of worker threads
+ **/
+void reqsched_set_threads(struct reqsched* s, int threads);
+
+/**
+ * Set a function that every worker thread started from now on calls
+ * before it takes any work, to set itself up
+ **/
+void reqsched_set_start(struct reqsched* s, void (*start)(void* arg), void* arg);
+
+/**
+ * Queue a piece of work.
+ *
+ * Every worker has a queue of its own, and takes work from the queues of
+ * the others when it runs out. Work goes to the queue of the range of
+ * REQSCHED_LOCALITY bytes that it is about, so that work that could be
+ * merged ends up in the same queue.
+ *
+ * A free worker takes the work of the class whose turn it is; classes
+ * take turns in proportion to their weight, so that small reads get
+ * most turns. Part of the workers is kept for small reads, so that a
+ * burst of large writes or slow flushes cannot hold up all of them. Work
+ * that has waited for longer than REQSCHED_MAXWAIT goes before all of that,
+ * oldest first, so that no class is starved.
+ *
+ * @param cls the class of the work, one of the REQSCHED_* classes
+ * @param pos the position in the export that the work is about
+ **/
+void reqsched_push(struct reqsched* s, int cls, uint64_t pos, void* data);
+
+/**
+ * Wait for all queued work to be done, stop the workers, and release the
+ * pool.
+ **/
+void reqsched_free(struct reqsched* s);
+
+#endif
@@ -0,0 +1,77 @@
+#include <lfs.h>
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <netinet/in.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <affinity.h>
+#include "macro.h"
+
+int main(void) {
+#ifdef HAVE_SCHED_SETAFFINITY
+	const char* invalid[] = { "", "x", "3-1", "1,", ",1", "1-", "node", "-1", "1 2", NULL };
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	struct affinity* a;
+	cpu_set_t cpus;
+	char spec[16];
+	bool ok = true;
+	int ls, cs, ss;
+	int cpu;
+	int i;
+
+	for(i = 0; invalid[i]; i++)
+		ok = ok && affinity_parse(invalid[i]) == NULL;
+	count_assert(ok);
+
+	a = affinity_parse("0-1,3");
+	count_assert(a != NULL);
+	affinity_free(a);
+
+	/* pin ourselves to the CPU we are on now */
+	cpu = sched_getcpu();
+	snprintf(spec, sizeof(spec), "%d", cpu);
+	a = affinity_parse(spec);
+	count_assert(a != NULL);
+	count_assert(affinity_apply(a, -1) == 0);
+	count_assert(sched_getaffinity(0, sizeof(cpus), &cpus) == 0);
+	count_assert(CPU_COUNT(&cpus) == 1 && CPU_ISSET(cpu, &cpus));
+	affinity_free(a);
+
+	if(access("/sys/devices/system/node/node0", F_OK))
+		return 0;
+
+	/* NUMA nodes, and following the CPU that receives a connection */
+	a = affinity_parse("node0");
+	count_assert(a != NULL);
+	count_assert(affinity_apply(a, -1) == 0);
+	affinity_free(a);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	ls = socket(AF_INET, SOCK_STREAM, 0);
+	count_assert(bind(ls, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	count_assert(listen(ls, 1) == 0);
+	count_assert(getsockname(ls, (struct sockaddr*)&addr, &len) == 0);
+	cs = socket(AF_INET, SOCK_STREAM, 0);
+	count_assert(connect(cs, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+	ss = accept(ls, NULL, NULL);
+	count_assert(write(cs, "x", 1) == 1 && read(ss, spec, 1) == 1);
+	a = affinity_parse(AFFINITY_AUTO);
+	count_assert(a != NULL);
+	count_assert(affinity_apply(a, ss) == 0);
+	affinity_free(a);
+	close(cs);
+	close(ss);
+	close(ls);
+#endif
+	return 0;
+}
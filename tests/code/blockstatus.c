@@ -0,0 +1,152 @@
+#include <lfs.h>
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <nbdsrv.h>
+#include "macro.h"
+#include "backend.h"
+#include "treefiles.h"
+
+#define MB (1024*1024)
+
+static uint64_t total_length(GArray* extents) {
+	uint64_t total = 0;
+	int i;
+
+	for(i = 0; i < extents->len; i++) {
+		total += g_array_index(extents, struct nbd_block_descriptor, i).length;
+	}
+	return total;
+}
+
+int main(void) {
+	SERVER srv;
+	CLIENT cl;
+	FILE_INFO export;
+	GArray* extents;
+	struct nbd_block_descriptor* ext;
+	char tmpl[] = "/tmp/blockstatusXXXXXX";
+	char buf[DIFFPAGESIZE];
+	uint32_t difmap[2 * MB / DIFFPAGESIZE];
+	bool holes;
+	int fd;
+	int i;
+
+	fd = mkstemp(tmpl);
+	assert(fd >= 0);
+	unlink(tmpl);
+	memset(buf, 'x', sizeof(buf));
+	assert(pwrite(fd, buf, sizeof(buf), 0) == sizeof(buf));
+	assert(pwrite(fd, buf, sizeof(buf), MB) == sizeof(buf));
+	assert(ftruncate(fd, 2 * MB) == 0);
+#ifdef SEEK_HOLE
+	/* Not every file system can tell us about holes */
+	holes = lseek(fd, 0, SEEK_HOLE) < 2 * MB;
+#else
+	holes = false;
+#endif
+
+	memset(&srv, 0, sizeof(srv));
+	srv.exportname = "dummy";
+	srv.servename = "dummy";
+	srv.flags = 0;
+	srv.virtstyle = VIRT_NONE;
+
+	export.fhandle = fd;
+	export.startoff = 0;
+
+	memset(&cl, 0, sizeof(cl));
+	cl.exportsize = 2 * MB;
+	cl.exportname = "dummy";
+	cl.export = g_array_new(TRUE, TRUE, sizeof(FILE_INFO));
+	g_array_append_val(cl.export, export);
+	cl.server = &srv;
+	cl.transactionlogfd = -1;
+	pthread_mutex_init(&cl.lock, NULL);
+
+	/* Out of range and empty requests are refused */
+	count_assert(expblockstatus(&cl, 2 * MB, DIFFPAGESIZE, 16) == NULL);
+	count_assert(errno == EINVAL);
+	count_assert(expblockstatus(&cl, 0, 0, 16) == NULL);
+
+	/* Plain export: the extents cover the request exactly, and start
+	 * with data */
+	extents = expblockstatus(&cl, 0, 2 * MB, 16);
+	count_assert(extents != NULL);
+	count_assert(total_length(extents) == 2 * MB);
+	ext = &g_array_index(extents, struct nbd_block_descriptor, 0);
+	count_assert(ext->status_flags == 0);
+	if(holes) {
+		count_assert(extents->len == 4);
+		count_assert(ext[1].status_flags == (NBD_STATE_HOLE | NBD_STATE_ZERO));
+		count_assert(ext[1].length == MB - ext[0].length);
+		count_assert(ext[2].status_flags == 0);
+		count_assert(ext[3].status_flags == (NBD_STATE_HOLE | NBD_STATE_ZERO));
+	}
+	g_array_free(extents, TRUE);
+
+	/* A request in the middle of a hole */
+	if(holes) {
+		extents = expblockstatus(&cl, MB / 2, DIFFPAGESIZE, 16);
+		count_assert(extents->len == 1);
+		count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).length == DIFFPAGESIZE);
+		count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).status_flags == (NBD_STATE_HOLE | NBD_STATE_ZERO));
+		g_array_free(extents, TRUE);
+	}
+
+	/* With a limit of one extent, we only get the first one */
+	extents = expblockstatus(&cl, 0, 2 * MB, 1);
+	count_assert(extents->len == 1);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).status_flags == 0);
+	g_array_free(extents, TRUE);
+
+	/* Copy-on-write: pages in the diff file are allocated, even if the
+	 * backing file has a hole there */
+	srv.flags |= F_COPYONWRITE;
+	for(i = 0; i < sizeof(difmap) / sizeof(difmap[0]); i++) {
+		difmap[i] = (uint32_t)-1;
+	}
+	difmap[MB / 2 / DIFFPAGESIZE] = 0;
+	cl.difmap = difmap;
+	extents = expblockstatus(&cl, MB / 2, 2 * DIFFPAGESIZE, 16);
+	count_assert(total_length(extents) == 2 * DIFFPAGESIZE);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).length == DIFFPAGESIZE);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).status_flags == 0);
+	if(holes) {
+		count_assert(extents->len == 2);
+		count_assert(g_array_index(extents, struct nbd_block_descriptor, 1).status_flags == (NBD_STATE_HOLE | NBD_STATE_ZERO));
+	}
+	g_array_free(extents, TRUE);
+
+	/* Tree files: only pages that have a file are allocated */
+	srv.flags = F_TREEFILES;
+	strcpy(tmpl, "/tmp/blockstatusXXXXXX");
+	assert(mkdtemp(tmpl) != NULL);
+	cl.exportname = tmpl;
+	cl.exportsize = 2 * MB;
+	extents = expblockstatus(&cl, 0, 2 * MB, 16);
+	count_assert(extents->len == 1);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).status_flags == (NBD_STATE_HOLE | NBD_STATE_ZERO));
+	g_array_free(extents, TRUE);
+	snprintf(buf, sizeof(buf), "%s/FILE0001", tmpl);
+	fd = open(buf, O_CREAT | O_WRONLY, 0600);
+	assert(fd >= 0);
+	close(fd);
+	extents = expblockstatus(&cl, 0, 2 * MB, 16);
+	count_assert(extents->len == 3);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 0).length == TREEPAGESIZE);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 1).length == TREEPAGESIZE);
+	count_assert(g_array_index(extents, struct nbd_block_descriptor, 1).status_flags == 0);
+	count_assert(total_length(extents) == 2 * MB);
+	g_array_free(extents, TRUE);
+	unlink(buf);
+	rmdir(tmpl);
+
+	return 0;
+}
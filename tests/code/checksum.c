@@ -0,0 +1,138 @@
+#include <lfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <checksum.h>
+#include "macro.h"
+
+#define NBLOCKS 10
+#define SIZE (NBLOCKS * CHECKSUM_BLOCKSIZE + 100)
+#define BUFLEN 20000
+
+/**
+ * CRC32C, one bit at a time
+ **/
+static uint32_t reference(const unsigned char* buf, size_t len) {
+	uint32_t crc = ~0U;
+	int i;
+
+	while(len--) {
+		crc ^= *buf++;
+		for(i = 0; i < 8; i++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+	}
+	return ~crc;
+}
+
+int main(void) {
+	char name[] = "/tmp/checksum.XXXXXX";
+	unsigned char* buf = malloc(BUFLEN);
+	char block[CHECKSUM_BLOCKSIZE];
+	struct checksums* c;
+	struct checksums* c2;
+	uint32_t flags = 1;
+	bool ok = true;
+	size_t len, split;
+	int i;
+
+	/* the check value of CRC32C */
+	count_assert(checksum_crc32c(0, "123456789", 9) == 0xe3069283);
+
+	/* all lengths and alignments, in one go and in two parts */
+	for(i = 0; i < BUFLEN; i++)
+		buf[i] = rand();
+	for(len = 0; len < BUFLEN - 8 && ok; len += len < 64 ? 1 : 997) {
+		ok = checksum_crc32c(0, buf + len % 8, len) == reference(buf + len % 8, len);
+		split = len / 3;
+		ok = ok && checksum_crc32c(checksum_crc32c(0, buf, split), buf + split, len - split) ==
+			checksum_crc32c(0, buf, len);
+	}
+	count_assert(ok);
+
+	close(mkstemp(name));
+	c = checksum_open(name, SIZE, false);
+	count_assert(c != NULL);
+	count_assert(checksum_blocklen(c, 0) == CHECKSUM_BLOCKSIZE);
+	count_assert(checksum_blocklen(c, NBLOCKS) == 100);
+
+	/* blocks without a checksum pass */
+	memset(block, 'a', sizeof(block));
+	count_assert(!checksum_known(c, 3));
+	count_assert(checksum_verify(c, 3, block));
+
+	checksum_update(c, 3, block);
+	count_assert(checksum_known(c, 3));
+	count_assert(checksum_verify(c, 3, block));
+	block[1000] = 'b';
+	count_assert(!checksum_verify(c, 3, block));
+
+	/* the short last block */
+	checksum_update(c, NBLOCKS, block);
+	count_assert(checksum_verify(c, NBLOCKS, block));
+	block[100] = 'c';
+	count_assert(checksum_verify(c, NBLOCKS, block));
+	block[99] = 'c';
+	count_assert(!checksum_verify(c, NBLOCKS, block));
+
+	memset(block, 0, sizeof(block));
+	checksum_zero(c, 4);
+	count_assert(checksum_verify(c, 4, block));
+	checksum_zero(c, NBLOCKS);
+	count_assert(checksum_verify(c, NBLOCKS, block));
+	block[0] = 1;
+	count_assert(!checksum_verify(c, 4, block));
+
+	/* forgetting a range touches every block in it */
+	checksum_forget(c, 4 * CHECKSUM_BLOCKSIZE - 1, 2);
+	count_assert(!checksum_known(c, 3) && !checksum_known(c, 4));
+	checksum_update(c, 3, block);
+	checksum_update(c, 4, block);
+
+	/* the scrubber goes around */
+	for(i = 0; i < NBLOCKS + 1; i++)
+		count_assert(checksum_scrub_next(c) == (uint64_t)i);
+	count_assert(checksum_scrub_next(c) == 0);
+	count_assert(checksum_close(c) == 0);
+
+	/* after a clean close, the checksums and the scrubber's position
+	 * are still there; readers can share the file */
+	c = checksum_open(name, SIZE, true);
+	c2 = checksum_open(name, SIZE, true);
+	count_assert(c != NULL && c2 != NULL);
+	count_assert(checksum_known(c, 3) && checksum_verify(c, 4, block));
+	count_assert(checksum_known(c2, 4));
+	count_assert(checksum_scrub_next(c) == 1);
+	count_assert(checksum_scrub_next(c2) == 2);
+	/* but a writer is turned away rather than kept waiting */
+	count_assert(checksum_open(name, SIZE, false) == NULL);
+	count_assert(errno == EBUSY);
+	count_assert(checksum_close(c2) == 0);
+	count_assert(checksum_close(c) == 0);
+
+	/* a file that was not closed cleanly is started over */
+	i = open(name, O_WRONLY);
+	count_assert(pwrite(i, &flags, sizeof(flags), 12) == sizeof(flags));
+	close(i);
+	c = checksum_open(name, SIZE, false);
+	count_assert(c != NULL);
+	count_assert(!checksum_known(c, 3) && !checksum_known(c, 4));
+	checksum_update(c, 3, block);
+	count_assert(checksum_close(c) == 0);
+
+	/* and so is one for an export of another size */
+	c = checksum_open(name, SIZE + CHECKSUM_BLOCKSIZE, true);
+	count_assert(c != NULL);
+	count_assert(!checksum_known(c, 3));
+	count_assert(checksum_close(c) == 0);
+
+	unlink(name);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,122 @@
+#include <lfs.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <cipher.h>
+#include "macro.h"
+
+#define THREADS 4
+#define LEN (64 * CIPHER_SECTORSIZE)
+
+static struct cipher* c;
+
+static void writekey(const char* name, const void* key, size_t len) {
+	FILE* f = fopen(name, "w");
+
+	count_assert(f != NULL);
+	count_assert(fwrite(key, len, 1, f) == 1);
+	fclose(f);
+}
+
+static void* worker(void* arg) {
+	uint64_t sector = (uintptr_t)arg * 1000;
+	char* in = malloc(LEN);
+	char* out = malloc(LEN);
+	bool ok = true;
+	int i, j;
+
+	for(i = 0; i < 100 && ok; i++) {
+		for(j = 0; j < LEN; j++)
+			in[j] = j + i + sector;
+		ok = !cipher_encrypt(c, sector + i, in, out, LEN) &&
+			!cipher_decrypt(c, sector + i, out, out, LEN) &&
+			!memcmp(in, out, LEN);
+	}
+	free(in);
+	free(out);
+	return (void*)(uintptr_t)ok;
+}
+
+int main(void) {
+	/* IEEE 1619 XTS-AES-128 test vector 4 */
+	const unsigned char key[32] = {
+		0x27, 0x18, 0x28, 0x18, 0x28, 0x45, 0x90, 0x45,
+		0x23, 0x53, 0x60, 0x28, 0x74, 0x71, 0x35, 0x26,
+		0x31, 0x41, 0x59, 0x26, 0x53, 0x58, 0x97, 0x93,
+		0x23, 0x84, 0x62, 0x64, 0x33, 0x83, 0x27, 0x95,
+	};
+	const unsigned char expect[16] = {
+		0x27, 0xa7, 0x47, 0x9b, 0xef, 0xa1, 0xd4, 0x76,
+		0x48, 0x9f, 0x30, 0x8c, 0xd4, 0xcf, 0xa6, 0xe2,
+	};
+	char name[] = "/tmp/cipher.XXXXXX";
+	unsigned char bigkey[64];
+	pthread_t threads[THREADS];
+	char pt[2 * CIPHER_SECTORSIZE];
+	char ct[2 * CIPHER_SECTORSIZE];
+	char back[2 * CIPHER_SECTORSIZE];
+	void* ok;
+	int i;
+
+	close(mkstemp(name));
+	writekey(name, key, sizeof(key));
+	c = cipher_open(name);
+	count_assert(c != NULL);
+	for(i = 0; i < CIPHER_SECTORSIZE; i++)
+		pt[i] = pt[i + CIPHER_SECTORSIZE] = i;
+	count_assert(cipher_encrypt(c, 0, pt, ct, sizeof(pt)) == 0);
+	count_assert(memcmp(ct, expect, sizeof(expect)) == 0);
+
+	/* the same plaintext in another sector encrypts differently */
+	count_assert(memcmp(ct, ct + CIPHER_SECTORSIZE, CIPHER_SECTORSIZE) != 0);
+	count_assert(cipher_decrypt(c, 0, ct, back, sizeof(ct)) == 0);
+	count_assert(memcmp(back, pt, sizeof(pt)) == 0);
+
+	/* in place, and not from sector 0 */
+	memcpy(back, pt, sizeof(pt));
+	count_assert(cipher_encrypt(c, 1234567, back, back, sizeof(back)) == 0);
+	count_assert(memcmp(back, ct, sizeof(ct)) != 0);
+	count_assert(cipher_decrypt(c, 1234567, back, back, sizeof(back)) == 0);
+	count_assert(memcmp(back, pt, sizeof(pt)) == 0);
+
+	/* sectors of zeroes on disk read as zeroes */
+	memset(ct, 0, CIPHER_SECTORSIZE);
+	count_assert(cipher_decrypt(c, 0, ct, back, sizeof(ct)) == 0);
+	count_assert(back[0] == 0 && memcmp(back, back + 1, CIPHER_SECTORSIZE - 1) == 0);
+	count_assert(memcmp(back + CIPHER_SECTORSIZE, pt + CIPHER_SECTORSIZE, CIPHER_SECTORSIZE) == 0);
+
+	/* only whole sectors */
+	count_assert(cipher_encrypt(c, 0, pt, ct, 100) != 0);
+
+	/* several threads at once */
+	for(i = 0; i < THREADS; i++)
+		count_assert(pthread_create(&threads[i], NULL, worker, (void*)(uintptr_t)i) == 0);
+	for(i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], &ok);
+		count_assert(ok);
+	}
+	cipher_close(c);
+
+	/* AES-256 keys work; keys of other sizes, or with equal halves,
+	 * don't */
+	for(i = 0; i < 64; i++)
+		bigkey[i] = i;
+	writekey(name, bigkey, 64);
+	c = cipher_open(name);
+	count_assert(c != NULL);
+	cipher_close(c);
+	writekey(name, bigkey, 48);
+	count_assert(cipher_open(name) == NULL && errno == EINVAL);
+	memset(bigkey, 'k', 64);
+	writekey(name, bigkey, 64);
+	count_assert(cipher_open(name) == NULL && errno == EINVAL);
+
+	unlink(name);
+	return 0;
+}
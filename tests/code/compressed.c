@@ -0,0 +1,83 @@
+#include <lfs.h>
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <compressed.h>
+#include "macro.h"
+
+#define CHUNK 4096
+#define SIZE (CHUNK * 10 + 1000)
+
+int main(void) {
+	struct compressed* c;
+	char in[] = "/tmp/compressed.in.XXXXXX";
+	char out[] = "/tmp/compressed.out.XXXXXX";
+	char* image = malloc(SIZE);
+	char* buf = malloc(SIZE);
+	bool present;
+	int infd, outfd;
+	int i;
+
+	/* chunk 0 compresses well, 1 and 2 are zeroes, 3 doesn't compress,
+	 * the rest is text, with a short last chunk */
+	memset(image, 0, SIZE);
+	memset(image, 'a', CHUNK);
+	srandom(42);
+	for(i = 3 * CHUNK; i < 4 * CHUNK; i++)
+		image[i] = random();
+	for(i = 4 * CHUNK; i < SIZE; i++)
+		image[i] = 'a' + i % 26;
+	infd = mkstemp(in);
+	outfd = mkstemp(out);
+	count_assert(infd >= 0 && outfd >= 0);
+	count_assert(write(infd, image, SIZE) == SIZE);
+	lseek(infd, 0, SEEK_SET);
+	count_assert(compressed_create(infd, outfd, CHUNK, 9) == 0);
+	close(infd);
+	close(outfd);
+
+	/* only room for two chunks in the cache, so that reading the whole
+	 * image evicts */
+	c = compressed_open(out, 2 * CHUNK);
+	count_assert(c != NULL);
+	count_assert(compressed_size(c) == SIZE);
+	count_assert(compressed_chunksize(c) == CHUNK);
+	for(i = 0; i < 2; i++) {
+		memset(buf, 'x', SIZE);
+		count_assert(compressed_read(c, 0, buf, SIZE) == 0);
+		count_assert(memcmp(buf, image, SIZE) == 0);
+	}
+
+	/* unaligned reads across chunk boundaries, and the short last chunk */
+	count_assert(compressed_read(c, CHUNK - 10, buf, 3 * CHUNK) == 0);
+	count_assert(memcmp(buf, image + CHUNK - 10, 3 * CHUNK) == 0);
+	count_assert(compressed_read(c, SIZE - 500, buf, 500) == 0);
+	count_assert(memcmp(buf, image + SIZE - 500, 500) == 0);
+
+	/* reads past the end fail */
+	count_assert(compressed_read(c, SIZE - 10, buf, 20) != 0);
+
+	/* the zero chunks are a hole */
+	count_assert(compressed_extent(c, 0, SIZE, &present) == CHUNK);
+	count_assert(present);
+	count_assert(compressed_extent(c, CHUNK, SIZE - CHUNK, &present) == 2 * CHUNK);
+	count_assert(!present);
+	count_assert(compressed_extent(c, 3 * CHUNK, SIZE - 3 * CHUNK, &present) == SIZE - 3 * CHUNK);
+	count_assert(present);
+	compressed_close(c);
+
+	/* something that isn't a compressed image */
+	c = compressed_open(in, 2 * CHUNK);
+	count_assert(c == NULL);
+
+	unlink(in);
+	unlink(out);
+	free(image);
+	free(buf);
+	return 0;
+}
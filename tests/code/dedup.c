@@ -0,0 +1,186 @@
+#include <lfs.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <dedup.h>
+#include "macro.h"
+
+#define SIZE (1024*1024 + 1000)
+#define BIGSIZE (16*1024*1024)
+
+/**
+ * The size of a file in the store
+ **/
+static off_t store_size(const char* store, const char* name) {
+	char path[4096];
+	struct stat st;
+
+	snprintf(path, sizeof(path), "%s/%s", store, name);
+	if(stat(path, &st))
+		return -1;
+	return st.st_size;
+}
+
+static void cleanup(const char* store) {
+	const char* names[] = { "lock", "chunks", "index" };
+	char path[4096];
+	size_t i;
+
+	for(i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		snprintf(path, sizeof(path), "%s/%s", store, names[i]);
+		unlink(path);
+	}
+	rmdir(store);
+}
+
+int main(void) {
+	struct dedup* dd1;
+	struct dedup* dd2;
+	struct dedup* dd3;
+	struct dedup_entry e1, e2;
+	char tmpl[] = "/tmp/dedup.XXXXXX";
+	char store[4096];
+	char map1[4096];
+	char map2[4096];
+	char map3[4096];
+	char buf[65536];
+	char expect[65536];
+	bool present;
+	int i;
+
+	count_assert(mkdtemp(tmpl) != NULL);
+	snprintf(store, sizeof(store), "%s/store", tmpl);
+	snprintf(map1, sizeof(map1), "%s/map1", tmpl);
+	snprintf(map2, sizeof(map2), "%s/map2", tmpl);
+	snprintf(map3, sizeof(map3), "%s/map3", tmpl);
+
+	/* the hash depends on every byte */
+	memset(buf, 'a', 4096);
+	dedup_hash(buf, &e1);
+	buf[4095] = 'b';
+	dedup_hash(buf, &e2);
+	count_assert(e1.h[0] != e2.h[0] && e1.h[1] != e2.h[1]);
+	count_assert((e1.h[1] & 0xff) == 0);
+
+	dd1 = dedup_open(store, map1, SIZE, false);
+	dd2 = dedup_open(store, map2, SIZE, false);
+	count_assert(dd1 != NULL && dd2 != NULL);
+
+	/* a fresh export reads as zeroes and has nothing mapped */
+	memset(buf, 'x', sizeof(buf));
+	count_assert(dedup_read(dd1, 0, buf, sizeof(buf)) == 0);
+	memset(expect, 0, sizeof(expect));
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(dedup_extent(dd1, 0, SIZE, &present) == SIZE);
+	count_assert(!present);
+
+	/* sixteen identical blocks take one chunk, in both exports */
+	memset(buf, 'a', sizeof(buf));
+	count_assert(dedup_write(dd1, 0, buf, sizeof(buf)) == 0);
+	count_assert(dedup_write(dd2, 65536, buf, sizeof(buf)) == 0);
+	count_assert(dedup_chunks(dd1) == 1);
+	count_assert(dedup_chunks(dd2) == 1);
+	/* chunks are packed, without anything in between */
+	count_assert(store_size(store, "chunks") == 4096);
+	count_assert(dedup_read(dd2, 65536, buf, sizeof(buf)) == 0);
+	memset(expect, 'a', sizeof(expect));
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+
+	/* blocks of zeroes are unmapped rather than stored */
+	memset(buf, 0, 8192);
+	count_assert(dedup_write(dd1, 8192, buf, 8192) == 0);
+	count_assert(dedup_extent(dd1, 0, SIZE, &present) == 8192);
+	count_assert(present);
+	count_assert(dedup_extent(dd1, 8192, SIZE - 8192, &present) == 8192);
+	count_assert(!present);
+
+	/* a write within a block makes it a chunk of its own */
+	memset(buf, 'b', 100);
+	count_assert(dedup_write(dd1, 4096 - 50, buf, 100) == 0);
+	count_assert(dedup_chunks(dd1) == 3);
+	count_assert(dedup_read(dd1, 0, buf, sizeof(buf)) == 0);
+	memset(expect + 8192, 0, 8192);
+	memset(expect + 4096 - 50, 'b', 100);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+
+	/* the last block of the export is a partial one */
+	memset(buf, 'c', 1000);
+	count_assert(dedup_write(dd2, SIZE - 1000, buf, 1000) == 0);
+	count_assert(dedup_write(dd2, SIZE - 1000, buf, 1001) != 0);
+	count_assert(dedup_read(dd2, SIZE - 1000, expect, 1000) == 0);
+	count_assert(memcmp(buf, expect, 1000) == 0);
+	count_assert(dedup_chunks(dd1) == 4);
+
+	/* chunks go away when the last reference does */
+	count_assert(dedup_trim(dd2, 0, SIZE) == 0);
+	count_assert(dedup_chunks(dd1) == 3);
+	count_assert(dedup_trim(dd1, 0, 4096) == 0);
+	count_assert(dedup_chunks(dd1) == 2);
+	for(i = 0; i < 4; i++)
+		count_assert(dedup_trim(dd1, i * 16384, 16384) == 0);
+	count_assert(dedup_chunks(dd1) == 0);
+	count_assert(dedup_flush(dd1) == 0);
+
+	/* the slots of chunks that went away are used again */
+	count_assert(store_size(store, "chunks") == 4 * 4096);
+	for(i = 0; i < 4; i++) {
+		memset(buf, 'e' + i, 4096);
+		count_assert(dedup_write(dd2, i * 4096, buf, 4096) == 0);
+	}
+	count_assert(dedup_chunks(dd1) == 4);
+	count_assert(store_size(store, "chunks") == 4 * 4096);
+	count_assert(dedup_trim(dd2, 0, 4 * 4096) == 0);
+	count_assert(dedup_chunks(dd1) == 0);
+
+	/* the map survives closing and opening again */
+	memset(buf, 'd', 4096);
+	count_assert(dedup_write(dd1, 4096, buf, 4096) == 0);
+	dedup_close(dd1);
+	dd1 = dedup_open(store, map1, SIZE, true);
+	count_assert(dd1 != NULL);
+	count_assert(dedup_read(dd1, 4096, expect, 4096) == 0);
+	count_assert(memcmp(buf, expect, 4096) == 0);
+
+	/* an export that fills the store past what its index holds makes
+	 * it grow, under the feet of the exports that have it open */
+	dd3 = dedup_open(store, map3, BIGSIZE, false);
+	count_assert(dd3 != NULL);
+	for(i = 0; i < BIGSIZE / 4096; i++) {
+		memset(buf, 0, 4096);
+		memcpy(buf, &i, sizeof(i));
+		buf[4095] = 1;
+		count_assert(dedup_write(dd3, (uint64_t)i * 4096, buf, 4096) == 0);
+	}
+	count_assert(dedup_chunks(dd3) == BIGSIZE / 4096 + 1);
+	count_assert(store_size(store, "index") > 4096 + 4 * 32 * (BIGSIZE / 4096) / 3);
+	count_assert(dedup_chunks(dd2) == BIGSIZE / 4096 + 1);
+	count_assert(dedup_read(dd1, 4096, expect, 4096) == 0);
+	count_assert(expect[0] == 'd' && expect[4095] == 'd');
+	memset(buf, 'f', 4096);
+	count_assert(dedup_write(dd2, 0, buf, 4096) == 0);
+	count_assert(dedup_read(dd3, 0, expect, 4096) == 0);
+	memset(buf, 0, 4096);
+	buf[4095] = 1;
+	count_assert(memcmp(buf, expect, 4096) == 0);
+	i = 1234;
+	count_assert(dedup_read(dd3, (uint64_t)i * 4096, expect, 4096) == 0);
+	count_assert(memcmp(expect, &i, sizeof(i)) == 0 && expect[4095] == 1);
+	count_assert(dedup_trim(dd3, 0, BIGSIZE) == 0);
+	count_assert(dedup_chunks(dd1) == 2);
+
+	dedup_close(dd1);
+	dedup_close(dd2);
+	dedup_close(dd3);
+	cleanup(store);
+	unlink(map1);
+	unlink(map2);
+	unlink(map3);
+	rmdir(tmpl);
+	return 0;
+}
@@ -0,0 +1,150 @@
+#include <lfs.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <gzindex.h>
+#include "macro.h"
+
+#define SIZE (3 * 1024 * 1024 + 512)
+#define SPAN (256 * 1024)
+#define THREADS 4
+
+static char* image;
+static struct gzindex* g;
+
+static void writegz(const char* name, int members) {
+	gzFile gz;
+	int i;
+
+	for(i = 0; i < members; i++) {
+		gz = gzopen(name, i ? "ab" : "wb");
+		count_assert(gz != NULL);
+		count_assert(gzwrite(gz, image, SIZE) == SIZE);
+		gzclose(gz);
+	}
+}
+
+static bool check(unsigned int* seed, char* buf, int n) {
+	uint64_t from, len;
+	int i;
+
+	for(i = 0; i < n; i++) {
+		len = rand_r(seed) % 70000 + 1;
+		from = rand_r(seed) % (SIZE - len);
+		if(gzindex_read(g, from, buf, len) || memcmp(buf, image + from, len))
+			return false;
+	}
+	return true;
+}
+
+static void* reader(void* arg) {
+	unsigned int seed = (uintptr_t)arg;
+	char* buf = malloc(70000);
+	bool ok = check(&seed, buf, 200);
+
+	free(buf);
+	return (void*)(uintptr_t)ok;
+}
+
+int main(void) {
+	char name[] = "/tmp/gzindex.XXXXXX";
+	char idx[4096];
+	char* buf = malloc(SIZE);
+	pthread_t threads[THREADS];
+	unsigned int seed = 1;
+	struct stat st;
+	ino_t ino;
+	void* ok;
+	int fd;
+	int i;
+
+	/* compressible, but not so much that the whole image is one
+	 * deflate block */
+	image = malloc(SIZE);
+	for(i = 0; i < SIZE; i++)
+		image[i] = 'a' + (random() % 4) + (i / 4096) % 20;
+	fd = mkstemp(name);
+	count_assert(fd >= 0);
+	close(fd);
+	writegz(name, 1);
+	snprintf(idx, sizeof(idx), "%s%s", name, GZINDEX_SUFFIX);
+
+	/* the first open builds the index and saves it */
+	g = gzindex_open(name, SPAN, 4 * GZINDEX_BLOCK);
+	count_assert(g != NULL);
+	count_assert(gzindex_size(g) == SIZE);
+	count_assert(gzindex_points(g) > SIZE / SPAN / 2);
+	count_assert(stat(idx, &st) == 0);
+	count_assert(gzindex_read(g, 0, buf, SIZE) == 0);
+	count_assert(memcmp(buf, image, SIZE) == 0);
+	count_assert(check(&seed, buf, 200));
+	count_assert(gzindex_read(g, SIZE - 10, buf, 20) != 0);
+
+	/* several threads at once, with a cache too small to hold much */
+	for(i = 0; i < THREADS; i++)
+		count_assert(pthread_create(&threads[i], NULL, reader, (void*)(uintptr_t)(i + 2)) == 0);
+	for(i = 0; i < THREADS; i++) {
+		pthread_join(threads[i], &ok);
+		count_assert(ok);
+	}
+	gzindex_close(g);
+
+	/* the second open uses the saved index */
+	g = gzindex_open(name, SPAN, GZINDEX_DEFAULT_CACHE);
+	count_assert(g != NULL);
+	count_assert(gzindex_size(g) == SIZE);
+	count_assert(check(&seed, buf, 200));
+	gzindex_close(g);
+
+	/* building an index that is already there leaves it be, and an
+	 * open uses the index that was built in advance */
+	count_assert(stat(idx, &st) == 0);
+	ino = st.st_ino;
+	count_assert(gzindex_build(name, SPAN) == 0);
+	count_assert(stat(idx, &st) == 0 && st.st_ino == ino);
+	unlink(idx);
+	count_assert(gzindex_build(name, SPAN) == 0);
+	count_assert(stat(idx, &st) == 0);
+	ino = st.st_ino;
+	g = gzindex_open(name, SPAN, GZINDEX_DEFAULT_CACHE);
+	count_assert(g != NULL);
+	count_assert(stat(idx, &st) == 0 && st.st_ino == ino);
+	count_assert(check(&seed, buf, 50));
+	gzindex_close(g);
+
+	/* a truncated index is built again */
+	count_assert(truncate(idx, st.st_size - 1) == 0);
+	g = gzindex_open(name, SPAN, GZINDEX_DEFAULT_CACHE);
+	count_assert(g != NULL);
+	count_assert(stat(idx, &st) == 0 && st.st_ino != ino);
+	count_assert(check(&seed, buf, 50));
+	gzindex_close(g);
+
+	/* an index made with another span isn't used */
+	g = gzindex_open(name, SPAN * 4, GZINDEX_DEFAULT_CACHE);
+	count_assert(g != NULL);
+	count_assert(gzindex_points(g) <= SIZE / SPAN / 4 + 1);
+	count_assert(check(&seed, buf, 50));
+	gzindex_close(g);
+
+	/* more than one gzip member can't be indexed */
+	unlink(idx);
+	writegz(name, 2);
+	g = gzindex_open(name, SPAN, GZINDEX_DEFAULT_CACHE);
+	count_assert(g == NULL && errno == EINVAL);
+	count_assert(gzindex_build(name, SPAN) != 0 && errno == EINVAL);
+
+	unlink(name);
+	unlink(idx);
+	free(image);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include <lfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <handles.h>
+#include <nbdsrv.h>
+#include "macro.h"
+
+static void make_file(const char* dir, int i, size_t size) {
+	gchar* name = g_strdup_printf("%s/export.%d", dir, i);
+	int fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600);
+
+	assert(fd >= 0);
+	assert(ftruncate(fd, size) == 0);
+	close(fd);
+	g_free(name);
+}
+
+int main(void) {
+	char dir[] = "/tmp/handles.XXXXXX";
+	gchar* name;
+	gchar* part;
+	struct handles* h;
+	GArray* export;
+	FILE_INFO fi;
+	int i;
+
+	count_assert(mkdtemp(dir) != NULL);
+	name = g_strdup_printf("%s/export", dir);
+
+	/* a missing export */
+	count_assert(handles_open(name, false, true) == NULL && errno == ENOENT);
+	count_assert(handles_open(name, true, true) == NULL && errno == ENOENT);
+
+	/* a multifile export */
+	make_file(dir, 0, 1000);
+	make_file(dir, 1, 3000);
+	make_file(dir, 2, 500);
+	h = handles_open(name, true, true);
+	count_assert(h != NULL);
+	count_assert(handles_size(h) == 4500);
+	count_assert(!handles_readonly(h));
+	count_assert(handles_current(h));
+	export = handles_dup(h);
+	count_assert(export != NULL && export->len == 3);
+	fi = g_array_index(export, FILE_INFO, 1);
+	count_assert(fi.startoff == 1000);
+	fi = g_array_index(export, FILE_INFO, 2);
+	count_assert(fi.startoff == 4000);
+	/* the connection's descriptors are its own */
+	for(i = 0; i < export->len; i++)
+		close(g_array_index(export, FILE_INFO, i).fhandle);
+	g_array_free(export, TRUE);
+	count_assert(handles_current(h));
+	export = handles_dup(h);
+	count_assert(export != NULL && export->len == 3);
+	for(i = 0; i < export->len; i++)
+		close(g_array_index(export, FILE_INFO, i).fhandle);
+	g_array_free(export, TRUE);
+
+	/* a file that is added, resized or replaced */
+	make_file(dir, 3, 100);
+	count_assert(!handles_current(h));
+	count_assert(handles_dup(h) == NULL && errno == ESTALE);
+	part = g_strdup_printf("%s.3", name);
+	unlink(part);
+	count_assert(handles_current(h));
+	make_file(dir, 1, 2000);
+	count_assert(!handles_current(h));
+	handles_close(h);
+	h = handles_open(name, true, true);
+	count_assert(handles_size(h) == 3500);
+	g_free(part);
+	part = g_strdup_printf("%s.2", name);
+	unlink(part);
+	make_file(dir, 2, 500);
+	count_assert(!handles_current(h));
+	handles_close(h);
+
+	/* a single file that can't be written */
+	g_free(part);
+	part = g_strdup_printf("%s.0", name);
+	count_assert(chmod(part, 0400) == 0);
+	h = handles_open(part, false, true);
+	if(!geteuid()) {
+		/* root can write anyway */
+		count_assert(h != NULL);
+	} else {
+		count_assert(h != NULL && handles_readonly(h));
+	}
+	count_assert(handles_size(h) == 1000);
+	handles_close(h);
+	h = handles_open(part, false, false);
+	count_assert(h != NULL && !handles_readonly(h));
+	handles_close(h);
+
+	for(i = 0; i < 3; i++) {
+		g_free(part);
+		part = g_strdup_printf("%s.%d", name, i);
+		unlink(part);
+	}
+	g_free(part);
+	g_free(name);
+	rmdir(dir);
+	return 0;
+}
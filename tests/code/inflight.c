@@ -0,0 +1,98 @@
+#include <lfs.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include <inflight.h>
+#include "macro.h"
+
+static struct inflight* f;
+static int acquired;
+
+struct want {
+	uint64_t bytes;
+};
+
+static void* acquire(void* arg) {
+	struct want* w = arg;
+
+	inflight_acquire(f, w->bytes);
+	__atomic_store_n(&acquired, 1, __ATOMIC_SEQ_CST);
+	return NULL;
+}
+
+/**
+ * Try to take a request from the budget in another thread, and see
+ * whether it gets it within a while
+ **/
+static bool blocks(pthread_t* t, struct want* w) {
+	__atomic_store_n(&acquired, 0, __ATOMIC_SEQ_CST);
+	pthread_create(t, NULL, acquire, w);
+	usleep(100000);
+	return !__atomic_load_n(&acquired, __ATOMIC_SEQ_CST);
+}
+
+int main(void) {
+	struct inflight_stats st;
+	struct want w;
+	pthread_t t;
+
+	/* a limit on the number of requests */
+	f = inflight_new(2, 0);
+	inflight_acquire(f, 1000000);
+	inflight_acquire(f, 1000000);
+	w.bytes = 0;
+	count_assert(blocks(&t, &w));
+	inflight_release(f, 1000000);
+	pthread_join(t, NULL);
+	count_assert(acquired);
+	inflight_get_stats(f, &st);
+	count_assert(st.requests == 2 && st.bytes == 1000000);
+	count_assert(st.maxrequests == 2 && st.maxbytes == 2000000);
+	count_assert(st.waits == 1);
+	inflight_release(f, 1000000);
+	inflight_release(f, 0);
+	inflight_free(f);
+
+	/* a limit on the number of bytes */
+	f = inflight_new(0, 4096);
+	inflight_acquire(f, 1024);
+	inflight_acquire(f, 2048);
+	inflight_acquire(f, 1024);
+	inflight_get_stats(f, &st);
+	count_assert(st.requests == 3 && st.bytes == 4096);
+	count_assert(st.waits == 0);
+	/* a single byte more than the budget has to wait */
+	w.bytes = 1;
+	count_assert(blocks(&t, &w));
+	inflight_release(f, 2048);
+	pthread_join(t, NULL);
+	inflight_release(f, 1);
+	inflight_release(f, 1024);
+	inflight_release(f, 1024);
+
+	/* a request larger than the budget has to wait until it is alone */
+	inflight_acquire(f, 1);
+	w.bytes = 8192;
+	count_assert(blocks(&t, &w));
+	inflight_release(f, 1);
+	pthread_join(t, NULL);
+	inflight_get_stats(f, &st);
+	count_assert(st.requests == 1 && st.bytes == 8192);
+	count_assert(st.maxbytes == 8192);
+	count_assert(st.waits == 2);
+	inflight_release(f, 8192);
+	inflight_free(f);
+
+	/* no limits at all */
+	f = inflight_new(0, 0);
+	inflight_acquire(f, UINT32_MAX);
+	inflight_acquire(f, UINT32_MAX);
+	inflight_get_stats(f, &st);
+	count_assert(st.requests == 2 && st.waits == 0);
+	inflight_free(f);
+	return 0;
+}
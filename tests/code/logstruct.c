@@ -0,0 +1,151 @@
+#include <lfs.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <logstruct.h>
+#include "macro.h"
+
+#define SIZE (1024*1024 + 1000)
+
+static void cleanup(const char* dir) {
+	struct dirent* de;
+	char name[4096];
+	DIR* d = opendir(dir);
+
+	while(d && (de = readdir(d))) {
+		if(de->d_name[0] == '.')
+			continue;
+		snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+		unlink(name);
+	}
+	if(d)
+		closedir(d);
+	rmdir(dir);
+}
+
+int main(void) {
+	struct logstruct* ls;
+	char tmpl[] = "/tmp/logstruct.XXXXXX";
+	char dir[4096];
+	char name[4096];
+	char newname[4096];
+	char buf[65536];
+	char expect[65536];
+	bool present;
+	pid_t pid;
+	int status;
+
+	count_assert(mkdtemp(tmpl) != NULL);
+	/* the store creates its directory itself */
+	snprintf(dir, sizeof(dir), "%s/store", tmpl);
+	ls = logstruct_open(dir, SIZE, true);
+	count_assert(ls != NULL);
+
+	/* nothing is mapped yet, and it all reads as zeroes */
+	count_assert(logstruct_extent(ls, 0, SIZE, &present) == SIZE);
+	count_assert(!present);
+	memset(buf, 'x', sizeof(buf));
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	memset(expect, 0, sizeof(expect));
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+
+	/* a write of full blocks, and one that straddles two blocks */
+	memset(buf, 'a', 8192);
+	count_assert(logstruct_write(ls, 8192, buf, 8192) == 0);
+	memset(buf, 'b', 100);
+	count_assert(logstruct_write(ls, 12288 - 50, buf, 100) == 0);
+	memset(expect + 8192, 'a', 8192);
+	memset(expect + 12288 - 50, 'b', 100);
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(logstruct_extent(ls, 0, SIZE, &present) == 8192);
+	count_assert(!present);
+	count_assert(logstruct_extent(ls, 8192, SIZE - 8192, &present) == 8192);
+	count_assert(present);
+
+	/* the last block of the export is a partial one */
+	memset(buf, 'c', 1000);
+	count_assert(logstruct_write(ls, SIZE - 1000, buf, 1000) == 0);
+	count_assert(logstruct_write(ls, SIZE - 1000, buf, 1001) != 0);
+
+	/* trimming unmaps full blocks only */
+	count_assert(logstruct_trim(ls, 8192 + 100, 8192) == 0);
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	memset(expect + 12288, 0, 4096);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(logstruct_extent(ls, 12288, 4096, &present) == 4096);
+	count_assert(!present);
+
+	/* everything survives closing and opening again */
+	count_assert(logstruct_close(ls) == 0);
+	ls = logstruct_open(dir, SIZE, true);
+	count_assert(ls != NULL);
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(logstruct_read(ls, SIZE - 1000, buf, 1000) == 0);
+	count_assert(buf[0] == 'c' && buf[999] == 'c');
+
+	/* only one user at a time */
+	count_assert(logstruct_open(dir, SIZE, false) == NULL);
+	count_assert(errno == EBUSY);
+	count_assert(logstruct_close(ls) == 0);
+
+	/* a store that was not closed is recovered from its log */
+	pid = fork();
+	if(pid == 0) {
+		ls = logstruct_open(dir, SIZE, true);
+		if(!ls)
+			_exit(1);
+		memset(buf, 'd', 4096);
+		if(logstruct_write(ls, 0, buf, 4096) || logstruct_flush(ls))
+			_exit(1);
+		_exit(0);
+	}
+	count_assert(waitpid(pid, &status, 0) == pid);
+	count_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	ls = logstruct_open(dir, SIZE, true);
+	count_assert(ls != NULL);
+	memset(expect, 'd', 4096);
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(logstruct_close(ls) == 0);
+
+	/* so is one whose checkpoint was cut short after the log was
+	 * rotated, with the records in the new log */
+	pid = fork();
+	if(pid == 0) {
+		ls = logstruct_open(dir, SIZE, true);
+		if(!ls)
+			_exit(1);
+		memset(buf, 'e', 4096);
+		if(logstruct_write(ls, 4096, buf, 4096) || logstruct_flush(ls))
+			_exit(1);
+		_exit(0);
+	}
+	count_assert(waitpid(pid, &status, 0) == pid);
+	count_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	snprintf(name, sizeof(name), "%s/log", dir);
+	snprintf(newname, sizeof(newname), "%s/log.new", dir);
+	count_assert(rename(name, newname) == 0);
+	ls = logstruct_open(dir, SIZE, true);
+	count_assert(ls != NULL);
+	memset(expect + 4096, 'e', 4096);
+	count_assert(logstruct_read(ls, 0, buf, sizeof(buf)) == 0);
+	count_assert(memcmp(buf, expect, sizeof(buf)) == 0);
+	count_assert(access(newname, F_OK) != 0);
+	count_assert(logstruct_close(ls) == 0);
+
+	/* a store can't be opened with another size */
+	count_assert(logstruct_open(dir, SIZE * 2, false) == NULL);
+
+	cleanup(dir);
+	rmdir(tmpl);
+	return 0;
+}
@@ -0,0 +1,114 @@
+#include <lfs.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <qos.h>
+#include "macro.h"
+
+static void setaddr(struct sockaddr_storage* ss, const char* ip) {
+	struct sockaddr_in* sin = (struct sockaddr_in*)ss;
+
+	memset(ss, 0, sizeof(*ss));
+	sin->sin_family = AF_INET;
+	inet_pton(AF_INET, ip, &sin->sin_addr);
+}
+
+int main(void) {
+	uint64_t limits[2][QOS_NLIMITS];
+	struct sockaddr_storage a, b;
+	struct qos* q;
+	uint64_t delay;
+	bool ok = true;
+	pid_t pid;
+	int i;
+
+	setaddr(&a, "192.0.2.1");
+	setaddr(&b, "192.0.2.2");
+
+	/* an idle export gets its burst allowance at once, and is paced
+	 * after that */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_EXPORT][QOS_READ_IOPS] = 10;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 1000);
+	count_assert(q != NULL);
+	for(i = 0; i < 10; i++)
+		ok = ok && qos_charge(q, &a, false, 4096) == 0;
+	count_assert(ok);
+	delay = qos_charge(q, &b, false, 4096);
+	count_assert(delay > 90000 && delay <= 100000);
+	delay = qos_charge(q, &a, false, 4096);
+	count_assert(delay > 190000 && delay <= 200000);
+
+	/* writes have limits of their own */
+	count_assert(qos_charge(q, &a, true, 1 << 20) == 0);
+	qos_free(q);
+
+	/* bytes */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_EXPORT][QOS_WRITE_BPS] = 1 << 20;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 1000);
+	count_assert(qos_charge(q, &a, true, 1 << 20) == 0);
+	delay = qos_charge(q, &a, true, 1 << 19);
+	count_assert(delay > 400000 && delay <= 500000);
+	qos_free(q);
+
+	/* without a burst allowance, every request is paced */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_EXPORT][QOS_READ_IOPS] = 100;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 0);
+	delay = qos_charge(q, &a, false, 0);
+	count_assert(delay > 9000 && delay <= 10000);
+	qos_free(q);
+
+	/* every client address has its own limits */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_CLIENT][QOS_WRITE_IOPS] = 10;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 1000);
+	for(i = 0; i < 10; i++)
+		ok = ok && qos_charge(q, &a, true, 0) == 0;
+	count_assert(ok);
+	count_assert(qos_charge(q, &a, true, 0) > 0);
+	count_assert(qos_charge(q, &b, true, 0) == 0);
+	count_assert(qos_charge(q, &b, false, 0) == 0);
+	qos_free(q);
+
+	/* a client that is behind on its share waits for it, and the
+	 * others still get at the export */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_EXPORT][QOS_READ_IOPS] = 10;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 1000);
+	for(i = 0; i < 20; i++)
+		delay = qos_share(q, &a, false, 0);
+	count_assert(delay > 900000);
+	count_assert(qos_share(q, &b, false, 0) == 0);
+	count_assert(qos_charge(q, &b, false, 0) == 0);
+	/* once both clients are counted, each gets half the limit */
+	usleep(2000);
+	for(i = 0; i < 10; i++)
+		delay = qos_share(q, &b, false, 0);
+	count_assert(delay > 1000000);
+	qos_free(q);
+
+	/* the limits hold across forked children */
+	memset(limits, 0, sizeof(limits));
+	limits[QOS_EXPORT][QOS_READ_IOPS] = 10;
+	q = qos_new((const uint64_t (*)[QOS_NLIMITS])limits, 1000);
+	pid = fork();
+	if(pid == 0) {
+		for(i = 0; i < 10; i++)
+			qos_charge(q, &a, false, 0);
+		_exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	count_assert(qos_charge(q, &b, false, 0) > 0);
+	qos_free(q);
+
+	return 0;
+}
@@ -0,0 +1,69 @@
+#include <lfs.h>
+
+#include <readahead.h>
+#include "macro.h"
+
+#define RS (128*1024)
+#define SIZE ((uint64_t)1024*1024*1024)
+
+int main(void) {
+	struct readahead *ra;
+	uint64_t rafrom = 0, ralen = 0;
+	uint64_t off;
+	uint64_t lastend;
+	int a = 0, b = 0;
+	int i;
+
+	ra = readahead_new(4*1024*1024);
+
+	/* random reads never trigger read-ahead */
+	for(i = 0; i < 100; i++) {
+		off = ((uint64_t)i * 7919 % 1000) * 1024 * 1024;
+		count_assert(!readahead_access(ra, off, RS, SIZE, &rafrom, &ralen));
+	}
+	readahead_free(ra);
+
+	ra = readahead_new(4*1024*1024);
+	/* a sequential stream triggers it after READAHEAD_TRIGGER reads,
+	 * and the window grows up to the maximum */
+	for(i = 0; i < READAHEAD_TRIGGER - 1; i++)
+		count_assert(!readahead_access(ra, (uint64_t)i * RS, RS, SIZE, &rafrom, &ralen));
+	count_assert(readahead_access(ra, (uint64_t)i * RS, RS, SIZE, &rafrom, &ralen));
+	count_assert(rafrom == (uint64_t)(i + 1) * RS);
+	count_assert(ralen == READAHEAD_MINWINDOW);
+	lastend = rafrom + ralen;
+	for(i++; i < 200; i++) {
+		off = (uint64_t)i * RS;
+		if(readahead_access(ra, off, RS, SIZE, &rafrom, &ralen)) {
+			/* read-ahead continues where it left off */
+			count_assert(rafrom >= off + RS);
+			count_assert(rafrom == lastend);
+			count_assert(rafrom + ralen <= off + RS + 4*1024*1024);
+			lastend = rafrom + ralen;
+		}
+	}
+	count_assert(ra->streams[0].window == 4*1024*1024 || ra->streams[1].window == 4*1024*1024);
+
+	/* two interleaved streams are both detected */
+	readahead_free(ra);
+	ra = readahead_new(4*1024*1024);
+	for(i = 0; i < 20; i++) {
+		if(readahead_access(ra, (uint64_t)i * RS, RS, SIZE, &rafrom, &ralen))
+			a++;
+		if(readahead_access(ra, SIZE / 2 + (uint64_t)i * RS, RS, SIZE, &rafrom, &ralen)) {
+			b++;
+			count_assert(rafrom > SIZE / 2);
+		}
+	}
+	count_assert(a > 0 && b > 0);
+
+	/* we never read ahead past the end of the export */
+	readahead_free(ra);
+	ra = readahead_new(4*1024*1024);
+	for(i = 0; i < 8; i++) {
+		if(readahead_access(ra, (uint64_t)i * RS, RS, 8 * RS, &rafrom, &ralen))
+			count_assert(rafrom + ralen <= 8 * RS);
+	}
+	readahead_free(ra);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#include <lfs.h>
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <readcache.h>
+#include "macro.h"
+
+static void fill(char *buf, uint64_t block) {
+	memset(buf, (int)(block & 0xff) + 1, READCACHE_BLOCKSIZE);
+}
+
+int main(void) {
+	struct readcache *cache;
+	char in[READCACHE_BLOCKSIZE];
+	char out[READCACHE_BLOCKSIZE];
+	uint64_t i;
+	int found = 0;
+	int status;
+	pid_t pid;
+
+	/* room for 64 blocks */
+	cache = readcache_new(64 * READCACHE_BLOCKSIZE);
+	count_assert(cache != NULL);
+	count_assert(!readcache_get(cache, 1, 0, out));
+
+	fill(in, 3);
+	readcache_put(cache, 1, 3, in);
+	count_assert(readcache_get(cache, 1, 3, NULL));
+	count_assert(readcache_get(cache, 1, 3, out));
+	count_assert(memcmp(in, out, READCACHE_BLOCKSIZE) == 0);
+	count_assert(!readcache_get(cache, 1, 4, out));
+	/* a block of other files isn't found */
+	count_assert(!readcache_get(cache, 2, 3, out));
+
+	/* putting a block twice doesn't change anything */
+	readcache_put(cache, 1, 3, in);
+	count_assert(readcache_get(cache, 1, 3, out));
+	count_assert(memcmp(in, out, READCACHE_BLOCKSIZE) == 0);
+
+	/* fill the cache way past its size; old blocks must be evicted,
+	 * and whatever is left must have the right contents */
+	for(i = 100; i < 1100; i++) {
+		fill(in, i);
+		readcache_put(cache, 1, i, in);
+	}
+	for(i = 100; i < 1100; i++) {
+		if(readcache_get(cache, 1, i, out)) {
+			found++;
+			fill(in, i);
+			count_assert(memcmp(in, out, READCACHE_BLOCKSIZE) == 0);
+		}
+	}
+	count_assert(found > 0 && found <= 64);
+	count_assert(readcache_get(cache, 1, 1099, NULL));
+
+	/* a block added by a child is visible in the parent */
+	pid = fork();
+	count_assert(pid >= 0);
+	if(pid == 0) {
+		fill(in, 5000);
+		readcache_put(cache, 1, 5000, in);
+		_exit(0);
+	}
+	waitpid(pid, &status, 0);
+	count_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	count_assert(readcache_get(cache, 1, 5000, out));
+	fill(in, 5000);
+	count_assert(memcmp(in, out, READCACHE_BLOCKSIZE) == 0);
+
+	readcache_free(cache);
+	return 0;
+}
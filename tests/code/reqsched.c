@@ -0,0 +1,172 @@
+#include <lfs.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <reqsched.h>
+#include "macro.h"
+
+struct work {
+	char kind;
+	bool block;	/**< wait for the test to let it go */
+	uint64_t from;
+	uint64_t len;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char order[32];
+static int done;
+static int started;
+static int gate[2];
+
+static void handle(void* data) {
+	struct work* w = data;
+	char c;
+
+	pthread_mutex_lock(&lock);
+	started++;
+	pthread_mutex_unlock(&lock);
+	if(w->block)
+		while(read(gate[0], &c, 1) != 1);
+	pthread_mutex_lock(&lock);
+	order[done++] = w->kind;
+	pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Merge reads that follow on from each other
+ **/
+static bool merge(void* data, void* other) {
+	struct work* w = data;
+	struct work* o = other;
+
+	if(w->kind != 'R' || o->kind != 'R' || o->from != w->from + w->len)
+		return false;
+	w->len += o->len;
+	return true;
+}
+
+static void reset(void) {
+	memset(order, 0, sizeof(order));
+	done = 0;
+	started = 0;
+}
+
+static void release(int n) {
+	while(n--)
+		while(write(gate[1], "x", 1) != 1);
+}
+
+static int get(int* counter) {
+	int rv;
+
+	pthread_mutex_lock(&lock);
+	rv = *counter;
+	pthread_mutex_unlock(&lock);
+	return rv;
+}
+
+/**
+ * Wait for up to a second for a counter to reach a value
+ **/
+static void wait_for(int* counter, int n) {
+	int i;
+
+	for(i = 0; i < 100 && get(counter) < n; i++)
+		usleep(10000);
+}
+
+int main(void) {
+	struct work blocker = { 'B', true };
+	struct work read = { 'R', false };
+	struct work write = { 'W', false };
+	struct work bigwrite = { 'W', true };
+	struct work parts[5] = {
+		{ 'R', false, 0, 4 },
+		{ 'R', false, 8, 4 },
+		{ 'R', false, 4, 4 },
+		{ 'R', false, 20, 4 },
+		{ 'R', false, 12, 4 },
+	};
+	struct reqsched* s;
+	int i;
+
+	count_assert(pipe(gate) == 0);
+
+	/* small reads get more turns than writes */
+	reset();
+	s = reqsched_new(handle, NULL, 1, false);
+	reqsched_push(s, REQSCHED_SYNC, 0, &blocker);
+	wait_for(&started, 1);
+	for(i = 0; i < 4; i++) {
+		reqsched_push(s, REQSCHED_WRITE, 0, &write);
+		reqsched_push(s, REQSCHED_SMALLREAD, 0, &read);
+	}
+	release(1);
+	reqsched_free(s);
+	count_assert(done == 9);
+	count_assert(order[1] == 'R');
+	count_assert(strrchr(order, 'R') < strrchr(order, 'W'));
+
+	/* but work that has waited for too long goes first */
+	reset();
+	s = reqsched_new(handle, NULL, 1, false);
+	reqsched_push(s, REQSCHED_SYNC, 0, &blocker);
+	wait_for(&started, 1);
+	reqsched_push(s, REQSCHED_WRITE, 0, &write);
+	reqsched_push(s, REQSCHED_WRITE, 0, &write);
+	usleep(REQSCHED_MAXWAIT + 50000);
+	reqsched_push(s, REQSCHED_SMALLREAD, 0, &read);
+	reqsched_push(s, REQSCHED_SMALLREAD, 0, &read);
+	release(1);
+	reqsched_free(s);
+	count_assert(strcmp(order, "BWWRR") == 0);
+
+	/* writes cannot take the workers that are kept for small reads */
+	reset();
+	s = reqsched_new(handle, NULL, 4, false);
+	for(i = 0; i < 4; i++)
+		reqsched_push(s, REQSCHED_WRITE, 0, &bigwrite);
+	wait_for(&started, 3);
+	usleep(50000);
+	count_assert(get(&started) == 3);
+	reqsched_push(s, REQSCHED_SMALLREAD, 0, &read);
+	wait_for(&done, 1);
+	count_assert(get(&done) == 1 && order[0] == 'R');
+	release(4);
+	reqsched_free(s);
+	count_assert(done == 5);
+
+	/* queued work is merged, also if it only becomes mergeable after
+	 * an earlier merge */
+	reset();
+	s = reqsched_new(handle, merge, 1, false);
+	reqsched_push(s, REQSCHED_SYNC, 0, &blocker);
+	wait_for(&started, 1);
+	for(i = 0; i < 5; i++)
+		reqsched_push(s, REQSCHED_SMALLREAD, 0, &parts[i]);
+	reqsched_push(s, REQSCHED_WRITE, 0, &write);
+	release(1);
+	reqsched_free(s);
+	count_assert(done == 4);
+	count_assert(parts[0].len == 16 && parts[3].len == 4);
+
+	/* a worker whose own queue is empty takes work from the others */
+	reset();
+	s = reqsched_new(handle, NULL, 2, false);
+	reqsched_push(s, REQSCHED_SYNC, 0, &blocker);
+	wait_for(&started, 1);
+	for(i = 0; i < 4; i++)
+		reqsched_push(s, REQSCHED_SMALLREAD, (uint64_t)i * REQSCHED_LOCALITY, &read);
+	wait_for(&done, 4);
+	count_assert(get(&done) == 4);
+	release(1);
+	reqsched_free(s);
+	count_assert(done == 5);
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * Micro-benchmark of the worker pool against a GThreadPool, which hands
+ * out all work through a single locked queue.
+ *
+ * Usage: reqschedbench [threads [producers [items]]]
+ *
+ * Every producer thread stands for the thread that reads the requests of
+ * a connection, and queues its share of the items, which take next to no
+ * time to handle, so that what is measured is the overhead of handing
+ * them out.
+ */
+#include <lfs.h>
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <glib.h>
+
+#include <reqsched.h>
+
+static int threads = 8;
+static int producers = 4;
+static long items = 1000000;
+
+static long handled;
+static struct reqsched* sched;
+static GThreadPool* pool;
+
+static double now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void handle(void* data) {
+	__atomic_add_fetch(&handled, 1, __ATOMIC_RELAXED);
+}
+
+static void handle_pool(gpointer data, gpointer user_data) {
+	handle(data);
+}
+
+static void* produce_sched(void* arg) {
+	/* Every connection queues work in a range of its own */
+	uint64_t pos = (uintptr_t)arg * REQSCHED_LOCALITY;
+	long i;
+
+	for(i = 0; i < items / producers; i++)
+		reqsched_push(sched, REQSCHED_SMALLREAD, pos, &handled);
+	return NULL;
+}
+
+static void* produce_pool(void* arg) {
+	long i;
+
+	for(i = 0; i < items / producers; i++)
+		g_thread_pool_push(pool, &handled, NULL);
+	return NULL;
+}
+
+static void run(const char* name, void* (*produce)(void* arg)) {
+	pthread_t* t = calloc(producers, sizeof(pthread_t));
+	double start = now();
+	double time;
+	int i;
+
+	handled = 0;
+	for(i = 0; i < producers; i++)
+		pthread_create(&t[i], NULL, produce, (void*)(uintptr_t)i);
+	for(i = 0; i < producers; i++)
+		pthread_join(t[i], NULL);
+	if(sched)
+		reqsched_free(sched);
+	if(pool)
+		g_thread_pool_free(pool, FALSE, TRUE);
+	time = now() - start;
+	printf("%-12s %10ld items %8.3f s %12.0f items/s\n", name, handled, time, handled / time);
+	free(t);
+}
+
+int main(int argc, char** argv) {
+	if(argc > 1)
+		threads = atoi(argv[1]);
+	if(argc > 2)
+		producers = atoi(argv[2]);
+	if(argc > 3)
+		items = atol(argv[3]);
+	if(threads < 1 || producers < 1 || items < producers) {
+		fprintf(stderr, "Usage: %s [threads [producers [items]]]\n", argv[0]);
+		return 1;
+	}
+	printf("%d worker threads, %d producers\n", threads, producers);
+
+	pool = g_thread_pool_new(handle_pool, NULL, threads, FALSE, NULL);
+	run("GThreadPool", produce_pool);
+	pool = NULL;
+
+	sched = reqsched_new(handle, NULL, threads, false);
+	run("reqsched", produce_sched);
+	sched = NULL;
+
+	return 0;
+}
@@ -62,6 +62,7 @@ int main(void) {
 	cl.modern = TRUE;
 	cl.transactionlogfd = -1;
 	cl.clientfeats = 0;
+	cl.checksums = NULL;
 	pthread_mutex_init(&cl.lock, NULL);
 
 	/* phew. Now test: */
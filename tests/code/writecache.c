@@ -0,0 +1,121 @@
+#include <lfs.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <writecache.h>
+#include "macro.h"
+
+#define SIZE (4*1024*1024)
+
+static char disk[SIZE];
+static int writes;
+static int flushes;
+
+static int memwrite(uint64_t from, char* buf, size_t len, void* opaque) {
+	memcpy(disk + from, buf, len);
+	writes++;
+	return 0;
+}
+
+static int memread(uint64_t from, char* buf, size_t len, void* opaque) {
+	memcpy(buf, disk + from, len);
+	return 0;
+}
+
+static int memflush(void* opaque) {
+	flushes++;
+	return 0;
+}
+
+int main(void) {
+	struct writecache* cache;
+	char buf[65536];
+	char expect[65536];
+	char jbuf[8192];
+	char journalname[] = "/tmp/writecache.XXXXXX";
+	char copyname[] = "/tmp/writecache.XXXXXX";
+	int journalfd;
+	int copyfd;
+	ssize_t len;
+	int i;
+
+	memset(disk, 0, SIZE);
+	cache = writecache_new(1024*1024, 1024*1024, -1, memwrite, memflush, NULL);
+
+	/* sixteen adjacent writes, in reverse order, and an overlapping one */
+	for(i = 15; i >= 0; i--) {
+		memset(buf, 'a' + i, 4096);
+		count_assert(writecache_write(cache, i * 4096, buf, 4096, false) == 0);
+	}
+	memset(buf, 'z', 8192);
+	count_assert(writecache_write(cache, 4096 + 2048, buf, 8192, false) == 0);
+
+	/* reads see the cached data, the export doesn't yet */
+	count_assert(writecache_read(cache, 0, buf, 65536, memread) == 0);
+	for(i = 0; i < 16; i++)
+		memset(expect + i * 4096, 'a' + i, 4096);
+	memset(expect + 4096 + 2048, 'z', 8192);
+	count_assert(memcmp(buf, expect, 65536) == 0);
+	count_assert(disk[0] == 0);
+
+	/* a flush writes it all back, merged into a single write */
+	writes = 0;
+	count_assert(writecache_flush(cache) == 0);
+	count_assert(writes == 1);
+	count_assert(flushes == 1);
+	count_assert(memcmp(disk, expect, 65536) == 0);
+
+	/* a write with FUA set is durable when it returns */
+	memset(buf, 'f', 512);
+	count_assert(writecache_write(cache, 100000, buf, 512, true) == 0);
+	count_assert(memcmp(disk + 100000, buf, 512) == 0);
+	count_assert(flushes == 2);
+
+	/* whatever is left is written back when the cache goes away */
+	memset(buf, 'x', 1000);
+	count_assert(writecache_write(cache, SIZE - 1000, buf, 1000, false) == 0);
+	count_assert(writecache_free(cache) == 0);
+	count_assert(memcmp(disk + SIZE - 1000, buf, 1000) == 0);
+
+	/* with a journal, a flush only syncs the journal */
+	journalfd = mkstemp(journalname);
+	copyfd = mkstemp(copyname);
+	count_assert(journalfd >= 0 && copyfd >= 0);
+	unlink(journalname);
+	unlink(copyname);
+	memset(disk, 0, SIZE);
+	flushes = 0;
+	cache = writecache_new(1024*1024, 1024*1024, journalfd, memwrite, memflush, NULL);
+	memset(buf, 'j', 4096);
+	count_assert(writecache_write(cache, 8192, buf, 4096, false) == 0);
+	count_assert(writecache_flush(cache) == 0);
+	count_assert(flushes == 0);
+	len = pread(journalfd, jbuf, sizeof(jbuf), 0);
+	count_assert(len > 4096);
+
+	/* the journal is emptied once its data is in the export */
+	count_assert(writecache_free(cache) == 0);
+	count_assert(lseek(journalfd, 0, SEEK_END) == 0);
+	count_assert(memcmp(disk + 8192, buf, 4096) == 0);
+
+	/* pretend we crashed before that happened, and replay a copy */
+	count_assert(write(copyfd, jbuf, len) == len);
+	memset(disk, 0, SIZE);
+	count_assert(writecache_replay(copyfd, memwrite, memflush, NULL) == 0);
+	count_assert(memcmp(disk + 8192, buf, 4096) == 0);
+	count_assert(lseek(copyfd, 0, SEEK_END) == 0);
+
+	/* a torn record at the end is ignored */
+	count_assert(pwrite(copyfd, jbuf, len - 100, 0) == len - 100);
+	memset(disk, 0, SIZE);
+	count_assert(writecache_replay(copyfd, memwrite, memflush, NULL) == 0);
+	count_assert(disk[8192] == 0);
+
+	close(copyfd);
+	close(journalfd);
+	return 0;
+}
@@ -49,6 +49,8 @@ static uint64_t size;
 
 static int looseordering = 0;
 
+static int use_go = 0;
+
 static gchar *transactionlog = "nbd-tester-client.tr";
 
 typedef enum {
@@ -347,6 +349,96 @@ static inline int write_all(int f, void *buf, size_t len)
 #define WRITE_ALL_ERRCHK(f, buf, len, whereto, errmsg...) if((write_all(f, buf, len))<=0) { snprintf(errstr, errstr_len, ##errmsg); goto whereto; }
 #define WRITE_ALL_ERR_RT(f, buf, len, whereto, rval, errmsg...) if((write_all(f, buf, len))<=0) { snprintf(errstr, errstr_len, ##errmsg); retval = rval; goto whereto; }
 
+static uint16_t goflags;
+
+/*
+ * Send NBD_OPT_GO or NBD_OPT_INFO for the given export, and handle the
+ * replies. Returns the type of the final reply, or 0 on failure.
+ */
+uint32_t send_go(int sock, uint32_t opt, char *name)
+{
+	struct {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t len;
+	} __attribute__ ((packed)) opthdr;
+	struct {
+		uint64_t magic;
+		uint32_t opt;
+		uint32_t type;
+		uint32_t len;
+	} __attribute__ ((packed)) rephdr;
+	uint32_t tmp32;
+	uint16_t tmp16;
+	char buf[1024];
+	uint32_t blocksize;
+	bool got_export = false;
+
+	opthdr.magic = htonll(opts_magic);
+	opthdr.opt = htonl(opt);
+	opthdr.len = htonl(sizeof(tmp32) + strlen(name) + 2 * sizeof(tmp16));
+	WRITE_ALL_ERRCHK(sock, &opthdr, sizeof(opthdr), err,
+			 "Could not write option: %s", strerror(errno));
+	tmp32 = htonl(strlen(name));
+	WRITE_ALL_ERRCHK(sock, &tmp32, sizeof(tmp32), err,
+			 "Could not write name length: %s", strerror(errno));
+	WRITE_ALL_ERRCHK(sock, name, strlen(name), err,
+			 "Could not write name: %s", strerror(errno));
+	tmp16 = htons(1);
+	WRITE_ALL_ERRCHK(sock, &tmp16, sizeof(tmp16), err,
+			 "Could not write number of requests: %s",
+			 strerror(errno));
+	tmp16 = htons(NBD_INFO_BLOCK_SIZE);
+	WRITE_ALL_ERRCHK(sock, &tmp16, sizeof(tmp16), err,
+			 "Could not write info request: %s", strerror(errno));
+	while (1) {
+		READ_ALL_ERRCHK(sock, &rephdr, sizeof(rephdr), err,
+				"Could not read reply: %s", strerror(errno));
+		rephdr.type = ntohl(rephdr.type);
+		rephdr.len = ntohl(rephdr.len);
+		if (ntohll(rephdr.magic) != 0x3e889045565a9LL
+		    || ntohl(rephdr.opt) != opt
+		    || rephdr.len > sizeof(buf)) {
+			snprintf(errstr, errstr_len, "Invalid option reply");
+			goto err;
+		}
+		if (rephdr.len)
+			READ_ALL_ERRCHK(sock, buf, rephdr.len, err,
+					"Could not read reply data: %s",
+					strerror(errno));
+		if (rephdr.type != NBD_REP_INFO) {
+			break;
+		}
+		memcpy(&tmp16, buf, sizeof(tmp16));
+		switch (ntohs(tmp16)) {
+		case NBD_INFO_EXPORT:
+			memcpy(&size, buf + 2, sizeof(size));
+			size = ntohll(size);
+			memcpy(&goflags, buf + 10, sizeof(goflags));
+			goflags = ntohs(goflags);
+			got_export = true;
+			break;
+		case NBD_INFO_BLOCK_SIZE:
+			memcpy(&blocksize, buf + 6, sizeof(blocksize));
+			blocksize = ntohl(blocksize);
+			if (!blocksize || (blocksize & (blocksize - 1))) {
+				snprintf(errstr, errstr_len,
+					 "Invalid preferred block size %u",
+					 blocksize);
+				goto err;
+			}
+			break;
+		}
+	}
+	if (rephdr.type == NBD_REP_ACK && !got_export) {
+		snprintf(errstr, errstr_len, "No export information received");
+		goto err;
+	}
+	return rephdr.type;
+err:
+	return 0;
+}
+
 int setup_connection_common(int sock, char *name, CONNECTION_TYPE ctype,
 			    int *serverflags)
 {
@@ -356,6 +448,7 @@ int setup_connection_common(int sock, char *name, CONNECTION_TYPE ctype,
 	uint32_t tmp32 = 0;
 	uint16_t handshakeflags = 0;
 	uint32_t negotiationflags = 0;
+	uint64_t infosize;
 
 	if (ctype < CONNECTION_TYPE_INIT_PASSWD)
 		goto end;
@@ -398,6 +491,29 @@ int setup_connection_common(int sock, char *name, CONNECTION_TYPE ctype,
 	negotiationflags = htonl(negotiationflags);
 	WRITE_ALL_ERRCHK(sock, &negotiationflags, sizeof(negotiationflags), err,
 			 "Could not write reserved field: %s", strerror(errno));
+	if (use_go) {
+		/* Asking for an export that doesn't exist must not end the
+		 * negotiation */
+		if (send_go(sock, NBD_OPT_GO, "this export does not exist") != NBD_REP_ERR_UNKNOWN) {
+			if (!*errstr)
+				snprintf(errstr, errstr_len,
+					 "Unknown export was not refused");
+			goto err;
+		}
+		/* Asking about the export must not select it */
+		if (send_go(sock, NBD_OPT_INFO, name) != NBD_REP_ACK)
+			goto err;
+		infosize = size;
+		if (send_go(sock, NBD_OPT_GO, name) != NBD_REP_ACK)
+			goto err;
+		if (size != infosize) {
+			snprintf(errstr, errstr_len,
+				 "NBD_OPT_INFO and NBD_OPT_GO disagree about the size");
+			goto err;
+		}
+		*serverflags = goflags;
+		goto end;
+	}
 	/* magic */
 	tmp64 = htonll(opts_magic);
 	WRITE_ALL_ERRCHK(sock, &tmp64, sizeof(tmp64), err,
@@ -596,6 +712,7 @@ int oversize_test(gchar * hostname, gchar * unixsock, int port, char *name,
 	pid_t G_GNUC_UNUSED mypid = getpid();
 	char buf[((1024 * 1024) + sizeof(struct nbd_request) / 2) << 1];
 	bool got_err;
+	int j;
 
 	/* This should work */
 	if (!sock_is_open) {
@@ -609,6 +726,50 @@ int oversize_test(gchar * hostname, gchar * unixsock, int port, char *name,
 		}
 	}
 	req.magic = htonl(NBD_REQUEST_MAGIC);
+	if (testflags & TEST_EXPECT_ERROR) {
+		/* The export takes less than a megabyte at once: a read
+		 * or write of that much must be refused, and the
+		 * connection must carry on */
+		for (j = 0; j < 3; j++) {
+			req.type = htonl(j == 1 ? NBD_CMD_WRITE : NBD_CMD_READ);
+			req.len = htonl(j == 2 ? 1024 : 1024 * 1024);
+			memcpy(&(req.handle), &i, sizeof(i));
+			req.from = htonll(0);
+			printf("%d: testing refused request: %d: ",
+			       getpid(), ntohl(req.len));
+			WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err, -1,
+					 "Could not write request: %s",
+					 strerror(errno));
+			if (j == 1)
+				WRITE_ALL_ERR_RT(sock, buf, 1024 * 1024, err,
+						 -1, "Could not write data: %s",
+						 strerror(errno));
+			READ_ALL_ERR_RT(sock, &rep, sizeof(struct nbd_reply),
+					err, -1,
+					"Could not read reply header: %s",
+					strerror(errno));
+			if (j < 2 && !rep.error) {
+				snprintf(errstr, errstr_len,
+					 "Request was not refused");
+				retval = -1;
+				goto err;
+			}
+			if (j == 2 && rep.error) {
+				snprintf(errstr, errstr_len,
+					 "Received unexpected error: %d",
+					 rep.error);
+				retval = -1;
+				goto err;
+			}
+			if (j == 2)
+				READ_ALL_ERR_RT(sock, &buf, ntohl(req.len), err,
+						-1, "Could not read data: %s",
+						strerror(errno));
+			printf("OK\n");
+			i++;
+		}
+		goto err;
+	}
 	req.type = htonl(NBD_CMD_READ);
 	req.len = htonl(1024 * 1024);
 	memcpy(&(req.handle), &i, sizeof(i));
@@ -670,6 +831,268 @@ err:
 	return retval;
 }
 
+int writezeroes_test(gchar * hostname, gchar * unixsock, int port, char *name,
+		     int sock, char sock_is_open, char close_sock, int testflags)
+{
+	int retval = 0;
+	struct nbd_request req;
+	int serverflags = 0;
+	char buf[65536];
+	char readbuf[65536];
+	char zerobuf[512];
+	uint32_t flags[2] = { 0, NBD_CMD_FLAG_NO_HOLE };
+	uint64_t from = 1000;
+	uint32_t len = 60000;
+	uint64_t i = 0;
+	int j;
+
+	if (!sock_is_open) {
+		if ((sock =
+		     setup_connection(hostname, unixsock, port, name,
+				      CONNECTION_TYPE_FULL,
+				      &serverflags)) < 0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval = -1;
+			goto err;
+		}
+	}
+	if (!(serverflags & NBD_FLAG_SEND_WRITE_ZEROES)) {
+		snprintf(errstr, errstr_len,
+			 "Server did not advertise WRITE_ZEROES");
+		retval = -1;
+		goto err_open;
+	}
+	memset(zerobuf, 0, sizeof(zerobuf));
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	for (j = 0; j < 2; j++) {
+		printf("%d: testing write zeroes%s: ", getpid(),
+		       j ? " (no hole)" : "");
+		/* Fill the first blocks with data, then zero an unaligned
+		 * range in the middle of it, so that both full and partial
+		 * pages are hit */
+		memset(buf, 'X', sizeof(buf));
+		req.type = htonl(NBD_CMD_WRITE);
+		req.from = htonll(0);
+		req.len = htonl(sizeof(buf));
+		memcpy(&(req.handle), &i, sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+				 "Could not write request: %s",
+				 strerror(errno));
+		WRITE_ALL_ERR_RT(sock, buf, sizeof(buf), err_open, -1,
+				 "Could not write data: %s", strerror(errno));
+		if (read_packet_check_header(sock, 0, i++) < 0) {
+			retval = -1;
+			goto err_open;
+		}
+		if (testflags & TEST_EXPECT_ERROR) {
+			/* The export only takes whole sectors: an unaligned
+			 * write or write zeroes must be refused, and an
+			 * aligned range is zeroed instead */
+			req.type = htonl(NBD_CMD_WRITE);
+			req.from = htonll(1000);
+			req.len = htonl(512);
+			memcpy(&(req.handle), &i, sizeof(i));
+			WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+					 "Could not write request: %s",
+					 strerror(errno));
+			WRITE_ALL_ERR_RT(sock, zerobuf, 512, err_open, -1,
+					 "Could not write data: %s",
+					 strerror(errno));
+			if (read_packet_check_header(sock, 0, i++) != -2) {
+				snprintf(errstr, errstr_len,
+					 "Unaligned write was not refused");
+				retval = -1;
+				goto err_open;
+			}
+			req.type = htonl(NBD_CMD_WRITE_ZEROES | flags[j]);
+			req.from = htonll(1000);
+			req.len = htonl(60000);
+			memcpy(&(req.handle), &i, sizeof(i));
+			WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+					 "Could not write request: %s",
+					 strerror(errno));
+			if (read_packet_check_header(sock, 0, i++) != -2) {
+				snprintf(errstr, errstr_len,
+					 "Unaligned write zeroes was not refused");
+				retval = -1;
+				goto err_open;
+			}
+			from = 1024;
+			len = 59904;
+		}
+		req.type = htonl(NBD_CMD_WRITE_ZEROES | flags[j]);
+		req.from = htonll(from);
+		req.len = htonl(len);
+		memcpy(&(req.handle), &i, sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+				 "Could not write request: %s",
+				 strerror(errno));
+		if (read_packet_check_header(sock, 0, i++) < 0) {
+			retval = -1;
+			goto err_open;
+		}
+		memset(buf + from, 0, len);
+		req.type = htonl(NBD_CMD_READ);
+		req.from = htonll(0);
+		req.len = htonl(sizeof(readbuf));
+		memcpy(&(req.handle), &i, sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+				 "Could not write request: %s",
+				 strerror(errno));
+		if (read_packet_check_header(sock, 0, i++) < 0) {
+			retval = -1;
+			goto err_open;
+		}
+		READ_ALL_ERR_RT(sock, readbuf, sizeof(readbuf), err_open, -1,
+				"Could not read data: %s", strerror(errno));
+		if (memcmp(buf, readbuf, sizeof(buf))) {
+			snprintf(errstr, errstr_len,
+				 "Data after write zeroes does not match");
+			retval = -1;
+			goto err_open;
+		}
+		printf("OK\n");
+	}
+err_open:
+	if (close_sock) {
+		close_connection(sock, CONNECTION_CLOSE_PROPERLY);
+	}
+err:
+	return retval;
+}
+
+int cache_test(gchar * hostname, gchar * unixsock, int port, char *name,
+	       int sock, char sock_is_open, char close_sock, int testflags)
+{
+	int retval = 0;
+	struct nbd_request req;
+	struct nbd_reply rep;
+	int serverflags = 0;
+	uint64_t i = 0;
+
+	if (!sock_is_open) {
+		if ((sock =
+		     setup_connection(hostname, unixsock, port, name,
+				      CONNECTION_TYPE_FULL,
+				      &serverflags)) < 0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval = -1;
+			goto err;
+		}
+	}
+	if (!(serverflags & NBD_FLAG_SEND_CACHE)) {
+		snprintf(errstr, errstr_len, "Server did not advertise CACHE");
+		retval = -1;
+		goto err_open;
+	}
+	printf("%d: testing cache: ", getpid());
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.type = htonl(NBD_CMD_CACHE);
+	req.from = htonll(0);
+	req.len = htonl(size);
+	memcpy(&(req.handle), &i, sizeof(i));
+	WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+			 "Could not write request: %s", strerror(errno));
+	if (read_packet_check_header(sock, 0, i++) < 0) {
+		retval = -1;
+		goto err_open;
+	}
+	printf("OK\n");
+	printf("%d: testing cache beyond the end: ", getpid());
+	req.from = htonll(size);
+	req.len = htonl(4096);
+	memcpy(&(req.handle), &i, sizeof(i));
+	WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+			 "Could not write request: %s", strerror(errno));
+	READ_ALL_ERR_RT(sock, &rep, sizeof(rep), err_open, -1,
+			"Could not read reply header: %s", strerror(errno));
+	if (!rep.error) {
+		snprintf(errstr, errstr_len,
+			 "Cache beyond the end of the export succeeded");
+		retval = -1;
+		goto err_open;
+	}
+	printf("Received expected error\n");
+err_open:
+	if (close_sock) {
+		close_connection(sock, CONNECTION_CLOSE_PROPERLY);
+	}
+err:
+	return retval;
+}
+
+/*
+ * With TEST_WRITE, write a pattern and drop the connection as soon as the
+ * writes are acknowledged, without a disconnect request, as a client that
+ * is killed would; otherwise, check that the pattern is there.
+ */
+int crash_test(gchar * hostname, gchar * unixsock, int port, char *name,
+	       int sock, char sock_is_open, char close_sock, int testflags)
+{
+	int retval = 0;
+	struct nbd_request req;
+	int serverflags = 0;
+	char buf[4096];
+	char readbuf[4096];
+	uint64_t i;
+
+	if (!sock_is_open) {
+		if ((sock =
+		     setup_connection(hostname, unixsock, port, name,
+				      CONNECTION_TYPE_FULL,
+				      &serverflags)) < 0) {
+			g_warning("Could not open socket: %s", errstr);
+			retval = -1;
+			goto err;
+		}
+	}
+	printf("%d: %s: ", getpid(), (testflags & TEST_WRITE) ?
+	       "writing, then dropping the connection" :
+	       "checking the data of the dropped connection");
+	req.magic = htonl(NBD_REQUEST_MAGIC);
+	req.len = htonl(sizeof(buf));
+	for (i = 0; i < 64; i++) {
+		memset(buf, 'A' + i % 26, sizeof(buf));
+		req.type = htonl((testflags & TEST_WRITE) ?
+				 NBD_CMD_WRITE : NBD_CMD_READ);
+		req.from = htonll(i * sizeof(buf));
+		memcpy(&(req.handle), &i, sizeof(i));
+		WRITE_ALL_ERR_RT(sock, &req, sizeof(req), err_open, -1,
+				 "Could not write request: %s",
+				 strerror(errno));
+		if (testflags & TEST_WRITE)
+			WRITE_ALL_ERR_RT(sock, buf, sizeof(buf), err_open, -1,
+					 "Could not write data: %s",
+					 strerror(errno));
+		if (read_packet_check_header(sock, 0, i) < 0) {
+			retval = -1;
+			goto err_open;
+		}
+		if (testflags & TEST_WRITE)
+			continue;
+		READ_ALL_ERR_RT(sock, readbuf, sizeof(readbuf), err_open, -1,
+				"Could not read data: %s", strerror(errno));
+		if (memcmp(buf, readbuf, sizeof(buf))) {
+			snprintf(errstr, errstr_len,
+				 "Acknowledged write at %llu was lost",
+				 (unsigned long long)i * sizeof(buf));
+			retval = -1;
+			goto err_open;
+		}
+	}
+	printf("OK\n");
+	if (testflags & TEST_WRITE) {
+		close_connection(sock, CONNECTION_CLOSE_FAST);
+		return retval;
+	}
+err_open:
+	if (close_sock) {
+		close_connection(sock, CONNECTION_CLOSE_PROPERLY);
+	}
+err:
+	return retval;
+}
+
 int throughput_test(gchar * hostname, gchar * unixsock, int port, char *name,
 		    int sock, char sock_is_open, char close_sock, int testflags)
 {
@@ -1511,7 +1934,7 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 	logging(MY_NAME);
-	while ((c = getopt(argc, argv, "FN:t:owfilu:")) >= 0) {
+	while ((c = getopt(argc, argv, "cFgkN:t:owfilu:z")) >= 0) {
 		switch (c) {
 		case 1:
 			handle_nonopt(optarg, &hostname, &p);
@@ -1546,6 +1969,18 @@ int main(int argc, char **argv)
 		case 'u':
 			unixsock = g_strdup(optarg);
 			break;
+		case 'z':
+			test = writezeroes_test;
+			break;
+		case 'c':
+			test = cache_test;
+			break;
+		case 'g':
+			use_go = 1;
+			break;
+		case 'k':
+			test = crash_test;
+			break;
 		}
 	}
 
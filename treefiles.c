@@ -1,4 +1,5 @@
 #include "lfs.h"
+#include <dirent.h>
 #include <fcntl.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -46,6 +47,23 @@ void delete_treefile(char* name,off_t size,off_t pos) {
 		DEBUG("Deleting failed : %s",strerror(errno));
 }
 
+void cache_treefile(char* name,off_t size,off_t pos) {
+	char filename[256+strlen(name)];
+	strcpy(filename,name);
+	off_t ppos;
+	construct_path(filename+strlen(name),256,size,pos,&ppos);
+
+	/* A missing file reads as zeroes; there is nothing to prefetch */
+	int handle=open(filename, O_RDONLY);
+	if (handle<0)
+		return;
+	DEBUG("Prefetching treefile: %s",filename);
+#if HAVE_POSIX_FADVISE
+	posix_fadvise(handle, 0, TREEPAGESIZE, POSIX_FADV_WILLNEED);
+#endif
+	close(handle);
+}
+
 void mkdir_path(char * path) {
 	char *subpath=path+1;
 	while ((subpath=strchr(subpath,'/'))) {
@@ -103,3 +121,76 @@ int open_treefile(char* name,mode_t mode,off_t size,off_t pos, pthread_mutex_t *
 	return handle;
 }
 
+/**
+ * Find out how much of a tree starting at a given position is backed by
+ * tree block files (or is not). A whole directory of block files is read
+ * at once, and a missing directory accounts for everything below it, so
+ * large unwritten areas don't need a stat() per block.
+ *
+ * @param name the base name of the tree
+ * @param size the size of the export
+ * @param pos the position to start at
+ * @param len the maximum number of bytes to report on
+ * @param present [out] whether the returned range is backed by files
+ * @return the number of bytes starting at pos, at most len, which all
+ * share the state returned in present
+ **/
+off_t treefile_extent(char* name, off_t size, off_t pos, off_t len, bool *present) {
+	char path[256+strlen(name)];
+	char bitmap[TREEDIRSIZE];
+	off_t ppos;
+	off_t span = TREEPAGESIZE;
+	off_t dirstart;
+	off_t run;
+	char *slash;
+	DIR *dir;
+	struct dirent *de;
+	struct stat st;
+	int i;
+
+	strcpy(path, name);
+	construct_path(path+strlen(name), 256, size, pos, &ppos);
+
+	/* Strip the file name, leaving the directory it lives in */
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	span *= TREEDIRSIZE;
+	dirstart = (pos / span) * span;
+
+	if (!(dir = opendir(path))) {
+		/* If we can't tell, claim the data is there */
+		*present = (errno != ENOENT);
+		if (*present)
+			return len;
+		/* Find the topmost missing directory; all of it is a hole */
+		while (strlen(path) > strlen(name)) {
+			slash = strrchr(path, '/');
+			*slash = '\0';
+			if (!stat(path, &st))
+				break;
+			span *= TREEDIRSIZE;
+		}
+		if (strlen(path) <= strlen(name) && stat(path, &st))
+			return len;
+		dirstart = (pos / span) * span;
+		run = dirstart + span - pos;
+		return run < len ? run : len;
+	}
+
+	memset(bitmap, 0, sizeof(bitmap));
+	while ((de = readdir(dir))) {
+		if (strncmp(de->d_name, "FILE", 4))
+			continue;
+		i = strtol(de->d_name + 4, NULL, 16);
+		if (i >= 0 && i < TREEDIRSIZE)
+			bitmap[i] = 1;
+	}
+	closedir(dir);
+
+	i = (pos - dirstart) / TREEPAGESIZE;
+	*present = bitmap[i];
+	run = TREEPAGESIZE - (pos % TREEPAGESIZE);
+	for (i++; i < TREEDIRSIZE && run < len && bitmap[i] == *present; i++)
+		run += TREEPAGESIZE;
+	return run < len ? run : len;
+}
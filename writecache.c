@@ -0,0 +1,520 @@
+/*
+ * Write-back cache. Writes are kept in memory as a sorted list of
+ * extents, in which overlapping and adjacent writes are merged, and a
+ * thread writes them back in order of their offset.
+ *
+ * While a write-back pass runs, the extents it writes are moved to a
+ * separate list, so that new writes don't have to wait for it. Reads
+ * overlay the data in both lists on what they read from the export, and
+ * hold a read lock while they do so, so that a pass can't drop extents
+ * between a read of the export and the overlay.
+ *
+ * If there is a journal, every write is appended to it before it is
+ * acknowledged, so that a flush only has to sync the journal. The
+ * journal is emptied once everything in it was written back and synced.
+ */
+#include "lfs.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "writecache.h"
+
+#define WRITECACHE_MAGIC 0x6e62646a /**< "nbdj", marks a journal record */
+
+/**
+ * A range of dirty data
+ **/
+struct writecache_extent {
+	uint64_t from;
+	uint64_t len;
+	char* data;
+};
+
+/**
+ * Header of a record in the journal; the data follows it
+ **/
+struct writecache_record {
+	uint32_t magic;
+	uint32_t len;
+	uint64_t from;
+	uint32_t sum;	/**< checksum of the header and the data */
+	uint32_t pad;
+} __attribute__((packed));
+
+struct writecache {
+	pthread_mutex_t lock;	/**< protects everything below */
+	pthread_cond_t work;	/**< wakes the write-back thread */
+	pthread_cond_t space;	/**< signalled when dirty data was dropped */
+	pthread_rwlock_t readlock; /**< held by reads, taken for writing
+				     to drop written-back extents */
+	pthread_mutex_t passlock; /**< serializes write-back passes */
+	GArray* dirty;		/**< extents not yet being written back */
+	GArray* inflight;	/**< extents being written back */
+	uint64_t dirtybytes;	/**< bytes in dirty and inflight */
+	uint64_t maxdirty;
+	uint64_t background;
+	int journalfd;
+	off_t journalpos;	/**< where the next record goes */
+	off_t journalmax;	/**< writes block while the journal is bigger */
+	int error;		/**< first write-back error since the last flush */
+	int barrier;		/**< writes wait while this is nonzero */
+	int waiting;		/**< number of writes waiting for room */
+	bool stop;		/**< tells the write-back thread to exit */
+	pthread_t thread;
+	writecache_write_fn writefn;
+	writecache_flush_fn flushfn;
+	void* opaque;
+};
+
+static uint32_t record_sum(struct writecache_record* rec, const char* data) {
+	uint32_t sum = 2166136261u;
+	struct writecache_record hdr = *rec;
+	const unsigned char* p;
+	size_t i;
+
+	/* FNV-1a */
+	hdr.sum = 0;
+	p = (const unsigned char*)&hdr;
+	for(i = 0; i < sizeof(hdr); i++)
+		sum = (sum ^ p[i]) * 16777619u;
+	p = (const unsigned char*)data;
+	for(i = 0; i < rec->len; i++)
+		sum = (sum ^ p[i]) * 16777619u;
+	return sum;
+}
+
+int writecache_replay(int journalfd, writecache_write_fn writefn,
+		writecache_flush_fn flushfn, void* opaque) {
+	struct writecache_record rec;
+	off_t pos = 0;
+	char* data = NULL;
+	int count = 0;
+
+	while(pread(journalfd, &rec, sizeof(rec), pos) == sizeof(rec)) {
+		if(rec.magic != WRITECACHE_MAGIC || rec.len > WRITECACHE_MAXEXTENT * 64)
+			break;
+		data = g_realloc(data, rec.len);
+		if(pread(journalfd, data, rec.len, pos + sizeof(rec)) != (ssize_t)rec.len)
+			break;
+		/* A record that was only partly written when we crashed
+		 * wasn't acknowledged, so we can drop it and the rest */
+		if(record_sum(&rec, data) != rec.sum)
+			break;
+		if(writefn(rec.from, data, rec.len, opaque)) {
+			g_free(data);
+			return -1;
+		}
+		pos += sizeof(rec) + rec.len;
+		count++;
+	}
+	g_free(data);
+	if(count > 0 && flushfn(opaque))
+		return -1;
+	return ftruncate(journalfd, 0);
+}
+
+/**
+ * Append a write to the journal. Called with the lock held, so that the
+ * records are in the same order as the writes in the cache.
+ **/
+static int journal_append(struct writecache* cache, uint64_t from, const char* buf, size_t len) {
+	struct writecache_record rec;
+	ssize_t ret;
+	size_t done;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.magic = WRITECACHE_MAGIC;
+	rec.len = len;
+	rec.from = from;
+	rec.sum = record_sum(&rec, buf);
+	if(pwrite(cache->journalfd, &rec, sizeof(rec), cache->journalpos) != sizeof(rec))
+		return -1;
+	for(done = 0; done < len; done += ret) {
+		ret = pwrite(cache->journalfd, buf + done, len - done,
+				cache->journalpos + sizeof(rec) + done);
+		if(ret <= 0)
+			return -1;
+	}
+	cache->journalpos += sizeof(rec) + len;
+	return 0;
+}
+
+/**
+ * Find the first extent that ends at or after an offset. Called with the
+ * lock held.
+ **/
+static guint find_extent(GArray* list, uint64_t from) {
+	guint lo = 0, hi = list->len, mid;
+	struct writecache_extent* ext;
+
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		ext = &g_array_index(list, struct writecache_extent, mid);
+		if(ext->from + ext->len < from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/**
+ * Add a write to the list of dirty extents, merging it with the extents
+ * it overlaps or touches. Called with the lock held.
+ **/
+static void insert_extent(struct writecache* cache, uint64_t from, const char* buf, size_t len) {
+	GArray* list = cache->dirty;
+	struct writecache_extent* first;
+	struct writecache_extent* last;
+	struct writecache_extent* ext;
+	struct writecache_extent merged;
+	uint64_t end = from + len;
+	uint64_t oldbytes = 0;
+	guint i, j, k;
+
+	i = find_extent(list, from);
+	for(j = i; j < list->len; j++) {
+		if(g_array_index(list, struct writecache_extent, j).from > end)
+			break;
+	}
+	if(i < j) {
+		first = &g_array_index(list, struct writecache_extent, i);
+		last = &g_array_index(list, struct writecache_extent, j - 1);
+		merged.from = MIN(from, first->from);
+		merged.len = MAX(end, last->from + last->len) - merged.from;
+		/* Only merge with extents we merely touch if the result
+		 * doesn't get too big; overlapping ones must be merged */
+		if(merged.len > WRITECACHE_MAXEXTENT) {
+			if(first->from + first->len == from)
+				i++;
+			if(i < j && last->from == end)
+				j--;
+		}
+	}
+	if(i == j) {
+		merged.from = from;
+		merged.len = len;
+		merged.data = g_malloc(len);
+		memcpy(merged.data, buf, len);
+		g_array_insert_val(list, i, merged);
+		cache->dirtybytes += len;
+		return;
+	}
+	first = &g_array_index(list, struct writecache_extent, i);
+	last = &g_array_index(list, struct writecache_extent, j - 1);
+	merged.from = MIN(from, first->from);
+	merged.len = MAX(end, last->from + last->len) - merged.from;
+	/* Appending to an extent is the common case, so grow its buffer
+	 * rather than copying it */
+	if(first->from == merged.from) {
+		merged.data = g_realloc(first->data, merged.len);
+		oldbytes += first->len;
+		k = i + 1;
+	} else {
+		merged.data = g_malloc(merged.len);
+		k = i;
+	}
+	for(; k < j; k++) {
+		ext = &g_array_index(list, struct writecache_extent, k);
+		memcpy(merged.data + (ext->from - merged.from), ext->data, ext->len);
+		oldbytes += ext->len;
+		g_free(ext->data);
+	}
+	memcpy(merged.data + (from - merged.from), buf, len);
+	g_array_index(list, struct writecache_extent, i) = merged;
+	if(j - i > 1)
+		g_array_remove_range(list, i + 1, j - i - 1);
+	cache->dirtybytes += merged.len - oldbytes;
+}
+
+/**
+ * Copy the data of a list of extents over a buffer. Called with the lock
+ * held.
+ **/
+static void overlay(GArray* list, uint64_t from, char* buf, size_t len) {
+	struct writecache_extent* ext;
+	uint64_t end = from + len;
+	uint64_t start, stop;
+	guint i;
+
+	for(i = find_extent(list, from); i < list->len; i++) {
+		ext = &g_array_index(list, struct writecache_extent, i);
+		if(ext->from >= end)
+			break;
+		start = MAX(from, ext->from);
+		stop = MIN(end, ext->from + ext->len);
+		if(start < stop)
+			memcpy(buf + (start - from), ext->data + (start - ext->from), stop - start);
+	}
+}
+
+/**
+ * Write all dirty data back. Called with passlock held.
+ *
+ * @param journalpos set to the end of the journal as it was when the
+ * pass started, if not NULL
+ **/
+static int writeback_pass(struct writecache* cache, off_t* journalpos) {
+	struct writecache_extent* ext;
+	GArray* tmp;
+	uint64_t written = 0;
+	int retval = 0;
+	guint i;
+
+	pthread_mutex_lock(&cache->lock);
+	if(journalpos)
+		*journalpos = cache->journalpos;
+	tmp = cache->inflight;
+	cache->inflight = cache->dirty;
+	cache->dirty = tmp;
+	pthread_mutex_unlock(&cache->lock);
+
+	for(i = 0; i < cache->inflight->len; i++) {
+		ext = &g_array_index(cache->inflight, struct writecache_extent, i);
+		if(cache->writefn(ext->from, ext->data, ext->len, cache->opaque)) {
+			retval = -1;
+			pthread_mutex_lock(&cache->lock);
+			if(!cache->error)
+				cache->error = errno ? errno : EIO;
+			pthread_mutex_unlock(&cache->lock);
+		}
+		written += ext->len;
+	}
+
+	pthread_rwlock_wrlock(&cache->readlock);
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < cache->inflight->len; i++)
+		g_free(g_array_index(cache->inflight, struct writecache_extent, i).data);
+	g_array_set_size(cache->inflight, 0);
+	cache->dirtybytes -= written;
+	pthread_cond_broadcast(&cache->space);
+	pthread_mutex_unlock(&cache->lock);
+	pthread_rwlock_unlock(&cache->readlock);
+	return retval;
+}
+
+/**
+ * Write all dirty data back and make it durable, so that the journal can
+ * be emptied. Called with passlock held.
+ **/
+static int journal_checkpoint(struct writecache* cache) {
+	off_t pos;
+	int retval;
+
+	retval = writeback_pass(cache, &pos);
+	if(retval || cache->flushfn(cache->opaque))
+		return -1;
+	pthread_mutex_lock(&cache->lock);
+	/* If more writes came in during the pass, their records must stay;
+	 * we'll get them next time */
+	if(cache->journalpos == pos) {
+		if(ftruncate(cache->journalfd, 0) == 0)
+			cache->journalpos = 0;
+		pthread_cond_broadcast(&cache->space);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return 0;
+}
+
+/**
+ * Whether we shouldn't wait for the interval to expire before the next
+ * write-back pass. Extents that a pass is busy with don't count, or we'd
+ * keep waking up until it is done. Called with the lock held.
+ **/
+static bool writeback_due(struct writecache* cache) {
+	if(cache->waiting && cache->journalpos > 0)
+		return true;
+	if(cache->dirty->len == 0)
+		return false;
+	if(cache->waiting)
+		return true;
+	return cache->dirtybytes >= cache->background ||
+		(cache->journalfd >= 0 && cache->journalpos >= cache->journalmax / 2);
+}
+
+static void* writeback_thread(void* data) {
+	struct writecache* cache = (struct writecache*)data;
+	struct timeval now;
+	struct timespec timeout;
+	int ret;
+
+	pthread_mutex_lock(&cache->lock);
+	while(!cache->stop) {
+		gettimeofday(&now, NULL);
+		timeout.tv_sec = now.tv_sec + WRITECACHE_INTERVAL;
+		timeout.tv_nsec = now.tv_usec * 1000;
+		ret = 0;
+		while(!cache->stop && ret != ETIMEDOUT && !writeback_due(cache))
+			ret = pthread_cond_timedwait(&cache->work, &cache->lock, &timeout);
+		if(cache->stop)
+			break;
+		if(cache->dirty->len == 0 && cache->journalpos == 0)
+			continue;
+		pthread_mutex_unlock(&cache->lock);
+		pthread_mutex_lock(&cache->passlock);
+		if(cache->journalfd >= 0)
+			journal_checkpoint(cache);
+		else
+			writeback_pass(cache, NULL);
+		pthread_mutex_unlock(&cache->passlock);
+		pthread_mutex_lock(&cache->lock);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return NULL;
+}
+
+struct writecache* writecache_new(uint64_t maxdirty, uint64_t background,
+		int journalfd, writecache_write_fn writefn,
+		writecache_flush_fn flushfn, void* opaque) {
+	struct writecache* cache = g_new0(struct writecache, 1);
+
+	pthread_mutex_init(&cache->lock, NULL);
+	pthread_cond_init(&cache->work, NULL);
+	pthread_cond_init(&cache->space, NULL);
+	pthread_rwlock_init(&cache->readlock, NULL);
+	pthread_mutex_init(&cache->passlock, NULL);
+	cache->dirty = g_array_new(FALSE, FALSE, sizeof(struct writecache_extent));
+	cache->inflight = g_array_new(FALSE, FALSE, sizeof(struct writecache_extent));
+	cache->maxdirty = maxdirty;
+	cache->background = background;
+	cache->journalfd = journalfd;
+	cache->journalmax = 4 * maxdirty;
+	cache->writefn = writefn;
+	cache->flushfn = flushfn;
+	cache->opaque = opaque;
+	pthread_create(&cache->thread, NULL, writeback_thread, cache);
+	return cache;
+}
+
+int writecache_free(struct writecache* cache) {
+	int retval;
+
+	pthread_mutex_lock(&cache->lock);
+	cache->stop = true;
+	pthread_cond_signal(&cache->work);
+	pthread_mutex_unlock(&cache->lock);
+	pthread_join(cache->thread, NULL);
+
+	pthread_mutex_lock(&cache->passlock);
+	if(cache->journalfd >= 0) {
+		retval = journal_checkpoint(cache);
+	} else {
+		retval = writeback_pass(cache, NULL);
+		if(!retval)
+			retval = cache->flushfn(cache->opaque);
+	}
+	pthread_mutex_unlock(&cache->passlock);
+
+	g_array_free(cache->dirty, TRUE);
+	g_array_free(cache->inflight, TRUE);
+	pthread_mutex_destroy(&cache->passlock);
+	pthread_rwlock_destroy(&cache->readlock);
+	pthread_cond_destroy(&cache->space);
+	pthread_cond_destroy(&cache->work);
+	pthread_mutex_destroy(&cache->lock);
+	g_free(cache);
+	return retval;
+}
+
+int writecache_write(struct writecache* cache, uint64_t from, const char* buf,
+		size_t len, bool fua) {
+	pthread_mutex_lock(&cache->lock);
+	/* Backpressure: hold the write until there's room for it. A write
+	 * that is bigger than the whole cache is let through once the
+	 * cache is empty. */
+	while((cache->dirtybytes > 0 && cache->dirtybytes + len > cache->maxdirty) ||
+	      (cache->journalfd >= 0 && cache->journalpos > cache->journalmax) ||
+	      cache->barrier) {
+		/* If write-back keeps failing, the journal can't be emptied */
+		if(cache->error && cache->journalfd >= 0 && cache->journalpos > cache->journalmax) {
+			errno = cache->error;
+			pthread_mutex_unlock(&cache->lock);
+			return -1;
+		}
+		cache->waiting++;
+		pthread_cond_signal(&cache->work);
+		pthread_cond_wait(&cache->space, &cache->lock);
+		cache->waiting--;
+	}
+	if(cache->journalfd >= 0 && journal_append(cache, from, buf, len)) {
+		pthread_mutex_unlock(&cache->lock);
+		return -1;
+	}
+	insert_extent(cache, from, buf, len);
+	if(cache->dirtybytes >= cache->background)
+		pthread_cond_signal(&cache->work);
+	pthread_mutex_unlock(&cache->lock);
+
+	if(fua)
+		return writecache_flush(cache);
+	return 0;
+}
+
+int writecache_read(struct writecache* cache, uint64_t from, char* buf,
+		size_t len, writecache_read_fn readfn) {
+	int retval;
+
+	pthread_rwlock_rdlock(&cache->readlock);
+	retval = readfn(from, buf, len, cache->opaque);
+	if(!retval) {
+		pthread_mutex_lock(&cache->lock);
+		overlay(cache->inflight, from, buf, len);
+		overlay(cache->dirty, from, buf, len);
+		pthread_mutex_unlock(&cache->lock);
+	}
+	pthread_rwlock_unlock(&cache->readlock);
+	return retval;
+}
+
+int writecache_sync(struct writecache* cache) {
+	int retval;
+
+	pthread_mutex_lock(&cache->passlock);
+	if(cache->journalfd >= 0) {
+		/* Keep writes out until the journal is empty */
+		pthread_mutex_lock(&cache->lock);
+		cache->barrier++;
+		pthread_mutex_unlock(&cache->lock);
+		retval = journal_checkpoint(cache);
+		pthread_mutex_lock(&cache->lock);
+		cache->barrier--;
+		pthread_cond_broadcast(&cache->space);
+		pthread_mutex_unlock(&cache->lock);
+	} else {
+		retval = writeback_pass(cache, NULL);
+	}
+	pthread_mutex_unlock(&cache->passlock);
+	return retval;
+}
+
+int writecache_flush(struct writecache* cache) {
+	int retval = 0;
+	int error;
+
+	if(cache->journalfd >= 0) {
+		/* Everything that was acknowledged is in the journal */
+		retval = fdatasync(cache->journalfd);
+	} else {
+		pthread_mutex_lock(&cache->passlock);
+		writeback_pass(cache, NULL);
+		retval = cache->flushfn(cache->opaque);
+		pthread_mutex_unlock(&cache->passlock);
+	}
+	pthread_mutex_lock(&cache->lock);
+	error = cache->error;
+	cache->error = 0;
+	pthread_mutex_unlock(&cache->lock);
+	if(error) {
+		errno = error;
+		return -1;
+	}
+	return retval;
+}
@@ -0,0 +1,108 @@
+/**
+ * Write-back cache for exports
+ */
+#ifndef NBD_WRITECACHE_H
+#define NBD_WRITECACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define WRITECACHE_MAXEXTENT (1024*1024) /**< Adjacent writes are merged up to this size */
+#define WRITECACHE_INTERVAL 1 /**< Seconds after which dirty data is written back anyway */
+
+/**
+ * Write a range of data to the export.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+typedef int (*writecache_write_fn)(uint64_t from, char* buf, size_t len, void* opaque);
+
+/**
+ * Read a range of data from the export.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+typedef int (*writecache_read_fn)(uint64_t from, char* buf, size_t len, void* opaque);
+
+/**
+ * Make all data written to the export so far durable.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+typedef int (*writecache_flush_fn)(void* opaque);
+
+struct writecache;
+
+/**
+ * Write the records in a journal that weren't written back yet to the
+ * export, and empty the journal. Must be done before the cache for an
+ * export is created with that journal.
+ *
+ * @param journalfd the journal
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int writecache_replay(int journalfd, writecache_write_fn writefn,
+		writecache_flush_fn flushfn, void* opaque);
+
+/**
+ * Create a write-back cache, and start the thread that writes dirty data
+ * back.
+ *
+ * @param maxdirty the maximum number of dirty bytes; writes block while
+ * the cache holds more than this
+ * @param background the number of dirty bytes above which we write back
+ * without waiting for WRITECACHE_INTERVAL to expire
+ * @param journalfd a file to which every write is appended before it is
+ * acknowledged, so that a flush only has to sync that; or -1 to flush by
+ * writing back all dirty data
+ * @param opaque passed to the callbacks
+ **/
+struct writecache* writecache_new(uint64_t maxdirty, uint64_t background,
+		int journalfd, writecache_write_fn writefn,
+		writecache_flush_fn flushfn, void* opaque);
+
+/**
+ * Write back all dirty data, stop the write-back thread, and release the
+ * cache. The journal is not closed.
+ *
+ * @return 0 if all data was written back, nonzero otherwise
+ **/
+int writecache_free(struct writecache* cache);
+
+/**
+ * Add a write to the cache. This blocks while the cache is full.
+ *
+ * @param fua whether the data must be durable when we return
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int writecache_write(struct writecache* cache, uint64_t from, const char* buf,
+		size_t len, bool fua);
+
+/**
+ * Read a range of the export, as modified by the data in the cache.
+ *
+ * @param readfn used to read the parts that aren't in the cache
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int writecache_read(struct writecache* cache, uint64_t from, char* buf,
+		size_t len, writecache_read_fn readfn);
+
+/**
+ * Write back all dirty data. Used before operations which change the
+ * export without going through the cache. If there is a journal, it is
+ * emptied as well, so that replaying it can't undo such an operation.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int writecache_sync(struct writecache* cache);
+
+/**
+ * Make all writes added to the cache so far durable. If writing back data
+ * failed since the last flush, this reports the error.
+ *
+ * @return 0 on success, nonzero with errno set on failure
+ **/
+int writecache_flush(struct writecache* cache);
+
+#endif